@@ -0,0 +1,144 @@
+#include "fcontext.h"
+#include "log.h"
+#include "macro.h"
+#include <stdint.h>
+
+namespace sylar {
+
+#if defined(__x86_64__) && SYLAR_FCONTEXT_ASM_AVAILABLE
+    /*
+        System V AMD64: callee-saved是 rbp rbx r12-r15，外加MXCSR和x87控制字
+        切出去之后栈上(从低到高)是: [mxcsr|x87cw 16字节][r15][r14][r13][r12][rbx][rbp][返回地址]
+    */
+    asm(R"(
+        .text
+        .globl sylar_swap_fcontext
+        .type sylar_swap_fcontext, %function
+        .align 16
+    sylar_swap_fcontext:
+        pushq %rbp
+        pushq %rbx
+        pushq %r12
+        pushq %r13
+        pushq %r14
+        pushq %r15
+        leaq -16(%rsp), %rsp
+        stmxcsr (%rsp)
+        fnstcw 4(%rsp)
+        movq %rsp, (%rdi)
+        movq %rsi, %rsp
+        ldmxcsr (%rsp)
+        fldcw 4(%rsp)
+        leaq 16(%rsp), %rsp
+        popq %r15
+        popq %r14
+        popq %r13
+        popq %r12
+        popq %rbx
+        popq %rbp
+        ret
+        .size sylar_swap_fcontext, .-sylar_swap_fcontext
+    )");
+
+    void* MakeFcontext(void* stack, size_t size, void (*fn)()) {
+        void** sp = (void**)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+        *--sp = nullptr;                    // fn的返回地址，fn不会返回，顺便让fn入口的时候rsp是16n+8，和正常call进来一样
+        *--sp = (void*)fn;                  // sylar_swap_fcontext最后ret到fn
+        for(int i = 0; i < 6; ++ i) {
+            *--sp = nullptr;                // rbp rbx r12-r15
+        }
+        sp -= 2;
+        uint32_t* ctl = (uint32_t*)sp;
+        ctl[0] = 0x1F80;                    // MXCSR默认值
+        ctl[1] = 0x037F;                    // x87控制字默认值
+        return sp;
+    }
+#elif defined(__aarch64__) && SYLAR_FCONTEXT_ASM_AVAILABLE
+    /*
+        AAPCS64: callee-saved是 x19-x28, x29(fp), x30(lr), d8-d15，外加FPCR
+        切出去之后栈上是 [d8-d15 64字节][x19-x30 96字节][fpcr 8字节][对齐 8字节]
+    */
+    asm(R"(
+        .text
+        .globl sylar_swap_fcontext
+        .type sylar_swap_fcontext, %function
+        .align 4
+    sylar_swap_fcontext:
+        sub sp, sp, #176
+        stp d8, d9, [sp, #0]
+        stp d10, d11, [sp, #16]
+        stp d12, d13, [sp, #32]
+        stp d14, d15, [sp, #48]
+        stp x19, x20, [sp, #64]
+        stp x21, x22, [sp, #80]
+        stp x23, x24, [sp, #96]
+        stp x25, x26, [sp, #112]
+        stp x27, x28, [sp, #128]
+        stp x29, x30, [sp, #144]
+        mrs x9, fpcr
+        str x9, [sp, #160]
+        mov x9, sp
+        str x9, [x0]
+        mov sp, x1
+        ldp d8, d9, [sp, #0]
+        ldp d10, d11, [sp, #16]
+        ldp d12, d13, [sp, #32]
+        ldp d14, d15, [sp, #48]
+        ldp x19, x20, [sp, #64]
+        ldp x21, x22, [sp, #80]
+        ldp x23, x24, [sp, #96]
+        ldp x25, x26, [sp, #112]
+        ldp x27, x28, [sp, #128]
+        ldp x29, x30, [sp, #144]
+        ldr x9, [sp, #160]
+        msr fpcr, x9
+        add sp, sp, #176
+        ret
+        .size sylar_swap_fcontext, .-sylar_swap_fcontext
+    )");
+
+    void* MakeFcontext(void* stack, size_t size, void (*fn)()) {
+        char* top = (char*)(((uintptr_t)stack + size) & ~(uintptr_t)15);
+        void** sp = (void**)(top - 176);
+        for(int i = 0; i < 22; ++ i) {
+            sp[i] = nullptr;                // 寄存器全0, x29=0 让栈回溯到这里为止, fpcr=0 是默认值
+        }
+        sp[19] = (void*)fn;                 // x30(lr)，ret到fn
+        return sp;
+    }
+#endif
+
+#if SYLAR_FIBER_ASM
+    void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()) {
+        *ctx = MakeFcontext(stack, size, fn);
+    }
+
+    void SwapFiberContext(FiberContext* from, FiberContext* to) {
+        sylar_swap_fcontext(from, *to);
+    }
+
+    const char* FiberContextBackend() {
+        return "asm";
+    }
+#else
+    void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)()) {
+        if(getcontext(ctx)) {
+            SYLAR_ASSERT2(false, "getContext");
+        }
+        ctx -> uc_link = nullptr;               // 为空则执行完后退出线程，所以fn不能返回
+        ctx -> uc_stack.ss_sp = stack;
+        ctx -> uc_stack.ss_size = size;
+        makecontext(ctx, fn, 0);
+    }
+
+    void SwapFiberContext(FiberContext* from, FiberContext* to) {
+        if(swapcontext(from, to)) {
+            SYLAR_ASSERT2(false, "swapcontext");
+        }
+    }
+
+    const char* FiberContextBackend() {
+        return "ucontext";
+    }
+#endif
+}
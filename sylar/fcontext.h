@@ -0,0 +1,54 @@
+#ifndef __SYLAR_FCONTEXT_H__
+#define __SYLAR_FCONTEXT_H__
+
+#include <stddef.h>
+#include <ucontext.h>
+
+/*
+    协程上下文切换
+    swapcontext每次切换都会调用rt_sigprocmask保存/恢复信号掩码，一次yield来回就是两次系统调用
+    x86-64和aarch64上用手写的汇编，只保存callee-saved寄存器(外加浮点控制字)，不进内核
+    其他平台或者编译时定义了SYLAR_FIBER_UCONTEXT(cmake -DSYLAR_FIBER_UCONTEXT=ON)就退回ucontext
+*/
+#if (defined(__x86_64__) || defined(__aarch64__)) && defined(__ELF__)
+#define SYLAR_FCONTEXT_ASM_AVAILABLE 1
+#else
+#define SYLAR_FCONTEXT_ASM_AVAILABLE 0
+#endif
+
+#if SYLAR_FCONTEXT_ASM_AVAILABLE && !defined(SYLAR_FIBER_UCONTEXT)
+#define SYLAR_FIBER_ASM 1
+#else
+#define SYLAR_FIBER_ASM 0
+#endif
+
+#if SYLAR_FCONTEXT_ASM_AVAILABLE
+extern "C" {
+    /*
+        把当前的callee-saved寄存器压到当前栈上，栈顶存到*from，然后切到to这个栈上恢复寄存器并返回
+        to必须是之前sylar_swap_context存下来的，或者sylar_make_fcontext做出来的
+    */
+    void sylar_swap_fcontext(void** from, void* to);
+}
+#endif
+
+namespace sylar {
+
+#if SYLAR_FCONTEXT_ASM_AVAILABLE
+    // 在[stack, stack + size)上做一个第一次切进去就执行fn的上下文，fn不能返回
+    void* MakeFcontext(void* stack, size_t size, void (*fn)());
+#endif
+
+#if SYLAR_FIBER_ASM
+    typedef void* FiberContext;          // 就是切出去时候的栈顶
+#else
+    typedef ucontext_t FiberContext;
+#endif
+
+    // Fiber用的统一接口，具体是哪种实现由编译选项决定
+    void MakeFiberContext(FiberContext* ctx, void* stack, size_t size, void (*fn)());
+    void SwapFiberContext(FiberContext* from, FiberContext* to);
+    const char* FiberContextBackend();   // "asm" 或者 "ucontext"
+}
+
+#endif
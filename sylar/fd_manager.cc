@@ -2,24 +2,36 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sched.h>
+#include <new>
 #include "hook.h"
 
 namespace sylar {
-    FdCtx::FdCtx(int fd) 
-        :m_isInit(false),
-         m_isSocket(false),
-         m_sysNonblock(false),
-         m_userNonblock(false),
-         m_isClosed(false),
-         m_fd(fd),
-         m_recvTimeout(-1),
-         m_sendTimeout(-1) {
-        init();
+    FdCtx::FdCtx(int fd, bool nonblock_socket) {
+        reset(fd, nonblock_socket);
     }
     FdCtx::~FdCtx() {
 
     }
 
+    void FdCtx::reset(int fd, bool nonblock_socket) {
+        m_isInit = false;
+        m_isSocket = false;
+        m_sysNonblock = false;
+        m_userNonblock = false;
+        m_isClosed = false;
+        m_fd = fd;
+        m_recvTimeout = -1;
+        m_sendTimeout = -1;
+        if(nonblock_socket) {
+            m_isInit = true;
+            m_isSocket = true;
+            m_sysNonblock = true;
+        } else {
+            init();
+        }
+    }
+
     bool FdCtx::init() {
         if(m_isInit) {
             return true;
@@ -75,33 +87,46 @@ namespace sylar {
   }
 
     FdManager::FdManager() {
-        m_datas.resize(64);
     }
 
     FdCtx::ptr FdManager::get(int fd, bool auto_create) {       // 如果当前的句柄存在我们就返回，要不然就创建一个
-        RWMutexType::ReadLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
-            if(! auto_create) {
+        return get(fd, auto_create, false);
+    }
+
+    FdCtx::ptr FdManager::get(int fd, bool auto_create, bool nonblock_socket) {
+        Slot* slot = auto_create ? m_datas.getOrCreate(fd) : m_datas.get(fd);
+        if(!slot) {
+            return nullptr;
+        }
+        while(true) {
+            int state = slot -> state.load(std::memory_order_acquire);
+            if(state == Slot::READY) {
+                return FdCtx::ptr(FdCtx::ptr(), slot -> ctx());     // 不持有的ptr，对象跟着FdManager一直在，不能跨yield拿着
+            }
+            if(!auto_create) {
                 return nullptr;
             }
-        } else {
-            if(m_datas[fd] || !auto_create) {
-                return m_datas[fd];
+            if(state == Slot::EMPTY
+                    && slot -> state.compare_exchange_strong(state, Slot::CREATING)) {
+                if(slot -> constructed) {
+                    slot -> ctx() -> reset(fd, nonblock_socket);    // 别人手里可能还有旧的ptr，不能析构
+                } else {
+                    new (&slot -> storage) FdCtx(fd, nonblock_socket);
+                    slot -> constructed = true;
+                }
+                slot -> state.store(Slot::READY, std::memory_order_release);
+                return FdCtx::ptr(FdCtx::ptr(), slot -> ctx());
             }
+            sched_yield();                      // 别的线程正在构造，fstat一下就好
         }
-        lock.unlock();
-
-        RWMutexType::WriteLock lock2(m_mutex);
-        FdCtx::ptr ctx(new FdCtx(fd));
-        m_datas[fd] = ctx;
-        return ctx;
     }
 
     void FdManager::del(int fd) {
-        RWMutexType::WriteLock lock(m_mutex);
-        if((int)m_datas.size() <= fd) {
+        Slot* slot = m_datas.get(fd);
+        if(!slot) {
             return;
         }
-        m_datas[fd].reset();
+        int expect = Slot::READY;
+        slot -> state.compare_exchange_strong(expect, Slot::EMPTY);
     }
-}
\ No newline at end of file
+}
@@ -2,18 +2,26 @@
 #define __FD_MANAGER_H__
 
 #include <memory.h>
+#include <atomic>
+#include <type_traits>
 #include "thread.h"
 #include "iomanager.h"
 #include "singleton.h"
+#include "fd_table.h"
 
 namespace sylar {
 
-    class FdCtx : public std::enable_shared_from_this<FdCtx> {
+    /*
+        FdCtx::ptr是FdManager::get给的不持有的ptr，对象归FdManager管，没有enable_shared_from_this
+    */
+    class FdCtx {
         public:
             typedef std::shared_ptr<FdCtx> ptr;
-            FdCtx(int fd);
+            FdCtx(int fd, bool nonblock_socket = false);
             ~FdCtx();
 
+            // fd关了又被同一个号码复用的时候原地重新初始化，对象本身不析构
+            void reset(int fd, bool nonblock_socket);
             bool init();
             bool isInit() const {return m_isInit;}
             bool isSocket() const {return m_isSocket;}
@@ -43,17 +51,43 @@ namespace sylar {
             IOManager* m_iomanager;
     };
 
+    /*
+        每次hook的IO都要查一次，不加锁: FdCtx直接构造在FdTable的段里，地址一直不变
+        get返回的ptr不持有引用计数(空的控制块)，拷贝没有原子操作
+        - FdCtx在一个槽上只构造一次，FdManager析构的时候才析构。del之后同一个fd再get(fd, true)是reset()
+          原地重新初始化字段，之前拿着ptr的人读到的一直是个活着的对象，不会碰上析构了一半的
+        - 但读到的可能已经是复用了这个fd号码的新连接的状态，所以ptr不要跨yield拿着，
+          醒来之后要用就重新get。hook.cc/socket.cc里的调用方都是先读完再挂起(do_io先取超时)
+    */
     class FdManager {
         public:
-            typedef RWMutex RWMutexType;
             FdManager();
 
             FdCtx::ptr get(int fd, bool auto_create = false);       // 如果当前的句柄存在我们就返回，要不然就创建一个
+            // 调用方知道fd是刚accept4(SOCK_NONBLOCK)出来的socket，新建的时候省掉fstat和两次fcntl
+            FdCtx::ptr get(int fd, bool auto_create, bool nonblock_socket);
             void del(int fd);
 
         private:
-            RWMutexType m_mutex;
-            std::vector<FdCtx::ptr> m_datas;
+            struct Slot {
+                enum State {
+                    EMPTY,
+                    CREATING,                   // 有线程正在构造，别的线程等一下
+                    READY,
+                };
+                std::atomic<int> state = {EMPTY};
+                bool constructed = false;       // storage上构造过FdCtx(del之后也还是true)
+                std::aligned_storage<sizeof(FdCtx), alignof(FdCtx)>::type storage;
+
+                FdCtx* ctx() { return (FdCtx*)&storage;}
+                ~Slot() {
+                    if(constructed) {
+                        ctx() -> ~FdCtx();
+                    }
+                }
+            };
+
+            FdTable<Slot> m_datas;
     };
 
     typedef Singleton<FdManager> FdMgr;
@@ -0,0 +1,80 @@
+#ifndef __SYLAR_FD_TABLE_H__
+#define __SYLAR_FD_TABLE_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /*
+        按fd下标的两级表，查找就是两次指针读，不加锁
+        - 第一级是固定大小的段指针数组，构造的时候一次分配好，永远不扩容不搬家
+        - 第二级每段SEG_SIZE个元素，一整块new出来(不是每个fd一次new)，第一次用到的时候建，CAS发布
+          两个线程同时建同一段的时候输的那个删掉自己的
+        - 段建好之后一直到表析构才释放，拿到的指针任何时候都是有效的
+        fd超过MAX_FD返回nullptr(默认1M，和linux的nr_open默认值一样)
+    */
+    template<class T, int SEG_BITS = 8>
+    class FdTable : Noncopyable {
+    public:
+        static const size_t SEG_SIZE = (size_t)1 << SEG_BITS;
+        static const size_t MAX_FD = 1 << 20;
+        static const size_t SEGMENTS = MAX_FD / SEG_SIZE;
+
+        typedef void (*InitFunc)(T& item, int fd);      // 新建段的时候对每个元素调一次，比如填上fd
+
+        FdTable(InitFunc init = nullptr)
+            : m_init(init) {
+            m_segments = new std::atomic<T*>[SEGMENTS];
+            for(size_t i = 0; i < SEGMENTS; ++ i) {
+                m_segments[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~FdTable() {
+            for(size_t i = 0; i < SEGMENTS; ++ i) {
+                delete[] m_segments[i].load(std::memory_order_relaxed);
+            }
+            delete[] m_segments;
+        }
+
+        // 没建过(或者fd不合法)返回nullptr
+        T* get(int fd) const {
+            if(fd < 0 || (size_t)fd >= MAX_FD) {
+                return nullptr;
+            }
+            T* seg = m_segments[fd >> SEG_BITS].load(std::memory_order_acquire);
+            return seg ? &seg[fd & (SEG_SIZE - 1)] : nullptr;
+        }
+
+        // 段不存在就建，只有fd不合法的时候返回nullptr
+        T* getOrCreate(int fd) {
+            T* item = get(fd);
+            if(item || fd < 0 || (size_t)fd >= MAX_FD) {
+                return item;
+            }
+            size_t idx = fd >> SEG_BITS;
+            T* seg = new T[SEG_SIZE];
+            if(m_init) {
+                for(size_t i = 0; i < SEG_SIZE; ++ i) {
+                    m_init(seg[i], (int)(idx * SEG_SIZE + i));
+                }
+            }
+            T* expect = nullptr;
+            if(!m_segments[idx].compare_exchange_strong(expect, seg,
+                        std::memory_order_acq_rel, std::memory_order_acquire)) {
+                delete[] seg;                           // 别人先建好了
+                seg = expect;
+            }
+            return &seg[fd & (SEG_SIZE - 1)];
+        }
+
+    private:
+        std::atomic<T*>* m_segments;
+        InitFunc m_init;
+    };
+}
+
+#endif
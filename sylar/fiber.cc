@@ -4,6 +4,10 @@
 #include "config.h"
 #include "scheduler.h"
 #include "log.h"
+#include "stack_allocator.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define optimizerTest 0
 
@@ -20,72 +24,68 @@ namespace sylar{
     static thread_local Fiber::ptr t_threadFiber = nullptr;                    // main_fiber
 
     static ConfigVar<uint32_t>::ptr g_stack_size = Config::Lookup<uint32_t>("fiber.stack_size", 1024 * 1024, "fiber stack size");
-    
-    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
-
-    // 协程栈内存分配器
-    class MallocStackAllocator {
-    public:
-        static void* Alloc(size_t size) {
-            return malloc(size);
-        }
-
-        static void Dealloc(void* vp, size_t size) {
-            return free(vp);
+    static ConfigVar<bool>::ptr g_shared_stack =
+        Config::Lookup<bool>("fiber.shared_stack", false, "run scheduler callback fibers on a per-thread shared stack");
+    static ConfigVar<uint32_t>::ptr g_shared_stack_size =
+        Config::Lookup<uint32_t>("fiber.shared_stack_size", 8 * 1024 * 1024, "per-thread shared fiber stack size");
+
+    static std::atomic<uint64_t> s_shared_saved_bytes {0};
+
+    // 每个线程一个的共享栈，owner是现在栈上放着谁的数据(挂起了但还没拷出去的也算)
+    struct SharedStack {
+        void* stack = nullptr;
+        size_t size = 0;
+        Fiber* owner = nullptr;
+
+        ~SharedStack() {
+            if(stack) {
+                StackAllocator::Dealloc(stack, size);
+            }
         }
     };
-
-    using StackAllocator = MallocStackAllocator;  // 现在使用Malloc这种静态的分配器，这样下面的编程中我可以一直使用StackAllocator, 如果我以后要换内存分配器，我只需要修改这行
+    static thread_local SharedStack t_shared_stack;
+    
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
     // 主协程创建，在当前的线程上赋值我们的线程上下文, 之所以要实现是为了之后static方法调用实现单列
     Fiber::Fiber() {
         m_state = EXEC;                         // 主协程通常是在整个应用程序的生命周期内存在的
-        SetThis(this);                          // 置fiber为当前的实例(主fiber)
-
-        if(getcontext(&m_ctx)) {
-            SYLAR_ASSERT2(false, "getContext");
-        }
+        SetThis(this);                          // 置fiber为当前的实例(主fiber), 上下文在第一次切出去的时候保存
 
         ++s_fiber_count;
 
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber()";
     }
 
-    Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller) 
-        : m_id(++s_fiber_id), m_cb(cb) {
+    Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack) 
+        : m_id(++s_fiber_id), m_cb(std::move(cb)) {
         ++ s_fiber_count;
+    #if SYLAR_FIBER_ASM
+        if(shared_stack) {
+            SYLAR_ASSERT2(!use_caller, "use_caller fiber can not use shared stack");
+            m_sharedStack = true;               // 栈和上下文等第一次swapIn的时候在那个线程的共享栈上做
+            SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber(shared stack) id = " << m_id;
+            return;
+        }
+    #endif
         m_stacksize = stacksize == 0 ? g_stack_size -> getValue() : stacksize; 
 
         m_stack = StackAllocator::Alloc(m_stacksize);
 
-        // 初始化ucp结构体，将当前的上下文保存在ucp中
-        if(getcontext(&m_ctx)) {
-            SYLAR_ASSERT2(false, "getContext");
-        } 
-
-        m_ctx.uc_link = nullptr;                  // sylar在uc_link设置当前context执行完的下一个要执行的上下文，如果为空则执行完后退出, 非常危险，这里的退出指的是退出当前的线程！！！
-        //m_ctx.uc_link = &t_threadFiber -> m_ctx;    // 优化：按照sylar的协程逻辑，直接返回到主协程 。。。update: sylar是对的，因为按照直接回到当前线程的主协程在加入调度器之后就没法正常工作了...
-        m_ctx.uc_stack.ss_sp = m_stack;             // 执行当前上下文的需要的stack
-        m_ctx.uc_stack.ss_size = m_stacksize;
-
-        if(! use_caller) {
-            #if optimizerTest
-            m_ctx.uc_link = &Scheduler::GetMainFiber() -> m_ctx; // test
-            #endif
-            makecontext(&m_ctx, &Fiber::MainFunc, 0); // 调用&fiber::Mainfunc, 设置下一个要执行的上下文。如果uc_link不是空，就执行下一个context,空就返回
-
-        } else {
-            #if optimizerTest
-            m_ctx.uc_link = &t_threadFiber -> m_ctx;    // test
-            #endif
-            makecontext(&m_ctx, &Fiber::CallerMainFunc, 0); 
-        }
+        // 在协程栈上准备好上下文，第一次切进来的时候执行MainFunc/CallerMainFunc
+        // 执行完不能直接返回(ucontext的uc_link是空的，返回就退出线程了)，而是在MainFunc最后swapOut回主协程
+        MakeFiberContext(&m_ctx, m_stack, m_stacksize, use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc);
         SYLAR_LOG_DEBUG(g_logger) << "Fiber::Fiber(std::function<void()> cb, size_t stacksize) id = " << m_id; 
     }
 
     Fiber::~Fiber() {
         --s_fiber_count;
-        if(m_stack) {                                           // 如果是sub_fiber
+        if(m_sharedStack) {                                     // 共享栈的sub_fiber，栈是线程的，只要释放拷出来的那份
+            SYLAR_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);
+
+            s_shared_saved_bytes -= m_savedCap;
+            free(m_saved);
+        } else if(m_stack) {                                    // 如果是sub_fiber
             SYLAR_ASSERT(m_state == INIT || m_state == TERM || m_state == EXCEPT);  
 
             StackAllocator::Dealloc(m_stack, m_stacksize);
@@ -116,25 +116,17 @@ namespace sylar{
         重置方法，为了节省内存空间，如果我们的一个协程完成了上面运行的工作但还没有释放
         我们可以复用这个协程
     */
-    void Fiber::reset(std::function<void()> cb) {
-        SYLAR_ASSERT(m_stack);
+    void Fiber::reset(Task cb) {
+        SYLAR_ASSERT(m_stack || m_sharedStack);
         SYLAR_ASSERT(m_state == TERM || m_state == INIT || m_state == EXCEPT);
-        m_cb = cb;
+        m_cb = std::move(cb);
         
-        if(getcontext(&m_ctx)) {
-            SYLAR_ASSERT2(false, "getContext");
+        if(m_sharedStack) {
+            m_boundThread = -1;                 // 栈上已经没有它的东西了，下次在哪个线程跑都行
+            m_savedSize = 0;
+        } else {
+            MakeFiberContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
         }
-
-        m_ctx.uc_link = nullptr;    
-
-        #if optimizerTest
-        m_ctx.uc_link = &Scheduler::GetMainFiber() -> m_ctx;    
-        #endif
-
-        m_ctx.uc_stack.ss_sp = m_stack;           
-        m_ctx.uc_stack.ss_size = m_stacksize;
-
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
         m_state = INIT;
     }
 
@@ -142,35 +134,97 @@ namespace sylar{
         SetThis(this);
         //SYLAR_ASSERT(m_state != EXEC);
         m_state = EXEC;
-        if(swapcontext(&t_threadFiber -> m_ctx, &m_ctx)) { // 从thread 协程切换到要执行的协程
-            SYLAR_ASSERT2(false, "swapcontext");
-        }
+        SwapFiberContext(&t_threadFiber -> m_ctx, &m_ctx);  // 从thread 协程切换到要执行的协程
     }
-    void Fiber::swapIn() {
+    /*
+        协程经常是先把自己交出去(加定时器、注册事件)再YieldToHold，
+        别的线程可能在原来的线程还没切出来的时候就拿到了它，这时候上下文还没保存好，状态也还会被原来的线程改
+        所以用m_switching交接：原来的线程切回来、处理完状态之后才放手，别的线程等它放手再切进去
+    */
+    Fiber::State Fiber::swapIn() {
+        while(m_switching.load(std::memory_order_acquire)) {
+            sched_yield();                                  // 只差几条指令，一般一次都不用等
+        }
+        if(m_sharedStack) {
+            switchSharedStack();
+        }
         SetThis(this);
         SYLAR_ASSERT(m_state != EXEC);
         m_state = EXEC;
-        if(swapcontext(&Scheduler::GetMainFiber() -> m_ctx, &m_ctx)) {
-            SYLAR_ASSERT2(false, "swapcontext");
+        m_switching.store(true, std::memory_order_relaxed);
+        SwapFiberContext(&Scheduler::GetMainFiber() -> m_ctx, &m_ctx);
+
+        State state = m_state;
+        if(state == EXEC) {                                 // 直接swapOut出来的，当成HOLD
+            m_state = state = HOLD;
+        }
+        if(m_sharedStack && (state == TERM || state == EXCEPT)) {
+            t_shared_stack.owner = nullptr;                 // 跑完了，栈上的东西不用再拷出去
         }
+        m_switching.store(false, std::memory_order_release);
+        return state;                                       // 放手之后m_state可能已经被别的线程改了，调用方只能看这个返回值
+    }
+
+    /*
+        在调度协程(不在共享栈上)里调用，这时候共享栈上可能还放着上一个挂起的协程的栈
+        要等到有别的协程要用共享栈才拷出去，同一个协程连着被切回来就不用拷
+    */
+    void Fiber::switchSharedStack() {
+    #if SYLAR_FIBER_ASM
+        SharedStack& ss = t_shared_stack;
+        if(!ss.stack) {
+            ss.size = g_shared_stack_size -> getValue();
+            ss.stack = StackAllocator::Alloc(ss.size);
+        }
+        int tid = GetThreadID();
+        SYLAR_ASSERT2(m_boundThread == -1 || m_boundThread == tid, "shared stack fiber resumed on another thread");
+        if(ss.owner == this) {
+            return;
+        }
+        if(ss.owner) {
+            ss.owner -> saveSharedStack();
+        }
+        ss.owner = this;
+        if(m_state == INIT) {
+            m_stack = ss.stack;
+            m_stacksize = ss.size;
+            m_boundThread = tid;
+            MakeFiberContext(&m_ctx, m_stack, m_stacksize, &Fiber::MainFunc);
+        } else {
+            memcpy(m_ctx, m_saved, m_savedSize);            // 放回原来的地址，栈上的指针都还是对的
+        }
+    #endif
+    }
+
+    void Fiber::saveSharedStack() {
+    #if SYLAR_FIBER_ASM
+        char* sp = (char*)m_ctx;                            // 切出去时候的栈顶，往上到栈底就是用到的部分
+        size_t used = (char*)m_stack + m_stacksize - sp;
+        if(used > m_savedCap) {
+            size_t cap = (used + 1023) & ~(size_t)1023;
+            free(m_saved);
+            m_saved = (char*)malloc(cap);
+            SYLAR_ASSERT2(m_saved, "malloc shared stack save buffer");
+            s_shared_saved_bytes += cap - m_savedCap;
+            m_savedCap = cap;
+        }
+        memcpy(m_saved, sp, used);
+        m_savedSize = used;
+    #endif
     }
 
     void Fiber::swapOut() {
         SetThis(Scheduler::GetMainFiber());
 
         //m_state = HOLD;
-        if(swapcontext(&m_ctx, &Scheduler::GetMainFiber() -> m_ctx)) {
-            SYLAR_ASSERT2(false, "swapcontext");
-        }
+        SwapFiberContext(&m_ctx, &Scheduler::GetMainFiber() -> m_ctx);
     }
 
     void Fiber::callOut() {
         SetThis(t_threadFiber.get());
 
         //m_state = HOLD;
-        if(swapcontext(&m_ctx, &t_threadFiber -> m_ctx)) {
-            SYLAR_ASSERT2(false, "swapcontext");
-        }
+        SwapFiberContext(&m_ctx, &t_threadFiber -> m_ctx);
     }
 
     void Fiber::SetThis(Fiber* f) {
@@ -203,6 +257,14 @@ namespace sylar{
         return s_fiber_count;
     }
 
+    bool Fiber::SharedStackEnabled() {
+        return SYLAR_FIBER_ASM && g_shared_stack -> getValue();
+    }
+
+    uint64_t Fiber::SharedStackSavedBytes() {
+        return s_shared_saved_bytes;
+    }
+
     void Fiber::MainFunc() {
         Fiber::ptr cur = GetThis();
         SYLAR_ASSERT(cur);
@@ -2,9 +2,11 @@
 #define __SYLAR_FIBER_H__
 
 #include <memory>
+#include <atomic>
 #include <functional>
-#include <ucontext.h>
 #include "thread.h"
+#include "task.h"
+#include "fcontext.h"
 
 namespace sylar {
     class Scheduler;
@@ -31,37 +33,57 @@ namespace sylar {
         Fiber();      // 默认构造器私有，为了实现单列模式
 
     public:
-        Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);    // 构造器，提供的执行方法和协程栈大小
+        /*
+            构造器，提供的执行方法和协程栈大小
+            @shared_stack 共享栈模式(只有asm的上下文切换支持)：不单独分配栈，在当前线程的共享大栈上跑，
+                          别的协程要用这个栈的时候把自己用到的那一截拷出来，内存只和实际用到的栈深度有关
+                          代价是第一次跑起来之后只能在这个线程上恢复，并且挂起的时候栈上的变量不能被别人访问
+        */
+        Fiber(Task cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
         ~Fiber();
 
-        void reset(std::function<void()> cb);                     // 充值协程的回调方法和状态
-        void swapIn();                                            // Scheduler切换到当前的协程执行，目标协程唤醒到当前的执行状态 
+        void reset(Task cb);                                      // 充值协程的回调方法和状态
+        State swapIn();                                           // Scheduler切换到当前的协程执行，返回切回来时协程的状态(EXEC会改成HOLD)
         void swapOut();                                           // Scheduler切换到后台执行
         void callIn();                                            // 原版的swapin()
         void callOut();                                           // 原版的swapOut()
         uint64_t getId() const {return m_id;}
         State getState() const {return m_state;}
         void setState(State value) {m_state = value;}
+        bool isSharedStack() const {return m_sharedStack;}
+        int getBoundThread() const {return m_boundThread;}       // 共享栈协程只能回到第一次运行的线程，-1表示不限
     public:
         static void SetThis(Fiber* f);   // 设置当前的协程
         static Fiber::ptr GetThis();     // 返回当前的协程
         static void YieldToReady();      // 切换到后台，并且变成ready 状态
         static void YieldToHold();       // 切换到后台，并且变成Hold 状态
         static uint64_t TotalFibers();   // 返回总协程数
+        static bool SharedStackEnabled();        // fiber.shared_stack, Scheduler给回调建协程的时候用
+        static uint64_t SharedStackSavedBytes(); // 共享栈协程拷出来保存栈用的内存
 
         static void MainFunc();          //  执行fiber的回调函数
         static void CallerMainFunc();
 
         static uint64_t GetFiberID();        
+    private:
+        void switchSharedStack();       // 切进来之前把共享栈腾给自己
+        void saveSharedStack();         // 把自己在共享栈上用到的部分拷出来
     private:
         uint64_t m_id = 0;              // 协程ID
         uint32_t m_stacksize = 0;       // 协程栈大小
         State m_state = INIT;           // 协程状态
+        std::atomic<bool> m_switching = {false};    // 还在某个线程上跑/正在切出来，上下文没保存完之前别的线程不能swapIn
 
-        ucontext_t m_ctx;
+        FiberContext m_ctx;             // 上下文，asm或者ucontext，见fcontext.h
         void* m_stack = nullptr;        // 协程栈
 
-        std::function<void()> m_cb;
+        Task m_cb;
+
+        bool m_sharedStack = false;                 // 是否在线程的共享栈上跑
+        std::atomic<int> m_boundThread = {-1};      // 共享栈协程绑定的线程
+        char* m_saved = nullptr;                    // 拷出来的栈
+        uint32_t m_savedSize = 0;
+        uint32_t m_savedCap = 0;
     };
 
 }
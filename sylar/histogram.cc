@@ -0,0 +1,89 @@
+#include "histogram.h"
+
+namespace sylar {
+
+    Histogram::Histogram() {
+        reset();
+    }
+
+    void Histogram::reset() {
+        for(int i = 0; i < BUCKETS; ++ i) {
+            m_buckets[i].store(0, std::memory_order_relaxed);
+        }
+        m_count.store(0, std::memory_order_relaxed);
+        m_sum.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+
+    void Histogram::merge(const Histogram& o) {
+        for(int i = 0; i < BUCKETS; ++ i) {
+            Add(m_buckets[i], o.m_buckets[i].load(std::memory_order_relaxed));
+        }
+        Add(m_count, o.getCount());
+        Add(m_sum, o.getSum());
+        if(o.getMax() > getMax()) {
+            m_max.store(o.getMax(), std::memory_order_relaxed);
+        }
+    }
+
+    /*
+        [0, SUB_BUCKETS)一个值一个桶
+        再往上最高位是msb的值落在第(msb - SUB_BITS + 1)段，段里按最高位下面SUB_BITS位分桶
+    */
+    size_t Histogram::BucketIndex(uint64_t v) {
+        if(v < (uint64_t)SUB_BUCKETS) {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        if(msb >= MAX_BITS) {
+            return BUCKETS - 1;
+        }
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((v >> shift) - SUB_BUCKETS);
+    }
+
+    uint64_t Histogram::BucketUpper(size_t idx) {
+        size_t seg = idx / SUB_BUCKETS;
+        uint64_t sub = idx % SUB_BUCKETS;
+        if(seg == 0) {
+            return sub;
+        }
+        int shift = seg - 1;
+        return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+    }
+
+    uint64_t Histogram::getPercentile(double p) const {
+        uint64_t count = getCount();
+        if(count == 0) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)(count * p / 100.0 + 0.5);
+        if(target < 1) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for(int i = 0; i < BUCKETS; ++ i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if(seen >= target) {
+                uint64_t upper = BucketUpper(i);
+                return upper < getMax() ? upper : getMax();
+            }
+        }
+        return getMax();
+    }
+
+    Histogram::Summary Histogram::summarize() const {
+        Summary s;
+        s.count = getCount();
+        if(s.count == 0) {
+            return s;
+        }
+        s.mean = getSum() / s.count;
+        s.p50 = getPercentile(50);
+        s.p90 = getPercentile(90);
+        s.p99 = getPercentile(99);
+        s.p999 = getPercentile(99.9);
+        s.max = getMax();
+        return s;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef __SYLAR_HISTOGRAM_H__
+#define __SYLAR_HISTOGRAM_H__
+
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /*
+        HDR风格的延迟直方图(对数-线性分桶)，单位ns
+        - 按2的幂分段，每段再等分SUB_BUCKETS个桶，相对误差不超过1/SUB_BUCKETS(6.25%)
+        - 最大记到2^MAX_BITS ns(大约18分钟)，再大的算进最后一个桶
+        - 只允许一个线程record(读了再写回去，不带lock前缀)，别的线程随时可以读
+          多个线程各记各的，要看整体的时候merge()到一个快照上再算分位数
+    */
+    class Histogram : Noncopyable {
+    public:
+        static const int SUB_BITS = 4;
+        static const int SUB_BUCKETS = 1 << SUB_BITS;
+        static const int MAX_BITS = 40;
+        static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+        struct Summary {
+            uint64_t count = 0;
+            uint64_t mean = 0;
+            uint64_t p50 = 0;
+            uint64_t p90 = 0;
+            uint64_t p99 = 0;
+            uint64_t p999 = 0;
+            uint64_t max = 0;
+        };
+
+        Histogram();
+
+        void record(uint64_t v) {
+            Add(m_buckets[BucketIndex(v)], 1);
+            Add(m_count, 1);
+            Add(m_sum, v);
+            if(v > m_max.load(std::memory_order_relaxed)) {
+                m_max.store(v, std::memory_order_relaxed);
+            }
+        }
+
+        void merge(const Histogram& o);                 // 把o加到自己身上，自己这时候不能有人在record
+        void reset();
+
+        uint64_t getCount() const { return m_count.load(std::memory_order_relaxed);}
+        uint64_t getMax() const { return m_max.load(std::memory_order_relaxed);}
+        uint64_t getSum() const { return m_sum.load(std::memory_order_relaxed);}
+        uint64_t getPercentile(double p) const;         // p是0-100，返回所在桶的上界(不超过max)
+        Summary summarize() const;
+
+        static size_t BucketIndex(uint64_t v);
+        static uint64_t BucketUpper(size_t idx);        // 这个桶里最大的值
+
+    private:
+        static void Add(std::atomic<uint64_t>& c, uint64_t n) {
+            c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint64_t> m_buckets[BUCKETS];
+        std::atomic<uint64_t> m_count;
+        std::atomic<uint64_t> m_sum;
+        std::atomic<uint64_t> m_max;
+    };
+}
+
+#endif
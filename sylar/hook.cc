@@ -23,6 +23,7 @@ namespace sylar {
         XX(socket)  \
         XX(connect) \
         XX(accept)  \
+        XX(accept4) \
         XX(read) \
         XX(readv) \
         XX(recv) \
@@ -91,6 +92,71 @@ struct timer_info {
     int cancelled = 0;
 };
 
+// 填一个io_uring的读写请求，addr是缓冲区(readv/writev是iovec，recvmsg/sendmsg是msghdr)
+static io_uring_sqe* prep_sqe(io_uring_sqe& sqe, uint8_t opcode, int fd, const void* addr, 
+                              uint32_t len, uint32_t msg_flags = 0) {
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)(uintptr_t)addr;
+    sqe.len = len;
+    if(opcode == IORING_OP_READ || opcode == IORING_OP_WRITE
+            || opcode == IORING_OP_READV || opcode == IORING_OP_WRITEV) {
+        sqe.off = (uint64_t)-1;                         // 用当前位置，socket上没意义；send/recv这里必须是0
+    }
+    sqe.msg_flags = msg_flags;
+    return &sqe;
+}
+
+/*
+    开了io_uring的IOManager上，读写直接交给内核，不先试一次再等epoll
+    超时和原来一样用条件定时器，到时间cancelEvent会把io_uring上的请求取消掉
+    返回false表示这次没法走io_uring(或者内核返回EAGAIN/被close之类的取消了)，调用方接着走原来的路径
+*/
+static bool ring_io(int fd, uint32_t event, uint64_t to, io_uring_sqe* sqe, ssize_t& n) {
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    if(!iom || !iom -> isUring()) {
+        return false;
+    }
+    std::shared_ptr<timer_info> tinfo(new timer_info);
+    sylar::Timer::ptr timer;
+    std::weak_ptr<timer_info> winfo(tinfo);
+    if(to != (uint64_t)-1) {
+        timer = iom -> addConditionTimer(to, [winfo, fd, iom, event]() {
+            auto t = winfo.lock();
+            if(!t || t->cancelled) {
+                return;
+            }
+            t->cancelled = ETIMEDOUT;
+            iom -> cancelEvent(fd, (sylar::IOManager::Event)(event));
+        }, winfo);
+    }
+
+    int res = 0;
+    bool submitted = iom -> submitIO(fd, (sylar::IOManager::Event)(event), *sqe, res);
+    if(timer) {
+        timer -> cancel();
+    }
+    if(!submitted) {
+        return false;
+    }
+    if(res >= 0) {                                      // 超时和完成撞在一起的时候数据已经读走了，以结果为准
+        n = res;
+        return true;
+    }
+    if(res == -ECANCELED && tinfo -> cancelled) {
+        errno = tinfo -> cancelled;
+        n = -1;
+        return true;
+    }
+    if(res == -ECANCELED || res == -EAGAIN || res == -EINTR) {  // 被close取消了或者老内核不肯等，按原来的方式再来一遍
+        return false;
+    }
+    errno = -res;
+    n = -1;
+    return true;
+}
+
 /*
     传一个我们要hook的函数名， 以及ioevent中的事件， fdmanager 超时类型
     @fd  句柄
@@ -98,11 +164,12 @@ struct timer_info {
     @hook_fun_name hook 函数名
     @event 事件类型（读/写）
     @time_so 超时类型
+    @sqe 能交给io_uring做的读写填好的请求，不能的传nullptr
     @args 参数列表
 */
 template<typename OriginFun, typename ... Args>
 static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name, 
-                     uint32_t event, int timeout_so, Args&&... args) {
+                     uint32_t event, int timeout_so, io_uring_sqe* sqe, Args&&... args) {
     if(!sylar::t_hook_enable) {                         // 如果没有开启hook
         return fun(fd, std::forward<Args>(args)...);    // 直接使用原本的方法，用forward把对应的参数完美转发过去
     }
@@ -121,7 +188,13 @@ static ssize_t do_io(int fd, OriginFun fun, const char* hook_fun_name,
     }
 
     uint64_t to = ctx->getTimeout(timeout_so);              //取出超时时间
-    std::shared_ptr<timer_info> tinfo(new timer_info);      // 设置超时条件
+    if(sqe) {
+        ssize_t n = 0;
+        if(ring_io(fd, event, to, sqe, n)) {
+            return n;
+        }
+    }
+    std::shared_ptr<timer_info> tinfo;                      // 设置超时条件，第一次EAGAIN的时候才new，大部分调用一次就成功了
 
 // TODO: change to while flag 
 retry:
@@ -133,6 +206,9 @@ retry:
         //SYLAR_LOG_DEBUG(g_logger) << "do_io<" << hook_fun_name << ">" << " async";
         sylar::IOManager* iom = sylar::IOManager::GetThis();    
         sylar::Timer::ptr timer;
+        if(!tinfo) {
+            tinfo.reset(new timer_info);
+        }
         std::weak_ptr<timer_info> winfo(tinfo);
         if(to != (uint64_t)-1) {                         // 如果超时时间不是-1
             timer = iom -> addConditionTimer(to, [winfo, fd, iom, event]() {     //添加一个条件超时计时器，根据逻辑会加到TM中，之后会被IOmanager触发此CB，设置的to就是timer::m_ms即执行周期, 注意这是一个CB，不是现在执行的！！！
@@ -146,7 +222,12 @@ retry:
         }
         
         int rt = iom -> addEvent(fd, (sylar::IOManager::Event)(event)); // 添加一个事件，之后idle会触发, epoll_wait 会监听到有数据进来来触发，cb为空，说明以当前协程为唤醒对象
-        if(rt) {
+        if(rt == 1) {                       // 持久注册模式下等之前已经来过边沿了，不挂起直接再试
+            if(timer) {
+                timer -> cancel();
+            }
+            goto retry;
+        } else if(rt) {
             // 出错就纪录下日志
             SYLAR_LOG_ERROR(g_logger) << hook_fun_name << " addEvent("
                                       << fd << ", " << event << ")";
@@ -243,6 +324,10 @@ extern "C" {
             return fd;
         }
         sylar::FdMgr::GetInstance() -> get(fd, true);
+        sylar::IOManager* iom = sylar::IOManager::GetThis();
+        if(iom) {
+            iom -> onFdCreated(fd);
+        }
         return fd;
     }
 
@@ -289,7 +374,11 @@ extern "C" {
 
         int rt = iom->addEvent(fd, sylar::IOManager::WRITE);
 
-        if(rt == 0) {
+        if(rt == 1) {                       // 已经可写了，连接结果直接去取
+            if(timer) {
+                timer -> cancel();
+            }
+        } else if(rt == 0) {
             sylar::Fiber::YieldToHold();
             if(timer) {
                 timer -> cancel();
@@ -324,58 +413,91 @@ extern "C" {
     }
     
     int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-        int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+        int fd = do_io(s, accept_f, "accept", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, addr, addrlen);
         if(fd >= 0) {
             sylar::FdMgr::GetInstance() -> get(fd, true);
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            if(iom) {
+                iom -> onFdCreated(fd);
+            }
         }
         return fd;
     }
 
     ssize_t read(int fd, void *buf, size_t count) {
-        return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, buf, count);
+        io_uring_sqe sqe;
+        return do_io(fd, read_f, "read", sylar::IOManager::READ, SO_RCVTIMEO, 
+                     prep_sqe(sqe, IORING_OP_READ, fd, buf, count), buf, count);
     }
 
     ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-        return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+        io_uring_sqe sqe;
+        return do_io(fd, readv_f, "readv", sylar::IOManager::READ, SO_RCVTIMEO, 
+                     prep_sqe(sqe, IORING_OP_READV, fd, iov, iovcnt), iov, iovcnt);
     }   
 
     ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-        return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+        io_uring_sqe sqe;
+        return do_io(sockfd, recv_f, "recv", sylar::IOManager::READ, SO_RCVTIMEO, 
+                     prep_sqe(sqe, IORING_OP_RECV, sockfd, buf, len, flags), buf, len, flags);
     }
 
     ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                         struct sockaddr *src_addr, socklen_t *addrlen) {
         return do_io(sockfd, recvfrom_f, "recvfrom", 
-                        sylar::IOManager::READ, SO_RCVTIMEO, 
+                        sylar::IOManager::READ, SO_RCVTIMEO, nullptr,
                         buf, len, flags, src_addr, addrlen);
     }
     
     ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
+        io_uring_sqe sqe;
         return do_io(sockfd, recvmsg_f, "recvmsg", 
-                    sylar::IOManager::READ, SO_RCVTIMEO, msg, flags); 
+                    sylar::IOManager::READ, SO_RCVTIMEO, 
+                    prep_sqe(sqe, IORING_OP_RECVMSG, sockfd, msg, 1, flags), msg, flags); 
     }
 
     ssize_t write(int fd, const void *buf, size_t count) {
-        return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, buf, count);
+        io_uring_sqe sqe;
+        return do_io(fd, write_f, "write", sylar::IOManager::WRITE, SO_SNDTIMEO, 
+                     prep_sqe(sqe, IORING_OP_WRITE, fd, buf, count), buf, count);
     }
 
     ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-        return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+        io_uring_sqe sqe;
+        return do_io(fd, writev_f, "writev", sylar::IOManager::WRITE, SO_SNDTIMEO, 
+                     prep_sqe(sqe, IORING_OP_WRITEV, fd, iov, iovcnt), iov, iovcnt);
     }
 
     ssize_t send(int s, const void *msg, size_t len, int flags) {
-        return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+        io_uring_sqe sqe;
+        return do_io(s, send_f, "send", sylar::IOManager::WRITE, SO_SNDTIMEO, 
+                     prep_sqe(sqe, IORING_OP_SEND, s, msg, len, flags), msg, len, flags);
     }
 
     ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
-        return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+        return do_io(s, sendto_f, "sendto", sylar::IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, len, flags, to, tolen);
     }
 
     ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-        return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+        io_uring_sqe sqe;
+        return do_io(s, sendmsg_f, "sendmsg", sylar::IOManager::WRITE, SO_SNDTIMEO, 
+                     prep_sqe(sqe, IORING_OP_SENDMSG, s, msg, 1, flags), msg, flags);
     }
 
 
+    int accept4(int s, struct sockaddr *addr, socklen_t *addrlen, int flags) {
+        int fd = do_io(s, accept4_f, "accept4", sylar::IOManager::READ, SO_RCVTIMEO, nullptr, addr, addrlen, flags);
+        if(fd >= 0) {
+            // SOCK_NONBLOCK出来的一定是非阻塞的socket，不用再fstat/fcntl
+            sylar::FdMgr::GetInstance() -> get(fd, true, flags & SOCK_NONBLOCK);
+            sylar::IOManager* iom = sylar::IOManager::GetThis();
+            if(iom) {
+                iom -> onFdCreated(fd);
+            }
+        }
+        return fd;
+    }
+
     int close(int fd) {
         if(!sylar::t_hook_enable) {
             return close_f(fd);
@@ -51,14 +51,132 @@ namespace sylar {
             return strcasecmp(lhs.c_str(), rhs.c_str()) < 0;
         }
 
+        uint32_t HeaderHash(const char* str, size_t len) {
+            uint32_t h = 2166136261u;
+            for(size_t i = 0; i < len; ++ i) {
+                h = (h ^ (uint8_t)(str[i] | 0x20)) * 16777619u;
+            }
+            return h;
+        }
+
         HttpRequest::HttpRequest(uint8_t version, bool close) 
             : m_method(HttpMethod::GET),
               m_version(version), 
               m_close(close),
+              m_view(false),
+              m_materialized(false),
               m_path("/") {
 
         }
+
+        void HttpRequest::initClose() {
+            StringView conn = getHeaderView(header::CONNECTION);
+            if(conn.iequals(StringView("close", 5))) {
+                m_close = true;
+            } else if(conn.iequals(StringView("keep-alive", 10))) {
+                m_close = false;
+            } else {
+                m_close = m_version < 0x11;
+            }
+        }
+
+        void HttpRequest::reset() {
+            m_method = HttpMethod::GET;
+            m_version = 0x11;
+            m_close = true;
+            m_view = false;
+            m_materialized = false;
+            m_path = "/";
+            m_query.clear();
+            m_fragment.clear();
+            m_body.clear();
+            m_headers.clear();
+            m_params.clear();
+            m_cookies.clear();
+            m_buffer.reset();
+            m_bodyBuffer.reset();
+            m_pathView = StringView();
+            m_queryView = StringView();
+            m_fragmentView = StringView();
+            m_bodyView = StringView();
+            m_headerViews.clear();
+        }
+
+        void HttpRequest::setBuffer(std::shared_ptr<char> buffer) {
+            m_view = true;
+            m_materialized = false;
+            m_buffer = buffer;
+            m_bodyBuffer.reset();
+            m_pathView = StringView("/", 1);
+            m_queryView = StringView();
+            m_fragmentView = StringView();
+            m_bodyView = StringView();
+            m_headerViews.clear();
+            if(m_headerViews.capacity() == 0) {
+                m_headerViews.reserve(16);          // 一般的请求头不会超过16个，只分配这一次
+            }
+        }
+
+        void HttpRequest::setBodyView(const StringView& v, std::shared_ptr<char> owner) {
+            m_bodyView = v;
+            m_bodyBuffer = owner;
+        }
+
+        void HttpRequest::addHeaderView(const StringView& name, const StringView& value) {
+            HeaderView h;
+            h.name = name;
+            h.value = value;
+            h.hash = HeaderHash(name.data(), name.size());
+            m_headerViews.push_back(h);
+        }
+
+        const HttpRequest::HeaderView* HttpRequest::findHeaderView(const HeaderKey& key) const {
+            // 同名的头和解析成map的时候一样，最后一个算数
+            for(auto it = m_headerViews.rbegin(); it != m_headerViews.rend(); ++ it) {
+                if(it -> hash == key.hash && it -> name.iequals(key.name)) {
+                    return &*it;
+                }
+            }
+            return nullptr;
+        }
+
+        StringView HttpRequest::getHeaderView(const HeaderKey& key, const StringView& def) const {
+            if(m_view) {
+                const HeaderView* h = findHeaderView(key);
+                return h ? h -> value : def;
+            }
+            auto it = m_headers.find(key.name.toString());
+            return it == m_headers.end() ? def : StringView(it -> second);
+        }
+
+        void HttpRequest::doMaterialize() const {
+            m_path.assign(m_pathView.data(), m_pathView.size());
+            m_query.assign(m_queryView.data(), m_queryView.size());
+            m_fragment.assign(m_fragmentView.data(), m_fragmentView.size());
+            m_body.assign(m_bodyView.data(), m_bodyView.size());
+            m_headers.clear();
+            for(auto& h : m_headerViews) {
+                m_headers[h.name.toString()] = h.value.toString();
+            }
+            m_materialized = true;
+        }
+
+        void HttpRequest::unview() {
+            if(!m_view) {
+                return;
+            }
+            materialize();
+            m_view = false;
+            m_buffer.reset();
+            m_bodyBuffer.reset();
+            m_headerViews.clear();
+        }
+
         std::string HttpRequest::getHeaders(const std::string& key, const std::string& def) const {
+            if(m_view) {
+                const HeaderView* h = findHeaderView(HeaderKey(key));
+                return h ? h -> value.toString() : def;
+            }
             auto it = m_headers.find(key);
             return it == m_headers.end() ? def : it -> second;
         }
@@ -72,6 +190,7 @@ namespace sylar {
         }
 
         void HttpRequest::setHeader(const std::string& key, const std::string& val) {
+            unview();
             m_headers[key] = val;
         }
         void HttpRequest::setParams (const std::string& key, const std::string& val) {
@@ -82,6 +201,7 @@ namespace sylar {
         }
 
         void HttpRequest::delHeaders(const std::string& key) {
+            unview();
             m_headers.erase(key);
         }
         void HttpRequest::delParams (const std::string& key) {
@@ -92,6 +212,13 @@ namespace sylar {
         }
 
         bool HttpRequest::hasHeaders(const std::string& key, std::string* val) {
+            if(m_view) {
+                const HeaderView* h = findHeaderView(HeaderKey(key));
+                if(h && val) {
+                    *val = h -> value.toString();
+                }
+                return h != nullptr;
+            }
             auto it = m_headers.find(key);
             if(it == m_headers.end()) {
                 return false;
@@ -143,6 +270,7 @@ namespace sylar {
                 
                 HTTP/1.1 200 OK
             */
+            materialize();
             os << HttpMethodToString(m_method) << " "
                << m_path
                << (m_query.empty() ? "" : "?")
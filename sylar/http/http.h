@@ -4,9 +4,11 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <vector>
 #include <iostream>
 #include <sstream>
 #include <boost/lexical_cast.hpp>
+#include "sylar/string_view.h"
 
 
 
@@ -142,6 +144,40 @@ namespace sylar {
             bool operator() (const std::string& lhs, const std::string& rhs) const;
         };
 
+        /*
+            头名字的hash，大小写无关: FNV-1a，每个字节先|0x20
+            (字母变小写，token里的其他字符只会和别的字符撞hash，比较的时候还要再strncasecmp)
+            ConstHeaderHash给编译期的常量用，递归的，运行时用HeaderHash
+        */
+        constexpr uint32_t ConstHeaderHash(const char* str, size_t len, uint32_t h = 2166136261u) {
+            return len == 0 ? h : ConstHeaderHash(str + 1, len - 1, (h ^ (uint8_t)(*str | 0x20)) * 16777619u);
+        }
+        uint32_t HeaderHash(const char* str, size_t len);
+
+        struct HeaderKey {
+            StringView name;
+            uint32_t hash;
+
+            template<size_t N>
+            constexpr HeaderKey(const char (&str)[N])
+                : name(str, N - 1), hash(ConstHeaderHash(str, N - 1)) {}
+            HeaderKey(const StringView& str)
+                : name(str), hash(HeaderHash(str.data(), str.size())) {}
+        };
+
+        // 常用的头，hash编译期算好
+        namespace header {
+            constexpr HeaderKey HOST("host");
+            constexpr HeaderKey CONNECTION("connection");
+            constexpr HeaderKey CONTENT_LENGTH("content-length");
+            constexpr HeaderKey CONTENT_TYPE("content-type");
+            constexpr HeaderKey TRANSFER_ENCODING("transfer-encoding");
+            constexpr HeaderKey ACCEPT("accept");
+            constexpr HeaderKey ACCEPT_ENCODING("accept-encoding");
+            constexpr HeaderKey USER_AGENT("user-agent");
+            constexpr HeaderKey COOKIE("cookie");
+        }
+
         // 从map里找到一个key看能不能转成功
         template<class MapType, class T> 
         bool checkGetAs(const MapType& m, const std::string& key, T& val, const T& def = T()) {
@@ -172,34 +208,66 @@ namespace sylar {
             return def;
         }
 
+        /*
+            零拷贝模式(HttpRequestParser(true)解析出来的，isView())：
+            请求自己持有接收缓冲区，path/query/fragment/body/头都是指向缓冲区的StringView，
+            头放在一个扁平数组里，带着名字的hash，getHeaderView先比hash再比名字
+            原来返回std::string/MapType的接口照样能用，第一次调的时候才拷出来(materialize)，
+            任何修改(setXXX/delXXX)都会先拷出来再退出零拷贝模式
+        */
         class HttpRequest {
         public:
             typedef std::shared_ptr<HttpRequest> ptr;
             typedef std::map<std::string, std::string, CaseInsensitiveLess> MapType;
             //typedef std::map<std::string, std::string, CaseInsensitiveLess> MapType;
+
+            struct HeaderView {
+                StringView name;
+                StringView value;
+                uint32_t hash;
+            };
+            typedef std::vector<HeaderView> HeaderViews;
+
             HttpRequest(uint8_t version = 0x11, bool close = true);
 
             HttpMethod getMethod() const { return m_method; }
             uint8_t getVersion() const { return m_version; }
             // HttpStatus getStatus() const { return m_status; }
-            const std::string& getPath() const { return m_path; }
-            const std::string& getQuery() const { return m_query; }
-            const std::string& getBody() const { return m_body; }
+            const std::string& getPath() const { materialize(); return m_path; }
+            const std::string& getQuery() const { materialize(); return m_query; }
+            const std::string& getBody() const { materialize(); return m_body; }
         
-            const MapType& getHeaders() const { return m_headers; }
+            const MapType& getHeaders() const { materialize(); return m_headers; }
             const MapType& getParams() const { return m_params; }
             const MapType& getCookies() const { return m_cookies;}
 
+            // 不拷贝的版本，不是零拷贝模式的时候指向内部的std::string
+            bool isView() const { return m_view;}
+            StringView getPathView() const { return m_view ? m_pathView : StringView(m_path);}
+            StringView getQueryView() const { return m_view ? m_queryView : StringView(m_query);}
+            StringView getBodyView() const { return m_view ? m_bodyView : StringView(m_body);}
+            const HeaderViews& getHeaderViews() const { return m_headerViews;}     // 只有零拷贝模式有
+            // 没有返回def，同名的头返回最后一个
+            StringView getHeaderView(const HeaderKey& key, const StringView& def = StringView()) const;
+
+            // 进入零拷贝模式，之后的view都指向buffer(body可以另外给一块)
+            void setBuffer(std::shared_ptr<char> buffer);
+            void setPathView(const StringView& v) { m_pathView = v;}
+            void setQueryView(const StringView& v) { m_queryView = v;}
+            void setFragmentView(const StringView& v) { m_fragmentView = v;}
+            void setBodyView(const StringView& v, std::shared_ptr<char> owner = nullptr);
+            void addHeaderView(const StringView& name, const StringView& value);
+
             void setMethod(HttpMethod v) { m_method = v; }
             // void setStatus(HttpStatus v) { m_status = v; }
             void setVersion(uint8_t v)   { m_version = v; }
 
-            void setPath(const std::string& v) { m_path = v; }
-            void setQuery(const std::string& v) { m_query = v; }
-            void setFragment(const std::string& v) { m_fragment = v; }
-            void setBody(const std::string& v) { m_body = v; }
+            void setPath(const std::string& v) { unview(); m_path = v; }
+            void setQuery(const std::string& v) { unview(); m_query = v; }
+            void setFragment(const std::string& v) { unview(); m_fragment = v; }
+            void setBody(const std::string& v) { unview(); m_body = v; }
 
-            void setHeaders(const MapType& v) { m_headers = v; }
+            void setHeaders(const MapType& v) { unview(); m_headers = v; }
             void setParams(const MapType& v) { m_params = v; }
             void setCookies(const MapType& v) { m_cookies = v; }
 
@@ -222,14 +290,21 @@ namespace sylar {
 
             bool isClose() const {return m_close;}
             void setClose(bool v) {m_close = v;}
+            // 请求头解析完之后按版本和Connection头定长短连接: 1.1默认长连接，1.0默认短连接
+            void initClose();
+
+            // 回到刚构造完的样子，已经分配的内存(头数组、string)留着给下一个请求用
+            void reset();
 
             template<class T>
             bool checkGetHeaderAs(const std::string& key, T& val, const T& def = T()) {
+                materialize();
                 return checkGetAs(m_headers, key, val, def);
             }
 
             template<class T>
             T getHeaderAs(const std::string& key, const T& def = T()) {
+                materialize();
                 return getAs(m_headers, key, def);
             }
 
@@ -256,22 +331,41 @@ namespace sylar {
             std::ostream& dump(std::ostream& os) const;
             std::string toString() const;
 
+        private:
+            void materialize() const {
+                if(m_view && !m_materialized) {
+                    doMaterialize();
+                }
+            }
+            void doMaterialize() const;
+            void unview();
+            const HeaderView* findHeaderView(const HeaderKey& key) const;
         private:
             HttpMethod m_method;
             // HttpStatus m_status;
             uint8_t m_version;
             bool m_close;
+            bool m_view;
+            mutable bool m_materialized;        // 零拷贝模式下std::string那一套已经拷出来了
 
-            std::string m_path;
-            std::string m_query;
-            std::string m_fragment;
-            std::string m_body;
+            // 零拷贝模式下是第一次用到的时候才从view拷出来的，所以是mutable
+            mutable std::string m_path;
+            mutable std::string m_query;
+            mutable std::string m_fragment;
+            mutable std::string m_body;
 
             // 这里用了一个仿函数的方法把value变成上面我们定义的struct，即大小写不敏感
-            MapType m_headers;
+            mutable MapType m_headers;
             MapType m_params;
             MapType m_cookies;
 
+            std::shared_ptr<char> m_buffer;     // 零拷贝模式下view指向的接收缓冲区
+            std::shared_ptr<char> m_bodyBuffer; // body太大放不进m_buffer的时候单独的一块
+            StringView m_pathView;
+            StringView m_queryView;
+            StringView m_fragmentView;
+            StringView m_bodyView;
+            HeaderViews m_headerViews;
         };
 
         class HttpResponse {
@@ -16,8 +16,12 @@ namespace sylar {
         static sylar::ConfigVar<uint64_t>::ptr g_http_request_max_body_size = 
                sylar::Config::Lookup("http.request.max_body_size", (uint64_t)(64 * 1024 * 1024ull), "http reuqest max body size");
 
+        static sylar::ConfigVar<bool>::ptr g_http_request_zero_copy = 
+               sylar::Config::Lookup("http.request.zero_copy", true, "http request keeps its receive buffer and exposes views into it");
+
         static uint64_t s_http_request_buffer_size = 0;
         static uint64_t s_http_request_max_body_size = 0;
+        static bool s_http_request_zero_copy = true;
 
         uint64_t HttpRequestParser::GetHttpRequestBufferSize() {
             return s_http_request_buffer_size;
@@ -27,6 +31,10 @@ namespace sylar {
             return s_http_request_max_body_size;
         }
 
+        bool HttpRequestParser::IsHttpRequestZeroCopy() {
+            return s_http_request_zero_copy;
+        }
+
     namespace {
         struct _RequestSizeIniter {
             _RequestSizeIniter() {
@@ -39,6 +47,11 @@ namespace sylar {
                 g_http_request_max_body_size -> addListener([](const uint64_t& oldValue, const uint64_t& newValue) {
                     s_http_request_max_body_size = newValue;
                 });
+
+                s_http_request_zero_copy = g_http_request_zero_copy -> getValue();
+                g_http_request_zero_copy -> addListener([](const bool& oldValue, const bool& newValue) {
+                    s_http_request_zero_copy = newValue;
+                });
             }
         };
 
@@ -64,14 +77,26 @@ namespace sylar {
 
         void on_request_fragment(void *data, const char *at, size_t length) {
             HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
+            if(parser -> isView()) {
+                parser -> getData() -> setFragmentView(StringView(at, length));
+                return;
+            }
             parser -> getData() -> setFragment(std::string(at, length));    
         }
         void on_request_path(void *data, const char *at, size_t length) {
             HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
+            if(parser -> isView()) {
+                parser -> getData() -> setPathView(StringView(at, length));
+                return;
+            }
             parser -> getData() -> setPath(std::string(at, length));
         }
         void on_request_query(void *data, const char *at, size_t length) {
             HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
+            if(parser -> isView()) {
+                parser -> getData() -> setQueryView(StringView(at, length));
+                return;
+            }
             parser -> getData() -> setQuery(std::string(at, length));
         }
         void on_request_version(void *data, const char *at, size_t length) {
@@ -90,8 +115,8 @@ namespace sylar {
             parser -> getData() -> setVersion(v);
         }
         void on_request_header_done(void *data, const char *at, size_t length) {
-            // HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
-            
+            HttpRequestParser* parser = static_cast<HttpRequestParser*>(data);
+            parser -> getData() -> initClose();
         }
 
         void on_request_http_field(void *data, const char *field, size_t flen, const char *value, size_t vlen) {
@@ -101,12 +126,17 @@ namespace sylar {
                 parser -> setError(1002);
                 return;
             }
+            if(parser -> isView()) {
+                parser -> getData() -> addHeaderView(StringView(field, flen), StringView(value, vlen));
+                return;
+            }
             parser -> getData() -> setHeader(std::string(field, flen), std::string(value, vlen));
         }
 
 
-        HttpRequestParser::HttpRequestParser()
-            : m_error(0) {
+        HttpRequestParser::HttpRequestParser(bool view)
+            : m_error(0),
+              m_view(view) {
             m_data.reset(new sylar::http::HttpRequest);
             http_parser_init(&m_parser);
             m_parser.request_method = on_request_method;
@@ -125,11 +155,31 @@ namespace sylar {
 
         // 1: 成功， -1：失败， 其他表示已经处理的字节数，且data有效数据为len - v;
         size_t HttpRequestParser::execute(char* data, size_t len) {
+            m_parser.nread = 0;                 // nread是累加的，这里要的是这一次解析了多少
             size_t offset = http_parser_execute(&m_parser, data, len, 0);
             // 还没有解析完
             memmove(data, data + offset, (len - offset));
             return offset;
         }
+
+        size_t HttpRequestParser::parse(const char* data, size_t len, size_t off) {
+            if(off >= len) {
+                return off;
+            }
+            return http_parser_execute(&m_parser, data, len, off);
+        }
+
+        void HttpRequestParser::reset(bool view) {
+            if(m_data.use_count() == 1) {
+                m_data -> reset();
+            } else {
+                m_data.reset(new sylar::http::HttpRequest);
+            }
+            http_parser_init(&m_parser);
+            m_error = 0;
+            m_view = view;
+        }
+
         int HttpRequestParser::isFinished()  {
             return http_parser_finish(&m_parser);
         }
@@ -138,6 +188,18 @@ namespace sylar {
         }
 
         uint64_t HttpRequestParser::getContentLength() {
+            if(m_view) {
+                // 不走lexical_cast，也就不会把头拷成map
+                StringView v = m_data -> getHeaderView(header::CONTENT_LENGTH);
+                uint64_t len = 0;
+                for(size_t i = 0; i < v.size(); ++ i) {
+                    if(v[i] < '0' || v[i] > '9') {
+                        return 0;
+                    }
+                    len = len * 10 + (v[i] - '0');
+                }
+                return len;
+            }
             return m_data -> getHeaderAs<uint64_t>("content-length", 0);
         }
 
@@ -11,10 +11,24 @@ namespace sylar {
         class HttpRequestParser {
         public:
             typedef std::shared_ptr<HttpRequestParser> ptr;
-            HttpRequestParser();
+            // view为true的时候是零拷贝模式，解析结果都是指向输入数据的StringView，
+            // 要用parse()，调用方保证数据不挪动，并且把数据所在的缓冲区交给getData() -> setBuffer()
+            HttpRequestParser(bool view = false);
             size_t execute(char* data, size_t len);
+            /*
+                零拷贝模式用，不memmove，之前解析到一半的位置也还指向原来的数据
+                data是从请求开头算起的全部数据，off是上次的返回值(第一次0)，返回一共解析了多少字节，
+                isFinished()的时候就是请求头的长度
+            */
+            size_t parse(const char* data, size_t len, size_t off);
+            /*
+                重新开始解析下一个请求，HttpSession在长连接上复用同一个parser
+                上一个请求没有别人拿着的话原地reset接着用，否则换一个新的
+            */
+            void reset(bool view);
             int isFinished();
             int hasError();
+            bool isView() const { return m_view;}
 
             HttpRequest::ptr getData() const {return m_data;}
             void setError(int v) { m_error = v; }
@@ -23,6 +37,7 @@ namespace sylar {
         public:
             static uint64_t GetHttpRequestBufferSize();
             static uint64_t GetHttpRequestMaxBodySize();
+            static bool IsHttpRequestZeroCopy();
         private:
             http_parser m_parser;
             HttpRequest::ptr m_data;
@@ -30,6 +45,7 @@ namespace sylar {
             // 1001: invalid version
             // 1002: invalid field
             int m_error;
+            bool m_view;
         };
 
         class HttpResponseParser {
@@ -1,16 +1,71 @@
 #include "http_server.h"
 #include "sylar/log.h"
+#include "sylar/hook.h"
 
 namespace sylar {
     namespace http {
         static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+        static const int64_t kRejectLingerMs = 200;         // 回了503之后最多等对端这么久
+        static const size_t kRejectDrainMax = 64 * 1024;    // 最多替对端读掉这么多
+        static const int kRejectLingerMax = 1024;           // 同时在lingering close的连接数上限
+        static std::atomic<int> s_reject_lingering = {0};
+
+        // 把对端发来的读掉，读到EOF、超时或者读够了为止，nonblock的时候只读已经到了的
+        static void DrainClient(Socket::ptr client, bool nonblock) {
+            char buf[1024];
+            size_t total = 0;
+            while(total < kRejectDrainMax) {
+                int rt = nonblock ? recv_f(client -> geSocket(), buf, sizeof(buf), MSG_DONTWAIT)
+                                  : client -> recv(buf, sizeof(buf));
+                if(rt <= 0) {
+                    break;
+                }
+                total += rt;
+            }
+        }
+
         HttpServer::HttpServer(bool keepalive, sylar::IOManager* worker, sylar::IOManager* accept_worker)
             : TcpServer(worker, accept_worker),
               m_isKeeplive(keepalive) {
             m_dispatch.reset(new ServletDispatch);
         }
 
+        void HttpServer::rejectClient(Socket::ptr client, Reject reason) {
+            static const char s_rsp[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                        "Content-Length: 0\r\n"
+                                        "Connection: close\r\n"
+                                        "Retry-After: 1\r\n\r\n";
+            // 刚accept出来发送缓冲区是空的，直接调原始的send，发不出去也不等，accept协程不能被挂起
+            send_f(client -> geSocket(), s_rsp, sizeof(s_rsp) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            /*
+                接收缓冲区里还有没读的请求的时候直接close，内核回的是RST，对端多半只看到connection reset，看不到503
+                所以先shutdown写端(503后面跟FIN)，把已经到了的读掉，再开个协程等对端关(最多kRejectLingerMs)再close
+                - 协程开在accept的IOManager上。reuseport的时候accept协程跑在worker上，拒绝的时候worker正忙，不能再往上加活
+                - accept和worker是同一个IOManager、又是因为worker排队排不过来被拒的，就不等了
+                - lingering的太多了也不等了
+            */
+            ::shutdown(client -> geSocket(), SHUT_WR);
+            DrainClient(client, true);
+            IOManager* iom = getAcceptWorker();
+            if(iom == getWorker() && (reason == REJECT_PENDING || reason == REJECT_OVERLOAD)) {
+                iom = nullptr;
+            }
+            if(!iom || ++s_reject_lingering > kRejectLingerMax) {
+                if(iom) {
+                    --s_reject_lingering;
+                }
+                client -> close();
+                return;
+            }
+            iom -> schedule([client](){
+                client -> setRecvTimeout(kRejectLingerMs);
+                DrainClient(client, false);
+                client -> close();
+                --s_reject_lingering;
+            });
+        }
+
         void HttpServer::handleClient(Socket::ptr client) {
             sylar::http::HttpSession::ptr session(new HttpSession(client));
             // SYLAR_LOG_DEBUG(g_logger) << "test1";
@@ -34,6 +89,9 @@ namespace sylar {
                 // SYLAR_LOG_INFO(g_logger) << "response: " << std::endl << *rsp;
 
                 session -> sendResponse(rsp);
+                if(rsp -> isClose()) {
+                    break;
+                }
             } while(m_isKeeplive);
             session -> close();
         }
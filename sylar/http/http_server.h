@@ -18,6 +18,11 @@ namespace sylar {
             void setServletDispatch(ServletDispatch::ptr v) {m_dispatch = v;}
         protected:
             virtual void handleClient(Socket::ptr client) override;
+            /*
+                回一个503再关，客户端看得到是过载而不是连接被重置:
+                shutdown写端，已经到了的请求读掉，再在accept的IOManager上等对端关(最多读64KB、等200ms)才close
+            */
+            virtual void rejectClient(Socket::ptr client, Reject reason) override;
         private:
             bool m_isKeeplive;
             ServletDispatch::ptr m_dispatch;
@@ -5,58 +5,144 @@ namespace sylar {
     namespace http {
 
         HttpSession::HttpSession(Socket::ptr sock, bool owner)
-            : SocketStream(sock, owner) {
+            : SocketStream(sock, owner),
+              m_bufferSize(0),
+              m_leftOff(0),
+              m_leftLen(0) {
             
         }
 
-        HttpRequest::ptr HttpSession::recvRequest() {
-            HttpRequestParser::ptr parser(new HttpRequestParser);
-            uint64_t buffer_size = HttpRequestParser::GetHttpRequestBufferSize();
+        char* HttpSession::prepareBuffer() {
+            uint64_t buffer_size = std::max<uint64_t>(HttpRequestParser::GetHttpRequestBufferSize(), m_leftLen);
+            if(!m_buffer || m_buffer.use_count() > 1 || m_bufferSize != buffer_size) {
+                // 上一个请求还被别人拿着(view指着这块缓冲区)，或者配置改了，换一块新的
+                std::shared_ptr<char> buffer(new char[buffer_size], [](char* ptr){
+                    delete[] ptr;
+                });
+                if(m_leftLen) {
+                    memcpy(buffer.get(), m_buffer.get() + m_leftOff, m_leftLen);
+                }
+                m_buffer = buffer;
+                m_bufferSize = buffer_size;
+            } else if(m_leftLen && m_leftOff) {
+                memmove(m_buffer.get(), m_buffer.get() + m_leftOff, m_leftLen);
+            }
+            m_leftOff = 0;
+            return m_buffer.get();
+        }
 
-            std::shared_ptr<char> buffer(new char[buffer_size], [](char* ptr){
-                delete[] ptr;
-            });
+        HttpRequest::ptr HttpSession::recvRequest() {
+            bool view = HttpRequestParser::IsHttpRequestZeroCopy();
+            // 先reset parser，放掉上一个请求对缓冲区的引用，缓冲区才能接着用
+            if(m_parser) {
+                m_parser -> reset(view);
+            } else {
+                m_parser.reset(new HttpRequestParser(view));
+            }
+            HttpRequest::ptr req = view ? recvRequestView() : recvRequestCopy();
+            if(!req) {
+                m_leftLen = 0;
+            }
+            return req;
+        }
 
-            char* data = buffer.get();
-            int offset = 0;
+        HttpRequest::ptr HttpSession::recvRequestCopy() {
+            char* data = prepareBuffer();
+            size_t buffer_size = m_bufferSize;
+            size_t len = m_leftLen;             // data里还没解析的字节，execute会把它们挪到开头
+            m_leftLen = 0;
             do {
-                int len = read(data + offset, buffer_size - offset);
-                if(len <= 0) {
-                    return nullptr;
+                if(len) {
+                    size_t nparse = m_parser -> execute(data, len);
+                    if(m_parser -> hasError()) {
+                        return nullptr;
+                    }
+                    len -= nparse;
+                    if(m_parser -> isFinished()) {
+                        break;
+                    }
                 }
-                len += offset;
-                size_t nparse = parser -> execute(data, len);
-                if(parser -> hasError()) {
+                if(len == buffer_size) {
                     return nullptr;
                 }
-                offset = len - nparse;
-                if(offset == (int)buffer_size) {
+                int rt = read(data + len, buffer_size - len);
+                if(rt <= 0) {
                     return nullptr;
                 }
-                if(parser -> isFinished()) {
-                    break;
-                }
+                len += rt;
             } while (true);
 
-            int64_t length = parser -> getContentLength();
+            uint64_t length = m_parser -> getContentLength();
+            size_t have = std::min<uint64_t>(len, length);
             if(length > 0) {
                 std::string body;
-                body.reserve(length);
-                
-                if(length >= offset) {
-                    body.append(data, offset);
-                } else {
-                    body.append(data, length);
+                body.resize(length);
+                memcpy(&body[0], data, have);
+                if(have < length) {
+                    if(readFixSize(&body[have], length - have) <= 0) {
+                        return nullptr;
+                    }
                 }
-                length -= offset;
-                if (length > 0) {
-                    if(readFixSize(&body[body.size()], length) <= 0) {
+                m_parser -> getData() -> setBody(body);
+            }
+            m_leftOff = have;
+            m_leftLen = len - have;
+            return m_parser -> getData();
+        }
+
+        HttpRequest::ptr HttpSession::recvRequestView() {
+            char* data = prepareBuffer();
+            size_t buffer_size = m_bufferSize;
+            // 请求头一直读在同一块缓冲区里不挪动，解析出来的view全都指向它，缓冲区交给请求保管
+            HttpRequest::ptr req = m_parser -> getData();
+            req -> setBuffer(m_buffer);
+
+            size_t len = m_leftLen;
+            size_t nparse = 0;
+            m_leftLen = 0;
+            do {
+                if(len) {
+                    nparse = m_parser -> parse(data, len, nparse);
+                    if(m_parser -> hasError()) {
+                        return nullptr;
+                    }
+                    if(m_parser -> isFinished()) {
+                        break;
+                    }
+                }
+                if(len == buffer_size) {
+                    return nullptr;                 // 请求头比缓冲区还大
+                }
+                int rt = read(data + len, buffer_size - len);
+                if(rt <= 0) {
+                    return nullptr;
+                }
+                len += rt;
+            } while(true);
+
+            uint64_t length = m_parser -> getContentLength();
+            size_t have = std::min<uint64_t>(len - nparse, length);
+            if(length > 0) {
+                if(nparse + length <= buffer_size) {
+                    // 剩下的地方放得下body，接着读在后面
+                    if(have < length && readFixSize(data + len, length - have) <= 0) {
+                        return nullptr;
+                    }
+                    req -> setBodyView(StringView(data + nparse, length));
+                } else {
+                    std::shared_ptr<char> body(new char[length], [](char* ptr){
+                        delete[] ptr;
+                    });
+                    memcpy(body.get(), data + nparse, have);
+                    if(have < length && readFixSize(body.get() + have, length - have) <= 0) {
                         return nullptr;
                     }
+                    req -> setBodyView(StringView(body.get(), length), body);
                 }
-                parser -> getData() -> setBody(body);
             }
-            return parser -> getData();
+            m_leftOff = nparse + have;
+            m_leftLen = len - m_leftOff;
+            return req;
         }
 
         int HttpSession::sendResponse(HttpResponse::ptr rsp) {
@@ -67,4 +153,4 @@ namespace sylar {
         }
         
     }
-}
\ No newline at end of file
+}
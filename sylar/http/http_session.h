@@ -6,16 +6,33 @@
 
 namespace sylar {
     namespace http {
+        class HttpRequestParser;
+
+        /*
+            长连接上一直用同一个接收缓冲区和parser，上一个请求后面多读进来的字节(pipelining)留给下一个请求
+            零拷贝模式下请求拿着缓冲区，如果上一个请求在下一次recvRequest的时候还被别人拿着，就换一块新的，
+            剩下的字节拷过去
+        */
         class HttpSession : public SocketStream {
         public:
             typedef std::shared_ptr<HttpSession> ptr;
             HttpSession(Socket::ptr sock, bool owner = true);
 
+            // http.request.zero_copy打开的时候是零拷贝模式，返回的请求持有接收缓冲区
             HttpRequest::ptr recvRequest();
             int sendResponse(HttpResponse::ptr rsp);
-        
+        private:
+            char* prepareBuffer();
+            HttpRequest::ptr recvRequestView();
+            HttpRequest::ptr recvRequestCopy();
+        private:
+            std::shared_ptr<HttpRequestParser> m_parser;
+            std::shared_ptr<char> m_buffer;
+            size_t m_bufferSize;
+            size_t m_leftOff;           // 上一个请求之后剩下的字节在m_buffer里的位置
+            size_t m_leftLen;
         };
     }
 }
 
-#endif
\ No newline at end of file
+#endif
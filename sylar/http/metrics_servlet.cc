@@ -0,0 +1,142 @@
+#include "metrics_servlet.h"
+#include <sstream>
+
+namespace sylar {
+    namespace http {
+
+        static void JsonString(std::ostream& os, const std::string& str) {
+            os << '"';
+            for(char c : str) {
+                if(c == '"' || c == '\\') {
+                    os << '\\' << c;
+                } else if((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    os << buf;
+                } else {
+                    os << c;
+                }
+            }
+            os << '"';
+        }
+
+        static void WorkerJson(std::ostream& os, const Scheduler::WorkerMetrics& w) {
+            os << "{\"index\":" << w.index
+               << ",\"thread_id\":" << w.threadId
+               << ",\"queued\":" << w.queued
+               << ",\"tasks\":" << w.tasks
+               << ",\"busy_us\":" << w.busyUs
+               << ",\"idle_us\":" << w.idleUs
+               << ",\"idles\":" << w.idles
+               << ",\"wakeups\":" << w.wakeups
+               << ",\"events\":" << w.events
+               << ",\"timers\":" << w.timers
+               << "}";
+        }
+
+        static void SummaryJson(std::ostream& os, const Histogram::Summary& s) {
+            os << "{\"count\":" << s.count
+               << ",\"mean_ns\":" << s.mean
+               << ",\"p50_ns\":" << s.p50
+               << ",\"p90_ns\":" << s.p90
+               << ",\"p99_ns\":" << s.p99
+               << ",\"p999_ns\":" << s.p999
+               << ",\"max_ns\":" << s.max
+               << "}";
+        }
+
+        std::string MetricsServlet::ToJson(const Scheduler::Metrics& m, bool workers) {
+            std::stringstream ss;
+            ss << "{\"name\":";
+            JsonString(ss, m.name);
+            ss << ",\"threads\":" << m.threads
+               << ",\"active_threads\":" << m.activeThreads
+               << ",\"idle_threads\":" << m.idleThreads
+               << ",\"global_queued\":" << m.globalQueued
+               << ",\"fibers\":" << m.fibers
+               << ",\"pending_events\":" << m.pendingEvents
+               << ",\"timers\":" << m.timers
+               << ",\"tickles\":" << m.tickles
+               << ",\"tickles_suppressed\":" << m.ticklesSuppressed
+               << ",\"epoll_ctls\":" << m.epollCtls
+               << ",\"slow_tasks\":" << m.slowTasks
+               << ",\"queue_wait\":";
+            SummaryJson(ss, m.queueWait);
+            ss << ",\"run_slice\":";
+            SummaryJson(ss, m.runSlice);
+            ss << ",\"total\":";
+            WorkerJson(ss, m.total);
+            if(workers) {
+                ss << ",\"workers\":[";
+                for(size_t i = 0; i < m.workers.size(); ++ i) {
+                    if(i) {
+                        ss << ",";
+                    }
+                    WorkerJson(ss, m.workers[i]);
+                }
+                ss << "]";
+            }
+            ss << "}";
+            return ss.str();
+        }
+
+        std::string MetricsServlet::ToJson(const TcpServer::Stats& s) {
+            std::stringstream ss;
+            ss << "{\"name\":";
+            JsonString(ss, s.name);
+            ss << ",\"accepted\":" << s.accepted
+               << ",\"connections\":" << s.connections
+               << ",\"pending\":" << s.pending
+               << ",\"overloaded\":" << (s.overloaded ? "true" : "false")
+               << ",\"rejected\":{";
+            for(int i = 0; i < TcpServer::REJECT_COUNT; ++ i) {
+                if(i) {
+                    ss << ",";
+                }
+                ss << "\"" << TcpServer::RejectToString((TcpServer::Reject)i) << "\":" << s.rejected[i];
+            }
+            ss << "}}";
+            return ss.str();
+        }
+
+        MetricsServlet::MetricsServlet()
+            : Servlet("MetricsServlet") {
+        }
+
+        int32_t MetricsServlet::handle(sylar::http::HttpRequest::ptr request,
+                           sylar::http::HttpResponse::ptr response,
+                           sylar::http::HttpSession::ptr session) {
+            bool workers = request -> getQuery().find("workers=0") == std::string::npos;
+            // 先在锁里把数据取出来，拼JSON放到锁外面
+            std::vector<Scheduler::Metrics> all;
+            Scheduler::ForEach([&all](Scheduler* sc){
+                all.push_back(sc -> getMetrics());
+            });
+            std::stringstream ss;
+            ss << "{\"schedulers\":[";
+            for(size_t i = 0; i < all.size(); ++ i) {
+                if(i) {
+                    ss << ",";
+                }
+                ss << ToJson(all[i], workers);
+            }
+            std::vector<TcpServer::Stats> servers;
+            TcpServer::ForEach([&servers](TcpServer* server){
+                servers.push_back(server -> getStats());
+            });
+            ss << "],\"servers\":[";
+            for(size_t i = 0; i < servers.size(); ++ i) {
+                if(i) {
+                    ss << ",";
+                }
+                ss << ToJson(servers[i]);
+            }
+            ss << "]}";
+
+            response -> setHeader("Content-Type", "application/json");
+            response -> setHeader("Cache-Control", "no-cache");
+            response -> setBody(ss.str());
+            return 0;
+        }
+    }
+}
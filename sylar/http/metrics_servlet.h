@@ -0,0 +1,31 @@
+#ifndef __SYLAR_HTTP_METRICS_SERVLET_H__
+#define __SYLAR_HTTP_METRICS_SERVLET_H__
+
+#include "servlet.h"
+#include "sylar/scheduler.h"
+#include "sylar/tcp_server.h"
+
+namespace sylar {
+    namespace http {
+
+        /*
+            把进程里所有在跑的Scheduler/IOManager的运行指标(Scheduler::getMetrics)输出成JSON
+            还有所有在跑的TcpServer的准入统计(TcpServer::getStats)
+            挂到ServletDispatch上用，比如 dispatch -> addServlet("/_/metrics", MetricsServlet::ptr(new MetricsServlet));
+            请求带 ?workers=0 的时候不输出每个线程的明细
+        */
+        class MetricsServlet : public Servlet {
+        public:
+            typedef std::shared_ptr<MetricsServlet> ptr;
+            MetricsServlet();
+            virtual int32_t handle(sylar::http::HttpRequest::ptr request,
+                           sylar::http::HttpResponse::ptr response,
+                           sylar::http::HttpSession::ptr session) override;
+
+            static std::string ToJson(const Scheduler::Metrics& m, bool workers = true);
+            static std::string ToJson(const TcpServer::Stats& s);
+        };
+    }
+}
+
+#endif
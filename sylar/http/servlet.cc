@@ -25,7 +25,11 @@ namespace sylar {
         int32_t ServletDispatch::handle(sylar::http::HttpRequest::ptr request,
                     sylar::http::HttpResponse::ptr response,
                     sylar::http::HttpSession::ptr session)  {
-            auto slt = getMatchedServlet(request->getPath());
+            // 零拷贝的请求没有现成的std::string，每个线程复用一个，避免每次分配
+            static thread_local std::string t_path;
+            StringView path = request -> getPathView();
+            t_path.assign(path.data(), path.size());
+            auto slt = getMatchedServlet(t_path);
             if(slt) {
                 slt -> handle(request, response, session);
             }
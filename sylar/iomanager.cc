@@ -1,8 +1,12 @@
 #include "iomanager.h"
 #include "macro.h"
 #include "log.h"
+#include "config.h"
+#include "topology.h"
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -11,6 +15,20 @@
 namespace sylar {
     static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    static ConfigVar<bool>::ptr g_iomanager_sharded =
+        Config::Lookup<bool>("iomanager.sharded", false, "one epoll instance per worker thread");
+
+    static ConfigVar<bool>::ptr g_iomanager_uring =
+        Config::Lookup<bool>("iomanager.io_uring", false, "submit hooked socket reads/writes through io_uring");
+
+    static ConfigVar<bool>::ptr g_iomanager_persistent =
+        Config::Lookup<bool>("iomanager.persistent", false, "register fds once for EPOLLIN|EPOLLOUT|EPOLLET and latch readiness");
+
+    static ConfigVar<uint32_t>::ptr g_iomanager_idle_spin_us =
+        Config::Lookup<uint32_t>("iomanager.idle_spin_us", 0, "busy-poll budget in microseconds before an idle thread blocks, 0 disables");
+
+    static const unsigned kRingEntries = 256;
+
     IOManager::FdContext::EventContent& IOManager::FdContext::getcontext(IOManager::Event event) {
         switch(event) {
             case IOManager::READ:
@@ -28,11 +46,17 @@ namespace sylar {
         ctx.cb = nullptr;
     }
 
-    void IOManager::FdContext::triggerEvent(IOManager::Event event) {
+    void IOManager::FdContext::triggerEvent(IOManager::Event event, Scheduler::TaskBatch* batch) {
         SYLAR_ASSERT(m_event & event);
         m_event = (Event) (m_event & ~event);
         EventContent& ctx = getcontext(event);
-        if(ctx.cb) {
+        if(batch && batch -> getScheduler() == ctx.scheduler) {
+            if(ctx.cb) {
+                batch -> add(&ctx.cb);
+            } else {
+                batch -> add(&ctx.fiber);
+            }
+        } else if(ctx.cb) {
             ctx.scheduler -> schedule(&ctx.cb);
         } else {
             ctx.scheduler -> schedule(&ctx.fiber);
@@ -43,13 +67,14 @@ namespace sylar {
     
 
     IOManager::IOManager(size_t threads, bool use_caller, const std::string& name) 
-        : Scheduler(threads, use_caller, name) {
+        : Scheduler(threads, use_caller, name),
+          m_fdContexts(&IOManager::InitContext) {
         /*
-        epoll_event 和 m_epfd 之间的关系涉及到 epoll 的工作机制。让我解释一下：
+        epoll_event 和 epfd 之间的关系涉及到 epoll 的工作机制。让我解释一下：
 
-        m_epfd (epoll 文件描述符):
+        epfd (epoll 文件描述符):
 
-        m_epfd 是通过 epoll_create 创建的 epoll 实例的文件描述符。这个文件描述符是整个 epoll 实例的标识符，通过它进行对 epoll 实例的操作，例如添加或删除文件描述符，等待事件发生等。
+        epfd 是通过 epoll_create 创建的 epoll 实例的文件描述符。这个文件描述符是整个 epoll 实例的标识符，通过它进行对 epoll 实例的操作，例如添加或删除文件描述符，等待事件发生等。
         epoll_event:
 
         epoll_event 是一个结构体，用于描述发生在文件描述符上的事件。在这里，通过创建 epoll_event 结构体并设置相应的参数，你告诉 epoll 实例你对文件描述符感兴趣的事件类型以及关联的数据。
@@ -59,66 +84,92 @@ namespace sylar {
         在 Linux 中，“一切皆文件”是一个通用的概念，包括设备、套接字、管道等都可以通过文件描述符来访问。这里的文件描述符实际上是一个索引，通过它可以访问相应的资源。
         关于 epoll_event 的返回值：
 
-        epoll_event 结构体中的 data 成员可以用来存储用户数据。在这里，data.fd 存储了文件描述符（例如 m_tickleFds[0]），而不是 epoll 实例的文件描述符 (m_epfd)。
+        epoll_event 结构体中的 data 成员可以用来存储用户数据。在这里，data.ptr 存的是FdContext(或者tickle用的Shard)的指针，而不是 epoll 实例的文件描述符 (epfd)。
         epoll_wait 等调用返回时，会告诉你哪些文件描述符上发生了事件，你可以通过遍历返回的 epoll_event 数组来获取发生事件的文件描述符。
-        总结起来，m_epfd 是整个 epoll 实例的标识符，用于对整个 epoll 实例进行操作，而 epoll_event 结构体用于描述特定文件描述符上的事件。这两者是不同的概念，用途也不同。在事件发生时，你会从 epoll_wait 返回的 epoll_event 中得知哪些文件描述符上发生了事件，然后可以通过这些文件描述符进行相应的操作。
+        总结起来，epfd 是整个 epoll 实例的标识符，用于对整个 epoll 实例进行操作，而 epoll_event 结构体用于描述特定文件描述符上的事件。这两者是不同的概念，用途也不同。在事件发生时，你会从 epoll_wait 返回的 epoll_event 中得知哪些文件描述符上发生了事件，然后可以通过这些文件描述符进行相应的操作。
         */
-        m_epfd = epoll_create(5000);            // 创建一个epoll实例，参数原本是监听这个监控实例最大有多大，但是在linux2.6.8之后被忽略，只要大于0即可，返回一个int为epoll的句柄
-        SYLAR_ASSERT(m_epfd > 0);
-
-        int rt = pipe(m_tickleFds);             // 出创建管道，其中m_tickleFds[0] 是读取端， m_tickleFds[1]是写入端
-        SYLAR_ASSERT(!rt);
-
-        epoll_event event;                       // epoll_event数据结构
-        memset(&event, 0, sizeof(epoll_event));
-        event.events = EPOLLIN | EPOLLET;        // 可读事件 + 边缘触发（边缘触发的效率高，但是要尽可能的使得缓冲区大，要不然可能数据不全，对应的是水平触发，效率低但是更安全, epoll_event.events是一个uint32_t的掩码
-        event.data.fd = m_tickleFds[0];          // 这一行将事件的文件描述符设置为管道的读取端，表示关注读取端的事件。
-
-        rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK);        // 设置成异步, 非阻塞模式
-        SYLAR_ASSERT(!rt);
-
-        rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);  // 这一行将管道的读取端添加到之前创建的 epoll 实例中，并关注读事件。
-        SYLAR_ASSERT(!rt);
-
-        //m_fdContexts.resize(64);        //初始化到64
-        contextResize(32);
+        m_uring = g_iomanager_uring -> getValue();
+        if(m_uring && !IoUring::Supported()) {
+            SYLAR_LOG_INFO(g_logger) << "name = " << name << " io_uring unsupported, fall back to epoll";
+            m_uring = false;
+        }
+        m_persistent = g_iomanager_persistent -> getValue();
+        m_spinBudgetNs = g_iomanager_idle_spin_us -> getValue() * 1000ull;
+        if(m_spinBudgetNs && CpuTopology::Get().getCpus().size() < 2) {
+            // 只有一个cpu的时候忙等的线程只会和要给它派活的线程抢cpu，活反而来得更晚
+            SYLAR_LOG_INFO(g_logger) << "name = " << name << " single cpu, idle spinning disabled";
+            m_spinBudgetNs = 0;
+        }
+        m_sharded = m_uring || g_iomanager_sharded -> getValue();      // 完成只能由一个线程收，io_uring一定是每个线程一个
+        size_t shards = m_sharded ? getWorkerCount() : 1;
+        for(size_t i = 0; i < shards; ++ i) {
+            Shard* shard = new Shard;
+            shard -> epfd = epoll_create(5000);            // 创建一个epoll实例，参数原本是监听这个监控实例最大有多大，但是在linux2.6.8之后被忽略，只要大于0即可，返回一个int为epoll的句柄
+            SYLAR_ASSERT(shard -> epfd > 0);
+
+            // 原来是一个pipe，每次tickle写一个字节，idle要一个一个读干净；eventfd只是一个计数器，读一次就清零，也少占一个fd
+            shard -> tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            SYLAR_ASSERT(shard -> tickleFd >= 0);
+
+            epoll_event event;                       // epoll_event数据结构
+            memset(&event, 0, sizeof(epoll_event));
+            event.events = EPOLLIN | EPOLLET;        // 可读事件 + 边缘触发（边缘触发的效率高，但是要尽可能的使得缓冲区大，要不然可能数据不全，对应的是水平触发，效率低但是更安全, epoll_event.events是一个uint32_t的掩码
+            event.data.ptr = shard;                  // fd的事件data.ptr是FdContext，这里放Shard自己，用来区分是不是tickle
+
+            int rt = epoll_ctl(shard -> epfd, EPOLL_CTL_ADD, shard -> tickleFd, &event);  // 这一行将eventfd添加到之前创建的 epoll 实例中，并关注读事件。
+            SYLAR_ASSERT(!rt);
+            m_shards.push_back(shard);
+
+            if(m_uring) {
+                shard -> ring = new IoUring;
+                if(!shard -> ring -> init(kRingEntries)) {             // 比如超过了RLIMIT_MEMLOCK，整个退回epoll
+                    SYLAR_LOG_ERROR(g_logger) << "name = " << name << " io_uring init fail, fall back to epoll";
+                    m_uring = false;
+                }
+            }
+        }
+        if(!m_uring) {
+            for(auto shard : m_shards) {
+                delete shard -> ring;
+                shard -> ring = nullptr;
+            }
+        }
 
         start();                        // scheduler 的start方法
     }
     IOManager::~IOManager() {
         stop();
-        close(m_epfd);
-        close(m_tickleFds[0]);
-        close(m_tickleFds[1]);
-
-        for(size_t i = 0; i < m_fdContexts.size(); ++i) {
-            if(m_fdContexts[i]) {
-                delete m_fdContexts[i];
-            }
+        for(auto shard : m_shards) {
+            delete shard -> ring;                   // 关掉ring，上面还挂着的POLL_ADD一起没了
+            close(shard -> epfd);
+            close(shard -> tickleFd);
+            delete shard;
         }
     }
 
-    void IOManager::contextResize(size_t size) {
-        m_fdContexts.resize(size);
-        for(int i = 0; i < (int)(m_fdContexts.size()); ++ i) {
-            if(! m_fdContexts[i]) {
-                m_fdContexts[i] = new FdContext;
-                m_fdContexts[i]->fd = i;
-            }
+    void IOManager::InitContext(FdContext& ctx, int fd) {
+        ctx.fd = fd;
+    }
+
+    int IOManager::epollCtl(FdContext* fd_ctx, int op, uint32_t events) {
+        epoll_event epevent;
+        epevent.events = events;
+        epevent.data.ptr = fd_ctx;
+        ++m_epollCtlCount;
+        int rt = epoll_ctl(fd_ctx -> epfd, op, fd_ctx -> fd, &epevent);
+        if(rt) {
+            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << fd_ctx -> epfd << ", "
+                                      << op << ", " << fd_ctx -> fd << ", " << events << "): "
+                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
         }
+        return rt;
     }
 
-    int IOManager::addEvent(int fd, Event event, std::function<void()> cb) {
-        FdContext* fd_ctx = nullptr;        // 为什么是一个指针？因为epoll_event.data只能存一个指针或者int fd
-        RWmutexType::ReadLock lock(m_mutex);
-        if((int)(m_fdContexts.size()) > fd) {      // 如果可以放在队列中
-            fd_ctx = m_fdContexts[fd];     
-            lock.unlock();
-        } else {                                   // 扩容
-            lock.unlock();
-            RWmutexType::WriteLock lock2(m_mutex);
-            contextResize(fd * 1.5);
-            fd_ctx = m_fdContexts[fd];
+    int IOManager::addEvent(int fd, Event event, Task cb) {
+        FdContext* fd_ctx = m_fdContexts.getOrCreate(fd);   // 为什么是一个指针？因为epoll_event.data只能存一个指针或者int fd
+        if(!fd_ctx) {
+            SYLAR_LOG_ERROR(g_logger) << "addEvent invalid fd = " << fd;
+            return -1;
         }
 
         FdContext::MutexType::Lock lock2(fd_ctx -> m_mutex);
@@ -129,17 +180,32 @@ namespace sylar {
             SYLAR_ASSERT(! (fd_ctx->m_event & event));
         }
 
-        int op = fd_ctx -> m_event ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;     // 修改or添加
-        epoll_event epevent;
-        epevent.events = EPOLLET | fd_ctx -> m_event | event;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);  // 注册事件， 注册后epoll_wait才能监听到
-        if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << epevent.events << "): "
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return -1;
+        if(m_persistent) {
+            if(!fd_ctx -> registered) {             // 只在第一次等的时候注册一次，读写都要，之后不再改
+                fd_ctx -> epfd = pickEpoll();
+                uint32_t events = EPOLLET | EPOLLIN | EPOLLOUT;
+                if(epollCtl(fd_ctx, EPOLL_CTL_ADD, events)
+                        && (errno != EEXIST || epollCtl(fd_ctx, EPOLL_CTL_MOD, events))) {    // dup出来的同一个文件还挂着
+                    return -1;
+                }
+                fd_ctx -> registered = true;
+                fd_ctx -> m_ready = NONE;
+            } else if(fd_ctx -> m_ready & event) {  // 没人等的时候来过的边沿，现在用掉
+                fd_ctx -> m_ready = (Event)(fd_ctx -> m_ready & ~event);
+                if(!cb) {
+                    return 1;                       // 调用方不用挂起，直接再试一次
+                }
+                Scheduler::GetThis() -> schedule(&cb);
+                return 0;
+            }
+        } else {
+            int op = fd_ctx -> m_event ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;     // 修改or添加
+            if(op == EPOLL_CTL_ADD) {               // 第一次注册的时候定下来放在哪个epoll上，所有事件删掉之前不变
+                fd_ctx -> epfd = pickEpoll();
+            }
+            if(epollCtl(fd_ctx, op, EPOLLET | fd_ctx -> m_event | event)) {  // 注册事件， 注册后epoll_wait才能监听到
+                return -1;
+            }
         }
 
         ++m_pendingEventCount;
@@ -157,12 +223,10 @@ namespace sylar {
         return 0;
     }
     bool IOManager::delEvent(int fd, Event event) {
-        RWmutexType::ReadLock lock(m_mutex);
-        if((int)(m_fdContexts.size()) <= fd) {
+        FdContext* fd_ctx = m_fdContexts.get(fd);
+        if(!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
         
         FdContext::MutexType::Lock lock2(fd_ctx -> m_mutex);
         if(!(fd_ctx -> m_event & event)) {          // 如果不存在该事件
@@ -170,18 +234,12 @@ namespace sylar {
         }
 
         Event new_events = (Event) (fd_ctx -> m_event & ~event); // 新的事件是老的事件去掉了需要删除的事件
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;     // 修改or删除
-        // 修改epoll实例，把修改的注册上去
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << epevent.events << "): "
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
+        if(!m_persistent) {                         // 持久注册的不用动epoll，以后来的边沿记下来就行
+            int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;     // 修改or删除
+            // 修改epoll实例，把修改的注册上去
+            if(epollCtl(fd_ctx, op, EPOLLET | new_events)) {
+                return false;
+            }
         }
 
         --m_pendingEventCount;
@@ -199,32 +257,25 @@ namespace sylar {
     */
     bool IOManager::cancelEvent(int fd, Event event) {
         // 找到fd ctx
-        RWmutexType::ReadLock lock(m_mutex);
-        if((int)(m_fdContexts.size()) <= fd) {
+        FdContext* fd_ctx = m_fdContexts.get(fd);
+        if(!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
         
         FdContext::MutexType::Lock lock2(fd_ctx -> m_mutex);
+        bool ring_cancelled = cancelRingOp(fd_ctx, event);          // io_uring上在读写的也一起取消
         if(!(fd_ctx -> m_event & event)) {          // 如果不存在该事件
-            return false;
+            return ring_cancelled;
         }
 
         // 根据新的事件调整epoll_wait的方式
-        Event new_events = (Event) (fd_ctx -> m_event & ~event); // 新的事件是老的事件去掉了需要删除的事件
-        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;     // 修改or删除
-        // 修改epoll实例，把修改的注册上去
-        epoll_event epevent;
-        epevent.events = EPOLLET | new_events;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << epevent.events << "): "
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
-            return false;
+        if(!m_persistent) {
+            Event new_events = (Event) (fd_ctx -> m_event & ~event); // 新的事件是老的事件去掉了需要删除的事件
+            int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;     // 修改or删除
+            // 修改epoll实例，把修改的注册上去
+            if(epollCtl(fd_ctx, op, EPOLLET | new_events)) {
+                return false;
+            }
         }
 
         // FdContext::EventContent& event_ctx = fd_ctx->getcontext(event);
@@ -235,30 +286,27 @@ namespace sylar {
 
     bool IOManager::cancelAll(int fd) {
         // 找到fd ctx
-        RWmutexType::ReadLock lock(m_mutex);
-        if((int)(m_fdContexts.size()) <= fd) {
+        FdContext* fd_ctx = m_fdContexts.get(fd);
+        if(!fd_ctx) {
             return false;
         }
-        FdContext* fd_ctx = m_fdContexts[fd];
-        lock.unlock();
         
         FdContext::MutexType::Lock lock2(fd_ctx -> m_mutex);
+        bool ring_cancelled = cancelRingOp(fd_ctx, READ);
+        ring_cancelled = cancelRingOp(fd_ctx, WRITE) || ring_cancelled;
+        if(m_persistent) {                  // 要close了，没人等也要从epoll上摘掉，fd号以后会被别的文件用
+            if(fd_ctx -> registered) {
+                epollCtl(fd_ctx, EPOLL_CTL_DEL, 0);
+                fd_ctx -> registered = false;
+                fd_ctx -> m_ready = NONE;
+            }
+        }
         if(!(fd_ctx -> m_event)) {          // 如果不存在该事件
-            return false;
+            return ring_cancelled;
         }
 
         // 根据新的事件调整epoll_wait的方式
-        int op = EPOLL_CTL_DEL;     // 修改or删除
-        // 修改epoll实例，把修改的注册上去
-        epoll_event epevent;
-        epevent.events = 0;
-        epevent.data.ptr = fd_ctx;
-
-        int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-        if(rt) {
-            SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd << ", " << epevent.events << "): "
-                                      << rt << " (" << errno << ") (" << strerror(errno) << ")";
+        if(!m_persistent && epollCtl(fd_ctx, EPOLL_CTL_DEL, 0)) {
             return false;
         }
 
@@ -276,16 +324,223 @@ namespace sylar {
         return true;
     }
 
+    void IOManager::onFdCreated(int fd) {
+        if(!m_persistent) {
+            return;
+        }
+        FdContext* fd_ctx = m_fdContexts.get(fd);
+        if(!fd_ctx) {
+            return;
+        }
+        FdContext::MutexType::Lock lock(fd_ctx -> m_mutex);
+        if(!fd_ctx -> m_event) {                    // 旧文件没经过hook的close就关了，它的注册已经跟着没了
+            fd_ctx -> registered = false;
+            fd_ctx -> m_ready = NONE;
+        }
+    }
+
     IOManager* IOManager::GetThis() {
         return dynamic_cast<IOManager*>(Scheduler::GetThis());
     }
 
+    bool IOManager::submitIO(int fd, Event event, io_uring_sqe& sqe, int& res) {
+        if(!m_uring) {
+            return false;
+        }
+        int idx = getWorkerIndex();
+        if(idx < 0) {
+            return false;
+        }
+        Fiber::ptr self = Fiber::GetThis();
+        if(self -> isSharedStack()) {
+            return false;
+        }
+
+        RingOp op;
+        op.scheduler = Scheduler::GetThis();
+        op.fiber = self;
+        op.shard = m_shards[idx];
+        op.fdCtx = m_fdContexts.getOrCreate(fd);
+        if(!op.fdCtx) {
+            return false;
+        }
+        RingOp*& slot = event == READ ? op.fdCtx -> ringRead : op.fdCtx -> ringWrite;
+        {
+            FdContext::MutexType::Lock lock(op.fdCtx -> m_mutex);
+            if(slot) {                                  // 同一个方向已经有一个协程在等了，交给epoll那边去报错
+                return false;
+            }
+            slot = &op;
+        }
+
+        sqe.user_data = (uint64_t)(uintptr_t)&op;
+        ++m_pendingEventCount;
+        if(!op.shard -> ring -> push(sqe)) {
+            FdContext::MutexType::Lock lock(op.fdCtx -> m_mutex);
+            if(slot == &op) {
+                slot = nullptr;
+            }
+            --m_pendingEventCount;
+            return false;
+        }
+        self.reset();
+        Fiber::YieldToHold();                           // 等这个线程idle或者pollEvents的时候交给内核，完成了被调度回来
+        res = op.res;
+        return true;
+    }
+
+    /*
+        取消的sqe直接交上去，不等owner线程攒批: owner可能正睡在io_uring_enter里等的就是这个
+        槽位在这里就清掉，之后完成的时候不会再碰; 取消交上去的时候读写可能刚好已经完成了，那就是一个没找到的cancel，没关系
+    */
+    bool IOManager::cancelRingOp(FdContext* fd_ctx, Event event) {
+        RingOp*& op = event == READ ? fd_ctx -> ringRead : fd_ctx -> ringWrite;
+        if(!op) {
+            return false;
+        }
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_ASYNC_CANCEL;
+        sqe.fd = -1;
+        sqe.addr = (uint64_t)(uintptr_t)op;
+        sqe.user_data = 0;                              // 取消自己的完成不用管
+        IoUring* ring = op -> shard -> ring;
+        op = nullptr;
+        if(!ring -> push(sqe)) {
+            return false;
+        }
+        ring -> submit();
+        return true;
+    }
+
+    void IOManager::armEpoll(Shard* shard) {
+        if(shard -> epollArmed) {
+            return;
+        }
+        io_uring_sqe sqe;
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_POLL_ADD;
+        sqe.fd = shard -> epfd;
+        sqe.poll32_events = POLLIN;
+        sqe.user_data = (uint64_t)(uintptr_t)shard;
+        shard -> epollArmed = shard -> ring -> push(sqe);
+    }
+
+    bool IOManager::processCompletions(Shard* shard, Scheduler::TaskBatch& batch) {
+        bool epoll_ready = false;
+        io_uring_cqe cqes[64];
+        unsigned n = 0;
+        uint64_t completed = 0;
+        while((n = shard -> ring -> reap(cqes, 64)) > 0) {
+            for(unsigned i = 0; i < n; ++ i) {
+                uint64_t data = cqes[i].user_data;
+                if(data == 0) {                                     // cancel请求自己的完成
+                    continue;
+                }
+                if(data == (uint64_t)(uintptr_t)shard) {            // epfd上有事件了，POLL_ADD是一次性的，下次再挂
+                    shard -> epollArmed = false;
+                    epoll_ready = true;
+                    continue;
+                }
+
+                RingOp* op = (RingOp*)(uintptr_t)data;
+                {
+                    FdContext::MutexType::Lock lock(op -> fdCtx -> m_mutex);
+                    if(op -> fdCtx -> ringRead == op) {
+                        op -> fdCtx -> ringRead = nullptr;
+                    } else if(op -> fdCtx -> ringWrite == op) {
+                        op -> fdCtx -> ringWrite = nullptr;
+                    }
+                }
+                // 协程一被调度op就可能没了(在它栈上)，要用的先拿出来
+                op -> res = cqes[i].res;
+                Scheduler* scheduler = op -> scheduler;
+                Fiber::ptr fiber;
+                fiber.swap(op -> fiber);
+                --m_pendingEventCount;
+                ++completed;
+                if(scheduler == batch.getScheduler()) {
+                    batch.add(&fiber);
+                } else {
+                    scheduler -> schedule(&fiber);
+                }
+            }
+        }
+        WorkerCounters* counters = getWorkerCounters();
+        if(counters && completed) {
+            WorkerCounters::Add(counters -> events, completed);
+        }
+        return epoll_ready;
+    }
+
+    IOManager::Shard* IOManager::getShard() {
+        if(!m_sharded) {
+            return m_shards[0];
+        }
+        int idx = getWorkerIndex();
+        return m_shards[idx >= 0 ? idx : 0];
+    }
+
+    int IOManager::pickEpoll() {
+        if(!m_sharded) {
+            return m_shards[0] -> epfd;
+        }
+        int idx = getWorkerIndex();                 // 工作线程注册的放自己这里，事件和协程都留在这个线程上
+        if(idx < 0) {
+            idx = m_nextShard++ % m_shards.size();
+        }
+        return m_shards[idx] -> epfd;
+    }
+
+    /*
+        不分片的时候epoll是大家共享的，写一次内核只叫醒一个epoll_wait里的线程；
+        分片的时候自己挑一个在睡的线程叫，有指定给它的任务的优先，其次从上次的位置往后轮着找还没被叫过的
+    */
     void IOManager::tickle() {
-        if(hasIdleThreads()) {
+        if(!hasIdleThreads()) {                                         // 没有线程在epoll_wait里睡就不用叫
+            ++m_tickleSuppressed;
+            return;
+        }
+        if(!m_sharded) {
+            tickle(m_shards[0]);
+            return;
+        }
+        // 自己不用叫，在idle里调tickle的时候自己也算是"在睡"的
+        size_t self = getWorkerIndex();
+        size_t n = m_shards.size();
+        for(size_t i = 0; i < n; ++ i) {
+            if(i != self && isWorkerSleeping(i) && hasPinnedTask(i) && !m_shards[i] -> tickling) {
+                tickle(m_shards[i]);
+                return;
+            }
+        }
+        size_t start = m_tickleCursor++;
+        for(size_t i = 0; i < n; ++ i) {
+            size_t idx = (start + i) % n;
+            if(idx != self && isWorkerSleeping(idx) && !m_shards[idx] -> tickling) {
+                tickle(m_shards[idx]);
+                return;
+            }
+        }
+        ++m_tickleSuppressed;                                           // 在睡的都已经叫过了
+    }
+
+    /*
+        一次睡眠周期只写一次：写过了还没有线程醒来读走(tickling还是true)，再写也只是多一次系统调用，
+        醒来的线程清掉标记之后才会去看队列，所以这期间放进来的任务它一定能看到；
+        还有更多任务的话它领任务的时候(nextTask的tickle_me)会接力再叫一个
+    */
+    void IOManager::tickle(Shard* shard) {
+        // 有线程在这个shard上忙等，任务它自己会看到；它不转了之前会再看一次队列(spinIdle)
+        if(shard -> spinning > 0 || shard -> tickling.exchange(true)) {
+            ++m_tickleSuppressed;
             return;
         }
-        int rt = write(m_tickleFds[1], "T", 1);                         // 写入一个字符T，然后就可以idle检测到唤醒
-        SYLAR_ASSERT(rt == 1);
+        ++m_tickleCount;
+        shard -> tickleTime = GetMonotonicNS();
+        uint64_t one = 1;
+        int rt = write(shard -> tickleFd, &one, sizeof(one));           // 计数器加1，epoll_wait里的线程就能检测到唤醒
+        SYLAR_ASSERT(rt == sizeof(one));
     }
 
     bool IOManager::stopping() {
@@ -303,13 +558,28 @@ namespace sylar {
         std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr) {
             delete[] ptr;
         });
+        Shard* shard = getShard();
+        uint64_t spin_budget = m_spinBudgetNs;                         // idle协程跟线程一样长，预算在这里一直带着
+        WorkerCounters* counters = getWorkerCounters();
         
         while(true) {
             uint64_t next_timeout = 0;
             if(stopping(next_timeout)) {
                 SYLAR_LOG_INFO(g_logger) << "name = " << getName() << " idle stopping exit";
+                tickle();                                              // tickle的字节可能被一个线程读干净了，接力叫醒下一个还在睡的线程
                 break; 
             }
+            if(spin_budget && next_timeout != 0) {
+                if(spinIdle(shard, spin_budget)) {
+                    next_timeout = 0;                                   // 有活了，下面不阻塞地收一次
+                } else if(stopping(next_timeout)) {
+                    continue;                                           // 转的时候可能来了新的定时器或者要停了
+                } else {
+                    ++m_idleParks;
+                }
+            } else if(next_timeout != 0) {
+                ++m_idleParks;
+            }
 
             int rt = 0;
             do {
@@ -321,7 +591,12 @@ namespace sylar {
                     next_timeout = MAX_TIMEOUT;
                 }
 
-                rt = epoll_wait(m_epfd, events, 64, (int)next_timeout);      // 返回的监听事件，有触发会返回，如果超过timeout，也会唤醒
+                if(shard -> ring) {
+                    armEpoll(shard);                                    // 攒着的读写和epfd的POLL_ADD一起交上去，等任意一个完成
+                    rt = shard -> ring -> submitAndWait(next_timeout);
+                } else {
+                    rt = epoll_wait(shard -> epfd, events, 64, (int)next_timeout);  // 返回的监听事件，有触发会返回，如果超过timeout，也会唤醒
+                }
 
                 if(rt < 0 && errno == EINTR) {
                     // 重新循环
@@ -330,68 +605,204 @@ namespace sylar {
                 }
             } while (true);
         
-            // 如果定时器有任务，那么先scheduler下
+            // 这一轮epoll_wait的结果(到期的定时器 + 就绪的fd)攒成一批，最后一次提交
+            // 定时器取出来/事件计数减掉之后、batch提交之前，别的线程看起来就是什么活都没有了，
+            // 所以这段时间算自己active，不然它们会以为可以stop直接退出
+            ++m_activeThreadCount;
+            Scheduler::TaskBatch batch(this);
             std::vector<std::function<void()> > cbs;
             TimerManager::listExpiredCb(cbs);
-            if(!cbs.empty()) {
-                // SYLAR_LOG_DEBUG(g_logger) << "cbs size = " << cbs.size();
-                Scheduler::schedule(cbs.begin(), cbs.end());
-                cbs.clear();
+            if(counters) {
+                WorkerCounters::Add(counters -> wakeups);
+                WorkerCounters::Add(counters -> timers, cbs.size());
+            }
+            for(auto& cb : cbs) {
+                batch.add(&cb);
             }
 
-            for(int i = 0; i < rt; ++i) {                              // 遍历返回的监听事件
-                epoll_event& event = events[i];
-                if(event.data.fd == m_tickleFds[0]) {                   // 如果事件是否是用来唤醒的epollwait的事件，m_tickleFds[0]是我们的输入端
-                    uint8_t dummy;                                      // 如果是去处理下数据   
-                    while(read(m_tickleFds[0], &dummy, 1) == 1);        // ET 类型，边缘触发，不读干净就没了，所以要一直读，直到没有数据
-                    continue;
+            if(shard -> ring) {
+                rt = 0;
+                if(processCompletions(shard, batch)) {
+                    rt = epoll_wait(shard -> epfd, events, 64, 0);
                 }
+            }
+            processEvents(shard, events, rt, batch);
+            if(!batch.empty()) {
+                Scheduler::schedule(batch);                             // 一次上锁，按任务数叫醒空闲线程
+            }
+            --m_activeThreadCount;
+
+            // 处理完idle之后让出运行时间，返回到协程调度器那里 YieldToHold() better? 
+            Fiber::ptr cur = Fiber::GetThis();
+            auto raw_ptr = cur.get();
+            cur.reset();
 
-                FdContext* fd_ctx = (FdContext*)(event.data.ptr);
-                FdContext::MutexType:: Lock lock(fd_ctx -> m_mutex);
-                if(event.events & (EPOLLERR | EPOLLHUP)) {              // 错误或者中断
-                    event.events |= EPOLLIN | EPOLLOUT;                 // 唤醒读写事件
+            raw_ptr -> swapOut();
+        }
+    }
+
+    /*
+        只看不收：队列里的任务、到期的定时器、epoll/io_uring上有没有东西，有了就回去走idle正常的收事件流程
+        epfd是不是有事件用poll看(epoll_wait会把边沿触发的事件取走)，开了io_uring的话epfd的POLL_ADD也在完成队列里，不用进内核
+    */
+    bool IOManager::spinIdle(Shard* shard, uint64_t& budget_ns) {
+        ++m_idleSpins;
+        if(shard -> ring) {
+            armEpoll(shard);
+            shard -> ring -> submit();                                  // 进idle之前提交的读写先交上去
+        }
+        ++shard -> spinning;
+        uint64_t begin = GetMonotonicNS();
+        uint64_t now = begin;
+        bool found = false;
+        for(uint32_t i = 0; ; ++ i) {
+            if(hasPendingTask(true)) {
+                found = true;
+                break;
+            }
+            if((i & 7) == 0) {                                          // 下面的要上锁或者进内核，隔几圈看一次
+                if(getNextTimer() == 0) {
+                    found = true;
+                } else if(shard -> ring) {
+                    found = shard -> ring -> hasCompletions();
+                } else {
+                    pollfd pfd;
+                    pfd.fd = shard -> epfd;
+                    pfd.events = POLLIN;
+                    pfd.revents = 0;
+                    found = poll(&pfd, 1, 0) > 0;
                 }
-                int real_events = NONE;
-                if(event.events & EPOLLIN) {                            // 如果有读事件，那么记录上
-                    real_events |= READ;
+                if(found || stopping()) {
+                    found = true;
+                    break;
                 }
-                if(event.events & EPOLLOUT) {
-                    real_events |= WRITE;
+                now = GetMonotonicNS();
+                if(now - begin >= budget_ns) {
+                    break;
                 }
+            }
+            CpuRelax();
+        }
+        --shard -> spinning;
+        // 和enqueue里"先放任务再看idle(再看spinning)"配对：转的时候被省掉的tickle对应的任务这里一定能看到
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!found && hasPendingTask(true)) {
+            found = true;
+        }
+        m_idleSpinNs += GetMonotonicNS() - begin;
+        if(found) {
+            ++m_idleSpinHits;
+            budget_ns = m_spinBudgetNs;
+        } else {
+            budget_ns = std::max(budget_ns / 2, std::max<uint64_t>(m_spinBudgetNs / 16, 1));
+        }
+        return found;
+    }
 
-                if((fd_ctx -> m_event & real_events) == NONE) {         // 如果没有事件
-                    continue;
+    void IOManager::collectMetrics(Metrics& m) {
+        m.pendingEvents = m_pendingEventCount;
+        m.timers = getTimerCount();
+        m.tickles = m_tickleCount;
+        m.ticklesSuppressed = m_tickleSuppressed;
+        m.epollCtls = m_epollCtlCount;
+    }
+
+    IOManager::IdleStats IOManager::getIdleStats() const {
+        IdleStats stats;
+        stats.spins = m_idleSpins;
+        stats.spinHits = m_idleSpinHits;
+        stats.spinNs = m_idleSpinNs;
+        stats.parks = m_idleParks;
+        stats.wakeups = m_wakeups;
+        stats.wakeupNs = m_wakeupNs;
+        return stats;
+    }
+
+    void IOManager::processEvents(Shard* shard, epoll_event* events, int n, Scheduler::TaskBatch& batch) {
+        uint64_t triggered = 0;
+        for(int i = 0; i < n; ++i) {                              // 遍历返回的监听事件
+            epoll_event& event = events[i];
+            if(event.data.ptr == shard) {                           // 如果事件是否是用来唤醒的epollwait的事件
+                uint64_t dummy;
+                if(read(shard -> tickleFd, &dummy, sizeof(dummy)) < 0) {    // 一次就把计数器清零了
+                    SYLAR_ASSERT(errno == EAGAIN);
+                }
+                shard -> tickling = false;                          // 之后的tickle可以再写了，我们接下来会去看队列
+                uint64_t t = shard -> tickleTime.exchange(0);
+                if(t) {
+                    uint64_t now = GetMonotonicNS();
+                    ++m_wakeups;
+                    m_wakeupNs += now > t ? now - t : 0;
                 }
+                continue;
+            }
 
+            FdContext* fd_ctx = (FdContext*)(event.data.ptr);
+            FdContext::MutexType:: Lock lock(fd_ctx -> m_mutex);
+            if(event.events & (EPOLLERR | EPOLLHUP)) {              // 错误或者中断
+                event.events |= EPOLLIN | EPOLLOUT;                 // 唤醒读写事件
+            }
+            int real_events = NONE;
+            if(event.events & EPOLLIN) {                            // 如果有读事件，那么记录上
+                real_events |= READ;
+            }
+            if(event.events & EPOLLOUT) {
+                real_events |= WRITE;
+            }
+
+            if(m_persistent) {                                      // 没人等的边沿记下来，等的人来了直接用，不改epoll
+                fd_ctx -> m_ready = (Event)(fd_ctx -> m_ready | (real_events & ~fd_ctx -> m_event));
+            }
+            real_events &= fd_ctx -> m_event;                       // ERR/HUP的时候读写都置上了，只触发真正注册了的
+            if(real_events == NONE) {                               // 如果没有事件
+                continue;
+            }
+
+            if(!m_persistent) {
                 int left_events = (fd_ctx -> m_event & ~real_events);   // 剩余事件，当前上下文上的事件与非之前的real_events
                 int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;   // 非0， 修改 要不然del
-                event.events = EPOLLET | left_events;                   // 复用，改成剩余的事件
-
-                int rt2 = epoll_ctl(m_epfd, op, fd_ctx -> fd, &event);  // 剩余事件注册
-                if(rt2) {
-                    SYLAR_LOG_ERROR(g_logger) << "epoll_ctl(" << m_epfd << ", "
-                                      << op << ", " << fd_ctx -> fd << ", " << event.events << "): "
-                                      << rt2 << " (" << errno << ") (" << strerror(errno) << ")";
+                if(epollCtl(fd_ctx, op, EPOLLET | left_events)) {       // 剩余事件注册
                     continue;
                 }
-
-                if(real_events & READ) {                                // 读事件触发
-                    fd_ctx -> triggerEvent(READ);
-                    --m_pendingEventCount;
-                }
-                if(real_events & WRITE) {                               // 写事件触发
-                    fd_ctx -> triggerEvent(WRITE);
-                    --m_pendingEventCount;
-                }
             }
 
-            // 处理完idle之后让出运行时间，返回到协程调度器那里 YieldToHold() better? 
-            Fiber::ptr cur = Fiber::GetThis();
-            auto raw_ptr = cur.get();
-            cur.reset();
+            if(real_events & READ) {                                // 读事件触发
+                fd_ctx -> triggerEvent(READ, &batch);
+                --m_pendingEventCount;
+                ++triggered;
+            }
+            if(real_events & WRITE) {                               // 写事件触发
+                fd_ctx -> triggerEvent(WRITE, &batch);
+                --m_pendingEventCount;
+                ++triggered;
+            }
+        }
+        WorkerCounters* counters = getWorkerCounters();
+        if(counters && triggered) {
+            WorkerCounters::Add(counters -> events, triggered);
+        }
+    }
 
-            raw_ptr -> swapOut();
+    // 分片模式下线程一直有活干就进不了idle，隔一批任务不等待地收一下自己epoll(和io_uring)上的事件
+    void IOManager::pollEvents() {
+        if(!m_sharded) {
+            return;                                                     // 共享的epoll有空闲的线程在等
+        }
+        Shard* shard = getShard();
+        Scheduler::TaskBatch batch(this);
+        bool epoll_ready = true;
+        if(shard -> ring) {                                             // 这一批任务里提交的读写一次交上去，顺便收完成
+            armEpoll(shard);
+            shard -> ring -> submit();
+            epoll_ready = processCompletions(shard, batch);
+        }
+        epoll_event events[16];
+        int rt = epoll_ready ? epoll_wait(shard -> epfd, events, 16, 0) : 0;
+        if(rt > 0) {
+            processEvents(shard, events, rt, batch);
+        }
+        if(!batch.empty()) {
+            Scheduler::schedule(batch);
         }
     }
 
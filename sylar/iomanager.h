@@ -3,7 +3,33 @@
 
 #include "scheduler.h"
 #include "timer.h"
+#include "uring.h"
+#include "fd_table.h"
+#include <sys/epoll.h>
 
+/*
+    iomanager.sharded(默认false)：
+    - false: 所有线程在同一个epoll上epoll_wait，谁醒了谁处理
+    - true: 每个工作线程一个epoll和一个eventfd，fd第一次addEvent的时候注册到当前线程的epoll上(不是工作线程的话轮流分)，
+      之后这个fd的事件只有这个线程收，协程也就在这个线程的本地队列里接着跑，连接的数据不会在核之间来回跑；
+      tickle也可以挑一个具体在睡的线程叫(有指定给它的任务的优先)
+      线程忙的时候每跑一批任务会不睡觉地收一次自己epoll上的事件(pollEvents)，不会一直饿着
+    iomanager.io_uring(默认false)：
+    - 打开之后每个工作线程再多一个io_uring(一定是分片的)，hook的read/recv/write/send这些不再"先试一次，EAGAIN了注册epoll，
+      醒来再试一次"，直接把读写交给内核，协程挂起，完成了再被调度回来
+    - 协程提交的请求先攒在自己线程的提交队列里，线程闲下来(idle)或者跑完一批任务(pollEvents)的时候一次io_uring_enter交上去
+    - 线程自己的epoll也挂在io_uring上(POLL_ADD)，accept/connect和addEvent注册的事件照常工作，idle只在io_uring上等
+    - 内核不支持(没有io_uring或者太老)的时候自动退回epoll
+    iomanager.persistent(默认false)：
+    - false: 每次等都epoll_ctl(ADD/MOD)注册要等的事件，触发之后再MOD/DEL掉，长连接每个请求都要几次epoll_ctl
+    - true: fd第一次等的时候注册一次EPOLLIN|EPOLLOUT|EPOLLET，一直到hook的close才DEL；
+      来了边沿没人等就记在FdContext里(m_ready)，之后来等的人看到已经就绪就不挂起了，直接再试一次
+    iomanager.idle_spin_us(默认0，不转)：
+    - 队列空了先不睡，最多忙等这么久：看队列、定时器，不阻塞地看一眼epoll/io_uring有没有事件，等到了就直接接着干活
+    - 转着的线程不用tickle(省掉写eventfd和唤醒的系统调用)，任务来了它自己会看到
+    - 转完还没活才真的睡；连着转空了预算减半(最少1/16)，转到活了恢复满预算
+    - getIdleStats()看转掉的cpu时间和被tickle叫醒的延迟，用来调这个值
+*/
 namespace sylar{
     class IOManager : public Scheduler, public TimerManager {
     public:
@@ -17,6 +43,17 @@ namespace sylar{
         };
         
     private:
+        struct Shard;
+        struct FdContext;
+        // 提交给io_uring的一次读写，放在发起的协程栈上，完成之前协程一直挂着
+        struct RingOp {
+            Scheduler* scheduler = nullptr;
+            Fiber::ptr fiber;
+            Shard* shard = nullptr;             // 提交到哪个线程的io_uring上，cancel也要交到同一个上
+            FdContext* fdCtx = nullptr;
+            int res = 0;                        // cqe的结果，负数是-errno
+        };
+
         // 事件数据结构
         struct FdContext {
             typedef Mutex MutexType;
@@ -24,17 +61,23 @@ namespace sylar{
             struct EventContent {
                 Scheduler* scheduler = nullptr;  // 执行事件的scheduler
                 Fiber::ptr fiber;                // 执行事件的fiber
-                std::function<void()> cb;        // 执行事件的回调函数
+                Task cb;                         // 执行事件的回调函数
 
             };
 
             EventContent& getcontext(Event event);
             void resetContext(EventContent& ctx);
-            void triggerEvent(Event event);
+            // batch不为空并且事件属于同一个scheduler的时候放进batch里，由调用方统一提交
+            void triggerEvent(Event event, Scheduler::TaskBatch* batch = nullptr);
             EventContent read;                   // 读事件
             EventContent write;                  // 写事件
             int fd = 0;                          // 事件关联的句柄
+            int epfd = -1;                       // 注册在哪个epoll上，m_event不为0(持久注册是registered)的时候才有意义
             Event m_event = NONE;                // 已注册的事件
+            bool registered = false;             // 持久注册模式下已经挂在epfd上了
+            Event m_ready = NONE;                // 持久注册模式下来了还没人用的就绪事件
+            RingOp* ringRead = nullptr;          // 在io_uring上进行中的读写，cancel/close的时候要取消掉
+            RingOp* ringWrite = nullptr;
             MutexType m_mutex;
         };
 
@@ -42,28 +85,97 @@ namespace sylar{
         IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = ""); 
         ~IOManager();
 
-        //0 success, -1 fail
-        int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+        /*
+            0 success, -1 fail
+            持久注册模式下事件已经就绪的时候不注册：cb为空返回1，调用方不用挂起直接重试；cb不为空直接调度cb，返回0
+        */
+        int addEvent(int fd, Event event, Task cb = nullptr);
         bool delEvent(int fd, Event event);
         bool cancelEvent(int fd, Event event);
         bool cancelAll(int fd);
         static IOManager* GetThis();
+        // hook的socket/accept拿到新fd的时候调，这个fd号之前的文件没经过hook的close的话丢掉它的持久注册状态
+        void onFdCreated(int fd);
+
+        /*
+            把sqe(user_data会被覆盖)交给当前线程的io_uring，挂起当前协程直到完成，res是内核的结果(负数是-errno)
+            没开io_uring、共享栈的协程(缓冲区可能就在共享栈上，挂起的时候会被别的协程覆盖)等情况返回false，调用方走epoll
+            超时和close用cancelEvent/cancelAll取消，取消掉的res是-ECANCELED
+        */
+        bool submitIO(int fd, Event event, io_uring_sqe& sqe, int& res);
+
+        bool isUring() const { return m_uring;}
+        bool isSharded() const { return m_sharded;}
+        bool isPersistent() const { return m_persistent;}
+        uint64_t getEpollCtlCount() const { return m_epollCtlCount;}          // 对fd调epoll_ctl的次数
+
+        struct IdleStats {
+            uint64_t spins = 0;                 // 进idle先忙等的次数
+            uint64_t spinHits = 0;              // 忙等的时候等到了活，没睡
+            uint64_t spinNs = 0;                // 忙等一共花掉的时间(cpu一直占着)
+            uint64_t parks = 0;                 // 真的睡下去(阻塞在epoll_wait/io_uring里)的次数
+            uint64_t wakeups = 0;               // 被tickle叫醒的次数
+            uint64_t wakeupNs = 0;              // 从写eventfd到睡着的线程醒过来读走一共花的时间
+        };
+        IdleStats getIdleStats() const;
+        uint64_t getTickleCount() const { return m_tickleCount;}              // 真正写了eventfd的次数
+        uint64_t getTickleSuppressed() const { return m_tickleSuppressed;}    // 没人睡或者已经有一次没被读走，省掉的次数
     
     protected:
         void tickle() override;
         bool stopping() override;
         void idle() override;
         void onTimerInsertedAtFront() override; 
-        void contextResize(size_t size);
+        void pollEvents() override;
+        void collectMetrics(Metrics& m) override;
         bool stopping(uint64_t& timeout);
 
     private:
-        int m_epfd = 0;                // e_poll        epoll事件实例
-        int m_tickleFds[2];            // pipeline      [0]:输入端 [1]输出端
+        // 一个epoll实例和叫醒在它上面睡的线程用的eventfd，不分片的时候只有一个，大家共用
+        struct Shard {
+            int epfd = -1;
+            int tickleFd = -1;                          // eventfd，写一次epoll_wait里的线程就会醒一个
+            std::atomic<bool> tickling = {false};       // 写过了还没被idle读走，这期间不用再写
+            IoUring* ring = nullptr;                    // 开了io_uring才有，只有这个线程收完成
+            bool epollArmed = false;                    // epfd的POLL_ADD已经在ring上了
+            std::atomic<int> spinning = {0};            // 在idle里忙等的线程数，不为0就不用tickle
+            std::atomic<uint64_t> tickleTime = {0};     // 最近一次真正写eventfd的时间，醒来的线程算唤醒延迟
+        };
+
+        Shard* getShard();                              // 当前线程等事件用的那个
+        int pickEpoll();                                // 新注册的fd放到哪个epoll上
+        void tickle(Shard* shard);
+        // 处理epoll_wait拿到的事件，触发的任务放进batch
+        void processEvents(Shard* shard, epoll_event* events, int n, Scheduler::TaskBatch& batch);
+        // 收ring上所有的完成，读写完成的协程放进batch，返回epfd上是不是有事件了
+        bool processCompletions(Shard* shard, Scheduler::TaskBatch& batch);
+        void armEpoll(Shard* shard);
+        // 进idle先忙等一会，budget_ns是这个线程当前的预算(会自适应调整)，等到活了返回true
+        bool spinIdle(Shard* shard, uint64_t& budget_ns);
+        static void InitContext(FdContext& ctx, int fd);
+        int epollCtl(FdContext* fd_ctx, int op, uint32_t events);   // 出错记日志，返回epoll_ctl的结果
+        bool cancelRingOp(FdContext* fd_ctx, Event event);          // 持有fd_ctx的锁调用
+
+    private:
+        bool m_sharded = false;
+        bool m_uring = false;
+        bool m_persistent = false;
+        uint64_t m_spinBudgetNs = 0;                    // iomanager.idle_spin_us换成纳秒
+        std::vector<Shard*> m_shards;
+        std::atomic<size_t> m_nextShard = {0};          // 外部线程注册的fd轮流分
+        std::atomic<size_t> m_tickleCursor = {0};       // 分片模式下tickle从哪开始找在睡的线程
+        std::atomic<uint64_t> m_tickleCount = {0};
+        std::atomic<uint64_t> m_tickleSuppressed = {0};
+        std::atomic<uint64_t> m_epollCtlCount = {0};
+        std::atomic<uint64_t> m_idleSpins = {0};
+        std::atomic<uint64_t> m_idleSpinHits = {0};
+        std::atomic<uint64_t> m_idleSpinNs = {0};
+        std::atomic<uint64_t> m_idleParks = {0};
+        std::atomic<uint64_t> m_wakeups = {0};
+        std::atomic<uint64_t> m_wakeupNs = {0};
 
         std::atomic<size_t> m_pendingEventCount = {0};
-        RWmutexType m_mutex;
-        std::vector<FdContext*> m_fdContexts;       // 存放事件的vector
+        FdTable<FdContext> m_fdContexts;            // fd -> FdContext，查找不加锁，FdContext的地址一直不变
     };
 }
 
@@ -2,6 +2,11 @@
 #include <functional>
 #include <time.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "config.h"
 
 #define SlyarVerion 1
@@ -80,15 +85,152 @@ namespace sylar{
 #undef XX
     }
 
-    LogEventWrap::LogEventWrap(LogEvent::ptr e) : m_event(e) {
+    /*
+        写进连续内存的streambuf，写满了翻倍，reset只把写指针拨回开头，容量留着
+    */
+    class LogStreamBuf : public std::streambuf {
+    public:
+        LogStreamBuf() {
+            m_buf.resize(256);
+            reset();
+        }
+
+        void reset() {
+            setp(&m_buf[0], &m_buf[0] + m_buf.size());
+        }
+
+        const char* data() const { return pbase();}
+        size_t size() const { return pptr() - pbase();}
+    protected:
+        int_type overflow(int_type c) override {
+            grow(1);
+            if(!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
+            }
+            return traits_type::not_eof(c);
+        }
+
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            if(epptr() - pptr() < n) {
+                grow(n);
+            }
+            memcpy(pptr(), s, n);
+            pbump(n);
+            return n;
+        }
+    private:
+        void grow(size_t need) {
+            size_t used = size();
+            size_t cap = m_buf.size();
+            while(cap - used < need) {
+                cap *= 2;
+            }
+            m_buf.resize(cap);
+            setp(&m_buf[0], &m_buf[0] + m_buf.size());
+            pbump(used);
+        }
+    private:
+        std::string m_buf;
+    };
+
+    class LogStream : public std::ostream {
+    public:
+        LogStream()
+            : std::ostream(&m_buf),
+              m_flags(flags()) {
+        }
+
+        // 上一条日志可能改过进制/宽度之类的，还回来的时候恢复成新建时的样子
+        void reset() {
+            m_buf.reset();
+            clear();
+            flags(m_flags);
+            width(0);
+            precision(6);
+            fill(' ');
+        }
+
+        const char* data() const { return m_buf.data();}
+        size_t size() const { return m_buf.size();}
+    private:
+        LogStreamBuf m_buf;
+        std::ios_base::fmtflags m_flags;
+    };
+
+    /*
+        线程本地的LogStream池，日志内容里再打日志(嵌套)的时候会同时借出去好几个
+        线程退出的时候池先析构，之后(别的thread_local析构里)再打的日志临时new一个
+    */
+    namespace {
+        struct LogStreamPool {
+            static const size_t MAX = 8;
+            std::vector<LogStream*> streams;
+
+            ~LogStreamPool();
+        };
+        static thread_local bool t_stream_pool_dead = false;
+        static thread_local LogStreamPool t_stream_pool;
+
+        LogStreamPool::~LogStreamPool() {
+            for(auto i : streams) {
+                delete i;
+            }
+            streams.clear();
+            t_stream_pool_dead = true;
+        }
+    }
+
+    static LogStream* AcquireLogStream() {
+        if(t_stream_pool_dead || t_stream_pool.streams.empty()) {
+            return new LogStream;
+        }
+        LogStream* ss = t_stream_pool.streams.back();
+        t_stream_pool.streams.pop_back();
+        return ss;
+    }
 
+    static void ReleaseLogStream(LogStream* ss) {
+        if(t_stream_pool_dead || t_stream_pool.streams.size() >= LogStreamPool::MAX) {
+            delete ss;
+            return;
+        }
+        ss -> reset();
+        t_stream_pool.streams.push_back(ss);
     }
+
+    LogEventWrap::LogEventWrap(std::shared_ptr<Logger> logger, LogLevel::Level level,
+            const char* file, int32_t line, uint32_t elapse,
+            uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string& thread_name)
+        : m_event(logger, level, file, line, elapse, thread_id, fiber_id, time, thread_name) {
+    }
+
     LogEventWrap::~LogEventWrap() {
-        m_event -> getLogger() -> log(m_event -> getLevel(), m_event);
+        m_event.getLogger() -> log(m_event.getLevel(), getEvent());
+    }
+
+    std::ostream& LogEventWrap::getSS() {
+        return m_event.getSS();
     }
 
-    std::stringstream& LogEventWrap::getSS() {
-        return m_event -> getSS();
+    LogEvent::~LogEvent() {
+        ReleaseLogStream(m_ss);
+    }
+
+    std::ostream& LogEvent::getSS() {
+        return *m_ss;
+    }
+
+    std::string LogEvent::getContent() const {
+        return std::string(m_ss -> data(), m_ss -> size());
+    }
+
+    const char* LogEvent::getContentData() const {
+        return m_ss -> data();
+    }
+
+    size_t LogEvent::getContentSize() const {
+        return m_ss -> size();
     }
 
     
@@ -102,10 +244,22 @@ namespace sylar{
         va_end(ap);
     }
     void LogEvent::format(const char* fmt, va_list al) {
+        char buf[512];                          // 一般的日志栈上就够了，长的再去堆上
+        va_list copy;
+        va_copy(copy, al);
+        int len = vsnprintf(buf, sizeof(buf), fmt, copy);
+        va_end(copy);
+        if(len < 0) {
+            return;
+        }
+        if((size_t)len < sizeof(buf)) {
+            m_ss -> write(buf, len);
+            return;
+        }
         char* buff = nullptr;
-        int len = vasprintf(&buff, fmt, al);
+        len = vasprintf(&buff, fmt, al);
         if(len != -1) {
-            m_ss << std::string(buff, len);
+            m_ss -> write(buff, len);
             free(buff);
         }
     }
@@ -120,7 +274,7 @@ namespace sylar{
         //MessageFormatItem(const std::string& fmt) : FormatItem(fmt) {}
         MessageFormatItem(const std::string& fmt= "") {}
         void format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override {
-            os << event -> getContent();
+            os.write(event -> getContentData(), event -> getContentSize());
         }
     };
     class LevelFormatItem : public LogFormatter::FormatItem {
@@ -239,11 +393,72 @@ namespace sylar{
     LogEvent::LogEvent (std::shared_ptr<Logger> logger, LogLevel::Level level,
      const char* file, int32_t line, uint32_t elapse,
       uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string& thread_name) 
-    : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_threadId(thread_id), m_fiberId(fiber_id), m_time(time), m_thread_name(thread_name)
+    : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_threadId(thread_id), m_fiberId(fiber_id), m_time(time), m_thread_name(&thread_name),
+      m_ss(AcquireLogStream())
      {
 
     }
 
+// LogSite
+    static LogSite* s_log_sites = nullptr;                 // 常量初始化，静态构造里打日志也没问题
+    static uint64_t s_log_site_generation = 0;
+
+    static Mutex& LogSiteMutex() {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    bool LogSite::check(const Logger::ptr& logger) {
+        // 先拿代数再读等级，中间setLevel了的话下面能发现
+        uint64_t gen = __atomic_load_n(&s_log_site_generation, __ATOMIC_ACQUIRE);
+        bool on = logger -> getLevel() <= m_level;
+        uint8_t state = __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+        if(state == DYNAMIC) {
+            return on;
+        }
+        if(state == NEW) {
+            Mutex::Lock lock(LogSiteMutex());
+            if(__atomic_load_n(&m_state, __ATOMIC_RELAXED) == NEW) {
+                m_next = s_log_sites;
+                s_log_sites = this;
+                __atomic_store_n(&m_state, (uint8_t)UNKNOWN, __ATOMIC_RELAXED);
+            }
+        } else if(__atomic_load_n(&m_logger, __ATOMIC_RELAXED) != logger.get()) {
+            __atomic_store_n(&m_state, (uint8_t)DYNAMIC, __ATOMIC_RELAXED);
+            return on;
+        }
+        __atomic_store_n(&m_logger, logger.get(), __ATOMIC_RELAXED);
+        uint8_t cached = on ? ON : OFF;
+        __atomic_store_n(&m_state, cached, __ATOMIC_RELAXED);
+        if(__atomic_load_n(&s_log_site_generation, __ATOMIC_SEQ_CST) != gen) {
+            // 按旧等级算的，作废。DYNAMIC别人刚设的不能覆盖
+            __atomic_compare_exchange_n(&m_state, &cached, (uint8_t)UNKNOWN, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        return on;
+    }
+
+    void LogSite::Invalidate() {
+        __atomic_add_fetch(&s_log_site_generation, 1, __ATOMIC_SEQ_CST);
+        Mutex::Lock lock(LogSiteMutex());
+        for(LogSite* site = s_log_sites; site; site = site -> m_next) {
+            uint8_t state = __atomic_load_n(&site -> m_state, __ATOMIC_RELAXED);
+            if(state == ON || state == OFF) {
+                __atomic_compare_exchange_n(&site -> m_state, &state, (uint8_t)UNKNOWN, false,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    size_t LogSite::GetCount() {
+        Mutex::Lock lock(LogSiteMutex());
+        size_t count = 0;
+        for(LogSite* site = s_log_sites; site; site = site -> m_next) {
+            ++count;
+        }
+        return count;
+    }
+
 // LOGGER 模块 实现
     Logger::Logger(const std::string& name) : m_name(name), m_level(LogLevel::DEBUG) {
         m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n")); // sharded pointer reset，就是给sharded pointer 赋默认值
@@ -253,6 +468,11 @@ namespace sylar{
         // }
     }
 
+    void Logger::setLevel(LogLevel::Level val) {
+        m_level = val;
+        LogSite::Invalidate();
+    }
+
     void Logger::addAppender(LogAppender::ptr appender) {
         MutexType::Lock lock(m_mutex);
         if(! appender->getFormatter()) {
@@ -389,6 +609,14 @@ namespace sylar{
         reopen();
     }
 
+    // 格式化用的线程本地缓冲区，容量留着下次用
+    static thread_local std::string t_format_buffer;
+
+    static std::string& FormatBuffer() {
+        t_format_buffer.clear();
+        return t_format_buffer;
+    }
+
     void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
         if(level >= m_level) {
             uint64_t currTime = time(0);
@@ -397,7 +625,9 @@ namespace sylar{
                 m_LastTime = currTime;
             }
            MutexType::Lock lock(m_mutex);
-           m_fileStream << m_formatter->format(logger, level, event);
+           std::string& buf = FormatBuffer();
+           m_formatter->format(buf, logger, level, event);
+           m_fileStream.write(buf.c_str(), buf.size());
         }
     }
     
@@ -429,7 +659,9 @@ namespace sylar{
     void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event)  {
         if(level >= m_level) {
             MutexType::Lock lock(m_mutex);
-            std::cout << m_formatter->format(logger, level, event);
+            std::string& buf = FormatBuffer();
+            m_formatter->format(buf, logger, level, event);
+            std::cout.write(buf.c_str(), buf.size());
         }
     }
     
@@ -448,6 +680,337 @@ namespace sylar{
         return ss.str();
     }
 
+    /*
+        一个写日志的线程的字节环，head只有这个线程写，tail只有后台线程写
+        放进去的都是整条记录，后台线程看到多少就写多少，不会把一条拆开在两次写里(拆在两个iovec里没关系)
+    */
+    struct AsyncLogAppender::Ring {
+        Ring(size_t size)
+            : buf(new char[size]), mask(size - 1) {
+        }
+        ~Ring() {
+            delete[] buf;
+        }
+
+        char* buf;
+        size_t mask;
+        std::atomic<uint64_t> head = {0};
+        char pad[64];                               // head和tail不放在一个cache line上
+        std::atomic<uint64_t> tail = {0};
+        std::atomic<bool> orphan = {false};         // 线程退出了，读空了就可以扔
+        std::atomic<bool> closed = {false};         // appender析构了，线程这边的缓存可以扔
+    };
+
+    // 每个线程缓存自己在各个AsyncLogAppender里的环，线程退出的时候把环交给后台线程收尾
+    struct AsyncLogRings {
+        typedef std::shared_ptr<AsyncLogAppender::Ring> RingPtr;
+        std::vector<std::pair<uint64_t, RingPtr> > rings;
+
+        ~AsyncLogRings() {
+            for(auto& i : rings) {
+                i.second -> orphan = true;
+            }
+        }
+    };
+
+    static thread_local AsyncLogRings t_async_rings;
+    static std::atomic<uint64_t> s_async_appender_id = {0};
+
+    AsyncLogAppender::AsyncLogAppender(const std::string& fileName, Overflow overflow,
+                                       size_t buffer_size, uint32_t flush_ms)
+        : m_fileName(fileName),
+          m_overflow(overflow),
+          m_bufferSize(4096),
+          m_flushMs(flush_ms ? flush_ms : 1),
+          m_id(++s_async_appender_id) {
+        while(m_bufferSize < buffer_size) {
+            m_bufferSize <<= 1;
+        }
+        checkFile();
+        m_thread.reset(new Thread(std::bind(&AsyncLogAppender::run, this), "log_async"));
+    }
+
+    AsyncLogAppender::~AsyncLogAppender() {
+        m_stop = true;
+        wakeWriter();
+        if(m_thread) {
+            m_thread -> join();
+        }
+        SpinLock::Lock lock(m_ringsMutex);
+        for(auto& i : m_rings) {
+            i -> closed = true;
+        }
+        m_rings.clear();
+        if(m_fd > STDERR_FILENO) {
+            ::close(m_fd);
+        }
+    }
+
+    AsyncLogAppender::Overflow AsyncLogAppender::OverflowFromString(const std::string& str) {
+        if(str == "drop" || str == "DROP") {
+            return DROP;
+        }
+        return BLOCK;
+    }
+
+    const char* AsyncLogAppender::OverflowToString(Overflow v) {
+        return v == DROP ? "drop" : "block";
+    }
+
+    AsyncLogAppender::Ring* AsyncLogAppender::getRing() {
+        auto& rings = t_async_rings.rings;
+        for(auto& i : rings) {
+            if(i.first == m_id) {
+                return i.second.get();
+            }
+        }
+        // 第一次往这个appender写，顺便把已经析构的appender的环清掉
+        for(auto it = rings.begin(); it != rings.end();) {
+            if(it -> second -> closed) {
+                it = rings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        AsyncLogRings::RingPtr ring(new Ring(m_bufferSize));
+        {
+            SpinLock::Lock lock(m_ringsMutex);
+            m_rings.push_back(ring);
+        }
+        rings.push_back(std::make_pair(m_id, ring));
+        return ring.get();
+    }
+
+    void AsyncLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+        if(level < m_level) {
+            return;
+        }
+        LogFormatter::ptr fmt;
+        {
+            MutexType::Lock lock(m_mutex);
+            fmt = m_formatter;
+        }
+        std::string& data = FormatBuffer();
+        fmt -> format(data, logger, level, event);
+        if(push(getRing(), data) && level >= LogLevel::ERROR) {
+            wakeWriter();                       // 出错的日志不等攒批
+        }
+    }
+
+    bool AsyncLogAppender::push(Ring* ring, const std::string& data) {
+        size_t cap = ring -> mask + 1;
+        size_t len = data.size();
+        if(len > cap) {                         // 整个环都放不下
+            ++m_dropped;
+            return false;
+        }
+        uint64_t head = ring -> head.load(std::memory_order_relaxed);
+        uint64_t tail = ring -> tail.load(std::memory_order_acquire);
+        while(cap - (head - tail) < len) {
+            if(m_overflow == DROP || m_stop) {
+                ++m_dropped;
+                wakeWriter();
+                return false;
+            }
+            // 不能让出协程(调用方可能拿着Logger的锁)，直接把线程挂在信号量上
+            ++m_blocked;
+            wakeWriter();
+            m_space.waitFor(10);
+            --m_blocked;
+            tail = ring -> tail.load(std::memory_order_acquire);
+        }
+        size_t off = head & ring -> mask;
+        size_t first = std::min(len, cap - off);
+        memcpy(ring -> buf + off, data.c_str(), first);
+        memcpy(ring -> buf, data.c_str() + first, len - first);
+        ring -> head.store(head + len, std::memory_order_release);
+        if(head + len - tail > cap / 2) {
+            wakeWriter();                       // 过半了，早点叫后台线程，别等到满
+        }
+        return true;
+    }
+
+    void AsyncLogAppender::wakeWriter() {
+        if(!m_wakePending.exchange(true)) {
+            m_wake.notify();
+        }
+    }
+
+    void AsyncLogAppender::flush() {
+        uint64_t req = ++m_flushReq;
+        while(m_flushDone < req && !m_stop) {
+            wakeWriter();
+            m_flushed.waitFor(10);
+        }
+    }
+
+    void AsyncLogAppender::run() {
+        while(true) {
+            m_wake.waitFor(m_flushMs);
+            m_wakePending = false;
+            uint64_t req = m_flushReq;
+            while(drain()) {
+            }
+            if(req != m_flushDone) {
+                m_flushDone = req;
+                m_flushed.notify();
+            }
+            if(m_stop) {
+                while(drain()) {
+                }
+                break;
+            }
+        }
+    }
+
+    void AsyncLogAppender::checkFile() {
+        if(m_fileName.empty()) {
+            m_fd = STDOUT_FILENO;
+            return;
+        }
+        struct stat path_st, fd_st;
+        if(m_fd >= 0 && !stat(m_fileName.c_str(), &path_st) && !fstat(m_fd, &fd_st)
+                && path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev) {
+            return;
+        }
+        int fd = ::open(m_fileName.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if(fd < 0) {
+            std::cerr << "AsyncLogAppender open " << m_fileName << " errno=" << errno
+                      << " " << strerror(errno) << std::endl;
+            return;                             // 留着旧的fd接着写，下次再试
+        }
+        if(m_fd >= 0) {
+            ::close(m_fd);
+        }
+        m_fd = fd;
+    }
+
+    /*
+        一批最多IOV_MAX个iovec，每个环最多两段(绕回来的时候)
+        返回写了多少字节，环太多一批装不下的时候返回值非0，调用方接着调
+    */
+    size_t AsyncLogAppender::drain() {
+        uint64_t now = time(0);
+        if(now != m_lastCheck) {
+            m_lastCheck = now;
+            checkFile();
+        }
+
+        std::vector<std::shared_ptr<Ring> > rings;
+        {
+            SpinLock::Lock lock(m_ringsMutex);
+            rings = m_rings;
+        }
+        static const int kMaxIov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+        struct iovec iov[kMaxIov];
+        std::vector<std::pair<Ring*, uint64_t> > done;      // 写完之后每个环的tail推到哪
+        std::vector<Ring*> orphans;
+        int cnt = 0;
+        size_t bytes = 0;
+
+        std::string dropped_msg;
+        uint64_t dropped = m_dropped;
+        if(dropped != m_droppedReported) {
+            dropped_msg = "AsyncLogAppender dropped " + std::to_string(dropped - m_droppedReported)
+                          + " log records\n";
+            m_droppedReported = dropped;
+            iov[cnt].iov_base = (void*)dropped_msg.c_str();
+            iov[cnt].iov_len = dropped_msg.size();
+            ++cnt;
+        }
+
+        for(auto& r : rings) {
+            if(cnt + 2 > kMaxIov) {
+                break;
+            }
+            uint64_t tail = r -> tail.load(std::memory_order_relaxed);
+            uint64_t head = r -> head.load(std::memory_order_acquire);
+            if(head == tail) {
+                if(r -> orphan) {
+                    orphans.push_back(r.get());
+                }
+                continue;
+            }
+            size_t cap = r -> mask + 1;
+            size_t off = tail & r -> mask;
+            size_t len = head - tail;
+            size_t first = std::min(len, cap - off);
+            iov[cnt].iov_base = r -> buf + off;
+            iov[cnt].iov_len = first;
+            ++cnt;
+            if(len > first) {
+                iov[cnt].iov_base = r -> buf;
+                iov[cnt].iov_len = len - first;
+                ++cnt;
+            }
+            bytes += len;
+            done.push_back(std::make_pair(r.get(), head));
+        }
+
+        struct iovec* p = iov;
+        int left = cnt;
+        while(left > 0 && m_fd >= 0) {
+            ssize_t n = ::writev(m_fd, p, left);
+            if(n < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "AsyncLogAppender writev " << m_fileName << " errno=" << errno
+                          << " " << strerror(errno) << std::endl;
+                break;                          // 写不进去就扔掉这一批，不能让写日志的线程一直等
+            }
+            while(left > 0 && (size_t)n >= p -> iov_len) {
+                n -= p -> iov_len;
+                ++p;
+                --left;
+            }
+            if(left > 0) {
+                p -> iov_base = (char*)p -> iov_base + n;
+                p -> iov_len -= n;
+            }
+        }
+
+        for(auto& i : done) {
+            i.first -> tail.store(i.second, std::memory_order_release);
+        }
+        if(m_blocked > 0) {
+            m_space.notify();
+        }
+        if(!orphans.empty()) {
+            SpinLock::Lock lock(m_ringsMutex);
+            for(auto r : orphans) {
+                for(auto it = m_rings.begin(); it != m_rings.end(); ++it) {
+                    if(it -> get() == r) {
+                        m_rings.erase(it);
+                        break;
+                    }
+                }
+            }
+        }
+        return bytes;
+    }
+
+    std::string AsyncLogAppender::toYamlString() {
+        MutexType::Lock lock(m_mutex);
+        YAML::Node node;
+        node["type"] = "AsyncLogAppender";
+        if(!m_fileName.empty()) {
+            node["file"] = m_fileName;
+        }
+        node["overflow"] = OverflowToString(m_overflow);
+        node["buffer_size"] = m_bufferSize;
+        node["flush_ms"] = m_flushMs;
+        if(m_level != LogLevel::UNKNOW) {
+            node["level"] = LogLevel::ToString(m_level);
+        }
+        if(m_hasFormatter && m_formatter) {
+            node["formatter"] = m_formatter -> getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
 // LogFormatter 模块实现
     /*  
         构造方法输入一个pattern然后
@@ -460,11 +1023,105 @@ namespace sylar{
         组装，用stringstream性能更加，将解析好的格式从m_item里取出来拼接成普通的字符串
     */
     std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-        std::stringstream ss;
+        std::string str;
+        format(str, logger, level, event);
+        return str;
+    }
+
+    std::ostream& LogFormatter::format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
         for(auto& i : m_items) {
-            i->format(ss, logger, level, event);
+            i->format(os, logger, level, event);
+        }
+        return os;
+    }
+
+    static void AppendInt(std::string& out, int64_t v) {
+        char buf[24];
+        char* end = buf + sizeof(buf);
+        char* p = end;
+        uint64_t u = v < 0 ? -(uint64_t)v : v;
+        do {
+            *--p = '0' + u % 10;
+            u /= 10;
+        } while(u);
+        if(v < 0) {
+            *--p = '-';
+        }
+        out.append(p, end - p);
+    }
+
+    /*
+        时间戳按秒缓存，每个线程几个槽，按Op的id分槽
+        同一秒里同一个格式只调一次localtime_r + strftime
+    */
+    namespace {
+        struct DateTimeCache {
+            uint64_t id = 0;
+            time_t sec = -1;
+            size_t len = 0;
+            char buf[64];
+        };
+        static const size_t s_datetime_slots = 4;
+        static thread_local DateTimeCache t_datetime_cache[s_datetime_slots];
+        static std::atomic<uint64_t> s_datetime_id = {0};
+    }
+
+    static void AppendDateTime(std::string& out, uint64_t id, const std::string& fmt, time_t sec) {
+        DateTimeCache& c = t_datetime_cache[id % s_datetime_slots];
+        if(c.id != id || c.sec != sec) {
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            c.len = strftime(c.buf, sizeof(c.buf), fmt.c_str(), &tm);
+            c.id = id;
+            c.sec = sec;
+        }
+        out.append(c.buf, c.len);
+    }
+
+    void LogFormatter::format(std::string& out, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+        for(auto& op : m_ops) {
+            switch(op.type) {
+                case Op::STRING:
+                    out.append(op.str);
+                    break;
+                case Op::MESSAGE:
+                    out.append(event -> getContentData(), event -> getContentSize());
+                    break;
+                case Op::LEVEL:
+                    out.append(LogLevel::ToString(level));
+                    break;
+                case Op::ELAPSE:
+                    AppendInt(out, event -> getElapse());
+                    break;
+                case Op::NAME:
+                    out.append(event -> getLogger() -> getName());
+                    break;
+                case Op::THREAD_ID:
+                    AppendInt(out, event -> getThreadId());
+                    break;
+                case Op::THREAD_NAME:
+                    out.append(event -> getThreadName());
+                    break;
+                case Op::FIBER_ID:
+                    AppendInt(out, event -> getFiberId());
+                    break;
+                case Op::DATETIME:
+                    AppendDateTime(out, op.id, op.str, event -> getTime());
+                    break;
+                case Op::FILENAME:
+                    out.append(event -> getFile());
+                    break;
+                case Op::LINE:
+                    AppendInt(out, event -> getLine());
+                    break;
+                case Op::NEWLINE:
+                    out.push_back('\n');
+                    break;
+                case Op::TAB:
+                    out.push_back('\t');
+                    break;
+            }
         }
-        return ss.str();
     }
 
     /*
@@ -641,17 +1298,49 @@ namespace sylar{
         //     //std::cout << "(" << std::get<0>(i) << ") - (" << std::get<1>(i) << ") - (" << std::get<2>(i) << ")" << std::endl;
         // }
     
+    // 和上面的FormatItem一一对应的指令
+    static std::unordered_map<std::string, Op::Type> s_format_ops = {
+        {"m", Op::MESSAGE},
+        {"p", Op::LEVEL},
+        {"r", Op::ELAPSE},
+        {"c", Op::NAME},
+        {"t", Op::THREAD_ID},
+        {"n", Op::NEWLINE},
+        {"d", Op::DATETIME},
+        {"f", Op::FILENAME},
+        {"l", Op::LINE},
+        {"T", Op::TAB},
+        {"F", Op::FIBER_ID},
+        {"N", Op::THREAD_NAME}
+    };
+
     for(auto& i : vec) {
+        Op op;
         if(std::get<2>(i) == 0) {
             m_items.emplace_back(FormatItem::ptr(new StringFormatItem(std::get<0>(i))));
+            op.type = Op::STRING;
+            op.str = std::get<0>(i);
         }else{
             if(s_format_items.count(std::get<0>(i)) == 0) {
                 m_error = true;
                 m_items.emplace_back(FormatItem::ptr(new StringFormatItem("<<[Error Pattern]: %" + std::get<0>(i) + ">>")));
+                op.type = Op::STRING;
+                op.str = "<<[Error Pattern]: %" + std::get<0>(i) + ">>";
             }else{
                 m_items.emplace_back(s_format_items[std::get<0>(i)](std::get<1>(i))); // 注意我们的value在map中是一个lambda函数，需要接受一个string:fmt 作为参数，因此我们根据类型找到value后还是要把参数塞进去的
+                op.type = s_format_ops[std::get<0>(i)];
+                if(op.type == Op::DATETIME) {
+                    op.str = std::get<1>(i).empty() ? "%Y-%m-%d %H:%M:%S" : std::get<1>(i);
+                    op.id = ++s_datetime_id;
+                }
             }
         }
+        // 相邻的字符串并成一条
+        if(op.type == Op::STRING && !m_ops.empty() && m_ops.back().type == Op::STRING) {
+            m_ops.back().str += op.str;
+        } else {
+            m_ops.push_back(op);
+        }
     }
 
 #else
@@ -680,13 +1369,18 @@ namespace sylar{
     }
 
     struct LogAppenderDefine {
-        int type = 0; // File = 1, stdOut = 2;
+        int type = 0; // File = 1, stdOut = 2, Async = 3;
         LogLevel::Level level = LogLevel::UNKNOW;
         std::string formatter;
         std::string file;
+        // 下面是Async的
+        std::string overflow = "block";
+        uint32_t buffer_size = 256 * 1024;
+        uint32_t flush_ms = 50;
 
         bool operator== (const LogAppenderDefine& oth) const {
-            return (type == oth.type) && (level == oth.level) && (formatter == oth.formatter) && (file == oth.file);
+            return (type == oth.type) && (level == oth.level) && (formatter == oth.formatter) && (file == oth.file)
+                && (overflow == oth.overflow) && (buffer_size == oth.buffer_size) && (flush_ms == oth.flush_ms);
         }
     };
 
@@ -747,6 +1441,23 @@ namespace sylar{
                         }
                     } else if(type == "StdoutLogAppender") {
                         lad.type = 2;
+                    } else if(type == "AsyncLogAppender") {
+                        lad.type = 3;
+                        if(a["file"].IsDefined()) {
+                            lad.file = a["file"].as<std::string>();
+                        }
+                        if(a["formatter"].IsDefined()) {
+                            lad.formatter = a["formatter"].as<std::string>();
+                        }
+                        if(a["overflow"].IsDefined()) {
+                            lad.overflow = a["overflow"].as<std::string>();
+                        }
+                        if(a["buffer_size"].IsDefined()) {
+                            lad.buffer_size = a["buffer_size"].as<uint32_t>();
+                        }
+                        if(a["flush_ms"].IsDefined()) {
+                            lad.flush_ms = a["flush_ms"].as<uint32_t>();
+                        }
                     } else {
                         std::cout << "log config error: Appender type is invalid" << type << std::endl;
                         continue;
@@ -778,6 +1489,14 @@ namespace sylar{
                     n["file"] = i.file; 
                 }else if(i.type == 2) {
                     n["type"] = "StdoutLogAppender";
+                }else if(i.type == 3) {
+                    n["type"] = "AsyncLogAppender";
+                    if(!i.file.empty()) {
+                        n["file"] = i.file;
+                    }
+                    n["overflow"] = i.overflow;
+                    n["buffer_size"] = i.buffer_size;
+                    n["flush_ms"] = i.flush_ms;
                 }
                 if(i.level != LogLevel::UNKNOW) {
                     n["level"] = LogLevel::ToString(i.level);
@@ -824,6 +1543,9 @@ namespace sylar{
                             app.reset(new FileLogAppender(j.file));
                         }else if(j.type == 2) {
                             app.reset(new StdoutLogAppender); 
+                        }else if(j.type == 3) {
+                            app.reset(new AsyncLogAppender(j.file, AsyncLogAppender::OverflowFromString(j.overflow),
+                                                           j.buffer_size, j.flush_ms));
                         }
                         app->setLevel(j.level);
 
@@ -16,11 +16,38 @@
 #include "util.h"
 #include "singleton.h"
 #include "thread.h"
+#include "noncopyable.h"
 
+/*
+    编译期最低等级，比它低的语句整条去掉(条件是常量，-O0下也不生成代码)
+    cmake -DSYLAR_LOG_MIN_LEVEL=INFO，默认DEBUG全留着
+*/
+#ifndef SYLAR_LOG_MIN_LEVEL
+#define SYLAR_LOG_MIN_LEVEL sylar::LogLevel::DEBUG
+#endif
+#define SYLAR_LOG_COMPILED(level) ((level) >= SYLAR_LOG_MIN_LEVEL)
+
+// 调用点缓存的开关，logger还是记下的那个的时候直接用缓存的ON/OFF，不然进check()，见LogSite
+#define SYLAR_LOG_ENABLED(logger, level) \
+    __extension__ ({ \
+        static sylar::LogSite s_sylar_log_site(level); \
+        const sylar::Logger::ptr& s_sylar_log_logger = (logger); \
+        uint8_t s_sylar_log_state = __atomic_load_n(&s_sylar_log_site.m_state, __ATOMIC_RELAXED); \
+        (s_sylar_log_state == sylar::LogSite::ON || s_sylar_log_state == sylar::LogSite::OFF) \
+            && __atomic_load_n(&s_sylar_log_site.m_logger, __ATOMIC_RELAXED) == s_sylar_log_logger.get() \
+            ? s_sylar_log_state == sylar::LogSite::ON : s_sylar_log_site.check(s_sylar_log_logger); \
+    })
+
+// LogEventWrap是栈上的临时对象，事件就在它里面，不再new
 #define SYLAR_LOG_LEVEL(logger, level) \
-    if(logger -> getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()))).getSS()
-        
+    if(SYLAR_LOG_COMPILED(level) && SYLAR_LOG_ENABLED(logger, level)) \
+        sylar::LogEventWrap(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()).getSS()
+
+// 不用调用点缓存，每次都查logger的等级
+#define SYLAR_LOG_DYNAMIC(logger, level) \
+    if(SYLAR_LOG_COMPILED(level) && logger -> getLevel() <= level) \
+        sylar::LogEventWrap(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()).getSS()
+
 #define SYLAR_LOG_DEBUG(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::DEBUG)
 #define SYLAR_LOG_INFO(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::INFO)
 #define SYLAR_LOG_WARN(logger) SYLAR_LOG_LEVEL(logger, sylar::LogLevel::WARN)
@@ -29,8 +56,8 @@
 
 
 #define SYLAR_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if(logger -> getLevel() <= level) \
-        sylar::LogEventWrap(sylar::LogEvent::ptr(new sylar::LogEvent(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()))).getEvent() -> format(fmt, __VA_ARGS__)
+    if(SYLAR_LOG_COMPILED(level) && SYLAR_LOG_ENABLED(logger, level)) \
+        sylar::LogEventWrap(logger, level, __FILE__, __LINE__, 0, sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()).getEvent() -> format(fmt, __VA_ARGS__)
 
 #define SYLAR_LOG_FMT_DEBUG(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define SYLAR_LOG_FMT_INFO(logger, fmt, ...) SYLAR_LOG_FMT_LEVEL(logger, sylar::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -62,14 +89,21 @@ public:
     static LogLevel::Level FromString(const std::string& str);
 };
 
+/*
+    日志内容写进来的流，从线程本地的池里借，事件析构的时候还回去
+    缓冲区的容量留着给下一条用，稳定之后写日志内容不分配内存
+*/
+class LogStream;
+
 // 日志事件
-class LogEvent {
+class LogEvent : Noncopyable {
 public:
     typedef std::shared_ptr<LogEvent> ptr;
+    // thread_name只存引用，要比event活得久(宏里传的是线程本地的名字)
     LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, 
             const char* file, int32_t line, uint32_t elapse, 
             uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string& thread_name);
-    // ~LogEvent();
+    ~LogEvent();
   
     const char* getFile() const {return m_file;}
     int32_t getLine() const {return m_line;}
@@ -77,11 +111,13 @@ public:
     uint32_t getThreadId() const {return m_threadId;}
     uint32_t getFiberId() const {return m_fiberId;}
     uint64_t getTime() const {return m_time;}
-    const std::string& getThreadName() const {return m_thread_name;}
-    std::string getContent() const {return m_ss.str();}
+    const std::string& getThreadName() const {return *m_thread_name;}
+    std::string getContent() const;
+    const char* getContentData() const;         // 不拷贝，事件析构之前有效
+    size_t getContentSize() const;
     std::shared_ptr<Logger> getLogger() const {return m_logger;}
     LogLevel::Level getLevel() const {return m_level;}
-    std::stringstream& getSS() {return m_ss;}
+    std::ostream& getSS();
     /*
         可变参数，在不确定有多少参数的时候可使用，但是至少要保证一个明确的参数
         va_list al, 即所有参数的列表
@@ -98,23 +134,24 @@ private:
     uint32_t m_threadId = 0;     // 线程ID
     uint32_t m_fiberId = 0;      // 协程ID
     uint64_t m_time;            // 时间
-    std::string m_thread_name;    // 线程名
-    std::stringstream m_ss;      // 内容
-
-    
+    const std::string* m_thread_name;    // 线程名
+    LogStream* m_ss;             // 内容
 };
 
 // 在wrap析构的时候把event写进log里
 // 这里用wrap的原因是，wrap作为临时对象，在使用完后直接析构，触发日志写入，然而日志本身的智能指针，如果声明在主函数里面，程序不结束就永远无法释放
 // 这样写配合文件开头的宏，在宏中if的作用域内构造一个临时的LogEventWrap文件，当我们使用宏去写入日志的时候会产生临时作用域并且通过warp的生命周期完成日志的写入之后析构
+// 事件直接放在wrap里(栈上)，交给Logger的是不管生命周期的LogEvent::ptr(aliasing构造，没有控制块，不分配)
 class LogEventWrap {
 public:
-    LogEventWrap(LogEvent::ptr e);
+    LogEventWrap(std::shared_ptr<Logger> logger, LogLevel::Level level,
+            const char* file, int32_t line, uint32_t elapse,
+            uint32_t thread_id, uint32_t fiber_id, uint64_t time, const std::string& thread_name);
     ~LogEventWrap();
-    LogEvent::ptr getEvent() const {return m_event;}
-    std::stringstream& getSS();
+    LogEvent::ptr getEvent() {return LogEvent::ptr(LogEvent::ptr(), &m_event);}
+    std::ostream& getSS();
 private:
-    LogEvent::ptr m_event;
+    LogEvent m_event;
 };
 
 class LogFormatter {
@@ -123,6 +160,10 @@ public:
     LogFormatter(const std::string& pattern);
 
     std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    // 追加到out后面，走预编译好的指令表，out容量够的时候不分配内存
+    void format(std::string& out, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    // 逐个FormatItem虚函数输出到流，原来的写法，留着给对比用
+    std::ostream& format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
     /*
         没有具体实现的父类，之后会实现成不同的格式的输出
         然后全部存在m_items里
@@ -141,9 +182,21 @@ public:
     bool isError() const {return m_error;}
 
     const std::string getPattern() const {return m_pattern;}
+private:
+    // pattern编译成的平铺指令，一个switch就能格式化完，不走虚函数
+    struct Op {
+        enum Type {
+            STRING, MESSAGE, LEVEL, ELAPSE, NAME, THREAD_ID, THREAD_NAME,
+            FIBER_ID, DATETIME, FILENAME, LINE, NEWLINE, TAB
+        };
+        Type type;
+        std::string str;                        // STRING的内容，DATETIME的strftime格式
+        uint64_t id = 0;                        // DATETIME的缓存用的，全局唯一
+    };
 private:
     std::string m_pattern;
     std::vector<FormatItem::ptr> m_items;
+    std::vector<Op> m_ops;
     bool m_error = false;
 };
 
@@ -160,7 +213,8 @@ public:
     typedef SpinLock MutexType;
     virtual ~LogAppender(){}
 
-    virtual void log(std::shared_ptr<Logger> logger, LogLevel:: Level level, LogEvent::ptr event) = 0;  // log作为纯虚函数，这样子类必须去实现log方法
+    // log作为纯虚函数，这样子类必须去实现log方法。event只在这次调用里有效，要留着的话自己格式化成字符串
+    virtual void log(std::shared_ptr<Logger> logger, LogLevel:: Level level, LogEvent::ptr event) = 0;
     virtual std::string toYamlString() = 0;
 
     // logformatter的get & set
@@ -212,7 +266,7 @@ public:
 
     // 该方法加了const，说明该方法不允许修改任何类变量
     LogLevel::Level getLevel() const {return m_level;}
-    void setLevel(LogLevel::Level val) {m_level = val;} 
+    void setLevel(LogLevel::Level val);         // 会把所有LogSite打回UNKNOWN
 
     const std::string& getName() const {return m_name;}
 
@@ -230,6 +284,43 @@ private:
     Logger::ptr m_root;
 };
 
+/*
+    日志调用点，SYLAR_LOG_ENABLED里每个调用点一个static，constexpr构造是常量初始化，没有guard
+    - 第一次走到的时候挂到全局链表上，看一眼logger的等级定成ON/OFF，记下是哪个logger
+    - 之后走到，传进来的还是记下的那个logger就直接用ON/OFF，不再碰logger
+    - Logger::setLevel(yaml配置变化最后也走到这)把所有调用点打回UNKNOWN，下次走到重新看
+    - 传进来的logger换了(logger是函数参数，比如每个线程一个logger)就退成DYNAMIC，以后每次都查等级，
+      和不缓存一样，不会拿着别的logger的OFF把日志吞掉
+    - logger表达式每次都要求值，SYLAR_LOG_ROOT()这种要拿单例、拷shared_ptr，热路径上用文件里的g_logger
+*/
+class LogSite {
+public:
+    enum State {
+        NEW = 0,        // 还没挂到链表上
+        UNKNOWN,        // 配置变过，下次走到重新看
+        OFF,
+        ON,
+        DYNAMIC,        // 见过不同的logger，不缓存了
+    };
+
+    constexpr LogSite(LogLevel::Level level) : m_level(level) {}
+
+    // 缓存用不上的时候(第一次、等级变过、换了logger、DYNAMIC)进来，返回这次要不要打
+    bool check(const Logger::ptr& logger);
+
+    // 日志等级变了，所有调用点重新看
+    static void Invalidate();
+    static size_t GetCount();                   // 挂上来的调用点个数
+
+public:
+    // 宏里直接读，__atomic_*访问
+    uint8_t m_state = NEW;
+    const Logger* m_logger = nullptr;           // 只比地址，不解引用；挂上之后就不变了，换了logger的退成DYNAMIC
+private:
+    LogLevel::Level m_level;
+    LogSite* m_next = nullptr;
+};
+
 class StdoutLogAppender : public LogAppender {
 public:
     typedef std::shared_ptr<StdoutLogAppender> ptr;
@@ -250,6 +341,68 @@ private:
     uint64_t m_LastTime = 0;
 };
 
+/*
+    异步输出地，写日志的线程只管格式化好放进自己的环形缓冲区，落盘交给后台线程
+    - 每个写日志的线程一个SPSC的字节环(第一次写的时候建)，只有它自己往里放，只有后台线程往外拿，不用锁
+    - 后台线程把所有环里攒着的记录一次writev出去，每秒检查一次文件是不是被挪走/删掉了(logrotate)，是的话重新打开
+    - 环满了按overflow处理: BLOCK等后台线程腾地方，DROP直接丢掉并计数，后台线程会补一行丢了多少条
+    - 同一个线程的日志保持顺序，不同线程之间只保证按批次大致有序
+    file为空的时候写stdout
+*/
+class AsyncLogAppender : public LogAppender {
+friend struct AsyncLogRings;
+public:
+    typedef std::shared_ptr<AsyncLogAppender> ptr;
+    enum Overflow {
+        BLOCK = 0,
+        DROP = 1
+    };
+
+    AsyncLogAppender(const std::string& fileName = "", Overflow overflow = BLOCK,
+                     size_t buffer_size = 256 * 1024, uint32_t flush_ms = 50);
+    ~AsyncLogAppender();
+
+    void log(Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string toYamlString() override;
+
+    void flush();                               // 等到调用之前写进来的日志都落盘
+    uint64_t getDropped() const { return m_dropped;}
+
+    static Overflow OverflowFromString(const std::string& str);     // "drop"/"block"，不认识的当block
+    static const char* OverflowToString(Overflow v);
+private:
+    struct Ring;
+    Ring* getRing();
+    bool push(Ring* ring, const std::string& data);
+    void wakeWriter();
+    void run();                                 // 后台线程
+    size_t drain();                             // 把所有环里的东西写出去，返回写了多少字节
+    void checkFile();
+private:
+    std::string m_fileName;
+    Overflow m_overflow;
+    size_t m_bufferSize;                        // 每个线程的环多大(字节，向上取到2的幂)
+    uint32_t m_flushMs;                         // 没人叫的时候后台线程多久醒一次
+    uint64_t m_id;                              // 线程本地缓存用来认appender的，地址可能被复用
+    int m_fd = -1;
+    uint64_t m_lastCheck = 0;
+
+    SpinLock m_ringsMutex;
+    std::vector<std::shared_ptr<Ring> > m_rings;
+
+    Semaphore m_wake;                           // 叫后台线程
+    std::atomic<bool> m_wakePending = {false};  // 已经叫过还没醒，就不用再post了
+    Semaphore m_space;                          // BLOCK的时候等腾地方
+    std::atomic<int> m_blocked = {0};
+    std::atomic<uint64_t> m_dropped = {0};
+    uint64_t m_droppedReported = 0;
+    std::atomic<uint64_t> m_flushReq = {0};     // flush()的请求号和后台线程做完的号
+    std::atomic<uint64_t> m_flushDone = {0};
+    Semaphore m_flushed;
+    std::atomic<bool> m_stop = {false};
+    Thread::ptr m_thread;
+};
+
 class LoggerManager {
 public:
     typedef SpinLock MutexType;
@@ -2,14 +2,128 @@
 #include "log.h"
 #include "macro.h"
 #include "hook.h"
+#include "config.h"
+#include "topology.h"
+#include "util.h"
+#include <algorithm>
+#include <execinfo.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
 
 namespace sylar {
 
     static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
 
+    static ConfigVar<bool>::ptr g_scheduler_work_stealing =
+        Config::Lookup<bool>("scheduler.work_stealing", true, "scheduler per-thread queue with work stealing");
+    static ConfigVar<uint32_t>::ptr g_scheduler_local_queue_size =
+        Config::Lookup<uint32_t>("scheduler.local_queue_size", 256, "scheduler per-thread local queue capacity");
+    // key是scheduler的名字("*"是没单独配的)，value是"auto"(一个worker一个物理核)或者cpu列表"0-3,8"，没配就不绑
+    static ConfigVar<std::map<std::string, std::string> >::ptr g_scheduler_affinity =
+        Config::Lookup("scheduler.affinity", std::map<std::string, std::string>(), "worker thread cpu affinity per scheduler name");
+
+    static ConfigVar<bool>::ptr g_scheduler_latency_stats =
+        Config::Lookup<bool>("scheduler.latency_stats", false, "record fiber queue wait and run slice histograms");
+    static ConfigVar<uint32_t>::ptr g_scheduler_slow_task_ms =
+        Config::Lookup<uint32_t>("scheduler.slow_task_ms", 0, "log a warning for a task holding a worker longer than this, 0 disables");
+    static ConfigVar<bool>::ptr g_scheduler_slow_task_backtrace =
+        Config::Lookup<bool>("scheduler.slow_task_backtrace", false,
+                             "signal the stuck thread to sample its backtrace; its interrupted syscalls may fail with EINTR");
+
+    // 正在跑的scheduler，给metrics之类的遍历用
+    static Mutex s_registry_mutex;
+    static std::vector<Scheduler*> s_registry;
+
+    static void Unregister(Scheduler* sc) {
+        Mutex::Lock lock(s_registry_mutex);
+        auto it = std::find(s_registry.begin(), s_registry.end(), sc);
+        if(it != s_registry.end()) {
+            s_registry.erase(it);
+        }
+    }
+
     static thread_local Scheduler* t_scheduler = nullptr;
     static thread_local Fiber* t_fiber = nullptr;               // 当前Scheduler的主协程
+    static thread_local int t_queue_index = -1;                 // 当前线程在Scheduler::m_queues中的下标
+
+    /*
+        慢任务的栈(scheduler.slow_task_backtrace，默认关，只在排查问题的时候开)：
+        watchdog用tgkill给跑着慢任务的线程发SIGURG，线程在信号处理函数里backtrace()到自己队列的缓冲区，
+        符号化(要malloc)留给watchdog线程做。SIGURG默认是忽略的，没装处理函数的时候收到也没事
+        代价:
+        - 信号打断的是用户代码，SA_RESTART不会重启nanosleep/usleep、epoll_wait、sem_timedwait、
+          设了超时的socket调用，这些会返回EINTR，慢任务自己卡在usleep里的时候正好被打断
+        - backtrace()不是async-signal-safe的，提前调一次只是把libgcc_s加载掉，
+          线程正好停在动态链接器/unwinder的锁里的时候还是可能死锁
+    */
+    static const int s_trace_signal = SIGURG;
+    static thread_local void** t_trace_frames = nullptr;
+    static thread_local std::atomic<int>* t_trace_size = nullptr;
+
+    static void OnTraceSignal(int sig) {
+        if(t_trace_frames && t_trace_size) {
+            int saved = errno;
+            t_trace_size -> store(::backtrace(t_trace_frames, 64), std::memory_order_release);
+            errno = saved;
+        }
+    }
+
+    static void InstallTraceHandler() {
+        static Mutex s_mutex;
+        static bool s_installed = false;
+        Mutex::Lock lock(s_mutex);
+        if(s_installed) {
+            return;
+        }
+        void* warm[1];
+        ::backtrace(warm, 1);                   // 第一次调会去加载libgcc_s(要malloc)，先在这里调掉，省得在信号处理函数里malloc
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = OnTraceSignal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if(sigaction(s_trace_signal, &sa, nullptr)) {
+            SYLAR_LOG_ERROR(g_logger) << "sigaction errno=" << errno << " " << strerror(errno);
+            return;
+        }
+        s_installed = true;
+    }
+
+    /*
+        FiberAndThread节点池
+        投递任务的线程(比如accept)和执行任务的线程通常不是同一个，节点会从一个线程流到另一个线程
+        所以线程本地缓存多了就成批还给全局池，空了就从全局池成批拿，一批只上一次锁
+    */
+    namespace {
+        struct FreeTaskNode {
+            FreeTaskNode* next;
+        };
+
+        static const size_t s_task_cache_max = 256;             // 线程本地最多缓存多少个节点
+        static const size_t s_task_cache_batch = 128;           // 和全局池一次交换多少个
+        static const size_t s_task_pool_max = 64 * 1024;        // 全局池上限，超过的直接释放
+
+        struct TaskNodeCache {
+            FreeTaskNode* head = nullptr;
+            size_t size = 0;
+
+            ~TaskNodeCache() {
+                while(head) {
+                    FreeTaskNode* next = head -> next;
+                    ::operator delete(head);
+                    head = next;
+                }
+                size = 0;
+            }
+        };
+
+        static Mutex s_task_pool_mutex;
+        static FreeTaskNode* s_task_pool = nullptr;
+        static size_t s_task_pool_size = 0;
+        static thread_local TaskNodeCache t_task_cache;
+    }
 
     /*
         @threads size_t, 线程的数量，默认是1
@@ -17,8 +131,23 @@ namespace sylar {
         @std::string name, scheduler 的名字
     */
     Scheduler::Scheduler(size_t threads, bool use_caller, const std::string name)
-        : m_name(name) {
+        : m_name(name),
+          m_workStealing(g_scheduler_work_stealing -> getValue()),
+          m_latencyStats(g_scheduler_latency_stats -> getValue()),
+          m_slowTaskNs(g_scheduler_slow_task_ms -> getValue() * 1000000ull),
+          m_slowTaskBacktrace(g_scheduler_slow_task_backtrace -> getValue()) {
         SYLAR_ASSERT(threads > 0);                                           // Scheduler管理的线程数量
+        m_taskTiming = m_latencyStats || m_slowTaskNs;
+
+        // 每个线程一个队列，线程数在构造的时候就确定了，之后m_queues不会再变，所以读的时候不用加锁
+        for(size_t i = 0; i < threads; ++ i) {
+            WorkerQueue* q = new WorkerQueue(g_scheduler_local_queue_size -> getValue());
+            if(m_latencyStats) {
+                q -> waitHist = new Histogram;
+                q -> runHist = new Histogram;
+            }
+            m_queues.push_back(q);
+        }
 
         if(use_caller) {                                                     // 如果将call Scheduler的线程放入调度器管理
             // Fiber::ptr test_main =  sylar::Fiber::GetThis();
@@ -36,6 +165,8 @@ namespace sylar {
             t_fiber = m_rootFiber.get();
             m_rootThread = sylar::GetThreadID();
             m_threadIds.push_back(m_rootThread);
+            t_queue_index = 0;                                               // 主线程用第0个队列
+            m_queues[0] -> threadId = m_rootThread;
             // if(test_main == m_rootFiber) {
             //     SYLAR_LOG_INFO(g_logger) << "same Fiber";
             // } else {
@@ -45,11 +176,71 @@ namespace sylar {
             m_rootThread = -1;
         }
         m_threadCount = threads;
+        initAffinity();
+    }
+
+    /*
+        算出每个新建的线程绑哪个cpu，cpu比线程少的时候轮着用
+        use_caller的主线程不是我们建的，不去动它的绑定
+    */
+    void Scheduler::initAffinity() {
+        auto conf = g_scheduler_affinity -> getValue();
+        auto it = conf.find(m_name);
+        if(it == conf.end()) {
+            it = conf.find("*");
+        }
+        if(it == conf.end() || it -> second.empty()) {
+            return;
+        }
+        std::vector<int> cpus;
+        if(it -> second == "auto") {
+            cpus = CpuTopology::Get().getAutoOrder();
+        } else if(!CpuTopology::ParseCpuList(it -> second, cpus)) {
+            SYLAR_LOG_ERROR(g_logger) << "scheduler " << m_name << " invalid affinity \""
+                                      << it -> second << "\"";
+            return;
+        }
+        if(cpus.empty()) {
+            return;
+        }
+        if(cpus.size() < m_threadCount) {
+            SYLAR_LOG_WARN(g_logger) << "scheduler " << m_name << " has " << m_threadCount
+                                     << " threads but only " << cpus.size() << " cpus in affinity";
+        }
+        size_t first = m_rootThread == -1 ? 0 : 1;
+        for(size_t i = 0; i < m_threadCount; ++ i) {
+            m_queues[first + i] -> wantCpu = cpus[i % cpus.size()];
+        }
+    }
+
+    std::vector<Scheduler::WorkerPlacement> Scheduler::getPlacement() const {
+        std::vector<WorkerPlacement> res;
+        for(size_t i = 0; i < m_queues.size(); ++ i) {
+            WorkerPlacement p;
+            p.index = i;
+            p.threadId = m_queues[i] -> threadId;
+            p.cpu = m_queues[i] -> cpu;
+            p.node = m_queues[i] -> node;
+            res.push_back(p);
+        }
+        return res;
     }
     Scheduler::~Scheduler() {
         SYLAR_ASSERT(m_stopping);
+        Unregister(this);
         if(GetThis() == this) {
             t_scheduler = nullptr;
+            t_queue_index = -1;
+        }
+        m_fibers.clear();
+        for(auto& q : m_queues) {
+            while(FiberAndThread* ft = q -> local.pop()) {
+                FreeTask(ft);
+            }
+            q -> pinned.clear();
+            delete q -> waitHist;
+            delete q -> runHist;
+            delete q;
         }
     }
 
@@ -71,12 +262,31 @@ namespace sylar {
                 return;
             }
             m_stopping = false;
+            {
+                Mutex::Lock lock(s_registry_mutex);
+                s_registry.push_back(this);
+            }
             SYLAR_ASSERT(m_threads.empty());
             m_threads.resize(m_threadCount);
-            // 创建线程池
+            // 创建线程池，线程一起来先记下自己的队列下标再进run
             for(size_t i = 0 ; i < m_threadCount; ++ i) {
-                m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i)));
+                int idx = (m_rootThread == -1 ? 0 : 1) + i;
+                // 先绑核再进run，之后这个线程第一次碰的内存(协程栈、本地缓存、分片的fd上下文)都在本地node上
+                m_threads[i].reset(new Thread([this, idx]() {
+                    t_queue_index = idx;
+                    run();
+                }, m_name + "_" + std::to_string(i), m_queues[idx] -> wantCpu));
                 m_threadIds.push_back(m_threads[i]->getId());
+                m_queues[idx] -> threadId = m_threads[i] -> getId();      // run()里也会设，这里先填上，start()返回就能查到
+                m_queues[idx] -> cpu = m_threads[i] -> getCpu();
+                m_queues[idx] -> node = CpuTopology::Get().getNode(m_threads[i] -> getCpu());
+            }
+            if(m_slowTaskNs) {
+                if(m_slowTaskBacktrace) {
+                    InstallTraceHandler();
+                }
+                m_watchdogStop = false;
+                m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_watchdog"));
             }
         //}
             lock.unlock();
@@ -93,6 +303,7 @@ namespace sylar {
     }
     
     void Scheduler::stop() {
+        Unregister(this);                       // 子类(IOManager)的析构第一步就是stop，之后不能再来读它的metrics
         m_autoStop = true;
         // 这里是判断是不是use caller并且只有一个线程？ => 为什么要这么设计？
         // 这里的m_rootFiber是创建Scheduler的线程的协程里面执行Schedlder run的协程
@@ -150,6 +361,11 @@ namespace sylar {
         for(auto& i : thrs) {
             i -> join();
         }   
+        if(m_watchdog) {
+            m_watchdogStop = true;
+            m_watchdog -> join();
+            m_watchdog.reset();
+        }
     }
 
     void Scheduler::setThis() {
@@ -167,7 +383,7 @@ namespace sylar {
     */
     // 新创建的线程直接在run 里面启动
     void Scheduler::run() {
-        SYLAR_LOG_INFO(g_logger) << "stepin to run()";
+        SYLAR_LOG_DEBUG(g_logger) << "stepin to run()";
         set_hook_enable(true);
         setThis();
         if(sylar::GetThreadID() != m_rootThread) {  // 判断运行call方法的是不是当前的主线程，如果不是就要初始化fiber，主线程的初始化fiber在构造函数中完成了
@@ -178,102 +394,640 @@ namespace sylar {
         Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
         Fiber::ptr cb_fiber;                     // 如果是cb，执行这个cb的fiber
 
+        WorkerQueue* self = getWorkerQueue();
+        WorkerCounters* counters = getWorkerCounters();
+        if(self) {
+            self -> threadId = sylar::GetThreadID();
+            counters -> startNs = GetMonotonicNS();
+            t_trace_frames = self -> traceFrames;
+            t_trace_size = &self -> traceSize;
+        }
+
         FiberAndThread ft;
+        static const int POLL_INTERVAL = 64;     // 每跑这么多个任务给子类一次pollEvents的机会
+        int since_poll = 0;
         while(true) {
             ft.reset();                          // 初始化
             bool tickle_me = false;
-            bool is_active = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                auto it = m_fibers.begin();
-                while(it != m_fibers.end()) {   // 检查我们的消息队列
-                    if(it->thread != -1 && it -> thread != GetThreadID()) {  // 如果我们的消息队列里的任务上指定的ID不等于我们当前的ID
-                        ++ it;
-                        tickle_me = true;       // 通知别的线程来领任务
-                        continue;
-                    }
-                    
-                    SYLAR_ASSERT(it -> cb || it -> fiber);
-                    // 如果fiber已经在运行了
-                    if(it -> fiber && it -> fiber -> getState() == Fiber::EXEC) {
-                        ++ it;
-                        continue;
-                    }
-                    ft = *it;                   // 领到任务
-                    m_fibers.erase(it);         // 移出队列
-                    ++m_activeThreadCount;
-                    is_active = true;
-                    break;                      
-                }
+            ++m_activeThreadCount;               // 先占住active，领任务的过程中stopping()不能返回true
+            FiberAndThread* task = nextTask(tickle_me);
+            uint64_t enqueue_ns = 0;
+            if(task) {                           // 领到任务
+                ft.fiber.swap(task -> fiber);
+                ft.cb.swap(task -> cb);
+                ft.thread = task -> thread;
+                enqueue_ns = task -> enqueueNs;
+                FreeTask(task);
             }
 
             if(tickle_me) {
                 tickle();
             }
+            if(task && ++since_poll >= POLL_INTERVAL) {
+                since_poll = 0;
+                pollEvents();
+            }
 
             if(ft.fiber && (ft.fiber -> getState() != Fiber::TERM || ft.fiber -> getState() != Fiber::EXCEPT)) { // 如果队列中是一个fiber
-                ft.fiber -> swapIn();      // 执行Fiber
+                Fiber::State state = runTask(ft.fiber.get(), self, enqueue_ns);  // 执行Fiber
                 --m_activeThreadCount;
+                if(counters) {
+                    WorkerCounters::Add(counters -> tasks);
+                }
 
-                if(ft.fiber -> getState() == Fiber::READY) {    // 说明是被fiber::yieldtoready的，还没做完，只是暂时让出cpu执行，推回队列
+                if(state == Fiber::READY) {    // 说明是被fiber::yieldtoready的，还没做完，只是暂时让出cpu执行，推回队列
                     schedule(ft.fiber);
-                }else if(ft.fiber -> getState() != Fiber::TERM && ft.fiber -> getState() != Fiber::EXCEPT) {
-                    ft.fiber -> setState(Fiber::HOLD);
                 }
 
                 ft.reset();               // 初始化这个ft为了智能指针自动释放
             }else if(ft.cb) {             // 如果是一个回调函数
                 if(cb_fiber) {                 // 如果cb_fiber 已经好了
-                    cb_fiber -> reset(ft.cb);  // 直接使用
+                    cb_fiber -> reset(std::move(ft.cb));  // 直接使用
                 } else {
-                    cb_fiber.reset(new Fiber(ft.cb)); // 初始化并且创建一个新的fiber
+                    cb_fiber.reset(new Fiber(std::move(ft.cb), 0, false, Fiber::SharedStackEnabled())); // 初始化并且创建一个新的fiber
                 }
 
                 ft.reset();
-                cb_fiber -> swapIn();
+                Fiber::State state = runTask(cb_fiber.get(), self, enqueue_ns);
                 --m_activeThreadCount;
-                if(cb_fiber->getState() == Fiber::READY) {
+                if(counters) {
+                    WorkerCounters::Add(counters -> tasks);
+                }
+                if(state == Fiber::READY) {
                     schedule(cb_fiber);
                     cb_fiber.reset();
-                } else if(cb_fiber -> getState() == Fiber::TERM || cb_fiber -> getState() == Fiber::EXCEPT) {
+                } else if(state == Fiber::TERM || state == Fiber::EXCEPT) {
                     cb_fiber->reset(nullptr);
-                } else {
-                    cb_fiber -> setState(Fiber::HOLD);
+                } else {                // HOLD, 已经交给定时器/事件了，不能再碰它
                     cb_fiber.reset();
                 }
             } else {                    // 消息队列中走了一圈没有领到任务, ft没有fiber也没有cb, 那么进入idle协程
-                if(is_active) {
-                    --m_activeThreadCount;
-                    continue;
-                }
+                --m_activeThreadCount;
                 if(idle_fiber->getState() == Fiber::TERM) {     // 如果idle协程已经是term了，说明已经没有任何任务了，
-                    SYLAR_LOG_INFO(g_logger) << "idle fiber term";
+                    SYLAR_LOG_DEBUG(g_logger) << "idle fiber term";
+                    t_trace_frames = nullptr;                   // 队列跟着scheduler析构，之后再来信号不能往里写
+                    t_trace_size = nullptr;
                     // tickle();
                     break;
                     //continue;
                 }
 
+                WorkerQueue* my = self;
+                if(my) {
+                    my -> sleeping = true;
+                }
                 ++m_idleThreadCount;
+                // 先把自己登记成idle再看一眼队列，和enqueue里"先放任务再看idle"配对，
+                // 保证不会出现任务放进来了但是谁都没被叫醒的情况
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if(hasPendingTask(!tickle_me)) {
+                    --m_idleThreadCount;
+                    if(my) {
+                        my -> sleeping = false;
+                    }
+                    continue;
+                }
+                uint64_t idle_begin = 0;
+                if(counters) {
+                    idle_begin = GetMonotonicNS();
+                    counters -> idleSince = idle_begin;
+                }
                 idle_fiber -> swapIn();
+                if(counters) {
+                    counters -> idleSince = 0;
+                    WorkerCounters::Add(counters -> idleNs, GetMonotonicNS() - idle_begin);
+                    WorkerCounters::Add(counters -> idles);
+                }
                 --m_idleThreadCount;
-                if(idle_fiber->getState() != Fiber::TERM && idle_fiber->getState() != Fiber::EXCEPT) {
-                    idle_fiber->setState(Fiber::HOLD);
+                if(my) {
+                    my -> sleeping = false;
                 }
             }
 
         }
     }
     void Scheduler::tickle() {
-        SYLAR_LOG_INFO(g_logger) << "tickle";
+        SYLAR_LOG_DEBUG(g_logger) << "tickle";
     }
     bool Scheduler::stopping() {
+        if(!m_stopping || !m_autoStop || m_activeThreadCount != 0) {
+            return false;
+        }
+        for(auto& q : m_queues) {
+            if(!q -> local.empty() || q -> pinnedCount != 0) {
+                return false;
+            }
+        }
         MutexType::Lock lock(m_mutex);
         return m_stopping && m_autoStop && m_fibers.empty() && m_activeThreadCount == 0;
     }
     void Scheduler::idle() {
-        SYLAR_LOG_INFO(g_logger) << "idle";
+        SYLAR_LOG_DEBUG(g_logger) << "idle";
         while(! stopping()) {
             sylar::Fiber::YieldToHold();
         }
     }
-}
\ No newline at end of file
+
+    Scheduler::WorkerQueue* Scheduler::getWorkerQueue() {
+        if(t_scheduler != this || t_queue_index < 0) {
+            return nullptr;
+        }
+        return m_queues[t_queue_index];
+    }
+
+    Scheduler::WorkerCounters* Scheduler::getWorkerCounters() {
+        int idx = getWorkerIndex();
+        return idx < 0 ? nullptr : &m_queues[idx] -> counters;
+    }
+
+    Scheduler::Metrics Scheduler::getMetrics() {
+        Metrics m;
+        m.name = m_name;
+        m.threads = m_queues.size();
+        m.activeThreads = m_activeThreadCount;
+        m.idleThreads = m_idleThreadCount;
+        m.globalQueued = m_globalCount;
+        m.fibers = Fiber::TotalFibers();
+        m.total.queued = m.globalQueued;
+        uint64_t now = GetMonotonicNS();
+        for(size_t i = 0; i < m_queues.size(); ++ i) {
+            WorkerQueue* q = m_queues[i];
+            WorkerCounters& c = q -> counters;
+            WorkerMetrics w;
+            w.index = i;
+            w.threadId = q -> threadId;
+            w.queued = q -> local.size() + q -> pinnedCount;
+            w.tasks = c.tasks;
+            w.idles = c.idles;
+            w.wakeups = c.wakeups;
+            w.events = c.events;
+            w.timers = c.timers;
+            uint64_t start = c.startNs;
+            uint64_t since = c.idleSince;
+            uint64_t idle = c.idleNs + (since && now > since ? now - since : 0);
+            uint64_t up = start && now > start ? now - start : 0;
+            w.idleUs = idle / 1000;
+            w.busyUs = up > idle ? (up - idle) / 1000 : 0;
+            m.workers.push_back(w);
+
+            m.total.queued += w.queued;
+            m.total.tasks += w.tasks;
+            m.total.busyUs += w.busyUs;
+            m.total.idleUs += w.idleUs;
+            m.total.idles += w.idles;
+            m.total.wakeups += w.wakeups;
+            m.total.events += w.events;
+            m.total.timers += w.timers;
+        }
+        if(m_latencyStats) {
+            Histogram wait, run;
+            getLatency(wait, run);
+            m.queueWait = wait.summarize();
+            m.runSlice = run.summarize();
+        }
+        m.slowTasks = m_slowTasks;
+        collectMetrics(m);
+        return m;
+    }
+
+    bool Scheduler::getLatency(Histogram& wait, Histogram& run) {
+        if(!m_latencyStats) {
+            return false;
+        }
+        for(auto q : m_queues) {
+            wait.merge(*q -> waitHist);
+            run.merge(*q -> runHist);
+        }
+        return true;
+    }
+
+    Fiber::State Scheduler::runTask(Fiber* fiber, WorkerQueue* q, uint64_t enqueue_ns) {
+        if(!m_taskTiming) {                     // 都没开的时候每个任务只有这一个分支
+            return fiber -> swapIn();
+        }
+        uint64_t begin_ns = beginTask(q, enqueue_ns);
+        Fiber::State state = fiber -> swapIn();
+        endTask(q, begin_ns);
+        return state;
+    }
+
+    uint64_t Scheduler::beginTask(WorkerQueue* q, uint64_t enqueue_ns) {
+        uint64_t now = GetMonotonicNS();
+        if(q) {
+            if(q -> waitHist && enqueue_ns) {
+                q -> waitHist -> record(now > enqueue_ns ? now - enqueue_ns : 0);
+            }
+            q -> counters.runningSince.store(now, std::memory_order_relaxed);
+        }
+        return now;
+    }
+
+    void Scheduler::endTask(WorkerQueue* q, uint64_t begin_ns) {
+        if(!q) {
+            return;
+        }
+        q -> counters.runningSince.store(0, std::memory_order_relaxed);
+        if(q -> runHist) {
+            q -> runHist -> record(GetMonotonicNS() - begin_ns);
+        }
+    }
+
+    /*
+        看得比阈值勤一点(阈值的1/4，1ms到100ms之间)，一个任务超时只报一次
+        报的时候任务还在跑，栈就是卡住的地方
+    */
+    void Scheduler::watchdog() {
+        uint64_t interval_us = std::min<uint64_t>(std::max<uint64_t>(m_slowTaskNs / 4000, 1000), 100000);
+        std::vector<uint64_t> reported(m_queues.size(), 0);
+        while(!m_watchdogStop) {
+            usleep(interval_us);
+            uint64_t now = GetMonotonicNS();
+            for(size_t i = 0; i < m_queues.size(); ++ i) {
+                uint64_t since = m_queues[i] -> counters.runningSince.load(std::memory_order_relaxed);
+                if(!since || since == reported[i] || now < since + m_slowTaskNs) {
+                    continue;
+                }
+                reported[i] = since;
+                ++m_slowTasks;
+                reportSlowTask(i, since, now);
+            }
+        }
+    }
+
+    void Scheduler::reportSlowTask(size_t idx, uint64_t since, uint64_t now) {
+        WorkerQueue* q = m_queues[idx];
+        int tid = q -> threadId;
+        std::string bt;
+        q -> traceSize.store(-1, std::memory_order_relaxed);
+        if(m_slowTaskBacktrace && tid > 0 && syscall(SYS_tgkill, getpid(), tid, s_trace_signal) == 0) {
+            for(int i = 0; i < 100 && q -> traceSize.load(std::memory_order_acquire) < 0; ++ i) {
+                usleep(100);
+            }
+            int n = q -> traceSize.load(std::memory_order_acquire);
+            // 抓栈的时候还是同一个任务在跑才算数，前两帧是信号处理函数和内核的trampoline
+            if(n > 2 && q -> counters.runningSince.load(std::memory_order_relaxed) == since) {
+                bt = BacktraceToString(q -> traceFrames, n, 2, "    ");
+            }
+        }
+        SYLAR_LOG_WARN(g_logger) << "scheduler " << m_name << " worker " << idx << " thread " << tid
+                                 << " task running " << (now - since) / 1000000 << "ms > slow_task_ms="
+                                 << m_slowTaskNs / 1000000
+                                 << (!m_slowTaskBacktrace ? "" : bt.empty() ? " (no backtrace, task finished)"
+                                                                            : ", backtrace:\n" + bt);
+    }
+
+    void Scheduler::ForEach(std::function<void(Scheduler*)> cb) {
+        Mutex::Lock lock(s_registry_mutex);
+        for(auto sc : s_registry) {
+            cb(sc);
+        }
+    }
+
+    int Scheduler::getWorkerIndex() {
+        if(t_scheduler != this) {
+            return -1;
+        }
+        return t_queue_index;
+    }
+
+    Scheduler::WorkerQueue* Scheduler::findWorkerQueue(int thread) {
+        for(auto& q : m_queues) {
+            if(q -> threadId == thread) {
+                return q;
+            }
+        }
+        return nullptr;
+    }
+
+    void Scheduler::pushGlobal(FiberAndThread* ft) {
+        MutexType::Lock lock(m_mutex);
+        m_fibers.push_back(ft);
+        ++m_globalCount;
+    }
+
+    bool Scheduler::enqueue(FiberAndThread* ft) {
+        if(m_latencyStats) {
+            ft -> enqueueNs = GetMonotonicNS();
+        }
+        if(!m_workStealing) {                           // 原来的模式，全部走全局队列
+            MutexType::Lock lock(m_mutex);
+            bool need_tickle = m_fibers.empty();        // 检查我们的队列是否为空, 为空我们就通知队列来取
+            m_fibers.push_back(ft);
+            ++m_globalCount;
+            return need_tickle;
+        }
+
+        if(ft -> thread != -1) {                        // 指定了线程，直接放到那个线程的pinned队列
+            WorkerQueue* q = findWorkerQueue(ft -> thread);
+            if(q) {
+                MutexType::Lock lock(q -> mutex);
+                q -> pinned.push_back(ft);
+                ++q -> pinnedCount;
+                return true;                            // 不知道那个线程是不是在睡，直接通知
+            }
+            pushGlobal(ft);                             // 线程还没跑起来，先放全局队列，run里会按线程ID筛选
+            return true;
+        }
+
+        WorkerQueue* q = getWorkerQueue();
+        if(!q || !q -> local.push(ft)) {                // 外部线程或者本地队列满了
+            pushGlobal(ft);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return hasIdleThreads();                        // 有空闲的线程才需要叫醒它来拿/偷
+    }
+
+    size_t Scheduler::enqueue(TaskList& fts) {
+        if(fts.empty()) {
+            return 0;
+        }
+        if(m_latencyStats) {
+            uint64_t now = GetMonotonicNS();
+            for(FiberAndThread* ft = fts.head; ft; ft = ft -> next) {
+                ft -> enqueueNs = now;
+            }
+        }
+        size_t wake = 0;
+        if(!m_workStealing) {
+            MutexType::Lock lock(m_mutex);
+            size_t n = fts.size;
+            m_fibers.append(fts);
+            m_globalCount += n;
+            return n;
+        }
+
+        WorkerQueue* my = getWorkerQueue();
+        std::vector<WorkerQueue*> pinned_queues;        // 这批任务涉及到的pinned队列，每个叫一次
+        size_t local = 0;
+        TaskList global;                                // 放不进本地队列的，最后一次上锁放全局
+        FiberAndThread* ft = fts.head;
+        fts.head = fts.tail = nullptr;
+        fts.size = 0;
+        while(ft) {
+            FiberAndThread* next = ft -> next;
+            ft -> next = nullptr;
+            if(ft -> thread != -1) {
+                WorkerQueue* q = findWorkerQueue(ft -> thread);
+                if(q) {
+                    MutexType::Lock lock(q -> mutex);
+                    q -> pinned.push_back(ft);
+                    ++q -> pinnedCount;
+                    if(std::find(pinned_queues.begin(), pinned_queues.end(), q) == pinned_queues.end()) {
+                        pinned_queues.push_back(q);
+                    }
+                    ft = next;
+                    continue;
+                }
+            } else if(my && my -> local.push(ft)) {
+                ++ local;
+                ft = next;
+                continue;
+            }
+            global.push_back(ft);
+            ft = next;
+        }
+        size_t n = global.size;
+        if(n) {
+            MutexType::Lock lock(m_mutex);
+            m_fibers.append(global);
+            m_globalCount += n;
+        }
+        wake = pinned_queues.size() + n;
+        if(local) {
+            wake += local - 1;                          // 本地队列里的自己会拿一个
+        }
+        return wake;
+    }
+
+    void Scheduler::wake(size_t n) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t idle = m_idleThreadCount;
+        n = std::min(n, idle);
+        for(size_t i = 0; i < n; ++ i) {
+            tickle();
+        }
+    }
+
+    void Scheduler::schedule(TaskBatch& batch) {
+        SYLAR_ASSERT(batch.m_scheduler == this);
+        wake(enqueue(batch.m_tasks));                   // enqueue之后batch里的节点都交给队列了，batch是空的
+    }
+
+    bool Scheduler::hasPendingTask(bool check_global) {
+        if(check_global && m_globalCount > 0) {
+            return true;
+        }
+        WorkerQueue* my = getWorkerQueue();
+        if(my && my -> pinnedCount > 0) {
+            return true;
+        }
+        if(!m_workStealing) {
+            return false;
+        }
+        for(auto& q : m_queues) {
+            if(!q -> local.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // fiber看着还在别的线程上跑的话先跳过去拿别的任务。这只是个省等待的判断，看完之后状态还会变，
+    // 真正保证不会两个线程同时跑一个fiber的是Fiber::swapIn里的m_switching交接
+    bool Scheduler::isRunnable(FiberAndThread* ft) {
+        SYLAR_ASSERT(ft -> cb || ft -> fiber);
+        if(ft -> fiber && ft -> fiber -> getState() == Fiber::EXEC) {
+            return false;
+        }
+        return true;
+    }
+
+    Scheduler::FiberAndThread* Scheduler::nextTask(bool& tickle_me) {
+        WorkerQueue* my = getWorkerQueue();
+        FiberAndThread* ft = nullptr;
+        // 1. 指定给自己的任务
+        if(my && my -> pinnedCount > 0) {
+            MutexType::Lock lock(my -> mutex);
+            FiberAndThread* prev = nullptr;
+            for(FiberAndThread* it = my -> pinned.head; it; prev = it, it = it -> next) {
+                if(isRunnable(it)) {
+                    my -> pinned.erase(prev, it);
+                    --my -> pinnedCount;
+                    return it;
+                }
+            }
+        }
+
+        // 2. 自己的本地队列
+        if(my) {
+            ft = my -> local.pop();
+            if(ft) {
+                if(isRunnable(ft)) {
+                    return ft;
+                }
+                pushGlobal(ft);
+            }
+        }
+
+        // 3. 全局队列
+        if(m_globalCount > 0) {
+            MutexType::Lock lock(m_mutex);
+            FiberAndThread* prev = nullptr;
+            for(FiberAndThread* it = m_fibers.head; it; prev = it, it = it -> next) {   // 检查我们的消息队列
+                if(it -> thread != -1 && it -> thread != GetThreadID()) {  // 如果我们的消息队列里的任务上指定的ID不等于我们当前的ID
+                    tickle_me = true;       // 通知别的线程来领任务
+                    continue;
+                }
+                if(!isRunnable(it)) {       // 如果fiber已经在运行了
+                    continue;
+                }
+                ft = it;                    // 领到任务
+                m_fibers.erase(prev, it);   // 移出队列
+                --m_globalCount;
+                if(m_globalCount > 0) {     // 还有剩下的，再叫一个线程起来帮忙
+                    tickle_me = true;
+                }
+                return ft;
+            }
+        }
+
+        // 4. 去别的线程那里偷
+        if(m_workStealing && !m_queues.empty()) {
+            size_t n = m_queues.size();
+            size_t start = t_queue_index >= 0 ? t_queue_index + 1 : 0;
+            for(size_t i = 0; i < n; ++ i) {
+                WorkerQueue* q = m_queues[(start + i) % n];
+                if(q == my || q -> local.empty()) {
+                    continue;
+                }
+                ft = q -> local.steal();
+                if(ft) {
+                    if(isRunnable(ft)) {
+                        if(!q -> local.empty()) {
+                            tickle_me = true;
+                        }
+                        return ft;
+                    }
+                    pushGlobal(ft);
+                }
+            }
+        }
+
+        // 5. 有指定给别的线程的任务而那个线程在睡，帮忙再叫一次(epoll是共享的，叫醒的不一定是它)
+        for(auto& q : m_queues) {
+            if(q != my && q -> pinnedCount > 0 && q -> sleeping) {
+                tickle_me = true;
+                break;
+            }
+        }
+        return nullptr;
+    }
+
+    void* Scheduler::AllocTask() {
+        TaskNodeCache& cache = t_task_cache;
+        if(!cache.head) {                               // 本地空了，从全局池拿一批
+            Mutex::Lock lock(s_task_pool_mutex);
+            while(s_task_pool && cache.size < s_task_cache_batch) {
+                FreeTaskNode* node = s_task_pool;
+                s_task_pool = node -> next;
+                --s_task_pool_size;
+                node -> next = cache.head;
+                cache.head = node;
+                ++cache.size;
+            }
+        }
+        if(cache.head) {
+            FreeTaskNode* node = cache.head;
+            cache.head = node -> next;
+            --cache.size;
+            return node;
+        }
+        static_assert(sizeof(FiberAndThread) >= sizeof(FreeTaskNode), "FiberAndThread too small");
+        return ::operator new(sizeof(FiberAndThread));
+    }
+
+    void Scheduler::FreeTask(FiberAndThread* ft) {
+        ft -> ~FiberAndThread();
+        TaskNodeCache& cache = t_task_cache;
+        FreeTaskNode* node = reinterpret_cast<FreeTaskNode*>(ft);
+        node -> next = cache.head;
+        cache.head = node;
+        ++cache.size;
+        if(cache.size < s_task_cache_max) {
+            return;
+        }
+
+        // 本地缓存满了，拆一批还给全局池
+        FreeTaskNode* first = cache.head;
+        FreeTaskNode* last = first;
+        for(size_t i = 1; i < s_task_cache_batch; ++ i) {
+            last = last -> next;
+        }
+        cache.head = last -> next;
+        cache.size -= s_task_cache_batch;
+        {
+            Mutex::Lock lock(s_task_pool_mutex);
+            if(s_task_pool_size < s_task_pool_max) {
+                last -> next = s_task_pool;
+                s_task_pool = first;
+                s_task_pool_size += s_task_cache_batch;
+                return;
+            }
+        }
+        last -> next = nullptr;
+        while(first) {
+            FreeTaskNode* next = first -> next;
+            ::operator delete(first);
+            first = next;
+        }
+    }
+
+    void Scheduler::TaskList::push_back(FiberAndThread* ft) {
+        ft -> next = nullptr;
+        if(tail) {
+            tail -> next = ft;
+        } else {
+            head = ft;
+        }
+        tail = ft;
+        ++size;
+    }
+
+    void Scheduler::TaskList::append(TaskList& o) {
+        if(o.empty()) {
+            return;
+        }
+        if(tail) {
+            tail -> next = o.head;
+        } else {
+            head = o.head;
+        }
+        tail = o.tail;
+        size += o.size;
+        o.head = o.tail = nullptr;
+        o.size = 0;
+    }
+
+    void Scheduler::TaskList::erase(FiberAndThread* prev, FiberAndThread* cur) {
+        if(prev) {
+            prev -> next = cur -> next;
+        } else {
+            head = cur -> next;
+        }
+        if(tail == cur) {
+            tail = prev;
+        }
+        cur -> next = nullptr;
+        --size;
+    }
+
+    void Scheduler::TaskList::clear() {
+        while(head) {
+            FiberAndThread* next = head -> next;
+            FreeTask(head);
+            head = next;
+        }
+        tail = nullptr;
+        size = 0;
+    }
+}
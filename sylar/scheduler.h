@@ -4,8 +4,12 @@
 #include <memory>
 #include "thread.h"
 #include "fiber.h"
+#include "task.h"
+#include "work_stealing_queue.h"
+#include "histogram.h"
 #include <vector>
 #include <list>
+#include "noncopyable.h"
 
 namespace sylar {
     /*
@@ -19,6 +23,21 @@ namespace sylar {
     public:
         typedef std::shared_ptr<Scheduler> ptr;
         typedef Mutex MutexType;
+    private:
+        struct FiberAndThread;
+        // 侵入式单链表，节点就是FiberAndThread本身(用它的next)，进出队列不用再分配链表节点
+        struct TaskList {
+            FiberAndThread* head = nullptr;
+            FiberAndThread* tail = nullptr;
+            size_t size = 0;
+
+            bool empty() const { return head == nullptr;}
+            void push_back(FiberAndThread* ft);
+            void append(TaskList& o);                                  // 把o整个接到后面，o被清空
+            void erase(FiberAndThread* prev, FiberAndThread* cur);     // 摘掉cur，prev是它前面一个，cur是头的时候传nullptr
+            void clear();                                              // 释放所有节点
+        };
+    public:
 
         /*
             @threads size_t, 线程的数量，默认是1
@@ -36,68 +55,219 @@ namespace sylar {
         void start();
         void stop();
 
+        /*
+            @fc 协程或者回调
+            @thread 指定在哪个线程(线程ID)上执行, -1表示任意线程
+            work stealing模式下:
+                - 指定了线程的任务直接放进该线程自己的pinned队列，别的线程不会拿走
+                - 本scheduler的工作线程自己产生的任务放进自己的无锁队列，空闲的线程会来偷
+                - 外部线程提交的任务或者本地队列满了的放进全局队列
+        */
         template<class FiberOrCb>
         void schedule(FiberOrCb fc, int thread = -1) {
-            bool need_tickle = false; 
-            {
-                MutexType::Lock lock(m_mutex);
-                need_tickle = scheduleNotLock(fc, thread);
+            FiberAndThread* ft = NewTask(std::move(fc), thread);
+            if(!ft) {
+                return;
             }
-
-            if(need_tickle) {
+            if(enqueue(ft)) {
                 tickle();
             }
-            
         }
 
-        // 批量方法，这样只要上一次锁就好了，减少context Switch的开销, 并且一次上锁后可以保证这些连续的任务都是按照我们的input的顺序去执行的
-        template<class InputIterator>
-        void schedule(InputIterator begin, InputIterator end) {
-            bool need_tickle = false;
-            {
-                MutexType::Lock lock(m_mutex);
-                while(begin != end) {
-                    need_tickle = scheduleNotLock(&*begin, -1) || need_tickle;
-                    ++ begin;
+        /*
+            批量提交的任务集合，攒好之后一次schedule(batch)提交:
+            全局队列只上一次锁，并且只叫醒这批任务喂得饱的线程数
+            IOManager::idle 就是把一次epoll_wait的结果(定时器+就绪的fd)攒成一个batch提交
+        */
+        class TaskBatch : Noncopyable {
+        public:
+            TaskBatch(Scheduler* scheduler)
+                : m_scheduler(scheduler) {
+            }
+
+            ~TaskBatch() {
+                clear();
+            }
+
+            // 和schedule一样，传指针的版本会把fiber/cb swap走
+            template<class FiberOrCb>
+            void add(FiberOrCb fc, int thread = -1) {
+                FiberAndThread* ft = NewTask(std::move(fc), thread);
+                if(ft) {
+                    m_tasks.push_back(ft);
                 }
             }
-            if(need_tickle) {
-                tickle();
+
+            void clear() { m_tasks.clear();}
+
+            Scheduler* getScheduler() const { return m_scheduler;}
+            size_t size() const { return m_tasks.size;}
+            bool empty() const { return m_tasks.empty();}
+        private:
+            friend class Scheduler;
+            Scheduler* m_scheduler;
+            TaskList m_tasks;
+        };
+
+        // 提交一批任务，提交之后batch被清空，可以接着复用
+        void schedule(TaskBatch& batch);
+
+        // 批量方法，攒成一个TaskBatch提交，这样只要上一次锁就好了，减少context Switch的开销
+        template<class InputIterator>
+        void schedule(InputIterator begin, InputIterator end) {
+            TaskBatch batch(this);
+            while(begin != end) {
+                batch.add(&*begin, -1);
+                ++ begin;
             }
+            schedule(batch);
         }
 
+        bool isWorkStealing() const { return m_workStealing; }
+
+        // 每个worker实际绑到的cpu和node，没绑(没配scheduler.affinity、绑失败、use_caller的主线程)的是-1
+        struct WorkerPlacement {
+            int index = -1;                         // 和getWorkerIndex()一致
+            int threadId = -1;
+            int cpu = -1;
+            int node = -1;
+        };
+        std::vector<WorkerPlacement> getPlacement() const;
+
+        // 一个工作线程的运行情况，下标和getWorkerIndex()一致
+        struct WorkerMetrics {
+            int index = -1;
+            int threadId = -1;
+            size_t queued = 0;                      // 本地队列 + 指定给它的任务
+            uint64_t tasks = 0;                     // 跑过的任务(协程或者回调)
+            uint64_t busyUs = 0;                    // 线程进run()之后不在idle里的时间
+            uint64_t idleUs = 0;                    // 在idle里的时间(包括正在idle的这一段)
+            uint64_t idles = 0;                     // 进idle的次数
+            // 下面是IOManager的，普通Scheduler是0
+            uint64_t wakeups = 0;                   // epoll_wait/io_uring的等待返回的次数
+            uint64_t events = 0;                    // 触发的读写事件和io_uring完成的读写
+            uint64_t timers = 0;                    // 跑过的到期定时器
+        };
+
+        struct Metrics {
+            std::string name;
+            size_t threads = 0;
+            size_t activeThreads = 0;
+            size_t idleThreads = 0;
+            size_t globalQueued = 0;                // 全局队列里的任务
+            uint64_t fibers = 0;                    // 整个进程活着的协程(Fiber::TotalFibers)
+            // 下面是IOManager的
+            size_t pendingEvents = 0;               // 注册了还没触发的事件(包括io_uring上进行中的读写)
+            size_t timers = 0;                      // 还会触发的定时器
+            uint64_t tickles = 0;
+            uint64_t ticklesSuppressed = 0;
+            uint64_t epollCtls = 0;
+            // 下面两个开了scheduler.latency_stats才有，单位ns
+            Histogram::Summary queueWait;           // 任务从放进队列(schedule/事件触发)到开始跑
+            Histogram::Summary runSlice;            // 任务一次swapIn跑了多久(到结束或者让出)
+            uint64_t slowTasks = 0;                 // watchdog发现的超过scheduler.slow_task_ms的次数
+            std::vector<WorkerMetrics> workers;
+            WorkerMetrics total;                    // workers加起来，queued再加上全局队列
+        };
+
+        /*
+            现场汇总，计数平时只有各个线程自己写自己的那块(没有共享的原子加)，读的时候不加锁，
+            各项之间不是同一时刻的快照，做容量规划、看趋势够用
+        */
+        Metrics getMetrics();
+        // 所有start()了还没stop()的scheduler，在锁里调cb，cb里不要start/stop scheduler
+        static void ForEach(std::function<void(Scheduler*)> cb);
+
+        // 把各个线程的直方图合到wait/run上，没开scheduler.latency_stats的时候什么都不加，返回false
+        bool getLatency(Histogram& wait, Histogram& run);
+
     protected:
+        // 每个工作线程一块计数，只有这个线程自己写(读了再写回去，不用带lock前缀的原子加)，getMetrics()的时候别的线程读
+        struct WorkerCounters {
+            char pad[64];                                   // 和WorkerQueue前面别的线程也会写的字段隔开，不在一个cache line上
+            std::atomic<uint64_t> tasks = {0};
+            std::atomic<uint64_t> idleNs = {0};
+            std::atomic<uint64_t> idles = {0};
+            std::atomic<uint64_t> wakeups = {0};
+            std::atomic<uint64_t> events = {0};
+            std::atomic<uint64_t> timers = {0};
+            std::atomic<uint64_t> startNs = {0};            // 线程进run()的时间
+            std::atomic<uint64_t> idleSince = {0};          // 正在idle里的话是进去的时间，不然是0
+            std::atomic<uint64_t> runningSince = {0};       // 正在跑的任务是什么时候开始的，不在跑任务是0(只在开了计时的时候维护)
+
+            static void Add(std::atomic<uint64_t>& c, uint64_t n = 1) {
+                c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+        };
+        WorkerCounters* getWorkerCounters();                // 当前线程的那块，不是本scheduler的线程返回nullptr
+        virtual void collectMetrics(Metrics& m) {}          // 子类补上自己的那部分
+
         virtual void tickle();      // 唤醒线程，类似型号量
         void run();
         virtual bool stopping();
         virtual void idle();        // idle，就算没有任务也可以keep住协程/线程，可以让他一直占着CPU，也可以时不时sleep下让出CPU时间，具体通过实现的子类来做
 
         void setThis();
+        virtual void pollEvents() {}    // 连着跑了一批任务之后调一下，子类可以不睡觉顺便收一下事件(分片的IOManager用)
 
         bool hasIdleThreads() { return m_idleThreadCount > 0; }
+        bool hasPendingTask(bool check_global);     // 进idle之前再确认一次有没有活，子类在idle里忙等的时候也用
+
+        // 子类按工作线程区分资源的时候用，下标和m_queues一致(use_caller的主线程是0)
+        int getWorkerIndex();                   // 当前线程的下标，不是本scheduler的线程返回-1
+        size_t getWorkerCount() const { return m_queues.size();}
+        bool isWorkerSleeping(size_t idx) const { return m_queues[idx] -> sleeping;}
+        bool hasPinnedTask(size_t idx) const { return m_queues[idx] -> pinnedCount > 0;}
         
     private:
+        struct WorkerQueue;
+        /*
+            把任务放进合适的队列，返回是否需要tickle
+            假如目前有线程空闲并且等待唤醒, 我们就通知线程消息队里有东西了，要来取
+        */
+        bool enqueue(FiberAndThread* ft);
+        size_t enqueue(TaskList& fts);                       // 返回值是这批任务需要叫醒几个线程
+        void wake(size_t n);                                 // 最多叫醒n个空闲的线程
+        void pushGlobal(FiberAndThread* ft);
+        WorkerQueue* getWorkerQueue();              // 当前线程自己的队列，不是本scheduler的线程返回nullptr
+        WorkerQueue* findWorkerQueue(int thread);   // 根据线程ID找队列
+        FiberAndThread* nextTask(bool& tickle_me);  // 按 pinned -> 本地 -> 全局 -> 偷 的顺序领任务
+        bool isRunnable(FiberAndThread* ft);
+        void initAffinity();                        // 按scheduler.affinity给每个新建的线程分cpu
+        Fiber::State runTask(Fiber* fiber, WorkerQueue* q, uint64_t enqueue_ns);   // swapIn，开了计时的话前后记时间
+        uint64_t beginTask(WorkerQueue* q, uint64_t enqueue_ns);
+        void endTask(WorkerQueue* q, uint64_t begin_ns);
+        void watchdog();                            // 盯着各个线程，任务跑太久的打出它的栈
+        void reportSlowTask(size_t idx, uint64_t since, uint64_t now);
+
         /*
-            无锁方法，假如目前所有线程空闲并且等待唤醒
-            我们就可以用这个方法通知所有线程消息队里有东西了，要来取
+            FiberAndThread节点的分配/释放，走线程本地的空闲链表，稳定之后调度一个任务不用malloc
+            NewTask构造出来既没有fiber也没有cb的话直接回收，返回nullptr
         */
+        static void* AllocTask();
+        static void FreeTask(FiberAndThread* ft);
         template<class FiberOrCb>
-        bool scheduleNotLock(FiberOrCb fc, int thread) {
-            bool need_tickle = m_fibers.empty();        // 检查我们的队列是否为空
-            FiberAndThread ft(fc, thread);              
-            if(ft.cb || ft.fiber) {                     // 有需要做的东西就放进队里
-                m_fibers.push_back(ft);
+        static FiberAndThread* NewTask(FiberOrCb&& fc, int thread) {
+            FiberAndThread* ft = new (AllocTask()) FiberAndThread(std::forward<FiberOrCb>(fc), thread);
+            if(!ft -> cb && !ft -> fiber) {
+                FreeTask(ft);
+                return nullptr;
+            }
+            if(ft -> fiber && ft -> fiber -> getBoundThread() != -1) {
+                ft -> thread = ft -> fiber -> getBoundThread();   // 共享栈协程只能回到原来的线程
             }
-            return need_tickle;                         // 如果为空我们就通知队列来取
+            return ft;
         }
     private:
         struct FiberAndThread {
             Fiber::ptr fiber;
-            std::function<void()> cb;
+            Task cb;
             int thread;                // 这个thread是thread_id, 用来表示在哪个线程上跑
+            FiberAndThread* next = nullptr;     // TaskList用的侵入式链表指针
+            uint64_t enqueueNs = 0;             // 放进队列的时间，开了scheduler.latency_stats才填
 
             FiberAndThread(Fiber::ptr f, int thr) 
-                : fiber(f), thread(thr) {
+                : fiber(std::move(f)), thread(thr) {
 
             }
 
@@ -106,14 +276,19 @@ namespace sylar {
                 fiber.swap(*f);         // 该构造函数是用来传入智能指针的构造函数，本质是不推荐这么做，因为智能指针应该让外部管理，不过先写了这个方法，不一定启用.. 要swap也是为了把f的引用放到fiber里，不影响智能指针的计数器
             }
 
-            FiberAndThread(std::function<void()> f, int thr) 
-                : cb(f), thread(thr) {
+            FiberAndThread(std::function<void()>* f, int thr) 
+                : cb(std::move(*f)), thread(thr) {
+                *f = nullptr;           // 同上，拿走f里的东西
+            }
 
+            FiberAndThread(Task* f, int thr) 
+                : cb(std::move(*f)), thread(thr) {
             }
 
-            FiberAndThread(std::function<void()>* f, int thr) 
-                : thread(thr) {
-                cb.swap(*f);            // 同上
+            // lambda/bind/函数指针/std::function之类的，直接move进Task里
+            template<class F>
+            FiberAndThread(F&& f, int thr) 
+                : cb(std::forward<F>(f)), thread(thr) {
             }
 
             // 默认构造函数，没有默认构造函数放入STL的容器里会出现初始化失败的问题
@@ -127,12 +302,44 @@ namespace sylar {
                 thread = -1;
             }
         };
+
+        // 每个工作线程一份的队列
+        struct WorkerQueue {
+            WorkerQueue(size_t capacity)
+                : local(capacity) {
+            }
+
+            WorkStealingQueue<FiberAndThread> local;     // 本线程产生的任务，无锁，其他线程可以偷
+            MutexType mutex;
+            TaskList pinned;                             // 指定在本线程执行的任务，只有本线程会取
+            std::atomic<size_t> pinnedCount = {0};       // pinned的数量，为0就不用上锁去看了
+            std::atomic<int> threadId = {-1};            // 队列所属的线程ID，线程跑起来的时候设置
+            std::atomic<bool> sleeping = {false};        // 是否在idle里睡着，别人发现有指定给它的任务时要帮忙叫醒
+            int wantCpu = -1;                            // 配置要绑的cpu，线程起来之前定好
+            int cpu = -1;                                // 实际绑上的cpu和它的node，start()里填
+            int node = -1;
+            WorkerCounters counters;
+            Histogram* waitHist = nullptr;               // 开了scheduler.latency_stats才有，只有本线程写
+            Histogram* runHist = nullptr;
+            void* traceFrames[64];                       // watchdog叫这个线程在信号处理函数里抓的栈(开了slow_task_backtrace)
+            std::atomic<int> traceSize = {-1};           // 抓好之前是-1
+        };
     private:
         MutexType m_mutex;
         std::vector<Thread::ptr> m_threads;       // 线程存放, 管理受Scheduler管理的线程
-        std::list<FiberAndThread> m_fibers;       // 协程管理清单, 保存即将执行的协程、方法清单, 是一种消息队列.
+        TaskList m_fibers;                        // 全局队列, 外部线程提交的任务、本地队列放不下的任务, 是一种消息队列.
         std::string m_name;                       // scheduler 的名字
         Fiber::ptr m_rootFiber;                   // 主协程调度器
+        std::atomic<size_t> m_globalCount = {0};  // 全局队列的长度，为0就不用上锁去看了
+        std::vector<WorkerQueue*> m_queues;       // 每个工作线程的队列，下标0是use_caller的主线程(如果有)
+        bool m_workStealing = true;               // false则所有任务都走全局队列(原来的模式)
+        bool m_latencyStats = false;              // 记录排队时间和运行时间的直方图
+        uint64_t m_slowTaskNs = 0;                // 一个任务占着线程超过这么久就打日志，0不检查
+        bool m_slowTaskBacktrace = false;         // 打日志的时候发信号抓它的栈，会让被打断的系统调用返回EINTR
+        bool m_taskTiming = false;                // latency_stats和slow_task_ms有一个开了，runTask()里只看这一个
+        Thread::ptr m_watchdog;
+        std::atomic<bool> m_watchdogStop = {false};
+        std::atomic<uint64_t> m_slowTasks = {0};
     protected:
         std::vector<int> m_threadIds;             // 管理线程ID，之后可以通过hash的方法去把需求的任务放到一个存在的线程上执行
         size_t m_threadCount = 0;
@@ -110,33 +110,81 @@ namespace sylar {
     }
 
     Socket::ptr Socket::accept() {
-        Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
-        int newsock = ::accept(m_sock, nullptr, nullptr);           // 用的全局的accept
+        int newsock = ::accept4(m_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);    // hook过的accept4
         if(newsock == -1) {
             SYLAR_LOG_ERROR(g_logger) << "accept(" << m_sock << ") errno = "
                                       << errno << " errstr = " << strerror(errno);
             return nullptr; 
         }
+        Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
         if(sock -> init(newsock)) {
             return sock;
         }
+        ::close(newsock);
         return nullptr;
     }
 
-    bool Socket::init(int sock) {
+    size_t Socket::acceptBatch(std::vector<Socket::ptr>& socks, size_t max, const AcceptTemplate* tmpl) {
+        int newsock = ::accept4(m_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(newsock == -1) {
+            return 0;
+        }
+        // 阻塞的监听socket接着accept会卡住线程
+        FdCtx::ptr ctx = FdMgr::GetInstance() -> get(m_sock);
+        bool more = is_hook_enable() && ctx && ctx -> getSysNonblock() && !ctx -> getUserNonblock();
+        IOManager* iom = IOManager::GetThis();
+        size_t n = 0;
+        while(true) {
+            Socket::ptr sock(new Socket(m_family, m_type, m_protocol));
+            if(sock -> init(newsock, tmpl)) {
+                socks.push_back(sock);
+                ++n;
+            } else {
+                ::close(newsock);
+            }
+            if(!more || n >= max) {
+                break;
+            }
+            // 后面的不挂起，直接调原始的accept4，hook里做的登记在这里做
+            newsock = accept4_f(m_sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if(newsock == -1) {
+                if(errno != EAGAIN) {
+                    SYLAR_LOG_ERROR(g_logger) << "accept4(" << m_sock << ") errno = "
+                                              << errno << " errstr = " << strerror(errno);
+                }
+                break;
+            }
+            FdMgr::GetInstance() -> get(newsock, true, true);
+            if(iom) {
+                iom -> onFdCreated(newsock);
+            }
+        }
+        return n;
+    }
+
+    // 只给accept出来的连接用，选项从监听socket继承，地址用到的时候再取
+    bool Socket::init(int sock, const AcceptTemplate* tmpl) {
         FdCtx::ptr ctx = FdMgr::GetInstance() -> get(sock);
         if(ctx && ctx -> isSocket() && !ctx -> isClose()) {
             m_sock = sock;
             m_isConnected = true;
-            initSock();
-            getLocalAddress();
-            getRemoteAddress();
+            if(tmpl) {
+                if(tmpl -> recvTimeout != -1) {
+                    ctx -> setTimeout(SO_RCVTIMEO, tmpl -> recvTimeout);
+                }
+                if(tmpl -> sendTimeout != -1) {
+                    ctx -> setTimeout(SO_SNDTIMEO, tmpl -> sendTimeout);
+                }
+                for(auto& i : tmpl -> options) {
+                    setOption(i.level, i.name, i.value);
+                }
+            }
             return true;
         }
         return false;
     }   
 
-    bool Socket::bind(const Address::ptr addr) {
+    bool Socket::bind(const Address::ptr addr, bool reuse_port) {
         if(! isValid()) {
             newSock();
             if(SYLAR_UNLICKLY(! isValid())) {
@@ -144,6 +192,10 @@ namespace sylar {
             }
         }
 
+        if(reuse_port && !setOption(SOL_SOCKET, SO_REUSEPORT, (int)1)) {
+            return false;
+        }
+
         if(SYLAR_UNLICKLY(addr->getFamily() != m_family)) {
             SYLAR_LOG_ERROR(g_logger) << "bind sock.family(" << m_family 
                                       << ") addr.family(" << addr -> getFamily() 
@@ -2,6 +2,7 @@
 #define __SYLAR_SOCKET_H__
 
 #include <memory>
+#include <vector>
 #include "address.h"
 #include "noncopyable.h"
 
@@ -57,10 +58,37 @@ namespace sylar {
             return setOption(level, option, &value, sizeof(T));
         }
 
+        /*
+            accept出来的连接统一的设置，开始accept之前算好，每个连接照着抄
+            - 收发超时直接写进FdCtx(hook只看这里)，不用每个连接调一次setsockopt
+            - options是真要setsockopt的；TCP_NODELAY、SO_KEEPALIVE这些会从监听socket继承，设在监听socket上就行
+        */
+        struct AcceptTemplate {
+            struct Option {
+                int level;
+                int name;
+                int value;
+            };
+            int64_t recvTimeout = -1;
+            int64_t sendTimeout = -1;
+            std::vector<Option> options;
+        };
+
+        /*
+            accept4(SOCK_NONBLOCK|SOCK_CLOEXEC)，新连接不用fstat/fcntl，也不再设TCP_NODELAY(从监听socket继承)
+            本地/对端地址等getLocalAddress/getRemoteAddress第一次调的时候再取
+        */
         Socket::ptr accept();
+        /*
+            一次就绪把backlog里的连接取干净: 第一个和accept一样会挂起等，之后不挂起一直取到EAGAIN或者够max个
+            取到的连接追加到socks后面，返回这次取到几个，出错(包括被cancel)一个都没取到返回0
+            出错不打日志，errno留给调用方看(停服务的时候监听socket被shutdown掉，accept返回EINVAL是正常的)
+            监听socket不是hook管着的非阻塞socket的时候只取一个
+        */
+        size_t acceptBatch(std::vector<Socket::ptr>& socks, size_t max, const AcceptTemplate* tmpl = nullptr);
 
         
-        bool bind(const Address::ptr addr);
+        bool bind(const Address::ptr addr, bool reuse_port = false);     // reuse_port在bind之前设SO_REUSEPORT
         bool connect(const Address::ptr addr, uint64_t timeout_ms = -1);
         bool listen(int backlog = SOMAXCONN);
         bool close();
@@ -100,7 +128,7 @@ namespace sylar {
     private:
         void initSock();
         void newSock();
-        bool init(int sock);
+        bool init(int sock, const AcceptTemplate* tmpl = nullptr);
 
     private:           
         int m_sock;
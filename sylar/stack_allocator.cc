@@ -0,0 +1,250 @@
+#include "stack_allocator.h"
+#include "config.h"
+#include "log.h"
+#include "macro.h"
+#include "topology.h"
+#include "thread.h"
+#include <atomic>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace sylar {
+
+    static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static ConfigVar<uint32_t>::ptr g_stack_pool_size =
+        Config::Lookup<uint32_t>("fiber.stack_pool_size", 64, "fiber stack cache size per thread");
+    static ConfigVar<bool>::ptr g_stack_trim =
+        Config::Lookup<bool>("fiber.stack_trim", true, "madvise cached fiber stacks so the kernel can reclaim them");
+    static ConfigVar<uint32_t>::ptr g_stack_hot_count =
+        Config::Lookup<uint32_t>("fiber.stack_hot_count", 16, "most recently freed fiber stacks per thread that are not trimmed");
+
+    /*
+        计数每个线程一份，只有自己写(读了再写回去，不用带lock前缀的原子加)，Get*()的时候加锁把所有线程的加起来
+        栈可能在别的线程上还回来，所以单个线程的cached/mapped会减成"负数"，按uint64回绕加起来总数是对的
+        线程退出的时候把自己的数并到s_stack_retired里再摘掉
+    */
+    struct StackCounters {
+        std::atomic<uint64_t> hits = {0};
+        std::atomic<uint64_t> misses = {0};
+        std::atomic<uint64_t> cached = {0};
+        std::atomic<uint64_t> mapped = {0};
+        StackCounters* next = nullptr;
+
+        StackCounters() {}                      // s_stack_retired用，不挂链表
+        StackCounters(bool registered);         // 线程本地的，挂到s_stack_counters上
+        ~StackCounters();
+    };
+
+    typedef std::atomic<uint64_t> StackCounters::*StackCounter;
+
+    static StackCounters s_stack_retired;               // 退出了的线程的数，常量初始化
+    static StackCounters* s_stack_counters = nullptr;
+
+    static Mutex& StackCountersMutex() {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    static thread_local StackCounters t_stack_counters(true);
+    // 和t_stack_cache_gone一样，计数析构之后还有来还栈的直接加到s_stack_retired上
+    static thread_local bool t_stack_counters_gone = false;
+
+    StackCounters::StackCounters(bool registered) {
+        Mutex::Lock lock(StackCountersMutex());
+        next = s_stack_counters;
+        s_stack_counters = this;
+    }
+
+    StackCounters::~StackCounters() {
+        if(this == &s_stack_retired) {
+            return;
+        }
+        Mutex::Lock lock(StackCountersMutex());
+        s_stack_retired.hits += hits;
+        s_stack_retired.misses += misses;
+        s_stack_retired.cached += cached;
+        s_stack_retired.mapped += mapped;
+        for(StackCounters** p = &s_stack_counters; *p; p = &(*p) -> next) {
+            if(*p == this) {
+                *p = next;
+                break;
+            }
+        }
+        t_stack_counters_gone = true;
+    }
+
+    static void AddStackCounter(StackCounter c, uint64_t n = 1) {
+        if(t_stack_counters_gone) {
+            (s_stack_retired.*c).fetch_add(n, std::memory_order_relaxed);
+            return;
+        }
+        std::atomic<uint64_t>& v = t_stack_counters.*c;
+        v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static uint64_t SumStackCounter(StackCounter c) {
+        Mutex::Lock lock(StackCountersMutex());
+        uint64_t sum = (s_stack_retired.*c).load(std::memory_order_relaxed);
+        for(StackCounters* i = s_stack_counters; i; i = i -> next) {
+            sum += (i ->* c).load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    static size_t GetPageSize() {
+        static size_t s_page_size = sysconf(_SC_PAGESIZE);
+        return s_page_size;
+    }
+
+    static size_t RoundUpToPage(size_t size) {
+        size_t page = GetPageSize();
+        return (size + page - 1) / page * page;
+    }
+
+    // 真正的mmap/munmap, 返回的是guard page之上可用的地址
+    static void* MapStack(size_t size) {
+        size_t guard = GetPageSize();
+        void* base = mmap(nullptr, size + guard, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(base == MAP_FAILED) {
+            SYLAR_LOG_ERROR(g_logger) << "mmap fiber stack size=" << size
+                                      << " errno=" << errno << " errstr=" << strerror(errno);
+            SYLAR_ASSERT2(false, "mmap fiber stack");
+        }
+        // 绑过核的线程建的栈从它自己的node上分，协程被偷到别的node上跑的时候栈也不跟着去那边缺页
+        CpuTopology::BindMemory(base, size + guard, CpuTopology::GetThreadNode());
+        // 栈是往低地址长的，所以guard page放在最低的一页
+        if(mprotect(base, guard, PROT_NONE)) {
+            SYLAR_LOG_ERROR(g_logger) << "mprotect guard page errno=" << errno
+                                      << " errstr=" << strerror(errno);
+        }
+        AddStackCounter(&StackCounters::mapped);
+        return (char*)base + guard;
+    }
+
+    static void UnmapStack(void* vp, size_t size) {
+        size_t guard = GetPageSize();
+        munmap((char*)vp - guard, size + guard);
+        AddStackCounter(&StackCounters::mapped, -1);
+    }
+
+    static void TrimStack(void* vp, size_t size) {
+    #ifdef MADV_FREE
+        if(madvise(vp, size, MADV_FREE) == 0) {
+            return;
+        }
+    #endif
+        madvise(vp, size, MADV_DONTNEED);                   // 老内核不支持MADV_FREE
+    }
+
+    /*
+        线程本地的空闲栈，按大小分组，一般全是fiber.stack_size一种大小
+        每组是个栈(后进先出)，最上面fiber.stack_hot_count个是热的，不madvise，马上又要用，
+        省得每个协程退出都来一次系统调用+TLB shootdown，再用的时候还要缺页
+        掉到热区下面的才trim，trimmed以下的都trim过了，每个栈放进来之后最多trim一次
+    */
+    struct StackCache {
+        struct Bucket {
+            size_t size;
+            size_t trimmed = 0;                 // stacks[0, trimmed)已经madvise过
+            std::vector<void*> stacks;
+        };
+
+        std::vector<Bucket> buckets;
+        size_t count = 0;
+
+        Bucket& getBucket(size_t size) {
+            for(auto& b : buckets) {
+                if(b.size == size) {
+                    return b;
+                }
+            }
+            buckets.push_back(Bucket());
+            buckets.back().size = size;
+            return buckets.back();
+        }
+
+        ~StackCache();
+    };
+
+    static thread_local StackCache t_stack_cache;
+    // 线程退出的时候thread_local的析构顺序不一定，缓存析构之后还有来还栈的(比如Fiber里线程本地的共享栈)直接munmap
+    static thread_local bool t_stack_cache_gone = false;
+
+    StackCache::~StackCache() {
+        for(auto& b : buckets) {
+            for(auto& s : b.stacks) {
+                UnmapStack(s, b.size);
+            }
+            AddStackCounter(&StackCounters::cached, -(uint64_t)b.stacks.size());
+        }
+        buckets.clear();
+        count = 0;
+        t_stack_cache_gone = true;
+    }
+
+    void* MallocStackAllocator::Alloc(size_t size) {
+        return malloc(size);
+    }
+
+    void MallocStackAllocator::Dealloc(void* vp, size_t size) {
+        free(vp);
+    }
+
+    void* MmapStackAllocator::Alloc(size_t size) {
+        size = RoundUpToPage(size);
+        StackCache::Bucket& b = t_stack_cache.getBucket(size);
+        if(!b.stacks.empty()) {
+            void* vp = b.stacks.back();
+            b.stacks.pop_back();
+            if(b.trimmed > b.stacks.size()) {
+                b.trimmed = b.stacks.size();
+            }
+            --t_stack_cache.count;
+            AddStackCounter(&StackCounters::cached, -1);
+            AddStackCounter(&StackCounters::hits);
+            return vp;
+        }
+        AddStackCounter(&StackCounters::misses);
+        return MapStack(size);
+    }
+
+    void MmapStackAllocator::Dealloc(void* vp, size_t size) {
+        size = RoundUpToPage(size);
+        if(t_stack_cache_gone || t_stack_cache.count >= g_stack_pool_size -> getValue()) {
+            UnmapStack(vp, size);
+            return;
+        }
+        StackCache::Bucket& b = t_stack_cache.getBucket(size);
+        b.stacks.push_back(vp);
+        ++t_stack_cache.count;
+        AddStackCounter(&StackCounters::cached);
+        if(g_stack_trim -> getValue()) {
+            size_t hot = g_stack_hot_count -> getValue();
+            while(b.stacks.size() > b.trimmed + hot) {
+                TrimStack(b.stacks[b.trimmed], size);
+                ++b.trimmed;
+            }
+        }
+    }
+
+    uint64_t MmapStackAllocator::GetHits() {
+        return SumStackCounter(&StackCounters::hits);
+    }
+
+    uint64_t MmapStackAllocator::GetMisses() {
+        return SumStackCounter(&StackCounters::misses);
+    }
+
+    uint64_t MmapStackAllocator::GetCached() {
+        return SumStackCounter(&StackCounters::cached);
+    }
+
+    uint64_t MmapStackAllocator::GetMapped() {
+        return SumStackCounter(&StackCounters::mapped);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef __SYLAR_STACK_ALLOCATOR_H__
+#define __SYLAR_STACK_ALLOCATOR_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace sylar {
+
+    // 最原始的协程栈分配器，直接malloc/free
+    class MallocStackAllocator {
+    public:
+        static void* Alloc(size_t size);
+        static void Dealloc(void* vp, size_t size);
+    };
+
+    /*
+        mmap出来的协程栈，带池子
+        - 每个栈在低地址多映射一页PROT_NONE的guard page，栈溢出直接SIGSEGV，不会悄悄写坏堆上别的东西
+        - 释放的栈先放回当前线程的空闲链表(按大小分)，下次同样大小的直接拿，不用再mmap/缺页
+        - 池子里最近放回来的fiber.stack_hot_count个栈留着不动，再往下的用MADV_FREE告诉内核这些页可以回收
+          (不支持就用MADV_DONTNEED)，池子里的栈不会一直占着物理内存，协程频繁进出也不用每次都madvise
+        - 每个线程缓存的栈数量有上限(fiber.stack_pool_size)，超过的直接munmap
+        - 绑过核的线程(scheduler.affinity)新mmap的栈优先从这个线程的NUMA node上分
+    */
+    class MmapStackAllocator {
+    public:
+        static void* Alloc(size_t size);
+        static void Dealloc(void* vp, size_t size);
+
+        // 计数是每个线程一份，读的时候加锁加起来，别放在热路径上读
+        static uint64_t GetHits();      // 从池子里拿到的次数
+        static uint64_t GetMisses();    // 池子里没有，新mmap的次数
+        static uint64_t GetCached();    // 现在所有线程池子里一共缓存的栈数量
+        static uint64_t GetMapped();    // 现在一共mmap着的栈数量(包括在用的和缓存的)
+    };
+
+    typedef MmapStackAllocator StackAllocator;   // 要换协程栈分配器改这一行就行
+}
+
+#endif
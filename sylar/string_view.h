@@ -0,0 +1,68 @@
+#ifndef __SYLAR_STRING_VIEW_H__
+#define __SYLAR_STRING_VIEW_H__
+
+#include <string>
+#include <ostream>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+
+/*
+    C++11没有std::string_view，这里是个只读的指针+长度，不拥有内存
+    指向的内存要比view活得久，比如HttpRequest零拷贝解析的时候指向它自己持有的接收缓冲区
+*/
+namespace sylar {
+
+    class StringView {
+    public:
+        static const size_t npos = (size_t)-1;
+
+        constexpr StringView() : m_data(""), m_size(0) {}
+        constexpr StringView(const char* data, size_t size) : m_data(data), m_size(size) {}
+        StringView(const char* str) : m_data(str), m_size(strlen(str)) {}
+        StringView(const std::string& str) : m_data(str.data()), m_size(str.size()) {}
+
+        constexpr const char* data() const { return m_data;}
+        constexpr size_t size() const { return m_size;}
+        constexpr bool empty() const { return m_size == 0;}
+        constexpr char operator[](size_t i) const { return m_data[i];}
+        const char* begin() const { return m_data;}
+        const char* end() const { return m_data + m_size;}
+
+        StringView substr(size_t pos, size_t n = npos) const {
+            if(pos > m_size) {
+                pos = m_size;
+            }
+            return StringView(m_data + pos, n < m_size - pos ? n : m_size - pos);
+        }
+
+        size_t find(char c, size_t pos = 0) const {
+            if(pos >= m_size) {
+                return npos;
+            }
+            const void* p = memchr(m_data + pos, c, m_size - pos);
+            return p ? (const char*)p - m_data : npos;
+        }
+
+        std::string toString() const { return std::string(m_data, m_size);}
+
+        bool operator==(const StringView& o) const {
+            return m_size == o.m_size && memcmp(m_data, o.m_data, m_size) == 0;
+        }
+        bool operator!=(const StringView& o) const { return !(*this == o);}
+
+        // 大小写无关的相等，http头名字用
+        bool iequals(const StringView& o) const {
+            return m_size == o.m_size && strncasecmp(m_data, o.m_data, m_size) == 0;
+        }
+    private:
+        const char* m_data;
+        size_t m_size;
+    };
+
+    inline std::ostream& operator<<(std::ostream& os, const StringView& v) {
+        return os.write(v.data(), v.size());
+    }
+}
+
+#endif
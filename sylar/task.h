@@ -0,0 +1,150 @@
+#ifndef __SYLAR_TASK_H__
+#define __SYLAR_TASK_H__
+
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+
+namespace sylar {
+
+    /*
+        只能move的 void() 任务，用来代替调度队列里的 std::function<void()>
+        - 小对象(<= INLINE_SIZE, 并且move不抛异常)直接放在内部的buffer里，不用分配内存
+          std::bind(&TcpServer::handleClient, shared_from_this(), client) 这种两个智能指针的bind刚好放得下
+        - 放不下的才new到堆上
+        - 可以从std::function构造(std::function本身也能放进buffer)，空的std::function/函数指针构造出来的Task也是空的
+        - 不能拷贝，所以调度队列里转手任务的时候不会拷贝捕获的智能指针(原子加减引用计数)
+    */
+    class Task {
+    public:
+        static const size_t INLINE_SIZE = 48;
+
+        Task() = default;
+        Task(std::nullptr_t) {}
+
+        template<class F, class = typename std::enable_if<
+                            !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+        Task(F&& f) {
+            typedef typename std::decay<F>::type Fn;
+            if(IsNull(f)) {
+                return;
+            }
+            init<Fn>(std::forward<F>(f), std::integral_constant<bool,
+                        sizeof(Fn) <= INLINE_SIZE && std::is_nothrow_move_constructible<Fn>::value>());
+        }
+
+        Task(Task&& o) {
+            moveFrom(o);
+        }
+
+        Task& operator=(Task&& o) {
+            if(this != &o) {
+                reset();
+                moveFrom(o);
+            }
+            return *this;
+        }
+
+        Task& operator=(std::nullptr_t) {
+            reset();
+            return *this;
+        }
+
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+
+        ~Task() {
+            reset();
+        }
+
+        void operator()() {
+            m_ops -> invoke(&m_buf);
+        }
+
+        explicit operator bool() const { return m_ops != nullptr;}
+
+        void reset() {
+            if(m_ops) {
+                m_ops -> destroy(&m_buf);
+                m_ops = nullptr;
+            }
+        }
+
+        void swap(Task& o) {
+            Task tmp(std::move(o));
+            o = std::move(*this);
+            *this = std::move(tmp);
+        }
+
+        // 是否放在内部buffer里(没有额外分配内存)，测试/统计用
+        bool isInline() const { return m_ops && m_ops -> isInline;}
+    private:
+        typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+        struct Ops {
+            void (*invoke)(void* buf);
+            void (*move)(void* dst, void* src);     // move到dst，并且析构src
+            void (*destroy)(void* buf);
+            bool isInline;
+        };
+
+        template<class Fn>
+        struct InlineOps {
+            static void Invoke(void* buf) { (*static_cast<Fn*>(buf))();}
+            static void Move(void* dst, void* src) {
+                new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+                static_cast<Fn*>(src) -> ~Fn();
+            }
+            static void Destroy(void* buf) { static_cast<Fn*>(buf) -> ~Fn();}
+            static const Ops s_ops;
+        };
+
+        template<class Fn>
+        struct HeapOps {
+            static void Invoke(void* buf) { (**static_cast<Fn**>(buf))();}
+            static void Move(void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src);}
+            static void Destroy(void* buf) { delete *static_cast<Fn**>(buf);}
+            static const Ops s_ops;
+        };
+
+        template<class Fn>
+        static bool IsNull(const Fn&) { return false;}
+        template<class R, class... Args>
+        static bool IsNull(const std::function<R(Args...)>& f) { return !f;}
+        template<class R, class... Args>
+        static bool IsNull(R (* const& f)(Args...)) { return f == nullptr;}
+
+        template<class Fn, class F>
+        void init(F&& f, std::true_type) {
+            new (&m_buf) Fn(std::forward<F>(f));
+            m_ops = &InlineOps<Fn>::s_ops;
+        }
+
+        template<class Fn, class F>
+        void init(F&& f, std::false_type) {
+            *reinterpret_cast<Fn**>(&m_buf) = new Fn(std::forward<F>(f));
+            m_ops = &HeapOps<Fn>::s_ops;
+        }
+
+        void moveFrom(Task& o) {
+            m_ops = o.m_ops;
+            if(m_ops) {
+                m_ops -> move(&m_buf, &o.m_buf);
+                o.m_ops = nullptr;
+            }
+        }
+    private:
+        Storage m_buf;
+        const Ops* m_ops = nullptr;
+    };
+
+    template<class Fn>
+    const Task::Ops Task::InlineOps<Fn>::s_ops = {&Invoke, &Move, &Destroy, true};
+
+    template<class Fn>
+    const Task::Ops Task::HeapOps<Fn>::s_ops = {&Invoke, &Move, &Destroy, false};
+}
+
+#endif
@@ -1,27 +1,74 @@
 #include "tcp_server.h"
 #include "config.h"
 #include "log.h"
+#include <linux/filter.h>
+#include <algorithm>
 
 namespace sylar {
 
     static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
     static ConfigVar<uint64_t>::ptr g_tcp_server_read_timeout = 
                             Config::Lookup("tcp_server.read_timeout", (uint64_t)(60 * 1000 * 2), "tcp server read timeout");
+    static ConfigVar<uint32_t>::ptr g_tcp_server_accept_batch =
+                            Config::Lookup("tcp_server.accept_batch", (uint32_t)64, "max connections accepted per readiness event");
+    static ConfigVar<bool>::ptr g_tcp_server_reuseport =
+                            Config::Lookup("tcp_server.reuseport", false, "one SO_REUSEPORT listener per worker thread");
+    static ConfigVar<bool>::ptr g_tcp_server_reuseport_cbpf =
+                            Config::Lookup("tcp_server.reuseport_cbpf", false, "steer reuseport listeners by cpu with cbpf");
+
+    static ConfigVar<uint32_t>::ptr g_admission_max_connections =
+                            Config::Lookup("tcp_server.admission.max_connections", (uint32_t)0, "max admitted connections not yet finished, 0 unlimited");
+    static ConfigVar<uint32_t>::ptr g_admission_max_pending =
+                            Config::Lookup("tcp_server.admission.max_pending", (uint32_t)0, "max admitted connections whose handleClient has not started, 0 unlimited");
+    static ConfigVar<uint32_t>::ptr g_admission_per_ip_rate =
+                            Config::Lookup("tcp_server.admission.per_ip_rate", (uint32_t)0, "new connections per second per source ip, 0 unlimited");
+    static ConfigVar<uint32_t>::ptr g_admission_per_ip_burst =
+                            Config::Lookup("tcp_server.admission.per_ip_burst", (uint32_t)0, "per source ip burst, 0 means same as rate");
+    static ConfigVar<uint32_t>::ptr g_admission_codel_target_ms =
+                            Config::Lookup("tcp_server.admission.codel_target_ms", (uint32_t)0, "shed new connections when queue delay stays above this, 0 disables");
+    static ConfigVar<uint32_t>::ptr g_admission_codel_interval_ms =
+                            Config::Lookup("tcp_server.admission.codel_interval_ms", (uint32_t)100, "how long queue delay must stay above target");
+
+    static const size_t kIpBucketSweep = 4096;              // 桶多过这么多的时候清理一下回满了的
+
+    static Mutex s_registry_mutex;
+    static std::vector<TcpServer*> s_registry;
+
+    static void Unregister(TcpServer* server) {
+        Mutex::Lock lock(s_registry_mutex);
+        auto it = std::find(s_registry.begin(), s_registry.end(), server);
+        if(it != s_registry.end()) {
+            s_registry.erase(it);
+        }
+    }
 
     TcpServer::TcpServer(sylar::IOManager* worker, sylar::IOManager* accept_worker) 
         : m_worker(worker), 
          m_acceptWorker(accept_worker),
           m_recvTimeout(g_tcp_server_read_timeout -> getValue()), 
           m_name("sylar_D_version/1.0.0"),
-          m_isStop(true) {
+          m_isStop(true),
+          m_reusePort(g_tcp_server_reuseport -> getValue()),
+          m_reusePortCbpf(g_tcp_server_reuseport_cbpf -> getValue()) {
+        m_limits.maxConnections = g_admission_max_connections -> getValue();
+        m_limits.maxPending = g_admission_max_pending -> getValue();
+        m_limits.perIpRate = g_admission_per_ip_rate -> getValue();
+        m_limits.perIpBurst = g_admission_per_ip_burst -> getValue();
+        m_limits.codelTargetMs = g_admission_codel_target_ms -> getValue();
+        m_limits.codelIntervalMs = g_admission_codel_interval_ms -> getValue();
+        for(auto& i : m_rejected) {
+            i = 0;
+        }
 
     }
 
     TcpServer::~TcpServer() {
+        Unregister(this);
         for(auto& i : m_socks) {
             i -> close();
         }
         m_socks.clear();
+        m_sockThreads.clear();
     }
     
     bool TcpServer::bind(Address::ptr addr) {
@@ -34,6 +81,13 @@ namespace sylar {
     bool TcpServer::bind(const std::vector<Address::ptr>& addrs, std::vector<Address::ptr>& failedAddrs) {
         bool rt = true;
         for(auto& addr : addrs) {
+            if(m_reusePort) {
+                if(!bindReusePort(addr)) {
+                    rt = false;
+                    failedAddrs.push_back(addr);
+                }
+                continue;
+            }
             Socket::ptr sock = Socket::CreateTCP(addr);
             if(!sock -> bind(addr)) {
                 SYLAR_LOG_ERROR(g_logger) << "bind fail errno: "
@@ -52,10 +106,12 @@ namespace sylar {
                 continue;
             }
             m_socks.push_back(sock);
+            m_sockThreads.push_back(-1);
         }
 
         if(!failedAddrs.empty()) {
             m_socks.clear();
+            m_sockThreads.clear();
             return false;
         }
 
@@ -65,18 +121,116 @@ namespace sylar {
         return rt;
     }
 
-    void TcpServer::startAccept(Socket::ptr sock) {
+    bool TcpServer::bindReusePort(Address::ptr addr) {
+        std::vector<Scheduler::WorkerPlacement> workers = m_worker -> getPlacement();
+        std::vector<Socket::ptr> socks;
+        std::vector<int> threads;
+        std::vector<int> cpus;
+        Address::ptr bind_addr = addr;
+        for(auto& w : workers) {
+            if(w.threadId == -1) {
+                continue;
+            }
+            // 按listen的顺序进reuseport组，下标和CBPF返回值对得上
+            Socket::ptr sock = Socket::CreateTCP(bind_addr);
+            if(!sock -> bind(bind_addr, true) || !sock -> listen()) {
+                SYLAR_LOG_ERROR(g_logger) << "reuseport bind/listen fail errno = "
+                                          << errno << " errstr = " << strerror(errno)
+                                          << " addr = [" << bind_addr -> toString() << "]";
+                return false;
+            }
+            if(socks.empty()) {
+                bind_addr = sock -> getLocalAddress();      // 端口是0的时候后面的要绑到同一个端口上
+            }
+            socks.push_back(sock);
+            threads.push_back(w.threadId);
+            cpus.push_back(w.cpu);
+        }
+        if(socks.empty()) {
+            SYLAR_LOG_ERROR(g_logger) << "reuseport no worker thread addr = [" << addr -> toString() << "]";
+            return false;
+        }
+        if(m_reusePortCbpf && !attachCbpf(socks[0], cpus)) {
+            return false;
+        }
+        m_socks.insert(m_socks.end(), socks.begin(), socks.end());
+        m_sockThreads.insert(m_sockThreads.end(), threads.begin(), threads.end());
+        return true;
+    }
+
+    static sock_filter BpfStmt(uint16_t code, uint32_t k) {
+        sock_filter f = BPF_STMT(code, k);
+        return f;
+    }
+
+    static sock_filter BpfJump(uint16_t code, uint32_t k, uint8_t jt, uint8_t jf) {
+        sock_filter f = BPF_JUMP(code, k, jt, jf);
+        return f;
+    }
+
+    /*
+        A = 收包的cpu
+        worker都绑了核: 逐个比cpu，命中返回对应的下标，都不中返回一个越界的下标，内核退回按hash选
+        有没绑核的: A % 监听socket数，不保证同核，只是按cpu分散开
+    */
+    bool TcpServer::attachCbpf(Socket::ptr sock, const std::vector<int>& cpus) {
+        bool bound = std::find(cpus.begin(), cpus.end(), -1) == cpus.end();
+        std::vector<sock_filter> code;
+        code.push_back(BpfStmt(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU)));
+        if(bound) {
+            for(size_t i = 0; i < cpus.size(); ++ i) {
+                code.push_back(BpfJump(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1));
+                code.push_back(BpfStmt(BPF_RET | BPF_K, (uint32_t)i));
+            }
+            code.push_back(BpfStmt(BPF_RET | BPF_K, (uint32_t)cpus.size()));
+        } else {
+            code.push_back(BpfStmt(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)cpus.size()));
+            code.push_back(BpfStmt(BPF_RET | BPF_A, 0));
+        }
+        sock_fprog prog;
+        prog.len = code.size();
+        prog.filter = &code[0];
+        if(!sock -> setOption(SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, prog)) {
+            SYLAR_LOG_ERROR(g_logger) << "attach reuseport cbpf fail errno = "
+                                      << errno << " errstr = " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    void TcpServer::startAccept(Socket::ptr sock, int thread) {
+        Socket::AcceptTemplate tmpl;
+        tmpl.recvTimeout = m_recvTimeout;
+        size_t max = std::max<uint32_t>(1, g_tcp_server_accept_batch -> getValue());
+        std::vector<Socket::ptr> clients;
+        Scheduler::TaskBatch batch(m_worker);
         while(!m_isStop) {
-            Socket::ptr clinet = sock -> accept();
-            if(clinet) {
-                clinet -> setRecvTimeout(m_recvTimeout);
-                // 需要传入自己的TcpServer智能指针，确保我的handleClient完成前你作为TcpServer自己不能释放
-                m_worker -> schedule(std::bind(&TcpServer::handleClient, shared_from_this(), clinet));
+            clients.clear();
+            if(sock -> acceptBatch(clients, max, &tmpl)) {
+                uint64_t now_us = m_limits.codelTargetMs ? GetCurrentUS() : 0;
+                for(auto& client : clients) {
+                    int reason = admit(client);
+                    if(reason != -1) {
+                        ++m_rejected[reason];
+                        rejectClient(std::move(client), (Reject)reason);
+                        continue;
+                    }
+                    // 需要传入自己的TcpServer智能指针，确保我的handleClient完成前你作为TcpServer自己不能释放
+                    ClientTask task = {shared_from_this(), std::move(client), now_us};
+                    batch.add(std::move(task), thread);
+                }
+                if(!batch.empty()) {
+                    m_worker -> schedule(batch);
+                }
             } else {
-                SYLAR_LOG_ERROR(g_logger) << "accept errno = " << errno
+                if(m_isStop) {
+                    break;
+                }
+                SYLAR_LOG_ERROR(g_logger) << "accept(" << sock -> geSocket() << ") errno = " << errno
                                           << " errstr = " << strerror(errno);
             }
         }
+        sock -> close();                // stop()只shutdown，由accept协程自己关
     }
 
     bool TcpServer::start() {
@@ -84,25 +238,178 @@ namespace sylar {
            return true; 
         }
         m_isStop = false;
-        for(auto& i : m_socks) {
-            m_acceptWorker -> schedule(std::bind(&TcpServer::startAccept, shared_from_this(), i));
+        {
+            Mutex::Lock lock(s_registry_mutex);
+            if(std::find(s_registry.begin(), s_registry.end(), this) == s_registry.end()) {
+                s_registry.push_back(this);
+            }
+        }
+        for(size_t i = 0; i < m_socks.size(); ++ i) {
+            int thread = m_sockThreads[i];
+            if(thread == -1) {
+                m_acceptWorker -> schedule(std::bind(&TcpServer::startAccept, shared_from_this(), m_socks[i], -1));
+            } else {
+                m_worker -> schedule(std::bind(&TcpServer::startAccept, shared_from_this(), m_socks[i], thread), thread);
+            }
         }
         return true;
     }
 
     void TcpServer::stop() {
         m_isStop = true;
+        Unregister(this);
         auto self = shared_from_this();
+        /*
+            从外面cancel再close的话，被叫醒的accept协程可能在别的线程上先重试accept拿到EAGAIN又把事件挂回去，
+            然后fd被关了，事件再也不会来，m_pendingEventCount一直是1，IOManager退不出去
+            不管是不是reuseport都只shutdown，挂着的accept被叫醒、之后的accept直接失败(EINVAL)，由accept协程自己close
+        */
+        for(size_t i = 0; i < m_socks.size(); ++ i) {
+            ::shutdown(m_socks[i] -> geSocket(), SHUT_RDWR);
+        }
         m_acceptWorker -> schedule([this, self]() {
-            for(auto& sock : m_socks) {
-                sock -> cancelAll();
-                sock -> close();
-            }
             m_socks.clear();
+            m_sockThreads.clear();
         });
     }
 
     void TcpServer::handleClient(Socket::ptr client) {
         SYLAR_LOG_INFO(g_logger) << "handleClient: " << *client;
     }
+
+    void TcpServer::rejectClient(Socket::ptr client, Reject reason) {
+        client -> close();
+    }
+
+    int TcpServer::admit(Socket::ptr client) {
+        // 先占名额再看有没有超，reuseport的时候几个accept线程同时进来也不会一起越过上限；没放进来的退回去
+        uint64_t connections = m_connections.fetch_add(1);
+        if(m_limits.maxConnections && connections >= m_limits.maxConnections) {
+            --m_connections;
+            return REJECT_CONNECTIONS;
+        }
+        uint64_t pending = m_pending.fetch_add(1);
+        int reason = -1;
+        if(m_limits.maxPending && pending >= m_limits.maxPending) {
+            reason = REJECT_PENDING;
+        } else if(m_overloaded) {
+            if(pending) {
+                reason = REJECT_OVERLOAD;
+            } else {
+                m_overloaded = false;               // 队列已经空了，不用再等下一个任务来恢复
+                m_firstAboveUs = 0;
+            }
+        }
+        // 要拿对端地址(一次getpeername)，放在最后
+        if(reason == -1 && m_limits.perIpRate && !allowIp(client, GetCurrentUS())) {
+            reason = REJECT_RATE;
+        }
+        if(reason != -1) {
+            --m_pending;
+            --m_connections;
+            return reason;
+        }
+        ++m_accepted;
+        return -1;
+    }
+
+    bool TcpServer::allowIp(Socket::ptr client, uint64_t now_us) {
+        Address::ptr addr = client -> getRemoteAddress();
+        const sockaddr* sa = addr -> getAddr();
+        std::string key;
+        if(sa -> sa_family == AF_INET) {
+            key.assign((const char*)&((const sockaddr_in*)sa) -> sin_addr, sizeof(in_addr));
+        } else if(sa -> sa_family == AF_INET6) {
+            key.assign((const char*)&((const sockaddr_in6*)sa) -> sin6_addr, sizeof(in6_addr));
+        } else {
+            return true;                            // unix socket没有IP
+        }
+        double rate = m_limits.perIpRate;
+        double burst = m_limits.perIpBurst ? m_limits.perIpBurst : m_limits.perIpRate;
+
+        Mutex::Lock lock(m_ipMutex);
+        if(m_ipBuckets.size() > kIpBucketSweep && now_us - m_ipSweepUs > 1000 * 1000) {
+            m_ipSweepUs = now_us;
+            for(auto it = m_ipBuckets.begin(); it != m_ipBuckets.end();) {
+                if(it -> second.tokens + (now_us - it -> second.lastUs) * rate / 1e6 >= burst) {
+                    it = m_ipBuckets.erase(it);
+                } else {
+                    ++ it;
+                }
+            }
+        }
+        auto it = m_ipBuckets.find(key);
+        if(it == m_ipBuckets.end()) {
+            IpBucket& b = m_ipBuckets[key];
+            b.tokens = burst - 1;
+            b.lastUs = now_us;
+            return true;
+        }
+        IpBucket& b = it -> second;
+        b.tokens = std::min(burst, b.tokens + (now_us - b.lastUs) * rate / 1e6);
+        b.lastUs = now_us;
+        if(b.tokens < 1) {
+            return false;
+        }
+        b.tokens -= 1;
+        return true;
+    }
+
+    void TcpServer::runClient(Socket::ptr client, uint64_t enqueue_us) {
+        // handleClient里抛出来的异常会被Fiber接住，名额要靠析构还回去，不然max_connections的名额会漏光
+        struct ConnectionGuard {
+            std::atomic<uint64_t>& connections;
+            ~ConnectionGuard() { --connections;}
+        } guard = {m_connections};
+        --m_pending;
+        if(enqueue_us) {
+            uint64_t now_us = GetCurrentUS();
+            if(now_us - enqueue_us < m_limits.codelTargetMs * 1000ull) {
+                m_firstAboveUs = 0;
+                m_overloaded = false;
+            } else if(m_firstAboveUs == 0) {
+                m_firstAboveUs = now_us + m_limits.codelIntervalMs * 1000ull;
+            } else if(now_us >= m_firstAboveUs && !m_overloaded.exchange(true)) {
+                SYLAR_LOG_WARN(g_logger) << m_name << " overloaded, queue delay "
+                                         << (now_us - enqueue_us) / 1000 << "ms > target "
+                                         << m_limits.codelTargetMs << "ms, shedding new connections";
+            }
+        }
+        handleClient(client);
+    }
+
+    TcpServer::Stats TcpServer::getStats() const {
+        Stats s;
+        s.name = m_name;
+        s.accepted = m_accepted;
+        for(int i = 0; i < REJECT_COUNT; ++ i) {
+            s.rejected[i] = m_rejected[i];
+        }
+        s.connections = m_connections;
+        s.pending = m_pending;
+        s.overloaded = m_overloaded;
+        return s;
+    }
+
+    const char* TcpServer::RejectToString(Reject reason) {
+        switch(reason) {
+            case REJECT_CONNECTIONS:
+                return "connections";
+            case REJECT_PENDING:
+                return "pending";
+            case REJECT_RATE:
+                return "rate";
+            case REJECT_OVERLOAD:
+                return "overload";
+            default:
+                return "unknown";
+        }
+    }
+
+    void TcpServer::ForEach(std::function<void(TcpServer*)> cb) {
+        Mutex::Lock lock(s_registry_mutex);
+        for(auto server : s_registry) {
+            cb(server);
+        }
+    }
 }
\ No newline at end of file
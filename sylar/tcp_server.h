@@ -5,6 +5,8 @@
 #include <functional>
 #include "iomanager.h"
 #include <vector>
+#include <atomic>
+#include <unordered_map>
 #include "socket.h"
 #include "noncopyable.h"
 
@@ -15,10 +17,57 @@ namespace sylar {
         1. bind address
         2. start
         3. stop
+
+        默认每个地址一个监听socket，accept_worker上一个协程accept，再把连接扔给worker
+        打开reuseport(tcp_server.reuseport)之后每个地址给worker的每个线程开一个SO_REUSEPORT的监听socket，
+        accept协程钉在对应的线程上，连接也在这个线程上处理，内核按四元组hash分连接，不用再过一次共享队列
+        再打开cbpf(tcp_server.reuseport_cbpf)的话挂一段CBPF，按收包的cpu选socket，
+        worker绑了核(scheduler.affinity)的时候，软中断在哪个核上连接就交给哪个核上的线程
+        要在bind之前设，bind的时候worker的线程要已经起来
+
+        准入控制(tcp_server.admission.*，0是不限)，accept出来不满足的直接rejectClient(默认直接关，HttpServer回503):
+        - max_connections: 放进来还没处理完的连接数(排队的+在handleClient里的)
+        - max_pending:     放进来了handleClient还没开始跑的连接数，也就是worker队列里压着的
+        - per_ip_rate/per_ip_burst: 每个对端IP每秒新建多少个连接，令牌桶，burst没配的时候等于rate
+        - codel_target_ms/codel_interval_ms: CoDel的思路，handleClient从进队列到开始跑的时间
+          连续一个interval都超过target就认为过载，过载期间队列里还有没开始跑的连接就拒绝新连接，
+          有一个低于target或者队列空了就恢复
     */
     class TcpServer : public std::enable_shared_from_this<TcpServer>, Noncopyable {
     public:
         typedef std::shared_ptr<TcpServer> ptr;
+
+        struct Limits {
+            uint32_t maxConnections = 0;
+            uint32_t maxPending = 0;
+            uint32_t perIpRate = 0;
+            uint32_t perIpBurst = 0;
+            uint32_t codelTargetMs = 0;
+            uint32_t codelIntervalMs = 100;
+        };
+
+        enum Reject {
+            REJECT_CONNECTIONS = 0,     // 超过max_connections
+            REJECT_PENDING,             // 超过max_pending
+            REJECT_RATE,                // 对端IP超过per_ip_rate
+            REJECT_OVERLOAD,            // 排队时间超过codel_target_ms
+            REJECT_COUNT,
+        };
+        static const char* RejectToString(Reject reason);
+
+        struct Stats {
+            std::string name;
+            uint64_t accepted = 0;                  // 放进来的
+            uint64_t rejected[REJECT_COUNT] = {0};
+            uint64_t connections = 0;               // 当前放进来还没处理完的
+            uint64_t pending = 0;                   // 当前handleClient还没开始跑的
+            bool overloaded = false;
+        };
+        Stats getStats() const;
+
+        // 所有start()了还没stop()的server，在锁里调cb
+        static void ForEach(std::function<void(TcpServer*)> cb);
+
         TcpServer(sylar::IOManager* worker = sylar::IOManager::GetThis(),
                   sylar::IOManager* accept_worker = sylar::IOManager::GetThis());
         virtual ~TcpServer();
@@ -32,19 +81,66 @@ namespace sylar {
         std::string getName() const {return m_name;}
         void setRecvTimeout(uint64_t v) {m_recvTimeout = v;}
         void setName(const std::string& v) {m_name = v;}
+        bool isReusePort() const {return m_reusePort;}
+        void setReusePort(bool v) {m_reusePort = v;}
+        bool isReusePortCbpf() const {return m_reusePortCbpf;}
+        void setReusePortCbpf(bool v) {m_reusePortCbpf = v;}
+        const Limits& getLimits() const {return m_limits;}
+        void setLimits(const Limits& v) {m_limits = v;}        // start之前设
 
         bool isStop() const {return m_isStop;}
+        IOManager* getWorker() const {return m_worker;}
+        IOManager* getAcceptWorker() const {return m_acceptWorker;}
+        std::vector<Socket::ptr> getSocks() const {return m_socks;}
 
     protected:
         virtual void handleClient(Socket::ptr client);      // 触发回调
-        virtual void startAccept(Socket::ptr sock);
+        // 没通过准入的连接，默认直接关，在accept协程里调，不要阻塞
+        virtual void rejectClient(Socket::ptr client, Reject reason);
+        // thread是这个监听socket钉住的线程，连接也交给它；-1的话交给worker里随便哪个线程
+        virtual void startAccept(Socket::ptr sock, int thread);
+    private:
+        bool bindReusePort(Address::ptr addr);
+        bool attachCbpf(Socket::ptr sock, const std::vector<int>& cpus);
+
+        int admit(Socket::ptr client);          // 放进来返回-1，否则返回Reject
+        bool allowIp(Socket::ptr client, uint64_t now_us);
+        void runClient(Socket::ptr client, uint64_t enqueue_us);
+
+        // 排进worker的任务，40字节放得进Task内部的buffer，client move进来不加引用计数
+        struct ClientTask {
+            TcpServer::ptr server;
+            Socket::ptr client;
+            uint64_t enqueueUs;
+            void operator()() { server -> runClient(std::move(client), enqueueUs);}
+        };
+
+        struct IpBucket {
+            double tokens = 0;
+            uint64_t lastUs = 0;
+        };
     private:
         std::vector<Socket::ptr> m_socks;   // 一个socket 数组来存储Listener socket, 因为有些机器是多网卡的
+        std::vector<int> m_sockThreads;     // 和m_socks一一对应，reuseport的时候是钉住的线程id，否则-1
         IOManager* m_worker;                // 工作线程池
         IOManager* m_acceptWorker;          // 专门负责accept
         uint64_t m_recvTimeout;             // 读超时，也可以防止恶意的链接之后不发数据的攻击
         std::string m_name;                 // server 的名字
         bool m_isStop;                      // server 是否停止
+        bool m_reusePort;
+        bool m_reusePortCbpf;
+
+        Limits m_limits;
+        std::atomic<uint64_t> m_accepted = {0};
+        std::atomic<uint64_t> m_rejected[REJECT_COUNT];
+        std::atomic<uint64_t> m_connections = {0};
+        std::atomic<uint64_t> m_pending = {0};
+        std::atomic<bool> m_overloaded = {false};
+        std::atomic<uint64_t> m_firstAboveUs = {0};     // 排队时间从什么时候开始一直超过target(加了interval)，0是没超过
+
+        Mutex m_ipMutex;
+        std::unordered_map<std::string, IpBucket> m_ipBuckets;
+        uint64_t m_ipSweepUs = 0;
     };
 }
 
@@ -1,6 +1,9 @@
 #include "thread.h"
 #include "log.h"
 #include "util.h"
+#include "topology.h"
+#include <errno.h>
+#include <time.h>
 
 namespace sylar {
     /*
@@ -28,6 +31,26 @@ namespace sylar {
         }
     }
 
+    bool Semaphore::waitFor(uint64_t ms) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000) {
+            ++ts.tv_sec;
+            ts.tv_nsec -= 1000000000;
+        }
+        while(sem_timedwait(&m_semaphore, &ts)) {
+            if(errno == ETIMEDOUT) {
+                return false;
+            }
+            if(errno != EINTR) {
+                throw std::logic_error("sem_timedwait error");
+            }
+        }
+        return true;
+    }
+
     void Semaphore::notify() {
         if(sem_post(&m_semaphore)) {
             throw std::logic_error("sem_post error");
@@ -49,8 +72,8 @@ namespace sylar {
         t_thread_name = name;
     }
 
-    Thread::Thread(std::function<void()> cb, const std::string& name) :
-        m_cb(cb), m_name(name) {
+    Thread::Thread(std::function<void()> cb, const std::string& name, int cpu) :
+        m_cb(cb), m_name(name), m_cpu(cpu) {
         if(name.empty()) {
             m_name = "UNKNOW";
         }
@@ -99,6 +122,9 @@ namespace sylar {
             posix是POSIX的线程标准，定义了创建和操纵线程的一套API，也就是我们现在用的API
         */
         pthread_setname_np(pthread_self(), thread -> m_name.substr(0, 15).c_str()); //pthread_setname_np 最大只能接收16个字符
+        if(thread -> m_cpu >= 0 && !CpuTopology::BindThread(thread -> m_cpu)) {
+            thread -> m_cpu = -1;
+        }
 
         /*  
             swap 掉，防止智能指针不被释放。
@@ -25,6 +25,7 @@ namespace sylar {
         ~Semaphore();
 
         void wait();
+        bool waitFor(uint64_t ms);      // 等到了返回true，超时返回false
         void notify();
     // private:
     //     Semaphore(const Semaphore&) = delete;
@@ -160,6 +161,10 @@ namespace sylar {
             pthread_mutex_lock(&m_mutex);
         }
 
+        bool trylock() {
+            return pthread_mutex_trylock(&m_mutex) == 0;
+        }
+
         void unlock() {
             pthread_mutex_unlock(&m_mutex);
         }
@@ -276,10 +281,12 @@ namespace sylar {
     class Thread {
     public:
         typedef std::shared_ptr<Thread> ptr;
-        Thread(std::function<void()> cb, const std::string& name);
+        // cpu >= 0 的时候线程跑回调之前先绑到这个cpu上，构造函数返回的时候已经绑好了
+        Thread(std::function<void()> cb, const std::string& name, int cpu = -1);
         ~Thread();
 
         pid_t getId() const {return m_id;}
+        int getCpu() const {return m_cpu;}             // 实际绑上的cpu，没绑或者绑失败是-1
         const std::string& getName() const {return m_name;}
 
         void join();
@@ -300,6 +307,7 @@ namespace sylar {
         pthread_t m_thread = 0;        // typedef unsign long pthread_t; 返回pthread_id，pthread_id是POSIX的标识符
         std::function<void()> m_cb;    // m_cb 实例，存储一个返回为空，输入为空的方法
         std::string m_name;            // 线程名字
+        int m_cpu = -1;                // 要绑的cpu，线程起来之后改成实际绑上的
 
         Semaphore m_semaphore;
     };
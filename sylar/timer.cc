@@ -1,6 +1,357 @@
 #include "timer.h"
+#include "config.h"
+#include <algorithm>
+#include <sched.h>
 
 namespace sylar {
+
+    static ConfigVar<bool>::ptr g_timer_wheel =
+        Config::Lookup<bool>("timer.wheel", true, "per-thread hierarchical timing wheels instead of one std::set");
+
+    static ConfigVar<uint64_t>::ptr g_timer_slack =
+        Config::Lookup<uint64_t>("timer.slack_ms", (uint64_t)0, "how late a timer may fire so that nearby timers share one wakeup");
+
+    static std::atomic<uint64_t> s_timer_manager_id {0};
+
+    // 当前线程上一次用的是哪个TimerManager的哪个轮子，不用每次都去找
+    struct WheelCache {
+        uint64_t managerId = 0;
+        TimerWheel* wheel = nullptr;
+    };
+    static thread_local WheelCache t_wheel_cache;
+
+    // 墓碑多到这个程度就压缩一遍：比还活着的多(至少1024个)，或者已经没有活着的了
+    static bool NeedCompact(int64_t live, int64_t dead) {
+        return dead > 0 && (live <= 0 || (dead >= 1024 && dead > live));
+    }
+
+    /*
+        分层时间轮，精度1ms
+        第0层256个槽，每槽1ms；第1、2、3层各64个槽，每槽分别是2^8、2^14、2^20 ms，一共覆盖2^26 ms(约18.6小时)
+        再远的先挂在第3层最远的槽上，转到了重新放
+        - 每个槽是Timer上的侵入式双向链表，加入/删除都是O(1)，不用分配节点
+        - 每层一个bitmap(第0层4个字，其他层1个字)记录哪些槽不空，推进和找下一个到期时间的时候空的一段直接跳过
+        - 第0层里下标比当前小的槽放的是下一圈的定时器，推进到256的整数倍时把上一层对应的槽拆下来重新放
+        所有操作都要拿着mutex，除了Timer::cancel/refresh：
+        - cancel只改Timer的状态，定时器留在槽里当墓碑，转到它的时候丢掉，
+          墓碑太多了expire的时候顺便压缩一段(每次最多看COMPACT_BUDGET个，不然一次扫几十万个到期的全被拖晚)，
+          一个高层的槽里可能挂着几十万个，所以记的是停在哪个节点，这个节点被拿走的时候游标跟着往后挪
+        - refresh只把m_next往后推，转到原来的槽发现还没到就按新的时间重新放
+    */
+    class TimerWheel {
+    public:
+        TimerWheel(int thread_id, uint64_t now_ms)
+            : threadId(thread_id)
+            , m_current(now_ms) {
+            for(auto& s : m_slots) {
+                s = nullptr;
+            }
+            for(auto& b : m_bitmap) {
+                b = 0;
+            }
+        }
+
+        ~TimerWheel() {
+            clear();
+        }
+
+        void add(Timer* timer);
+        Timer::ptr remove(Timer* timer);            // 返回轮子持有的那份引用，调用方出了锁再释放
+        void move(Timer* timer);                    // m_next改了之后重新放
+        void expire(uint64_t now_ms, std::vector<std::function<void()> >& cbs);
+        void clear();
+        bool needCompact() const { return NeedCompact(live, tombstones);}
+
+        Mutex mutex;
+        const int threadId;
+        std::atomic<uint64_t> nextHint = {~0ull};   // 最早到期时间的下界，没有定时器是~0，不用拿锁就能读
+        std::atomic<int64_t> live = {0};            // 还会触发的定时器数，墓碑不算
+        std::atomic<int64_t> tombstones = {0};      // 取消了还挂在槽里的
+    private:
+        static const int SLOTS = 256 + 64 * 3;
+        static const size_t COMPACT_BUDGET = 1024;
+
+        void link(Timer* timer);
+        void unlink(Timer* timer);
+        void cascade();
+        void compact();
+        void drop(Timer* timer);                    // 丢掉一个已经拆下来的墓碑
+        void fire(Timer* timer, uint64_t now_ms, bool force,
+                  std::vector<std::function<void()> >& cbs, std::vector<Timer*>& recurring);
+        uint64_t nextEvent();                       // 从m_current开始下一个要处理(到期或者拆槽)的时间
+        void updateHint(uint64_t next) {
+            if(next < nextHint.load(std::memory_order_relaxed)) {
+                nextHint.store(next);
+            }
+        }
+    private:
+        Timer* m_slots[SLOTS];
+        uint64_t m_bitmap[SLOTS / 64];
+        uint64_t m_current;                         // 下一个要处理的ms，之前的都处理过了
+        size_t m_count = 0;
+        int m_compactSlot = 0;                      // 压缩下一个要看的槽
+        Timer* m_compactCursor = nullptr;           // 压缩停在的节点，nullptr表示从m_compactSlot开始
+    };
+
+    void TimerWheel::link(Timer* timer) {
+        uint64_t expires = std::max(timer -> m_next.load(), m_current);
+        uint64_t delta = expires - m_current;
+        int slot;
+        if(delta < (1ull << 8)) {
+            slot = expires & 255;
+        } else if(delta < (1ull << 14)) {
+            slot = 256 + ((expires >> 8) & 63);
+        } else if(delta < (1ull << 20)) {
+            slot = 320 + ((expires >> 14) & 63);
+        } else {
+            if(delta >= (1ull << 26)) {
+                expires = m_current + (1ull << 26) - 1;
+            }
+            slot = 384 + ((expires >> 20) & 63);
+        }
+        timer -> m_slot = slot;
+        timer -> m_prevNode = nullptr;
+        timer -> m_nextNode = m_slots[slot];
+        if(m_slots[slot]) {
+            m_slots[slot] -> m_prevNode = timer;
+        }
+        m_slots[slot] = timer;
+        m_bitmap[slot >> 6] |= 1ull << (slot & 63);
+    }
+
+    void TimerWheel::unlink(Timer* timer) {
+        if(timer == m_compactCursor) {
+            m_compactCursor = timer -> m_nextNode;
+        }
+        int slot = timer -> m_slot;
+        if(timer -> m_prevNode) {
+            timer -> m_prevNode -> m_nextNode = timer -> m_nextNode;
+        } else {
+            m_slots[slot] = timer -> m_nextNode;
+            if(!m_slots[slot]) {
+                m_bitmap[slot >> 6] &= ~(1ull << (slot & 63));
+            }
+        }
+        if(timer -> m_nextNode) {
+            timer -> m_nextNode -> m_prevNode = timer -> m_prevNode;
+        }
+        timer -> m_prevNode = timer -> m_nextNode = nullptr;
+        timer -> m_slot = -1;
+    }
+
+    void TimerWheel::add(Timer* timer) {
+        if(m_count == 0) {
+            m_current = std::max(m_current, sylar::GetCurrentMS());    // 空了一段时间的轮子没人推进，先追上现在
+        }
+        timer -> m_self = timer -> shared_from_this();
+        link(timer);
+        ++m_count;
+        ++live;
+        updateHint(timer -> m_next);
+    }
+
+    Timer::ptr TimerWheel::remove(Timer* timer) {
+        if(timer -> m_slot < 0) {
+            return nullptr;
+        }
+        unlink(timer);
+        if(--m_count == 0) {
+            nextHint = ~0ull;
+        }
+        Timer::ptr self;
+        self.swap(timer -> m_self);
+        return self;
+    }
+
+    void TimerWheel::move(Timer* timer) {
+        unlink(timer);
+        link(timer);
+        updateHint(timer -> m_next);
+    }
+
+    void TimerWheel::cascade() {
+        // m_current是256的整数倍，高层先拆，拆下来的可能落到低一层当前要拆的槽里
+        int slots[3];
+        int n = 0;
+        if((m_current & ((1ull << 20) - 1)) == 0) {
+            slots[n++] = 384 + ((m_current >> 20) & 63);
+        }
+        if((m_current & ((1ull << 14) - 1)) == 0) {
+            slots[n++] = 320 + ((m_current >> 14) & 63);
+        }
+        slots[n++] = 256 + ((m_current >> 8) & 63);
+        for(int i = 0; i < n; ++ i) {
+            int slot = slots[i];
+            Timer* t = m_slots[slot];
+            if(m_compactCursor && m_compactCursor -> m_slot == slot) {
+                m_compactCursor = nullptr;
+            }
+            m_slots[slot] = nullptr;
+            m_bitmap[slot >> 6] &= ~(1ull << (slot & 63));
+            while(t) {
+                Timer* next = t -> m_nextNode;
+                link(t);
+                t = next;
+            }
+        }
+    }
+
+    uint64_t TimerWheel::nextEvent() {
+        if(m_count == 0) {
+            return ~0ull;
+        }
+        uint32_t idx = m_current & 255;
+        if(idx == 0) {
+            return m_current;                       // 整256的地方可能要拆上层的槽
+        }
+        uint64_t base = m_current - idx;
+        for(uint32_t w = idx >> 6; w < 4; ++ w) {   // 这一圈里第0层剩下的槽
+            uint64_t bits = m_bitmap[w];
+            if(w == (idx >> 6)) {
+                bits &= ~0ull << (idx & 63);
+            }
+            if(bits) {
+                return base + w * 64 + __builtin_ctzll(bits);
+            }
+        }
+        uint64_t next = ~0ull;
+        if(m_bitmap[0] | m_bitmap[1] | m_bitmap[2] | m_bitmap[3]) {
+            next = base + 256;                      // 第0层只剩下一圈的了
+        }
+        for(int level = 1; level < 4; ++ level) {   // 上面几层下一个不空的槽什么时候拆
+            uint64_t bits = m_bitmap[3 + level];
+            if(!bits) {
+                continue;
+            }
+            int shift = 8 + 6 * (level - 1);
+            uint64_t cur = m_current >> shift;
+            uint32_t start = (cur + 1) & 63;
+            uint64_t rot = start ? ((bits >> start) | (bits << (64 - start))) : bits;
+            next = std::min(next, (cur + 1 + __builtin_ctzll(rot)) << shift);
+        }
+        return next;
+    }
+
+    void TimerWheel::drop(Timer* timer) {
+        --tombstones;                           // 回调cancel的时候已经放掉了
+        Timer::ptr self;
+        self.swap(timer -> m_self);
+    }
+
+    void TimerWheel::compact() {
+        for(size_t visited = 0; visited < COMPACT_BUDGET; ++ visited) {
+            Timer* t = m_compactCursor;
+            for(int n = 0; !t && n < SLOTS; ++ n) {     // 这个槽看完了，找下一个不空的
+                t = m_slots[m_compactSlot];
+                m_compactSlot = (m_compactSlot + 1) % SLOTS;
+            }
+            if(!t) {
+                break;
+            }
+            m_compactCursor = t -> m_nextNode;
+            if(t -> m_status == Timer::CANCELLED) {
+                unlink(t);
+                --m_count;
+                drop(t);
+            }
+        }
+    }
+
+    /*
+        timer已经从槽里拆下来了(m_count也减过了)
+        先CAS成FIRING，抢不到说明被cancel了；抢到了之后cancel/refresh会等它变回ARMED或者FIRED
+        FIRING之后再看m_next，refresh在这之前推后的一定能看到
+    */
+    void TimerWheel::fire(Timer* t, uint64_t now_ms, bool force,
+                          std::vector<std::function<void()> >& cbs, std::vector<Timer*>& recurring) {
+        int status = Timer::ARMED;
+        if(!t -> m_status.compare_exchange_strong(status, Timer::FIRING)) {
+            drop(t);
+            return;
+        }
+        if(!force && t -> m_next > now_ms) {    // 被refresh推后了，按新的时间重新放
+            link(t);
+            ++m_count;
+            t -> m_status = Timer::ARMED;
+            return;
+        }
+        if(t -> m_recurring) {                  // 循环定时器先拿出来，推进完再放回去，不然这一轮可能又到期一次
+            cbs.push_back(t -> m_cb);
+            t -> m_next = now_ms + t -> m_ms;
+            recurring.push_back(t);
+            t -> m_status = Timer::ARMED;
+        } else {                                // 否则清空，防止智能指针不释放
+            cbs.push_back(std::move(t -> m_cb));
+            t -> m_cb = nullptr;
+            --live;
+            t -> m_status = Timer::FIRED;
+            Timer::ptr self;
+            self.swap(t -> m_self);
+        }
+    }
+
+    void TimerWheel::expire(uint64_t now_ms, std::vector<std::function<void()> >& cbs) {
+        if(needCompact()) {
+            compact();
+        }
+        std::vector<Timer*> recurring;
+        if(now_ms + 60 * 60 * 1000 < m_current) {   // 时钟往回调了一个多小时，和原来一样全部当成到期
+            std::vector<Timer*> all;
+            all.reserve(m_count);
+            for(int slot = 0; slot < SLOTS; ++ slot) {
+                while(m_slots[slot]) {
+                    Timer* t = m_slots[slot];
+                    unlink(t);
+                    --m_count;
+                    all.push_back(t);
+                }
+            }
+            m_current = now_ms;
+            for(auto t : all) {
+                fire(t, now_ms, true, cbs, recurring);
+            }
+        }
+        while(m_current <= now_ms) {
+            if(m_count == 0) {
+                m_current = now_ms + 1;
+                break;
+            }
+            uint32_t idx = m_current & 255;
+            if(idx == 0) {
+                cascade();
+            }
+            Timer* t = m_slots[idx];
+            if(m_compactCursor && m_compactCursor -> m_slot == (int)idx) {
+                m_compactCursor = nullptr;
+            }
+            m_slots[idx] = nullptr;
+            m_bitmap[idx >> 6] &= ~(1ull << (idx & 63));
+            while(t) {
+                Timer* next = t -> m_nextNode;
+                t -> m_prevNode = t -> m_nextNode = nullptr;
+                t -> m_slot = -1;
+                --m_count;
+                fire(t, now_ms, false, cbs, recurring);
+                t = next;
+            }
+            ++m_current;
+            m_current = std::min(nextEvent(), now_ms + 1);  // 中间空的一段直接跳过
+        }
+        for(auto t : recurring) {
+            link(t);
+            ++m_count;
+        }
+        nextHint = nextEvent();
+    }
+
+    void TimerWheel::clear() {
+        for(int slot = 0; slot < SLOTS; ++ slot) {
+            while(m_slots[slot]) {
+                remove(m_slots[slot]);
+            }
+        }
+    }
+
     bool Timer::Comparator::operator() (const Timer::ptr &lhs, const Timer::ptr &rhs) const {
         if(!lhs && !rhs) {
             return false;
@@ -29,29 +380,54 @@ namespace sylar {
     Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager) 
         : m_recurring(recurring),
           m_ms(ms),
+          m_next(0),
           m_cb(cb),
           m_manager(manager) {
             m_next = sylar::GetCurrentMS() + m_ms;
     }
     
     Timer::Timer(uint64_t next) 
-        : m_next(next) {
+        : m_ms(0),
+          m_next(next) {
 
     }
 
+    // 不拿锁，打个墓碑就走，真正从set/轮子上拿掉是到期或者压缩的时候
     bool Timer::cancel() {
-        TimerManager::RWMutexType::WriteLock lock(m_manager -> m_mutex);
-        if(m_cb) {
-            m_cb = nullptr;
-            auto it = m_manager->m_timers.find(shared_from_this());
-            m_manager -> m_timers.erase(it);
-            return true;
+        int status = ARMED;
+        while(!m_status.compare_exchange_weak(status, CANCELLED)) {
+            if(status == FIRING) {              // 轮子正在处理，马上就有结果
+                sched_yield();
+            } else if(status != ARMED) {        // 已经触发过或者取消过了
+                return false;
+            }
+            status = ARMED;
         }
-        return false;
+        // 抢到CANCELLED之后别的线程都不会再碰m_cb，回调和它捕获的socket/session这里就放掉，不等墓碑被清
+        std::function<void()> cb;
+        cb.swap(m_cb);
+        if(m_wheel) {
+            --m_wheel -> live;
+            ++m_wheel -> tombstones;
+        } else {
+            --m_manager -> m_liveTimers;
+            ++m_manager -> m_tombstones;
+        }
+        return true;
     }
+
     bool Timer::refresh() {             //刷新是时间
+        if(m_wheel) {
+            // 只会往后推，不用动轮子，转到原来的槽的时候会按新的m_next重新放
+            m_next = sylar::GetCurrentMS() + m_ms;
+            int status;
+            while((status = m_status) == FIRING) {
+                sched_yield();
+            }
+            return status == ARMED;
+        }
         TimerManager::RWMutexType::WriteLock lock(m_manager -> m_mutex);
-        if(! m_cb) {                    // 都没有cb
+        if(m_status != ARMED) {         // 已经触发或者取消了
             return false;
         }
         auto it = m_manager->m_timers.find(shared_from_this());
@@ -60,7 +436,7 @@ namespace sylar {
         }
         // 先删除重新加，为了让数据结构重新排序
         m_manager -> m_timers.erase(it);
-        m_next = sylar::GetCurrentMS() + m_next;
+        m_next = sylar::GetCurrentMS() + m_ms;
         m_manager -> m_timers.insert(shared_from_this());
         return true;
     }
@@ -68,8 +444,23 @@ namespace sylar {
         if(ms == m_ms && !from_now) {           // 现在就是
             return true;
         }
+        if(m_wheel) {
+            // 可能往前挪，要拿锁换槽；拿着锁的时候不会是FIRING，ARMED的一定挂在轮子上
+            {
+                Mutex::Lock lock(m_wheel -> mutex);
+                if(m_status != ARMED) {
+                    return false;
+                }
+                uint64_t start = from_now ? sylar::GetCurrentMS() : m_next - m_ms;
+                m_ms = ms;
+                m_next = start + m_ms;
+                m_wheel -> move(this);
+            }
+            m_manager -> onWheelTimerAdded(m_next);
+            return true;
+        }
         TimerManager::RWMutexType::WriteLock lock(m_manager -> m_mutex);
-        if(! m_cb) {                    
+        if(m_status != ARMED) {                    
             return false;
         }
         auto it = m_manager -> m_timers.find(shared_from_this());
@@ -91,14 +482,95 @@ namespace sylar {
 
     TimerManager::TimerManager() {
         m_previousTime = sylar::GetCurrentMS();
+        m_useWheel = g_timer_wheel -> getValue();
+        m_slack = g_timer_slack -> getValue();
+        m_id = ++s_timer_manager_id;
+        for(auto& w : m_wheels) {
+            w = nullptr;
+        }
     }
     TimerManager::~TimerManager() {
+        size_t n = m_wheelCount;
+        for(size_t i = 0; i < n; ++ i) {
+            delete m_wheels[i].load();
+        }
+    }
+
+    TimerWheel* TimerManager::findWheel() {
+        if(t_wheel_cache.managerId == m_id) {
+            return t_wheel_cache.wheel;
+        }
+        int tid = sylar::GetThreadID();
+        size_t n = m_wheelCount;
+        for(size_t i = 0; i < n; ++ i) {
+            TimerWheel* w = m_wheels[i];
+            if(w -> threadId == tid) {
+                t_wheel_cache.managerId = m_id;
+                t_wheel_cache.wheel = w;
+                return w;
+            }
+        }
+        return nullptr;
+    }
+
+    TimerWheel* TimerManager::getWheel() {
+        TimerWheel* w = findWheel();
+        if(w) {
+            return w;
+        }
+        Mutex::Lock lock(m_wheelMutex);
+        w = findWheel();
+        if(!w) {
+            size_t n = m_wheelCount;
+            if(n < MAX_WHEELS) {
+                w = new TimerWheel(sylar::GetThreadID(), sylar::GetCurrentMS());
+                m_wheels[n] = w;
+                m_wheelCount = n + 1;
+            } else {
+                w = m_wheels[0];                        // 线程太多了，大家挤一个轮子
+            }
+            t_wheel_cache.managerId = m_id;
+            t_wheel_cache.wheel = w;
+        }
+        return w;
+    }
 
+    uint64_t TimerManager::earliestWheelTimer() {
+        uint64_t next = ~0ull;
+        size_t n = m_wheelCount;
+        for(size_t i = 0; i < n; ++ i) {
+            TimerWheel* w = m_wheels[i];
+            if(w -> live > 0) {                         // 只剩墓碑的轮子不用醒
+                next = std::min(next, w -> nextHint.load());
+            }
+        }
+        return next;
+    }
+
+    /*
+        和set版本"放到了最前面就tickle"一样：新定时器比idle线程们现在等的时间还早，就叫醒一个来重新算epoll_wait的超时
+        先把时间写进轮子的nextHint再读m_earliest，getNextTimer是先写m_earliest再读一遍nextHint，两边总有一边能看到对方
+    */
+    void TimerManager::onWheelTimerAdded(uint64_t next) {
+        if(next < m_earliest.load() && !m_wheelTickled.exchange(true)) {
+            onTimerInsertedAtFront();
+        }
     }
 
     Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring) {
         Timer::ptr timer(new Timer(ms, cb, recurring, this));
+        if(m_useWheel) {
+            TimerWheel* w = getWheel();
+            {
+                Mutex::Lock lock(w -> mutex);
+                timer -> m_wheel = w;
+                w -> add(timer.get());
+            }
+            onWheelTimerAdded(timer -> m_next);
+            return timer;
+        }
         RWMutexType::WriteLock lock(m_mutex);
+        ++m_liveTimers;
         // auto it = m_timers.insert(timer).first;         // set 返回一个pair<it.location, bool success or not>
         // bool at_front = (it == m_timers.begin());       // 看看是不是放在最前面了
         // lock.unlock();
@@ -124,28 +596,66 @@ namespace sylar {
     }
 
     uint64_t TimerManager::getNextTimer() {
+        if(m_useWheel) {
+            m_wheelTickled = false;
+            uint64_t next = earliestWheelTimer();
+            m_earliest = next;
+            next = std::min(next, earliestWheelTimer());    // 上面两步之间加进来的
+            m_earliest = next;
+            if(next == ~0ull) {
+                return ~0ull;
+            }
+            next += m_slack;
+            uint64_t now_ms = sylar::GetCurrentMS();
+            return now_ms >= next ? 0 : next - now_ms;
+        }
         RWMutexType::ReadLock lock(m_mutex);
         m_tickled = false;
-        if(m_timers.empty()) {
-            return ~0ull;                       // 如果Timer为空说明没有任务目前，那么返回最大值，即0取反
+        if(m_timers.empty() || m_liveTimers <= 0) {
+            return ~0ull;                       // 如果Timer为空说明没有任务目前，那么返回最大值，即0取反；只剩墓碑的也一样
         }
 
         /*
             auto it = m_timers.begin();
             const Timer::ptr& next = *it;
         */
-        const Timer::ptr& next = *m_timers.begin(); 
+        uint64_t next = (*m_timers.begin()) -> m_next + m_slack;
         uint64_t now_ms = sylar::GetCurrentMS();
-        if(now_ms >= next -> m_next) {
+        if(now_ms >= next) {
             return 0;                           // 时间都过了或者已经到了，赶紧执行
         } else {
-            return next -> m_next - now_ms;
+            return next - now_ms;
         }
     }
 
     // 引用一个cbs vc, 到时候外部的cbs也会修改，C++技巧
     void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs) {
         uint64_t now_ms = sylar::GetCurrentMS();
+        if(m_useWheel) {
+            // 先处理自己的轮子，别人的轮子正在被用就先跳过，下一轮再来
+            // 时钟往回调了的话每个轮子都要拿锁处理(轮子自己会判断，全部当成到期)
+            bool rollover = detectClockRollover(now_ms);
+            TimerWheel* mine = findWheel();
+            if(mine && (rollover || mine -> nextHint <= now_ms || mine -> needCompact())) {
+                Mutex::Lock lock(mine -> mutex);
+                mine -> expire(now_ms, cbs);
+            }
+            size_t n = m_wheelCount;
+            for(size_t i = 0; i < n; ++ i) {
+                TimerWheel* w = m_wheels[i];
+                if(w == mine) {
+                    continue;
+                }
+                if(rollover) {
+                    w -> mutex.lock();
+                } else if((w -> nextHint > now_ms && !w -> needCompact()) || !w -> mutex.trylock()) {
+                    continue;
+                }
+                w -> expire(now_ms, cbs);
+                w -> mutex.unlock();
+            }
+            return;
+        }
         std::vector<Timer::ptr> expired;
         {
             RWMutexType::ReadLock lock(m_mutex);
@@ -154,6 +664,19 @@ namespace sylar {
             }
         }
         RWMutexType::WriteLock lock(m_mutex);
+        if(NeedCompact(m_liveTimers, m_tombstones)) {   // 墓碑太多了，先清一遍
+            for(auto it = m_timers.begin(); it != m_timers.end();) {
+                if((*it) -> m_status == Timer::CANCELLED) {
+                    --m_tombstones;
+                    it = m_timers.erase(it);
+                } else {
+                    ++ it;
+                }
+            }
+        }
+        if(m_timers.empty()) {                            // 换写锁的间隙可能已经被别的线程取空了
+            return;
+        }
 
         bool rollover = detectClockRollover(now_ms);
         if(! rollover && ((*m_timers.begin()) -> m_next > now_ms)) {
@@ -169,6 +692,12 @@ namespace sylar {
         cbs.reserve(expired.size());
 
         for(auto& timer : expired) {
+            // 循环的先占成FIRING，拷完回调放回去再改回ARMED，这中间cancel会等，不会和它一起碰m_cb
+            int status = Timer::ARMED;
+            if(!timer -> m_status.compare_exchange_strong(status, timer -> m_recurring ? Timer::FIRING : Timer::FIRED)) {
+                --m_tombstones;                 // 墓碑，丢掉(回调cancel的时候已经放掉了)
+                continue;
+            }
             cbs.push_back(timer -> m_cb);
 
             if(timer -> m_recurring) {          // 如果是循环定时器，那么重置
@@ -184,8 +713,10 @@ namespace sylar {
                 */
                 timer->m_next = now_ms + timer -> m_ms;  
                 m_timers.insert(timer);
+                timer -> m_status = Timer::ARMED;
             } else {                            // 否则清空，防止智能指针不释放
                 timer -> m_cb = nullptr;
+                --m_liveTimers;
             }
         }
     }
@@ -206,15 +737,30 @@ namespace sylar {
     //感觉实属多余了。。。
     bool TimerManager::detectClockRollover(uint64_t now_ms) {
         bool rollover = false;
-        if(now_ms < m_previousTime && now_ms < (m_previousTime - 60 * 60 * 1000)) {
+        uint64_t previous = m_previousTime.exchange(now_ms);    // 时间轮模式下不在锁里调用
+        if(now_ms < previous && now_ms < (previous - 60 * 60 * 1000)) {
             rollover = true;
         }
-        m_previousTime = now_ms;
         return rollover;
     }
 
+    size_t TimerManager::getTimerCount() {
+        int64_t n = 0;
+        if(m_useWheel) {
+            size_t wheels = m_wheelCount;
+            for(size_t i = 0; i < wheels; ++ i) {
+                n += m_wheels[i].load() -> live;
+            }
+        } else {
+            n = m_liveTimers;
+        }
+        return n > 0 ? n : 0;
+    }
+
     bool TimerManager::hasTimer() {
-        RWMutexType::ReadLock lock(m_mutex);
-        return !m_timers.empty();
+        if(m_useWheel) {
+            return earliestWheelTimer() != ~0ull;
+        }
+        return m_liveTimers > 0;
     }
 }
\ No newline at end of file
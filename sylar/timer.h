@@ -2,8 +2,10 @@
 #define __SYLAR_TIMER_H__
 
 #include <memory>
+#include <atomic>
 #include "thread.h"
 #include <set>
+#include <vector>
 #include "util.h"
 
 
@@ -19,12 +21,27 @@
     之后在IOmanager的核心方法Idle()中，会先检查一下再TM中下次的要执行的CB任务的时间，并且和默认的idle时间5秒选一个最小的出来，作为timeout时间
     在timeout的时候到的时候会去执行Scheduler里的待执行的CB或者Fiber，
     但是在Timout之前，会先来TM里找下有没有到时间要执行的方法，有就一并加到Scheduler的列表中，下次执行。
+
+    两种实现(timer.wheel配置)：
+    - true(默认): 分层时间轮，每个加定时器的线程一个轮子(各自一把锁)，加入/取消都是O(1)，见timer.cc里的TimerWheel
+    - false: 原来的std::set + 一把RWMutex，加入/refresh/reset O(log n)，所有线程抢一把写锁
+    getNextTimer/listExpiredCb对外的语义两种是一样的，idle的线程会把所有轮子上到期的都拿出来
+
+    取消不拿锁：hook里几乎每个超时定时器最后都是被cancel的(IO先回来了)，cancel只是CAS一下状态打个墓碑，
+    回调当场放掉(捕获的连接对象不会被墓碑拖着)，定时器本身还留在set/轮子上，
+    到期的时候或者listExpiredCb发现墓碑太多的时候再真正拿掉
+    时间轮模式下refresh也不拿锁，只把m_next往后推，轮子转到原来的位置发现还没到会重新放
+
+    timer.slack_ms: 允许定时器晚触发的时间，idle按"最早到期时间 + slack"睡，醒来把已经到期的一起拿走，
+    这样挨得很近的定时器一次唤醒就处理完了，默认0
 */    
 
 namespace sylar {
     class TimerManager;
+    class TimerWheel;
     class Timer : public std::enable_shared_from_this<Timer> {
         friend class TimerManager;
+        friend class TimerWheel;
         public:
             typedef std::shared_ptr<Timer> ptr;
             bool cancel();
@@ -36,12 +53,28 @@ namespace sylar {
             Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
             Timer(uint64_t next);
             
+            // 状态，只能从ARMED变出去(FIRING除外，轮子发现被refresh推后了会改回ARMED)
+            enum Status {
+                ARMED = 0,                  // 在等着到期
+                FIRING = 1,                 // 正在处理它(拿着轮子的锁/set模式的写锁)
+                FIRED = 2,                  // 非循环的已经触发了
+                CANCELLED = 3               // 取消了，可能还挂在set/轮子上(墓碑)
+            };
+
         private:
             bool m_recurring = false;       // 是否周期循环定时器
-            uint64_t m_ms = 0;              // 执行周期
-            uint64_t m_next = 0;            // 精确的下次执行时间
+            std::atomic<uint64_t> m_ms;     // 执行周期
+            std::atomic<uint64_t> m_next;   // 精确的下次执行时间，时间轮模式下refresh不拿锁改
+            std::atomic<int> m_status = {ARMED};
             std::function<void()> m_cb;
             TimerManager* m_manager = nullptr;
+
+            // 时间轮模式用的
+            TimerWheel* m_wheel = nullptr;  // 加在哪个轮子上，加进去之后就不变了
+            Timer* m_prevNode = nullptr;    // 槽里的侵入式双向链表
+            Timer* m_nextNode = nullptr;
+            int m_slot = -1;                // 在哪个槽，-1表示不在轮子上
+            Timer::ptr m_self;              // 挂在轮子上的时候自己持有自己，相当于set里存的那份引用
         private:
             // 比较器，给定时器用的，用来确定顺序
             struct Comparator { 
@@ -65,17 +98,37 @@ namespace sylar {
             uint64_t getNextTimer();
             void listExpiredCb(std::vector<std::function<void()> >& cbs);       //返回所有到期、要执行的回调，给scheduler 用的
             bool hasTimer();
+            size_t getTimerCount();                 // 还会触发的定时器数(取消了的不算)
+
+            void setSlack(uint64_t ms) { m_slack = ms;}
+            uint64_t getSlack() const { return m_slack;}
         protected:
             virtual void onTimerInsertedAtFront() = 0;              // 快速唤醒，如果当前的定时比idle默认轮训小，需要紧急唤醒
             void addTimer(Timer::ptr val, RWMutexType::WriteLock& lock);
         private:
             bool detectClockRollover(uint64_t now_ms);
+            TimerWheel* getWheel();                     // 当前线程的时间轮，没有就建一个
+            TimerWheel* findWheel();                    // 当前线程的时间轮，没有返回nullptr
+            uint64_t earliestWheelTimer();              // 所有轮子里最早的到期时间(下界)
+            void onWheelTimerAdded(uint64_t next);      // 比idle线程们等的时间还早的话tickle
         private:
             RWMutexType m_mutex;
             // 定时器，需要有序所以用set，注意这里第一个是存放的类型，即ptr，第二个是比较器的struct
             std::set<Timer::ptr, Timer::Comparator> m_timers;
             bool m_tickled = false; 
-            uint64_t m_previousTime = 0;
+            std::atomic<uint64_t> m_previousTime = {0};
+            std::atomic<int64_t> m_liveTimers = {0};    // set模式下还会触发的定时器数
+            std::atomic<int64_t> m_tombstones = {0};    // set模式下取消了但还在set里的
+            std::atomic<uint64_t> m_slack = {0};
+
+            static const size_t MAX_WHEELS = 256;       // 超过这么多线程的共用第0个轮子
+            bool m_useWheel = true;
+            uint64_t m_id = 0;                          // 线程本地缓存轮子的时候用，防止地址复用认错
+            Mutex m_wheelMutex;                         // 只有新建轮子的时候用
+            std::atomic<TimerWheel*> m_wheels[MAX_WHEELS];
+            std::atomic<size_t> m_wheelCount = {0};
+            std::atomic<uint64_t> m_earliest = {~0ull}; // 上一次getNextTimer算出来的最早到期时间，idle线程按这个睡
+            std::atomic<bool> m_wheelTickled = {false};
     };
 }
 
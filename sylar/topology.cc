@@ -0,0 +1,201 @@
+#include "topology.h"
+#include "log.h"
+
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+namespace sylar {
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static thread_local int t_thread_node = -1;
+
+    static bool ReadFile(const std::string& path, std::string& out) {
+        std::ifstream ifs(path);
+        if(!ifs) {
+            return false;
+        }
+        std::getline(ifs, out);
+        return true;
+    }
+
+    static int ReadInt(const std::string& path, int def) {
+        std::string str;
+        if(!ReadFile(path, str) || str.empty()) {
+            return def;
+        }
+        return atoi(str.c_str());
+    }
+
+    bool CpuTopology::ParseCpuList(const std::string& str, std::vector<int>& cpus) {
+        cpus.clear();
+        size_t pos = 0;
+        while(pos < str.size()) {
+            size_t end = str.find(',', pos);
+            if(end == std::string::npos) {
+                end = str.size();
+            }
+            std::string item = str.substr(pos, end - pos);
+            pos = end + 1;
+            item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+            if(item.empty()) {
+                continue;
+            }
+            char* p = nullptr;
+            long first = strtol(item.c_str(), &p, 10);
+            long last = first;
+            if(p == item.c_str() || first < 0) {
+                return false;
+            }
+            if(*p == '-') {
+                const char* q = p + 1;
+                last = strtol(q, &p, 10);
+                if(p == q || last < first) {
+                    return false;
+                }
+            }
+            if(*p) {
+                return false;
+            }
+            for(long i = first; i <= last; ++ i) {
+                cpus.push_back((int)i);
+            }
+        }
+        return true;
+    }
+
+    CpuTopology::CpuTopology() {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed)) {
+            SYLAR_LOG_ERROR(g_logger) << "sched_getaffinity errno=" << errno << " " << strerror(errno);
+            for(int i = 0; i < sysconf(_SC_NPROCESSORS_ONLN) && i < CPU_SETSIZE; ++ i) {
+                CPU_SET(i, &allowed);
+            }
+        }
+
+        // cpu -> node，从每个node的cpulist反查
+        std::map<int, int> cpu_node;
+        std::vector<int> nodes;
+        DIR* dir = opendir("/sys/devices/system/node");
+        if(dir) {
+            while(dirent* ent = readdir(dir)) {
+                int node = 0;
+                if(strncmp(ent -> d_name, "node", 4) || sscanf(ent -> d_name + 4, "%d", &node) != 1) {
+                    continue;
+                }
+                std::string list;
+                std::vector<int> cpus;
+                if(!ReadFile(std::string("/sys/devices/system/node/") + ent -> d_name + "/cpulist", list)
+                        || !ParseCpuList(list, cpus) || cpus.empty()) {
+                    continue;                               // 只有内存没有cpu的node
+                }
+                nodes.push_back(node);
+                for(int c : cpus) {
+                    cpu_node[c] = node;
+                }
+            }
+            closedir(dir);
+        }
+
+        for(int i = 0; i < CPU_SETSIZE; ++ i) {
+            if(!CPU_ISSET(i, &allowed)) {
+                continue;
+            }
+            Cpu cpu;
+            cpu.id = i;
+            auto it = cpu_node.find(i);
+            cpu.node = it == cpu_node.end() ? 0 : it -> second;
+            std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(i) + "/topology/";
+            cpu.package = ReadInt(base + "physical_package_id", 0);
+            cpu.core = ReadInt(base + "core_id", i);
+            m_cpus.push_back(cpu);
+        }
+        m_nodeCount = std::max<size_t>(1, nodes.size());
+    }
+
+    const CpuTopology& CpuTopology::Get() {
+        static CpuTopology s_topology;                  // C++11保证只构造一次
+        return s_topology;
+    }
+
+    int CpuTopology::getNode(int cpu) const {
+        for(auto& c : m_cpus) {
+            if(c.id == cpu) {
+                return c.node;
+            }
+        }
+        return -1;
+    }
+
+    std::vector<int> CpuTopology::getAutoOrder() const {
+        std::vector<Cpu> cpus = m_cpus;
+        std::stable_sort(cpus.begin(), cpus.end(), [](const Cpu& a, const Cpu& b) {
+            if(a.node != b.node) {
+                return a.node < b.node;
+            }
+            if(a.package != b.package) {
+                return a.package < b.package;
+            }
+            return a.core < b.core;
+        });
+        std::vector<int> first;                         // 每个物理核的第一个逻辑cpu
+        std::vector<int> siblings;                      // 剩下的超线程
+        for(size_t i = 0; i < cpus.size(); ++ i) {
+            bool same_core = i > 0 && cpus[i].package == cpus[i - 1].package
+                                   && cpus[i].core == cpus[i - 1].core;
+            (same_core ? siblings : first).push_back(cpus[i].id);
+        }
+        first.insert(first.end(), siblings.begin(), siblings.end());
+        return first;
+    }
+
+    bool CpuTopology::BindThread(int cpu) {
+        if(cpu < 0 || cpu >= CPU_SETSIZE) {
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rt = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if(rt) {
+            SYLAR_LOG_ERROR(g_logger) << "pthread_setaffinity_np cpu=" << cpu
+                                      << " rt=" << rt << " " << strerror(rt);
+            return false;
+        }
+        t_thread_node = Get().getNode(cpu);
+        return true;
+    }
+
+    int CpuTopology::GetThreadNode() {
+        return t_thread_node;
+    }
+
+    bool CpuTopology::BindMemory(void* addr, size_t len, int node) {
+        if(node < 0 || Get().getNodeCount() < 2) {
+            return false;
+        }
+        unsigned long mask[4] = {0};                    // 最多256个node
+        if(node >= (int)(sizeof(mask) * 8)) {
+            return false;
+        }
+        mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+        if(syscall(__NR_mbind, addr, len, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0)) {
+            SYLAR_LOG_ERROR(g_logger) << "mbind node=" << node << " len=" << len
+                                      << " errno=" << errno << " " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef __SYLAR_TOPOLOGY_H__
+#define __SYLAR_TOPOLOGY_H__
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+
+/*
+    CPU/NUMA拓扑，从/sys/devices/system读，不依赖libnuma
+    - 只算进程当前允许跑的cpu(sched_getaffinity)，比如被taskset/cgroup限制过
+    - 读不到(没有/sys或者内核没开NUMA)的时候当成只有一个node 0
+    - 进程里只读一次，之后的查询不加锁
+*/
+namespace sylar {
+
+    class CpuTopology {
+    public:
+        struct Cpu {
+            int id = -1;
+            int node = 0;           // NUMA node
+            int package = 0;        // 物理CPU(插槽)
+            int core = 0;           // package里的物理核
+        };
+
+        static const CpuTopology& Get();
+
+        const std::vector<Cpu>& getCpus() const { return m_cpus;}
+        size_t getNodeCount() const { return m_nodeCount;}
+        int getNode(int cpu) const;                     // 不在可用cpu里的返回-1
+
+        /*
+            自动绑核用的顺序：每个物理核先出一个逻辑cpu，按node排好，核用完了再出超线程的兄弟
+            前n个worker绑前n个cpu，同一个node上的worker尽量挨在一起
+        */
+        std::vector<int> getAutoOrder() const;
+
+        // "0-3,8,10-11"这样的列表，格式不对返回false
+        static bool ParseCpuList(const std::string& str, std::vector<int>& cpus);
+
+        // 把当前线程绑到一个cpu上，成功之后GetThreadNode()返回这个cpu的node
+        static bool BindThread(int cpu);
+        static int GetThreadNode();                     // 当前线程绑过核的话是它的node，没绑过-1
+
+        // 内存以后缺页的时候优先从node上分(MPOL_PREFERRED)，只有一个node的时候什么都不做
+        static bool BindMemory(void* addr, size_t len, int node);
+
+    private:
+        CpuTopology();
+
+    private:
+        std::vector<Cpu> m_cpus;
+        size_t m_nodeCount = 1;
+    };
+}
+
+#endif
@@ -0,0 +1,205 @@
+#include "uring.h"
+#include "log.h"
+#include "macro.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+namespace sylar {
+    static sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("system");
+
+    static int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+        return (int)syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                                  unsigned flags, const void* arg, size_t argsz) {
+        return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+    }
+
+    // 超时等待要IORING_FEAT_EXT_ARG，完成队列满了不丢要IORING_FEAT_NODROP
+    static const unsigned kRequiredFeatures = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+
+    IoUring::IoUring() {
+    }
+
+    IoUring::~IoUring() {
+        if(m_sqes) {
+            munmap(m_sqes, m_sqesSize);
+        }
+        if(m_cqPtr && m_cqPtr != m_sqPtr) {
+            munmap(m_cqPtr, m_cqSize);
+        }
+        if(m_sqPtr) {
+            munmap(m_sqPtr, m_sqSize);
+        }
+        if(m_fd >= 0) {
+            close(m_fd);
+        }
+    }
+
+    bool IoUring::Supported() {
+        static int s_supported = -1;                    // 多个线程同时探测结果也一样，不用加锁
+        if(s_supported < 0) {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            int fd = sys_io_uring_setup(2, &p);
+            if(fd < 0) {
+                SYLAR_LOG_INFO(g_logger) << "io_uring not available: " << strerror(errno);
+                s_supported = 0;
+            } else {
+                close(fd);
+                s_supported = (p.features & kRequiredFeatures) == kRequiredFeatures;
+                if(!s_supported) {
+                    SYLAR_LOG_INFO(g_logger) << "io_uring lacks required features, features=" << p.features;
+                }
+            }
+        }
+        return s_supported > 0;
+    }
+
+    bool IoUring::init(unsigned entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        m_fd = sys_io_uring_setup(entries, &p);
+        if(m_fd < 0) {
+            SYLAR_LOG_ERROR(g_logger) << "io_uring_setup(" << entries << ") errno="
+                                      << errno << " " << strerror(errno);
+            return false;
+        }
+        if((p.features & kRequiredFeatures) != kRequiredFeatures) {
+            return false;
+        }
+
+        m_sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;     // 提交和完成两个环可以一次映射
+        if(single) {
+            m_sqSize = m_cqSize = std::max(m_sqSize, m_cqSize);
+        }
+        m_sqPtr = mmap(nullptr, m_sqSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if(m_sqPtr == MAP_FAILED) {
+            m_sqPtr = nullptr;
+            return false;
+        }
+        if(single) {
+            m_cqPtr = m_sqPtr;
+        } else {
+            m_cqPtr = mmap(nullptr, m_cqSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if(m_cqPtr == MAP_FAILED) {
+                m_cqPtr = nullptr;
+                return false;
+            }
+        }
+        m_sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) {
+            return false;
+        }
+        m_sqes = (io_uring_sqe*)sqes;
+
+        char* sq = (char*)m_sqPtr;
+        m_sqHead = (unsigned*)(sq + p.sq_off.head);
+        m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+        m_sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+        m_sqArray = (unsigned*)(sq + p.sq_off.array);
+        m_sqEntries = p.sq_entries;
+
+        char* cq = (char*)m_cqPtr;
+        m_cqHead = (unsigned*)(cq + p.cq_off.head);
+        m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+        m_cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    bool IoUring::push(const io_uring_sqe& sqe) {
+        for(int i = 0; i < 2; ++ i) {
+            {
+                SpinLock::Lock lock(m_mutex);
+                unsigned tail = *m_sqTail;
+                unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+                if(tail - head < m_sqEntries) {
+                    unsigned idx = tail & *m_sqMask;
+                    m_sqes[idx] = sqe;
+                    m_sqArray[idx] = idx;
+                    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+                    ++m_queued;
+                    return true;
+                }
+            }
+            submit();                                   // 满了，先交给内核腾地方
+        }
+        SYLAR_LOG_ERROR(g_logger) << "io_uring submission queue full, fd=" << m_fd;
+        return false;
+    }
+
+    int IoUring::submit() {
+        return enter(0, 0, 0);
+    }
+
+    int IoUring::submitAndWait(uint64_t timeout_ms) {
+        return enter(1, IORING_ENTER_GETEVENTS, timeout_ms);
+    }
+
+    /*
+        提交的个数在锁里取走，系统调用在锁外做；
+        两个线程同时enter的时候内核各自从head往后拿，总数是对的，拿到的是谁放进去的无所谓
+        没交上去的(内核返回的比要交的少)再记回m_queued
+    */
+    int IoUring::enter(unsigned min_complete, unsigned flags, uint64_t timeout_ms) {
+        unsigned to_submit = 0;
+        {
+            SpinLock::Lock lock(m_mutex);
+            to_submit = m_queued;
+            m_queued = 0;
+        }
+        if(!to_submit && !min_complete) {
+            return 0;
+        }
+
+        int rt = 0;
+        if(min_complete) {
+            io_uring_getevents_arg arg;
+            memset(&arg, 0, sizeof(arg));
+            __kernel_timespec ts;
+            if(timeout_ms != ~0ull) {
+                ts.tv_sec = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+                arg.ts = (uint64_t)(uintptr_t)&ts;
+            }
+            rt = sys_io_uring_enter(m_fd, to_submit, min_complete,
+                                    flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        } else {
+            rt = sys_io_uring_enter(m_fd, to_submit, 0, flags, nullptr, 0);
+        }
+
+        unsigned submitted = rt < 0 ? 0 : std::min((unsigned)rt, to_submit);
+        if(submitted < to_submit) {
+            int err = errno;
+            SpinLock::Lock lock(m_mutex);
+            m_queued += to_submit - submitted;
+            errno = err;
+        }
+        return rt;
+    }
+
+    unsigned IoUring::reap(io_uring_cqe* cqes, unsigned max) {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        unsigned n = 0;
+        while(head != tail && n < max) {
+            cqes[n++] = m_cqes[head & *m_cqMask];
+            ++head;
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return n;
+    }
+}
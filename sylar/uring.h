@@ -0,0 +1,69 @@
+#ifndef __SYLAR_URING_H__
+#define __SYLAR_URING_H__
+
+#include "noncopyable.h"
+#include "thread.h"
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+/*
+    io_uring的一个很薄的封装，不依赖liburing，直接用io_uring_setup/io_uring_enter两个系统调用
+    - 要求内核支持IORING_FEAT_EXT_ARG(带超时的等待，5.11以后)，不支持的话Supported()返回false，IOManager退回epoll
+    - 提交队列可以多个线程往里放(有锁)，完成队列只能由一个线程收
+*/
+namespace sylar {
+
+    class IoUring : Noncopyable {
+    public:
+        IoUring();
+        ~IoUring();
+
+        static bool Supported();                // 内核能不能用，只探测一次
+
+        bool init(unsigned entries);
+
+        // 把填好的sqe拷进提交队列，队列满了先把已经放进去的提交掉；失败返回false
+        bool push(const io_uring_sqe& sqe);
+
+        // 把提交队列里攒着的一次提交掉，返回提交的个数
+        int submit();
+        // 提交，并且等到至少有一个完成或者超时(毫秒，~0ull一直等)
+        int submitAndWait(uint64_t timeout_ms);
+
+        // 从完成队列里最多拷出max个，返回拷出的个数
+        unsigned reap(io_uring_cqe* cqes, unsigned max);
+
+        // 完成队列里有没有没收的，不进内核
+        bool hasCompletions() const { return *m_cqHead != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);}
+        unsigned getQueued() const { return m_queued;}      // 放进去了还没提交的个数
+        int getFd() const { return m_fd;}
+
+    private:
+        int enter(unsigned min_complete, unsigned flags, uint64_t timeout_ms);
+
+    private:
+        int m_fd = -1;
+        // 提交队列
+        void* m_sqPtr = nullptr;
+        size_t m_sqSize = 0;
+        unsigned* m_sqHead = nullptr;
+        unsigned* m_sqTail = nullptr;
+        unsigned* m_sqMask = nullptr;
+        unsigned* m_sqArray = nullptr;
+        io_uring_sqe* m_sqes = nullptr;
+        size_t m_sqesSize = 0;
+        unsigned m_sqEntries = 0;
+        // 完成队列
+        void* m_cqPtr = nullptr;
+        size_t m_cqSize = 0;
+        unsigned* m_cqHead = nullptr;
+        unsigned* m_cqTail = nullptr;
+        unsigned* m_cqMask = nullptr;
+        io_uring_cqe* m_cqes = nullptr;
+
+        unsigned m_queued = 0;
+        SpinLock m_mutex;                       // 保护提交队列的tail和m_queued
+    };
+}
+
+#endif
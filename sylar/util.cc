@@ -2,6 +2,7 @@
 #include "log.h"
 #include "fiber.h"
 #include <execinfo.h>
+#include <time.h>
 
 namespace sylar {
     static Logger::ptr g_logger = SYLAR_LOG_NAME("system");
@@ -64,6 +65,20 @@ namespace sylar {
         return ss.str();
     }
 
+    std::string BacktraceToString(void** frames, int size, int skip, const std::string& prefix) {
+        char** strings = backtrace_symbols(frames, size);
+        if(strings == NULL) {
+            SYLAR_LOG_ERROR(g_logger) << "backtrace_symbols error.";
+            return "";
+        }
+        std::stringstream ss;
+        for(int i = skip; i < size; ++ i) {
+            ss << prefix << strings[i] << std::endl;
+        }
+        free(strings);
+        return ss.str();
+    }
+
     uint64_t GetCurrentMS() {
         struct timeval tv;
         gettimeofday(&tv, NULL);
@@ -75,4 +90,10 @@ namespace sylar {
         gettimeofday(&tv, NULL);
         return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
     }
+
+    uint64_t GetMonotonicNS() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
 }
\ No newline at end of file
@@ -16,10 +16,22 @@ namespace sylar{
 
     void Backtrace(std::vector<std::string>& bt, int size = 64, int skip = 1);
     std::string BacktraceToString(int size = 64, int skip = 2, const std::string& prefix = "");
+    // 别处(比如信号处理函数里)已经用backtrace()抓好的栈，这里只做符号化
+    std::string BacktraceToString(void** frames, int size, int skip = 0, const std::string& prefix = "");
     
     // 时间ms
     uint64_t GetCurrentMS();
     uint64_t GetCurrentUS();
+    uint64_t GetMonotonicNS();          // CLOCK_MONOTONIC，量耗时用，不受改系统时间影响
+
+    // 忙等循环里每一圈调一次，让出流水线给超线程的兄弟，也省电
+    inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield" ::: "memory");
+#endif
+    }
 
 }
 
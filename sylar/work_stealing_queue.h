@@ -0,0 +1,112 @@
+#ifndef __SYLAR_WORK_STEALING_QUEUE_H__
+#define __SYLAR_WORK_STEALING_QUEUE_H__
+
+#include <atomic>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include "noncopyable.h"
+
+namespace sylar {
+
+    /*
+        有界无锁双端队列 (Chase-Lev work stealing deque)
+        - 只有队列的拥有者线程可以push/pop，操作的是bottom端，后进先出，cache更热
+        - 其他线程只能steal，操作的是top端，先进先出，通过CAS抢top
+        容量固定(2的幂)，满了push返回false，由调用方决定放到哪里(比如全局队列)
+        因为buffer不扩容，所以不存在旧buffer回收的问题
+        队列里只存指针，元素的生命周期由调用方管理
+    */
+    template<class T>
+    class WorkStealingQueue : Noncopyable {
+    public:
+        WorkStealingQueue(size_t capacity = 256)
+            : m_top(0),
+              m_bottom(0),
+              m_mask(RoundUp(capacity) - 1),
+              m_buffer(m_mask + 1) {
+            for(auto& i : m_buffer) {
+                i.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        // 只能由拥有者线程调用
+        bool push(T* v) {
+            int64_t b = m_bottom.load(std::memory_order_relaxed);
+            int64_t t = m_top.load(std::memory_order_acquire);
+            if(b - t > (int64_t)m_mask) {        // 满了
+                return false;
+            }
+            m_buffer[b & m_mask].store(v, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // 只能由拥有者线程调用，空的时候返回nullptr
+        T* pop() {
+            int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+            m_bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = m_top.load(std::memory_order_relaxed);
+            if(t > b) {                          // 空队列, 还原bottom
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            T* v = m_buffer[b & m_mask].load(std::memory_order_relaxed);
+            if(t == b) {                         // 最后一个元素，要和steal的线程抢
+                if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                                  std::memory_order_relaxed)) {
+                    v = nullptr;                 // 被偷走了
+                }
+                m_bottom.store(b + 1, std::memory_order_relaxed);
+            }
+            return v;
+        }
+
+        // 任意线程都可以调用，空的或者抢失败返回nullptr
+        T* steal() {
+            int64_t t = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t b = m_bottom.load(std::memory_order_acquire);
+            if(t >= b) {
+                return nullptr;
+            }
+            T* v = m_buffer[t & m_mask].load(std::memory_order_relaxed);
+            if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                              std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return v;
+        }
+
+        // 近似值，只用来判断要不要去偷/是否空闲
+        size_t size() const {
+            int64_t b = m_bottom.load(std::memory_order_relaxed);
+            int64_t t = m_top.load(std::memory_order_relaxed);
+            return b > t ? (size_t)(b - t) : 0;
+        }
+
+        bool empty() const { return size() == 0; }
+        size_t capacity() const { return m_mask + 1; }
+    private:
+        static size_t RoundUp(size_t v) {
+            size_t cap = 2;
+            while(cap < v) {
+                cap <<= 1;
+            }
+            return cap;
+        }
+    private:
+        // top和bottom用padding分开cache line，避免steal和push/pop互相false sharing
+        // 不用alignas是因为c++11的new不保证超过16字节的对齐
+        std::atomic<int64_t> m_top;
+        char m_pad1[64 - sizeof(std::atomic<int64_t>)];
+        std::atomic<int64_t> m_bottom;
+        char m_pad2[64 - sizeof(std::atomic<int64_t>)];
+        size_t m_mask;
+        std::vector<std::atomic<T*> > m_buffer;
+    };
+}
+
+#endif
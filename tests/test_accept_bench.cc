@@ -0,0 +1,274 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/tcp_server.h"
+#include "sylar/socket.h"
+#include "sylar/address.h"
+#include <atomic>
+#include <map>
+#include <fstream>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include "sylar/hook.h"
+
+/*
+    短连接建连压测，服务端accept到就算一个然后关掉，客户端等到EOF再关(TIME_WAIT留在服务端，客户端端口不会用完)
+    服务端线程数从1开始翻倍，三种接法各跑一遍:
+    - single:  原来的一个accept协程，连接再过共享队列分给worker
+    - reuse:   tcp_server.reuseport，每个线程一个SO_REUSEPORT监听socket，在哪个线程accept就在哪个线程处理
+    - cbpf:    reuse再挂上按cpu选socket的CBPF(线程绑核才有同核的效果，这里配了scheduler.affinity=auto)
+    先单独量accept这一步: 把n个连接先连好堆在backlog里，再一口气取出来，
+    - legacy: 原来Socket::accept的系统调用序列(accept，hook登记fd的fstat+2次fcntl，SO_REUSEADDR/TCP_NODELAY，
+              getsockname/getpeername，TcpServer再setsockopt一次读超时)
+    - batch:  acceptBatch + AcceptTemplate(accept4，没有别的系统调用)
+    打出每秒建连数、服务端线程平均每个连接花的cpu时间(/proc的schedstat)，以及连接在各个线程上分得是不是均匀(最多的线程/平均)
+    test_accept_bench [每个点跑几秒] [服务端最多几个线程] [客户端并发数] [backlog里堆几个连接]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int kClientThreads = 2;
+
+static std::atomic<uint64_t> s_accepted = {0};
+static std::atomic<uint64_t> s_connects = {0};
+static std::atomic<int> s_clients_done = {0};
+
+class CountServer : public sylar::TcpServer {
+public:
+    typedef std::shared_ptr<CountServer> ptr;
+    CountServer(sylar::IOManager* worker)
+        : sylar::TcpServer(worker, worker) {
+    }
+
+    std::map<int, uint64_t> getPerThread() {
+        sylar::Mutex::Lock lock(m_mutex);
+        return m_perThread;
+    }
+protected:
+    void handleClient(sylar::Socket::ptr client) override {
+        ++s_accepted;
+        sylar::Mutex::Lock lock(m_mutex);
+        ++m_perThread[sylar::GetThreadID()];
+        client -> close();
+    }
+private:
+    sylar::Mutex m_mutex;
+    std::map<int, uint64_t> m_perThread;
+};
+
+static void client(sylar::Address::ptr addr, uint64_t deadline_ms) {
+    while(sylar::GetCurrentMS() < deadline_ms) {
+        sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+        if(!sock -> connect(addr)) {
+            SYLAR_LOG_ERROR(g_logger) << "connect fail errno=" << errno;
+            break;
+        }
+        char c;
+        sock -> recv(&c, 1);
+        sock -> close();
+        ++s_connects;
+    }
+    ++s_clients_done;
+}
+
+// 这些线程在cpu上跑过的总时间，ns
+static uint64_t cpu_ns(const std::vector<sylar::Scheduler::WorkerPlacement>& workers) {
+    uint64_t total = 0;
+    for(auto& w : workers) {
+        std::ifstream ifs("/proc/self/task/" + std::to_string(w.threadId) + "/schedstat");
+        uint64_t ns = 0;
+        ifs >> ns;
+        total += ns;
+    }
+    return total;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 返回平均每个连接多少ns
+static double drain(bool legacy, int n) {
+    double res = 0;
+    {                               // iom析构的时候等任务跑完
+        sylar::IOManager iom(1, false, "drain");
+        iom.schedule([legacy, n, &res](){
+            sylar::Address::ptr addr = sylar::IPAddress::Create("127.0.0.1", 0);
+            sylar::Socket::ptr listener = sylar::Socket::CreateTCP(addr);
+            if(!listener -> bind(addr) || !listener -> listen(n)) {
+                SYLAR_LOG_ERROR(g_logger) << "bind/listen fail errno=" << errno;
+                return;
+            }
+            sylar::Address::ptr local = listener -> getLocalAddress();
+            std::vector<sylar::Socket::ptr> clients;
+            for(int i = 0; i < n; ++ i) {
+                sylar::Socket::ptr c = sylar::Socket::CreateTCP(local);
+                if(!c -> connect(local)) {
+                    SYLAR_LOG_ERROR(g_logger) << "connect fail errno=" << errno << " at " << i;
+                    break;
+                }
+                clients.push_back(c);
+            }
+
+            std::vector<sylar::Socket::ptr> socks;
+            std::vector<int> fds;
+            uint64_t begin = now_ns();
+            if(legacy) {
+                int lfd = listener -> geSocket();
+                int one = 1;
+                struct timeval tv = {120, 0};
+                for(size_t i = 0; i < clients.size(); ++ i) {
+                    int fd = accept(lfd, nullptr, nullptr);
+                    if(fd == -1) {
+                        break;
+                    }
+                    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    sockaddr_storage sa;
+                    socklen_t len = sizeof(sa);
+                    getsockname(fd, (sockaddr*)&sa, &len);
+                    len = sizeof(sa);
+                    getpeername(fd, (sockaddr*)&sa, &len);
+                    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                    fds.push_back(fd);
+                }
+            } else {
+                sylar::Socket::AcceptTemplate tmpl;
+                tmpl.recvTimeout = 120 * 1000;
+                while(socks.size() < clients.size()) {
+                    if(!listener -> acceptBatch(socks, clients.size() - socks.size(), &tmpl)) {
+                        break;
+                    }
+                }
+            }
+            uint64_t used = now_ns() - begin;
+            size_t got = legacy ? fds.size() : socks.size();
+            res = got ? (double)used / got : 0;
+            for(int fd : fds) {
+                close(fd);
+            }
+        });
+    }
+    return res;
+}
+
+enum Mode {
+    SINGLE,
+    REUSE,
+    CBPF,
+};
+
+static const char* ModeName(Mode mode) {
+    switch(mode) {
+        case SINGLE:
+            return "single";
+        case REUSE:
+            return "reuse ";
+        case CBPF:
+            return "cbpf  ";
+    }
+    return "";
+}
+
+static double run(Mode mode, int threads, int conns, int seconds, double& skew, double& cpu_us) {
+    s_accepted = 0;
+    s_connects = 0;
+    s_clients_done = 0;
+    std::map<std::string, std::string> affinity;
+    if(mode == CBPF) {
+        affinity["accept"] = "auto";
+    }
+    sylar::Config::Lookup<std::map<std::string, std::string> >("scheduler.affinity") -> setValue(affinity);
+    sylar::IOManager server(threads, false, "accept");
+    sylar::IOManager clients(kClientThreads, false, "client");
+
+    // 监听socket要在hook打开的线程里建
+    CountServer::ptr srv(new CountServer(&server));
+    srv -> setReusePort(mode != SINGLE);
+    srv -> setReusePortCbpf(mode == CBPF);
+    sylar::Address::ptr local;
+    std::atomic<bool> ready = {false};
+    server.schedule([srv, &local, &ready](){
+        std::vector<sylar::Address::ptr> addrs, fails;
+        addrs.push_back(sylar::IPAddress::Create("127.0.0.1", 0));
+        if(srv -> bind(addrs, fails) && srv -> start()) {
+            local = srv -> getSocks()[0] -> getLocalAddress();
+        }
+        ready = true;
+    });
+    while(!ready) {
+        usleep(1000);
+    }
+    if(!local) {
+        SYLAR_LOG_ERROR(g_logger) << "bind fail";
+        srv -> stop();
+        return 0;
+    }
+
+    std::vector<sylar::Scheduler::WorkerPlacement> workers = server.getPlacement();
+    uint64_t cpu_begin = cpu_ns(workers);
+    uint64_t begin = sylar::GetCurrentMS();
+    uint64_t deadline = begin + seconds * 1000;
+    for(int i = 0; i < conns; ++ i) {
+        clients.schedule(std::bind(&client, local, deadline));
+    }
+    while(s_clients_done < conns) {
+        usleep(10 * 1000);
+    }
+    uint64_t used = sylar::GetCurrentMS() - begin;
+    cpu_us = s_accepted ? (cpu_ns(workers) - cpu_begin) / 1000.0 / s_accepted : 0;
+    srv -> stop();
+
+    std::map<int, uint64_t> per_thread = srv -> getPerThread();
+    uint64_t max = 0;
+    for(auto& i : per_thread) {
+        max = std::max(max, i.second);
+    }
+    skew = s_accepted ? (double)max * threads / s_accepted : 0;
+    return s_accepted * 1000.0 / (used ? used : 1);
+}
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int conns = argc > 3 ? atoi(argv[3]) : 32;
+    int backlog = argc > 4 ? atoi(argv[4]) : 1000;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur != RLIM_INFINITY && (rlim_t)backlog * 2 + 64 > rl.rlim_cur) {
+        backlog = (rl.rlim_cur - 64) / 2;
+    }
+    for(int i = 0; i < 3; ++ i) {
+        double legacy = drain(true, backlog);
+        double batch = drain(false, backlog);
+        SYLAR_LOG_INFO(g_logger) << "drain " << backlog << " backlogged connections: legacy="
+            << legacy << "ns/conn batch=" << batch << "ns/conn";
+    }
+
+    SYLAR_LOG_INFO(g_logger) << "cpus=" << sysconf(_SC_NPROCESSORS_ONLN)
+        << " concurrent connects=" << conns;
+    Mode modes[] = {SINGLE, REUSE, CBPF};
+    for(Mode mode : modes) {
+        double base = 0;
+        for(int threads = 1; threads <= max_threads; threads *= 2) {
+            double skew = 0;
+            double cpu_us = 0;
+            double cps = run(mode, threads, conns, seconds, skew, cpu_us);
+            if(threads == 1) {
+                base = cps;
+            }
+            SYLAR_LOG_INFO(g_logger) << ModeName(mode)
+                << " threads=" << threads
+                << " conn/s=" << (uint64_t)cps
+                << " scale=" << (base > 0 ? cps / base : 0)
+                << " server cpu/conn=" << cpu_us << "us"
+                << " max/avg per thread=" << skew;
+        }
+    }
+    return 0;
+}
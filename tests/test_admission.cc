@@ -0,0 +1,272 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/macro.h"
+#include "sylar/tcp_server.h"
+#include "sylar/socket.h"
+#include "sylar/address.h"
+#include "sylar/http/http_server.h"
+#include "sylar/http/metrics_servlet.h"
+#include <atomic>
+#include <stdexcept>
+
+/*
+    TcpServer准入控制
+    accept和worker各是一个单线程的IOManager，客户端在主线程上直接用阻塞的socket连
+    - max_connections: 占住两个连接，第三个被直接关掉
+    - 异常:            handleClient抛异常，名额照样还回来
+    - HttpServer:      同样超限，请求已经发过去了也能完整收到503(不是RST)
+    - per_ip_rate:     一口气连5个，burst=3，后面两个被限速拒绝
+    - codel:           handleClient空转30ms把worker卡住，排队时间一直超过target，之后的新连接被拒，
+                       队列排空之后恢复
+    - stop:            多线程IOManager上起停很多次，stop之后IOManager都能析构(accept的事件不会留下)
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_spin_ms = {0};
+static std::atomic<bool> s_throw = {false};
+
+class HoldServer : public sylar::TcpServer {
+public:
+    typedef std::shared_ptr<HoldServer> ptr;
+    HoldServer(sylar::IOManager* worker, sylar::IOManager* accept_worker)
+        : sylar::TcpServer(worker, accept_worker) {
+    }
+protected:
+    // s_spin_ms不是0的时候空转这么久(不让出线程)再关，否则一直读到客户端关
+    void handleClient(sylar::Socket::ptr client) override {
+        if(s_throw) {
+            throw std::runtime_error("handleClient throw");
+        }
+        if(s_spin_ms) {
+            uint64_t end = sylar::GetCurrentMS() + s_spin_ms;
+            while(sylar::GetCurrentMS() < end);
+        } else {
+            char buf[64];
+            while(client -> recv(buf, sizeof(buf)) > 0);
+        }
+        client -> close();
+    }
+};
+
+static sylar::Address::ptr start(sylar::TcpServer::ptr srv, sylar::IOManager& acceptor) {
+    sylar::Address::ptr local;
+    std::atomic<bool> ready = {false};
+    // 监听socket要在hook打开的线程里建
+    acceptor.schedule([srv, &local, &ready](){
+        std::vector<sylar::Address::ptr> addrs, fails;
+        addrs.push_back(sylar::IPAddress::Create("127.0.0.1", 0));
+        if(srv -> bind(addrs, fails) && srv -> start()) {
+            local = srv -> getSocks()[0] -> getLocalAddress();
+        }
+        ready = true;
+    });
+    while(!ready) {
+        usleep(1000);
+    }
+    SYLAR_ASSERT(local);
+    return local;
+}
+
+static sylar::Socket::ptr connect(sylar::Address::ptr addr) {
+    sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+    SYLAR_ASSERT(sock -> connect(addr));
+    return sock;
+}
+
+// 等服务端把这么多连接处理掉(放进来或者拒掉)
+static void wait_seen(sylar::TcpServer::ptr srv, uint64_t n) {
+    for(int i = 0; i < 2000; ++ i) {
+        sylar::TcpServer::Stats s = srv -> getStats();
+        uint64_t seen = s.accepted;
+        for(auto r : s.rejected) {
+            seen += r;
+        }
+        if(seen >= n) {
+            return;
+        }
+        usleep(1000);
+    }
+    SYLAR_ASSERT2(false, "wait_seen timeout");
+}
+
+static void wait_connections(sylar::TcpServer::ptr srv, uint64_t n) {
+    for(int i = 0; i < 2000 && srv -> getStats().connections != n; ++ i) {
+        usleep(1000);
+    }
+    SYLAR_ASSERT(srv -> getStats().connections == n);
+}
+
+static void test_max_connections(sylar::IOManager& worker, sylar::IOManager& acceptor) {
+    HoldServer::ptr srv(new HoldServer(&worker, &acceptor));
+    sylar::TcpServer::Limits limits;
+    limits.maxConnections = 2;
+    srv -> setLimits(limits);
+    sylar::Address::ptr addr = start(srv, acceptor);
+
+    sylar::Socket::ptr c1 = connect(addr);
+    sylar::Socket::ptr c2 = connect(addr);
+    wait_connections(srv, 2);
+    sylar::Socket::ptr c3 = connect(addr);
+    char c;
+    SYLAR_ASSERT(c3 -> recv(&c, 1) == 0);           // 被服务端直接关掉
+    sylar::TcpServer::Stats s = srv -> getStats();
+    SYLAR_ASSERT(s.accepted == 2);
+    SYLAR_ASSERT(s.rejected[sylar::TcpServer::REJECT_CONNECTIONS] == 1);
+
+    c1 -> close();
+    wait_connections(srv, 1);
+    sylar::Socket::ptr c4 = connect(addr);         // 空出来一个又能进
+    wait_seen(srv, 4);
+    SYLAR_ASSERT(srv -> getStats().accepted == 3);
+
+    c2 -> close();
+    c4 -> close();
+    wait_connections(srv, 0);
+    SYLAR_LOG_INFO(g_logger) << "max_connections " << sylar::http::MetricsServlet::ToJson(srv -> getStats());
+    srv -> stop();
+}
+
+static void test_exception(sylar::IOManager& worker, sylar::IOManager& acceptor) {
+    HoldServer::ptr srv(new HoldServer(&worker, &acceptor));
+    sylar::TcpServer::Limits limits;
+    limits.maxConnections = 1;
+    srv -> setLimits(limits);
+    sylar::Address::ptr addr = start(srv, acceptor);
+
+    s_throw = true;
+    for(int i = 0; i < 3; ++ i) {
+        sylar::Socket::ptr c = connect(addr);
+        wait_seen(srv, i + 1);
+        wait_connections(srv, 0);
+        c -> close();
+    }
+    s_throw = false;
+    sylar::TcpServer::Stats s = srv -> getStats();
+    SYLAR_ASSERT(s.accepted == 3);
+    SYLAR_ASSERT(s.rejected[sylar::TcpServer::REJECT_CONNECTIONS] == 0);
+    srv -> stop();
+}
+
+static void test_http_503(sylar::IOManager& worker, sylar::IOManager& acceptor) {
+    sylar::http::HttpServer::ptr srv(new sylar::http::HttpServer(true, &worker, &acceptor));
+    sylar::TcpServer::Limits limits;
+    limits.maxConnections = 1;
+    srv -> setLimits(limits);
+    sylar::Address::ptr addr = start(srv, acceptor);
+
+    sylar::Socket::ptr c1 = connect(addr);
+    wait_connections(srv, 1);
+    sylar::Socket::ptr c2 = connect(addr);
+    // 请求马上发过去，服务端拒绝的时候它多半已经在接收缓冲区里了
+    static const char s_req[] = "GET / HTTP/1.1\r\nHost: test\r\n\r\n";
+    SYLAR_ASSERT(c2 -> send(s_req, sizeof(s_req) - 1) == (int)sizeof(s_req) - 1);
+    std::string rsp;
+    char buf[256];
+    int rt;
+    while((rt = c2 -> recv(buf, sizeof(buf))) > 0) {
+        rsp.append(buf, rt);
+    }
+    SYLAR_ASSERT2(rsp.find("HTTP/1.1 503") == 0, rsp);
+    SYLAR_ASSERT(rsp.find("Retry-After: 1\r\n") != std::string::npos);
+
+    c1 -> close();
+    wait_connections(srv, 0);
+    srv -> stop();
+}
+
+static void test_per_ip_rate(sylar::IOManager& worker, sylar::IOManager& acceptor) {
+    HoldServer::ptr srv(new HoldServer(&worker, &acceptor));
+    sylar::TcpServer::Limits limits;
+    limits.perIpRate = 1;
+    limits.perIpBurst = 3;
+    srv -> setLimits(limits);
+    sylar::Address::ptr addr = start(srv, acceptor);
+
+    std::vector<sylar::Socket::ptr> socks;
+    for(int i = 0; i < 5; ++ i) {
+        socks.push_back(connect(addr));
+    }
+    wait_seen(srv, 5);
+    sylar::TcpServer::Stats s = srv -> getStats();
+    SYLAR_LOG_INFO(g_logger) << "per_ip_rate " << sylar::http::MetricsServlet::ToJson(s);
+    SYLAR_ASSERT(s.accepted == 3);
+    SYLAR_ASSERT(s.rejected[sylar::TcpServer::REJECT_RATE] == 2);
+
+    for(auto& i : socks) {
+        i -> close();
+    }
+    wait_connections(srv, 0);
+    srv -> stop();
+}
+
+static void test_codel(sylar::IOManager& worker, sylar::IOManager& acceptor) {
+    HoldServer::ptr srv(new HoldServer(&worker, &acceptor));
+    sylar::TcpServer::Limits limits;
+    limits.codelTargetMs = 5;
+    limits.codelIntervalMs = 20;
+    srv -> setLimits(limits);
+    sylar::Address::ptr addr = start(srv, acceptor);
+    s_spin_ms = 30;
+
+    // 先堆10个，worker要卡300ms，排队时间很快超过target并且持续超过interval
+    std::vector<sylar::Socket::ptr> socks;
+    for(int i = 0; i < 10; ++ i) {
+        socks.push_back(connect(addr));
+    }
+    wait_seen(srv, 10);
+    for(int i = 0; i < 200 && !srv -> getStats().overloaded; ++ i) {
+        usleep(1000);
+    }
+    SYLAR_ASSERT(srv -> getStats().overloaded);
+    for(int i = 0; i < 10; ++ i) {
+        socks.push_back(connect(addr));
+    }
+    wait_seen(srv, 20);
+    sylar::TcpServer::Stats s = srv -> getStats();
+    SYLAR_LOG_INFO(g_logger) << "codel " << sylar::http::MetricsServlet::ToJson(s);
+    SYLAR_ASSERT(s.rejected[sylar::TcpServer::REJECT_OVERLOAD] > 0);
+
+    // 排空之后新连接又能进
+    wait_connections(srv, 0);
+    s_spin_ms = 0;
+    sylar::Socket::ptr c = connect(addr);
+    wait_seen(srv, 21);
+    SYLAR_ASSERT(srv -> getStats().accepted == s.accepted + 1);
+    c -> close();
+    wait_connections(srv, 0);
+    SYLAR_ASSERT(!srv -> getStats().overloaded);
+    for(auto& i : socks) {
+        i -> close();
+    }
+    srv -> stop();
+}
+
+static void test_stop() {
+    for(int i = 0; i < 50; ++ i) {
+        sylar::IOManager iom(4, false, "stop");
+        HoldServer::ptr srv(new HoldServer(&iom, &iom));
+        sylar::Address::ptr addr = start(srv, iom);
+        sylar::Socket::ptr c = connect(addr);
+        wait_connections(srv, 1);
+        c -> close();
+        wait_connections(srv, 0);
+        srv -> stop();
+    }
+}
+
+int main(int argc, char** argv) {
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+    {
+        sylar::IOManager worker(1, false, "worker");
+        sylar::IOManager acceptor(1, false, "accept");
+        test_max_connections(worker, acceptor);
+        test_exception(worker, acceptor);
+        test_http_503(worker, acceptor);
+        test_per_ip_rate(worker, acceptor);
+        test_codel(worker, acceptor);
+    }
+    test_stop();
+    SYLAR_LOG_INFO(g_logger) << "test_admission ok";
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include "sylar/sylar.h"
+#include "sylar/log.h"
+#include "sylar/config.h"
+#include "sylar/macro.h"
+#include <yaml-cpp/yaml.h>
+#include <fstream>
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+    AsyncLogAppender
+    - 多线程写，flush之后每条都在，同一个线程的顺序不乱
+    - DROP的时候文件里的条数加上丢掉的条数等于写的条数
+    - 走YAML配置(logs.appender.type = AsyncLogAppender)
+    - 文件被挪走之后一秒内重新打开
+    最后和FileLogAppender比一下每秒能写多少行
+    test_async_log [每个线程写几行]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int kThreads = 4;
+static const char* kFile = "/tmp/sylar_test_async_log.txt";
+
+static uint64_t now_us() {
+    return sylar::GetMonotonicNS() / 1000;
+}
+
+static std::vector<std::string> read_lines(const char* path) {
+    std::vector<std::string> lines;
+    std::ifstream ifs(path);
+    std::string line;
+    while(std::getline(ifs, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+static sylar::Logger::ptr make_logger(const std::string& name, sylar::LogAppender::ptr app) {
+    sylar::Logger::ptr logger = SYLAR_LOG_NAME(name);
+    logger -> clearAppenders();
+    logger -> setFormatter("%t %m%n");
+    logger -> addAppender(app);
+    return logger;
+}
+
+static void write_lines(sylar::Logger::ptr logger, int lines) {
+    std::vector<sylar::Thread::ptr> thrs;
+    for(int t = 0; t < kThreads; ++ t) {
+        thrs.push_back(sylar::Thread::ptr(new sylar::Thread([logger, t, lines](){
+            for(int i = 0; i < lines; ++ i) {
+                SYLAR_LOG_INFO(logger) << t << " " << i;
+            }
+        }, "w_" + std::to_string(t))));
+    }
+    for(auto& i : thrs) {
+        i -> join();
+    }
+}
+
+static void test_order(int lines) {
+    unlink(kFile);
+    sylar::AsyncLogAppender::ptr app(new sylar::AsyncLogAppender(kFile));
+    sylar::Logger::ptr logger = make_logger("async_order", app);
+    write_lines(logger, lines);
+    app -> flush();
+
+    std::vector<int> next(kThreads, 0);
+    size_t total = 0;
+    for(auto& line : read_lines(kFile)) {
+        int tid = 0, t = 0, i = 0;
+        SYLAR_ASSERT(sscanf(line.c_str(), "%d %d %d", &tid, &t, &i) == 3);
+        SYLAR_ASSERT(t >= 0 && t < kThreads);
+        SYLAR_ASSERT(next[t] == i);
+        ++next[t];
+        ++total;
+    }
+    SYLAR_ASSERT(total == (size_t)kThreads * lines);
+    SYLAR_ASSERT(app -> getDropped() == 0);
+    logger -> clearAppenders();
+    SYLAR_LOG_INFO(g_logger) << "order ok lines=" << total;
+}
+
+static void test_drop(int lines) {
+    unlink(kFile);
+    // 4K的环，后台线程1秒才醒一次(过半的时候会被叫)，肯定有丢的
+    sylar::AsyncLogAppender::ptr app(new sylar::AsyncLogAppender(kFile, sylar::AsyncLogAppender::DROP, 4096, 1000));
+    sylar::Logger::ptr logger = make_logger("async_drop", app);
+    write_lines(logger, lines);
+    app -> flush();
+
+    size_t written = 0;
+    uint64_t reported = 0;
+    for(auto& line : read_lines(kFile)) {
+        unsigned long long n = 0;
+        if(sscanf(line.c_str(), "AsyncLogAppender dropped %llu", &n) == 1) {
+            reported += n;
+        } else {
+            ++written;
+        }
+    }
+    SYLAR_ASSERT(written + app -> getDropped() == (size_t)kThreads * lines);
+    SYLAR_ASSERT(reported == app -> getDropped());
+    logger -> clearAppenders();
+    SYLAR_LOG_INFO(g_logger) << "drop ok written=" << written << " dropped=" << app -> getDropped();
+}
+
+static void test_yaml_and_reopen() {
+    unlink(kFile);
+    YAML::Node root = YAML::Load(std::string() +
+        "logs:\n"
+        "    - name: async_yaml\n"
+        "      level: info\n"
+        "      formatter: '%m%n'\n"
+        "      appender:\n"
+        "          - type: AsyncLogAppender\n"
+        "            file: " + kFile + "\n"
+        "            overflow: drop\n"
+        "            buffer_size: 65536\n"
+        "            flush_ms: 10\n");
+    sylar::Config::LoadFromYaml(root);
+    sylar::Logger::ptr logger = SYLAR_LOG_NAME("async_yaml");
+    std::string yaml = logger -> toYamlString();
+    SYLAR_ASSERT(yaml.find("AsyncLogAppender") != std::string::npos);
+    SYLAR_ASSERT(yaml.find("overflow: drop") != std::string::npos);
+
+    SYLAR_LOG_INFO(logger) << "before";
+    usleep(100 * 1000);
+    std::string moved = std::string(kFile) + ".1";
+    SYLAR_ASSERT(rename(kFile, moved.c_str()) == 0);
+    usleep(1100 * 1000);                    // 后台线程每秒看一次文件
+    SYLAR_LOG_INFO(logger) << "after";
+    usleep(100 * 1000);
+    std::vector<std::string> old_lines = read_lines(moved.c_str());
+    std::vector<std::string> new_lines = read_lines(kFile);
+    SYLAR_ASSERT(old_lines.size() == 1 && old_lines[0] == "before");
+    SYLAR_ASSERT(new_lines.size() == 1 && new_lines[0] == "after");
+    unlink(moved.c_str());
+    SYLAR_LOG_INFO(g_logger) << "yaml/reopen ok";
+}
+
+static void bench(int lines) {
+    const char* names[] = {"FileLogAppender ", "AsyncLogAppender"};
+    for(int async = 0; async < 2; ++ async) {
+        unlink(kFile);
+        sylar::LogAppender::ptr app;
+        if(async) {
+            app.reset(new sylar::AsyncLogAppender(kFile));
+        } else {
+            app.reset(new sylar::FileLogAppender(kFile));
+        }
+        sylar::Logger::ptr logger = make_logger(async ? "bench_async" : "bench_file", app);
+        uint64_t begin = now_us();
+        write_lines(logger, lines);
+        uint64_t used = now_us() - begin;
+        if(async) {
+            std::dynamic_pointer_cast<sylar::AsyncLogAppender>(app) -> flush();
+        }
+        uint64_t total = now_us() - begin;
+        logger -> clearAppenders();
+        SYLAR_LOG_INFO(g_logger) << names[async] << " threads=" << kThreads
+            << " lines/s=" << (uint64_t)(kThreads * lines * 1000000.0 / (used ? used : 1))
+            << " (including flush " << (uint64_t)(kThreads * lines * 1000000.0 / (total ? total : 1)) << ")";
+    }
+    unlink(kFile);
+}
+
+int main(int argc, char** argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 20000;
+    test_order(lines);
+    test_drop(lines);
+    test_yaml_and_reopen();
+    bench(lines);
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "sylar/sylar.h"
+#include "sylar/fcontext.h"
+#include "sylar/macro.h"
+#include <ucontext.h>
+#include <stdlib.h>
+
+/*
+    协程上下文切换的微基准，单线程来回ping-pong，每一轮是两次切换
+    test_context_switch [轮数]
+    - raw asm       直接用sylar_swap_fcontext
+    - raw ucontext  直接用swapcontext(每次都会进内核改信号掩码)
+    - fiber         Fiber::callIn/callOut，用的是编译时选的实现
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t kStackSize = 128 * 1024;
+static uint64_t s_rounds = 1000000;
+
+static void report(const char* tag, uint64_t begin_us) {
+    uint64_t used = sylar::GetCurrentUS() - begin_us;
+    if(used == 0) {
+        used = 1;
+    }
+    double switches = s_rounds * 2.0;
+    SYLAR_LOG_INFO(g_logger) << tag << " rounds=" << s_rounds
+        << " used=" << used / 1000.0 << "ms"
+        << " switches/s=" << (uint64_t)(switches * 1000000 / used)
+        << " ns/switch=" << used * 1000.0 / switches;
+}
+
+#if SYLAR_FCONTEXT_ASM_AVAILABLE
+static void* s_asm_main = nullptr;
+static void* s_asm_co = nullptr;
+
+static void asm_func() {
+    while(true) {
+        sylar_swap_fcontext(&s_asm_co, s_asm_main);
+    }
+}
+
+static void bench_asm() {
+    void* stack = malloc(kStackSize);
+    s_asm_co = sylar::MakeFcontext(stack, kStackSize, &asm_func);
+    uint64_t begin = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++ i) {
+        sylar_swap_fcontext(&s_asm_main, s_asm_co);
+    }
+    report("raw asm     ", begin);
+    free(stack);
+}
+#endif
+
+static ucontext_t s_uc_main;
+static ucontext_t s_uc_co;
+
+static void uc_func() {
+    while(true) {
+        swapcontext(&s_uc_co, &s_uc_main);
+    }
+}
+
+static void bench_ucontext() {
+    void* stack = malloc(kStackSize);
+    getcontext(&s_uc_co);
+    s_uc_co.uc_link = nullptr;
+    s_uc_co.uc_stack.ss_sp = stack;
+    s_uc_co.uc_stack.ss_size = kStackSize;
+    makecontext(&s_uc_co, &uc_func, 0);
+    uint64_t begin = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++ i) {
+        swapcontext(&s_uc_main, &s_uc_co);
+    }
+    report("raw ucontext", begin);
+    free(stack);
+}
+
+static void bench_fiber() {
+    sylar::Fiber::GetThis();
+    sylar::Fiber* self = nullptr;
+    sylar::Fiber::ptr fiber(new sylar::Fiber([&self](){
+        for(uint64_t i = 0; i < s_rounds; ++ i) {
+            self -> callOut();
+        }
+    }, 0, true));
+    self = fiber.get();
+    uint64_t begin = sylar::GetCurrentUS();
+    for(uint64_t i = 0; i < s_rounds; ++ i) {
+        fiber -> callIn();
+    }
+    report("fiber       ", begin);
+    fiber -> callIn();                  // 让回调跑完，协程变成TERM再析构
+    SYLAR_ASSERT(fiber -> getState() == sylar::Fiber::TERM);
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1) {
+        s_rounds = strtoull(argv[1], nullptr, 10);
+    }
+    SYLAR_LOG_INFO(g_logger) << "fiber context backend: " << sylar::FiberContextBackend();
+#if SYLAR_FCONTEXT_ASM_AVAILABLE
+    bench_asm();
+#endif
+    bench_ucontext();
+    bench_fiber();
+    return 0;
+}
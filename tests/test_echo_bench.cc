@@ -0,0 +1,187 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/socket.h"
+#include "sylar/address.h"
+#include <atomic>
+#include <vector>
+
+/*
+    多核echo压测，服务端线程数从1开始翻倍，共享epoll(iomanager.sharded=false)、每线程一个epoll(true)、
+    每线程一个epoll再加持久注册(iomanager.persistent=true)、io_uring(iomanager.io_uring=true，内核不支持的时候退回epoll)各跑一遍
+    顺便打出服务端平均每个请求调了几次epoll_ctl
+    客户端是另一个IOManager，每个连接发64字节、收回64字节算一次，跑满固定时间
+    test_echo_bench [每个点跑几秒] [服务端最多几个线程] [连接数]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const size_t kMsgSize = 64;
+static const int kClientThreads = 2;
+
+static std::atomic<uint64_t> s_requests = {0};
+static std::atomic<int> s_clients_done = {0};
+static std::atomic<bool> s_stop = {false};
+
+static void serve(sylar::Socket::ptr client) {
+    char buf[kMsgSize * 4];
+    while(true) {
+        int rt = client -> recv(buf, sizeof(buf));
+        if(rt <= 0) {
+            break;
+        }
+        if(client -> send(buf, rt) != rt) {
+            break;
+        }
+    }
+    client -> close();
+}
+
+static void accept_loop(sylar::Socket::ptr sock) {
+    while(true) {
+        sylar::Socket::ptr client = sock -> accept();
+        if(s_stop) {
+            break;                          // 压测结束，被主线程连进来的那个连接叫醒
+        }
+        if(!client) {
+            break;
+        }
+        sylar::IOManager::GetThis() -> schedule(std::bind(&serve, client));
+    }
+}
+
+static void client(sylar::Address::ptr addr, uint64_t deadline_ms) {
+    sylar::Socket::ptr sock = sylar::Socket::CreateTCP(addr);
+    if(!sock -> connect(addr)) {
+        SYLAR_LOG_ERROR(g_logger) << "connect fail errno=" << errno;
+        ++s_clients_done;
+        return;
+    }
+    char buf[kMsgSize];
+    memset(buf, 'x', sizeof(buf));
+    uint64_t n = 0;
+    while(sylar::GetCurrentMS() < deadline_ms) {
+        if(sock -> send(buf, sizeof(buf)) != (int)sizeof(buf)) {
+            break;
+        }
+        size_t got = 0;
+        while(got < sizeof(buf)) {
+            int rt = sock -> recv(buf + got, sizeof(buf) - got);
+            if(rt <= 0) {
+                break;
+            }
+            got += rt;
+        }
+        if(got < sizeof(buf)) {
+            break;
+        }
+        ++n;
+    }
+    s_requests += n;
+    sock -> close();
+    ++s_clients_done;
+}
+
+enum Mode {
+    SHARED,
+    SHARDED,
+    PERSISTENT,
+    URING,
+};
+
+static const char* ModeName(Mode mode) {
+    switch(mode) {
+        case SHARED:
+            return "shared ";
+        case SHARDED:
+            return "sharded";
+        case PERSISTENT:
+            return "persist";
+        case URING:
+            return "uring  ";
+    }
+    return "";
+}
+
+static double run(Mode mode, int threads, int conns, int seconds, double& ctl_per_req) {
+    sylar::Config::Lookup<bool>("iomanager.sharded") -> setValue(mode == SHARDED || mode == PERSISTENT);
+    sylar::Config::Lookup<bool>("iomanager.persistent") -> setValue(mode == PERSISTENT);
+    sylar::Config::Lookup<bool>("iomanager.io_uring") -> setValue(mode == URING);
+    s_requests = 0;
+    s_clients_done = 0;
+    s_stop = false;
+
+    sylar::IOManager server(threads, false, "echo");
+    sylar::Config::Lookup<bool>("iomanager.sharded") -> setValue(false);
+    sylar::Config::Lookup<bool>("iomanager.persistent") -> setValue(false);
+    sylar::Config::Lookup<bool>("iomanager.io_uring") -> setValue(false);
+    sylar::IOManager clients(kClientThreads, false, "client");
+
+    // 监听的socket要在hook打开的线程里建，不然是阻塞的，accept会把worker线程卡住
+    sylar::Socket::ptr listener;
+    sylar::Address::ptr local;
+    std::atomic<bool> ready = {false};
+    server.schedule([&listener, &local, &ready](){
+        sylar::IPAddress::ptr addr = sylar::IPAddress::Create("127.0.0.1", 0);
+        listener = sylar::Socket::CreateTCP(addr);
+        if(listener -> bind(addr) && listener -> listen()) {
+            local = listener -> getLocalAddress();
+        } else {
+            SYLAR_LOG_ERROR(g_logger) << "bind/listen fail errno=" << errno;
+        }
+        ready = true;
+        if(local) {
+            accept_loop(listener);
+            listener -> close();
+        }
+    });
+    while(!ready) {
+        usleep(1000);
+    }
+    if(!local) {
+        return 0;
+    }
+
+    uint64_t begin = sylar::GetCurrentMS();
+    uint64_t deadline = begin + seconds * 1000;
+    for(int i = 0; i < conns; ++ i) {
+        clients.schedule(std::bind(&client, local, deadline));
+    }
+    while(s_clients_done < conns) {
+        usleep(10 * 1000);
+    }
+    uint64_t used = sylar::GetCurrentMS() - begin;
+    ctl_per_req = s_requests ? (double)server.getEpollCtlCount() / s_requests : 0;
+    // 不从别的线程cancel/close监听socket: accept被cancel叫醒后会重新addEvent，和close抢起来事件会漏掉，
+    // IOManager就一直等着退不出来。这里由accept协程自己关
+    s_stop = true;
+    sylar::Socket::ptr waker = sylar::Socket::CreateTCP(local);
+    waker -> connect(local);
+    return s_requests * 1000.0 / (used ? used : 1);
+}
+
+int main(int argc, char** argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    int conns = argc > 3 ? atoi(argv[3]) : 64;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+
+    SYLAR_LOG_INFO(g_logger) << "cpus=" << sysconf(_SC_NPROCESSORS_ONLN)
+        << " connections=" << conns << " msg=" << kMsgSize << "B";
+    Mode modes[] = {SHARED, SHARDED, PERSISTENT, URING};
+    for(Mode mode : modes) {
+        double base = 0;
+        for(int threads = 1; threads <= max_threads; threads *= 2) {
+            double ctl_per_req = 0;
+            double qps = run(mode, threads, conns, seconds, ctl_per_req);
+            if(threads == 1) {
+                base = qps;
+            }
+            SYLAR_LOG_INFO(g_logger) << ModeName(mode)
+                << " threads=" << threads
+                << " req/s=" << (uint64_t)qps
+                << " scale=" << (base > 0 ? qps / base : 0)
+                << " epoll_ctl/req=" << ctl_per_req;
+        }
+    }
+    return 0;
+}
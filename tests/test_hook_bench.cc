@@ -0,0 +1,127 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/fd_manager.h"
+#include "sylar/hook.h"
+#include "sylar/macro.h"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+
+/*
+    大量fd下hook的recv本身的开销
+    建一堆socketpair(默认25000对，5万个fd，受RLIMIT_NOFILE限制)，和hook的socket()一样在FdManager里登记
+    每次随机挑一对，先用原始的write往一端写1个字节，再在另一端recv，数据已经在了不会挂起，
+    量的就是hook这一层(FdManager查表 + do_io)的开销，同样的循环再直接调recv_f对比
+    最后确认del之后同一个fd再登记是原地reset，之前拿着的ptr还指向活着的对象
+    test_hook_bench [fd数] [每个线程recv次数]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int kThreads = 4;
+
+static std::vector<int> s_fds;                 // 两个一对，[2i]收，[2i+1]发
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(bool hooked, int iters, unsigned seed, std::vector<uint32_t>& lat) {
+    size_t pairs = s_fds.size() / 2;
+    char c = 'x';
+    lat.resize(iters);
+    for(int i = 0; i < iters; ++ i) {
+        size_t p = rand_r(&seed) % pairs;
+        if(write_f(s_fds[2 * p + 1], &c, 1) != 1) {
+            SYLAR_LOG_ERROR(g_logger) << "write fail errno=" << errno;
+            break;
+        }
+        uint64_t begin = now_ns();
+        ssize_t n = hooked ? recv(s_fds[2 * p], &c, 1, 0) : recv_f(s_fds[2 * p], &c, 1, 0);
+        lat[i] = now_ns() - begin;
+        if(n != 1) {
+            SYLAR_LOG_ERROR(g_logger) << "recv fail n=" << n << " errno=" << errno;
+            break;
+        }
+    }
+}
+
+static void report(const char* tag, std::vector<std::vector<uint32_t> >& lats) {
+    std::vector<uint32_t> all;
+    for(auto& v : lats) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    if(all.empty()) {
+        return;
+    }
+    std::sort(all.begin(), all.end());
+    uint64_t sum = 0;
+    for(auto i : all) {
+        sum += i;
+    }
+    SYLAR_LOG_INFO(g_logger) << tag << " calls=" << all.size()
+        << " avg=" << sum / all.size() << "ns"
+        << " p50=" << all[all.size() / 2] << "ns"
+        << " p99=" << all[all.size() * 99 / 100] << "ns"
+        << " max=" << all.back() << "ns";
+}
+
+int main(int argc, char** argv) {
+    int nfds = argc > 1 ? atoi(argv[1]) : 50000;
+    int iters = argc > 2 ? atoi(argv[2]) : 200000;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur != RLIM_INFINITY && (rlim_t)nfds + 64 > rl.rlim_cur) {
+        SYLAR_LOG_INFO(g_logger) << "RLIMIT_NOFILE=" << rl.rlim_cur << ", fds " << nfds
+            << " -> " << rl.rlim_cur - 64;
+        nfds = rl.rlim_cur - 64;
+    }
+
+    for(int i = 0; i + 1 < nfds; i += 2) {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+            SYLAR_LOG_ERROR(g_logger) << "socketpair fail errno=" << errno << " at " << i;
+            break;
+        }
+        sylar::FdMgr::GetInstance() -> get(sv[0], true);
+        sylar::FdMgr::GetInstance() -> get(sv[1], true);
+        s_fds.push_back(sv[0]);
+        s_fds.push_back(sv[1]);
+    }
+    SYLAR_LOG_INFO(g_logger) << "fds=" << s_fds.size() << " max_fd=" << s_fds.back()
+        << " threads=" << kThreads << " iters/thread=" << iters;
+
+    bool modes[] = {false, true};
+    for(bool hooked : modes) {
+        std::vector<std::vector<uint32_t> > lats(kThreads);
+        {
+            sylar::IOManager iom(kThreads, false);
+            for(int t = 0; t < kThreads; ++ t) {
+                iom.schedule([hooked, iters, t, &lats](){
+                    run(hooked, iters, t + 1, lats[t]);
+                });
+            }
+        }
+        report(hooked ? "hooked recv" : "raw recv   ", lats);
+    }
+
+    sylar::FdCtx::ptr old = sylar::FdMgr::GetInstance() -> get(s_fds[0]);
+    old -> setTimeout(SO_RCVTIMEO, 100);
+    sylar::FdMgr::GetInstance() -> del(s_fds[0]);
+    SYLAR_ASSERT(!sylar::FdMgr::GetInstance() -> get(s_fds[0]));
+    sylar::FdCtx::ptr now = sylar::FdMgr::GetInstance() -> get(s_fds[0], true);
+    SYLAR_ASSERT(now.get() == old.get());
+    SYLAR_ASSERT(old -> isSocket() && old -> getTimeout(SO_RCVTIMEO) == (uint64_t)-1);
+
+    for(auto fd : s_fds) {
+        close(fd);
+    }
+    return 0;
+}
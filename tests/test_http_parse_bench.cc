@@ -0,0 +1,165 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/socket.h"
+#include "sylar/address.h"
+#include "sylar/macro.h"
+#include "sylar/http/http_session.h"
+#include "sylar/http/http_parser.h"
+#include "sylar/http/servlet.h"
+#include <new>
+#include <stdlib.h>
+
+/*
+    HttpSession::recvRequest + ServletDispatch::handle 每个请求的内存分配次数和耗时
+    一个带11个头和32字节body的POST，在同一个长连接上客户端一次发一个(或者pipelining一次发8个)，
+    服务端收下来分发给一个读几个头/query/body的servlet(发送和回包不算在内):
+    - copy:       http.request.zero_copy=false，原来的解析，头和body都拷成std::string/map
+    - view:       零拷贝解析，servlet用getHeaderView/getQueryView/getBodyView
+    - view+str:   零拷贝解析，servlet还用原来返回std::string的接口，第一次用的时候拷出来
+    - *-pipe:     一次发8个，一次read读进来好几个请求，后面的留给下一次recvRequest
+    分配次数是重载全局operator new数出来的，HttpSession复用缓冲区和parser之后长连接上基本只剩
+    HttpResponse和servlet自己的分配
+    test_http_parse_bench [请求数]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static thread_local bool t_counting = false;
+static thread_local uint64_t t_allocs = 0;
+static thread_local uint64_t t_bytes = 0;
+
+void* operator new(size_t size) {
+    if(t_counting) {
+        ++t_allocs;
+        t_bytes += size;
+    }
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+static const char s_request[] = "POST /api/user?id=42&name=didi HTTP/1.1\r\n"
+                                "Host: www.sylar.top\r\n"
+                                "User-Agent: bench/1.0\r\n"
+                                "Accept: application/json\r\n"
+                                "Accept-Encoding: gzip, deflate\r\n"
+                                "Accept-Language: zh-CN,zh;q=0.9\r\n"
+                                "Cookie: session=0123456789abcdef0123456789abcdef\r\n"
+                                "X-Request-Id: 5b2f7c1e-8d3a-4f60-9e21-7a4c3b8d1f09\r\n"
+                                "X-Forwarded-For: 10.0.0.1\r\n"
+                                "Content-Type: application/json\r\n"
+                                "Connection: keep-alive\r\n"
+                                "Content-Length: 32\r\n\r\n"
+                                "{\"id\":42,\"name\":\"didi\",\"ok\":1}\r\n";
+
+static const int kPipelineDepth = 8;
+
+enum Mode {
+    COPY,
+    VIEW,
+    VIEW_STR,
+    COPY_PIPE,
+    VIEW_PIPE,
+};
+
+static const char* ModeName(Mode mode) {
+    switch(mode) {
+        case COPY:
+            return "copy     ";
+        case VIEW:
+            return "view     ";
+        case VIEW_STR:
+            return "view+str ";
+        case COPY_PIPE:
+            return "copy-pipe";
+        case VIEW_PIPE:
+            return "view-pipe";
+    }
+    return "";
+}
+
+static uint64_t s_checksum = 0;
+
+static void run(Mode mode, int n) {
+    sylar::Config::Lookup<bool>("http.request.zero_copy") -> setValue(mode != COPY && mode != COPY_PIPE);
+    int depth = (mode == COPY_PIPE || mode == VIEW_PIPE) ? kPipelineDepth : 1;
+    std::string batch;
+    for(int i = 0; i < depth; ++ i) {
+        batch.append(s_request, sizeof(s_request) - 1);
+    }
+
+    sylar::http::ServletDispatch::ptr dispatch(new sylar::http::ServletDispatch);
+    dispatch -> addServlet("/api/user", [mode](sylar::http::HttpRequest::ptr req
+                , sylar::http::HttpResponse::ptr rsp
+                , sylar::http::HttpSession::ptr session) {
+        if(mode == VIEW_STR) {
+            s_checksum += req -> getHeaders("host").size() + req -> getHeaders("x-request-id").size()
+                        + req -> getQuery().size() + req -> getBody().size();
+        } else {
+            s_checksum += req -> getHeaderView(sylar::http::header::HOST).size()
+                        + req -> getHeaderView(sylar::http::HeaderKey("x-request-id")).size()
+                        + req -> getQueryView().size() + req -> getBodyView().size();
+        }
+        return 0;
+    });
+
+    sylar::IPAddress::ptr addr = sylar::IPAddress::Create("127.0.0.1", 0);
+    sylar::Socket::ptr listener = sylar::Socket::CreateTCP(addr);
+    SYLAR_ASSERT(listener -> bind(addr) && listener -> listen());
+    sylar::Address::ptr local = listener -> getLocalAddress();
+    sylar::Socket::ptr client = sylar::Socket::CreateTCP(local);
+    SYLAR_ASSERT(client -> connect(local));
+    sylar::Socket::ptr server = listener -> accept();
+    SYLAR_ASSERT(server);
+    sylar::http::HttpSession::ptr session(new sylar::http::HttpSession(server));
+
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+    uint64_t used_us = 0;
+    for(int i = 0; i < n; ++ i) {
+        if(i % depth == 0) {
+            SYLAR_ASSERT(client -> send(batch.data(), batch.size()) == (int)batch.size());
+        }
+        uint64_t begin = sylar::GetCurrentUS();
+        t_allocs = 0;
+        t_bytes = 0;
+        t_counting = true;
+        {
+            sylar::http::HttpRequest::ptr req = session -> recvRequest();
+            SYLAR_ASSERT(req);
+            sylar::http::HttpResponse::ptr rsp(new sylar::http::HttpResponse(req -> getVersion(), false));
+            dispatch -> handle(req, rsp, session);
+        }
+        t_counting = false;
+        used_us += sylar::GetCurrentUS() - begin;
+        allocs += t_allocs;
+        bytes += t_bytes;
+    }
+    SYLAR_LOG_INFO(g_logger) << ModeName(mode) << " requests=" << n
+        << " allocs/req=" << (double)allocs / n
+        << " bytes/req=" << bytes / n
+        << " us/req=" << (double)used_us / n;
+    client -> close();
+    session -> close();
+    listener -> close();
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+    sylar::IOManager iom(1, false, "bench");
+    iom.schedule([n](){
+        Mode modes[] = {COPY, VIEW, VIEW_STR, COPY_PIPE, VIEW_PIPE};
+        for(Mode mode : modes) {
+            run(mode, n);
+        }
+        SYLAR_LOG_INFO(g_logger) << "checksum=" << s_checksum;
+    });
+    return 0;
+}
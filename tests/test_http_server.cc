@@ -1,4 +1,5 @@
 #include "sylar/http/http_server.h"
+#include "sylar/http/metrics_servlet.h"
 #include "sylar/log.h"
 
 static sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
@@ -23,6 +24,8 @@ void run() {
         rsp -> setBody("Glob:\r\n" + req -> toString());
         return 0;
     });
+
+    sd -> addServlet("/_/metrics", sylar::http::MetricsServlet::ptr(new sylar::http::MetricsServlet));
     server -> start();
 }
 
@@ -0,0 +1,68 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include <atomic>
+#include <algorithm>
+#include <vector>
+
+/*
+    idle忙等预算(iomanager.idle_spin_us)对唤醒延迟和cpu的影响
+    外部线程隔一小段时间(让worker都进idle)往IOManager里丢一个任务，量从schedule到任务开始跑的时间，
+    idle_spin_us从0(来了任务一定要tickle叫醒)开始往上加，同时打出IOManager的idle计数：
+    忙等花掉的cpu、忙等等到活的比例、真正睡下去的次数、tickle叫醒平均要多久
+    test_idle_bench [线程数] [每档ping次数] [两次ping之间隔多少us]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<uint64_t> s_start = {0};
+static std::atomic<uint64_t> s_latency = {0};
+
+static void run(int threads, int pings, int gap_us, uint32_t spin_us) {
+    sylar::Config::Lookup<uint32_t>("iomanager.idle_spin_us") -> setValue(spin_us);
+    std::vector<uint64_t> lat;
+    lat.reserve(pings);
+    sylar::IOManager::IdleStats stats;
+    uint64_t begin = sylar::GetMonotonicNS();
+    {
+        sylar::IOManager iom(threads, false, "idle");
+        for(int i = 0; i < pings; ++ i) {
+            usleep(gap_us);
+            s_latency = 0;
+            s_start = sylar::GetMonotonicNS();
+            iom.schedule([](){
+                s_latency = sylar::GetMonotonicNS() - s_start;
+            });
+            while(s_latency == 0) {
+                sylar::CpuRelax();
+            }
+            lat.push_back(s_latency);
+        }
+        stats = iom.getIdleStats();
+    }
+    uint64_t used = sylar::GetMonotonicNS() - begin;
+    std::sort(lat.begin(), lat.end());
+    SYLAR_LOG_INFO(g_logger) << "spin_us=" << spin_us
+        << " p50=" << lat[lat.size() / 2] / 1000.0 << "us"
+        << " p99=" << lat[lat.size() * 99 / 100] / 1000.0 << "us"
+        << " spin_cpu=" << stats.spinNs * 100.0 / used / threads << "%"
+        << " spins=" << stats.spins
+        << " hit=" << (stats.spins ? stats.spinHits * 100.0 / stats.spins : 0) << "%"
+        << " parks=" << stats.parks
+        << " wakeups=" << stats.wakeups
+        << " avg_wakeup=" << (stats.wakeups ? stats.wakeupNs / stats.wakeups / 1000.0 : 0) << "us";
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 2;
+    int pings = argc > 2 ? atoi(argv[2]) : 2000;
+    int gap_us = argc > 3 ? atoi(argv[3]) : 50;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+
+    SYLAR_LOG_INFO(g_logger) << "cpus=" << sysconf(_SC_NPROCESSORS_ONLN) << " threads=" << threads
+        << " pings=" << pings << " gap=" << gap_us << "us";
+    uint32_t spins[] = {0, 20, 100, 1000};
+    for(uint32_t spin_us : spins) {
+        run(threads, pings, gap_us, spin_us);
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/macro.h"
+#include "sylar/histogram.h"
+#include "sylar/http/metrics_servlet.h"
+#include <stdlib.h>
+
+/*
+    调度延迟直方图和慢任务watchdog
+    - Histogram本身：分桶的误差、分位数
+    - 开了scheduler.latency_stats和scheduler.slow_task_ms的IOManager跑一批短任务和一个占着线程的长任务，
+      排队时间/运行时间都记上了，长任务被watchdog抓到一次
+    - 再开scheduler.slow_task_backtrace，日志里有长任务的栈；长任务是usleep的话会被信号打断(EINTR)，
+      所以抓栈要单独打开
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int kTasks = 1000;
+static const uint64_t kSlowMs = 20;
+
+static void test_histogram() {
+    unsigned seed = 1;
+    for(int i = 0; i < 100000; ++ i) {
+        uint64_t v = (uint64_t)rand_r(&seed) >> (rand_r(&seed) % 31) << (rand_r(&seed) % 9);    // 0到2^39，不超过MAX_BITS
+        size_t idx = sylar::Histogram::BucketIndex(v);
+        uint64_t upper = sylar::Histogram::BucketUpper(idx);
+        SYLAR_ASSERT(idx < (size_t)sylar::Histogram::BUCKETS);
+        SYLAR_ASSERT(upper >= v);
+        SYLAR_ASSERT(upper - v <= v / sylar::Histogram::SUB_BUCKETS);
+        SYLAR_ASSERT(idx == 0 || sylar::Histogram::BucketUpper(idx - 1) < v);
+    }
+
+    sylar::Histogram h;
+    for(uint64_t v = 1; v <= 100000; ++ v) {
+        h.record(v);
+    }
+    SYLAR_ASSERT(h.getCount() == 100000 && h.getMax() == 100000);
+    sylar::Histogram::Summary s = h.summarize();
+    SYLAR_ASSERT(s.mean == 50000);
+    SYLAR_ASSERT(s.p50 >= 50000 && s.p50 <= 50000 + 50000 / 16);
+    SYLAR_ASSERT(s.p99 >= 99000 && s.p99 <= 100000);
+    SYLAR_ASSERT(s.max == 100000);
+
+    sylar::Histogram merged;
+    merged.merge(h);
+    merged.merge(h);
+    SYLAR_ASSERT(merged.getCount() == 200000 && merged.getPercentile(50) == s.p50);
+    SYLAR_LOG_INFO(g_logger) << "histogram ok p50=" << s.p50 << " p99=" << s.p99;
+}
+
+static void __attribute__((noinline)) hog_worker(uint64_t ms) {
+    uint64_t end = sylar::GetMonotonicNS() + ms * 1000000;
+    while(sylar::GetMonotonicNS() < end);           // 不让出，一直占着线程
+}
+
+static void test_scheduler(bool backtrace) {
+    sylar::Config::Lookup<bool>("scheduler.latency_stats") -> setValue(true);
+    sylar::Config::Lookup<uint32_t>("scheduler.slow_task_ms") -> setValue(kSlowMs);
+    sylar::Config::Lookup<bool>("scheduler.slow_task_backtrace") -> setValue(backtrace);
+    sylar::IOManager iom(2, false, "latency");
+    sylar::Config::Lookup<bool>("scheduler.latency_stats") -> setValue(false);
+    sylar::Config::Lookup<uint32_t>("scheduler.slow_task_ms") -> setValue(0);
+    sylar::Config::Lookup<bool>("scheduler.slow_task_backtrace") -> setValue(false);
+
+    std::atomic<int> done = {0};
+    iom.schedule([&done](){
+        hog_worker(kSlowMs * 5);
+        ++done;
+    });
+    for(int i = 0; i < kTasks; ++ i) {
+        iom.schedule([&done](){ ++done; });
+    }
+    while(done < kTasks + 1) {
+        usleep(1000);
+    }
+    usleep(10 * 1000);
+
+    sylar::Scheduler::Metrics m = iom.getMetrics();
+    SYLAR_LOG_INFO(g_logger) << sylar::http::MetricsServlet::ToJson(m, false);
+    SYLAR_ASSERT(m.queueWait.count >= (uint64_t)kTasks + 1);
+    SYLAR_ASSERT(m.runSlice.count >= (uint64_t)kTasks + 1);
+    SYLAR_ASSERT(m.runSlice.max >= kSlowMs * 5 * 1000000);
+    SYLAR_ASSERT(m.slowTasks == 1);
+}
+
+static void test_disabled() {
+    sylar::IOManager iom(1, false, "plain");
+    std::atomic<int> done = {0};
+    iom.schedule([&done](){ ++done; });
+    while(done < 1) {
+        usleep(1000);
+    }
+    sylar::Histogram wait, run;
+    SYLAR_ASSERT(!iom.getLatency(wait, run));
+    sylar::Scheduler::Metrics m = iom.getMetrics();
+    SYLAR_ASSERT(m.queueWait.count == 0 && m.runSlice.count == 0 && m.slowTasks == 0);
+}
+
+int main(int argc, char** argv) {
+    test_histogram();
+    test_scheduler(false);
+    test_scheduler(true);
+    test_disabled();
+    SYLAR_LOG_INFO(g_logger) << "test_latency ok";
+    return 0;
+}
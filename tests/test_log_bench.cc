@@ -0,0 +1,154 @@
+#include "sylar/sylar.h"
+#include "sylar/log.h"
+#include "sylar/macro.h"
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+/*
+    日志格式化的开销，每个线程一个logger，输出地只格式化不落盘，看每个线程每秒能格式化多少行、每行分配几次内存
+    - legacy: 原来的路子，new一个LogEvent，内容写stringstream，FormatItem逐个虚函数输出到stringstream再取str()
+    - current: 栈上的事件 + 线程本地的流 + 预编译的指令表写进线程本地的缓冲区
+      每个线程的logger不一样，用的是SYLAR_LOG_DYNAMIC(每次比等级，和legacy一样)；
+      SYLAR_LOG_INFO的调用点缓存在这里会退成DYNAMIC，等级检查的开销见test_log_level_bench
+    两条路格式化出来的内容先对一遍，要一样
+    test_log_bench [每个线程多少行] [最多几个线程]
+*/
+
+static std::atomic<uint64_t> s_allocs = {0};
+
+void* operator new(size_t size) {
+    s_allocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if(!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const char* kPattern = "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+
+// 只格式化，不输出
+class NullAppender : public sylar::LogAppender {
+public:
+    typedef std::shared_ptr<NullAppender> ptr;
+    NullAppender(bool legacy)
+        : m_legacy(legacy) {
+    }
+
+    void log(sylar::Logger::ptr logger, sylar::LogLevel::Level level, sylar::LogEvent::ptr event) override {
+        if(m_legacy) {
+            std::stringstream ss;
+            m_formatter -> format(ss, logger, level, event);
+            m_bytes += ss.str().size();
+        } else {
+            static thread_local std::string buf;
+            buf.clear();
+            m_formatter -> format(buf, logger, level, event);
+            m_bytes += buf.size();
+        }
+    }
+    std::string toYamlString() override { return "";}
+
+    uint64_t m_bytes = 0;
+private:
+    bool m_legacy;
+};
+
+static void legacy_log(sylar::Logger::ptr logger, int i) {
+    if(logger -> getLevel() <= sylar::LogLevel::INFO) {
+        sylar::LogEvent::ptr event(new sylar::LogEvent(logger, sylar::LogLevel::INFO, __FILE__, __LINE__, 0,
+                    sylar::GetThreadID(), sylar::GetFiberID(), time(0), sylar::Thread::GetName()));
+        std::stringstream ss;
+        ss << "request done id=" << i << " cost=" << 1.5 << "ms path=/index.html";
+        std::string content = ss.str();                 // 原来LogEvent里的stringstream
+        event -> getSS().write(content.c_str(), content.size());
+        std::string name = sylar::Thread::GetName();    // 原来的LogEvent拷贝一份线程名
+        logger -> log(sylar::LogLevel::INFO, event);
+    }
+}
+
+static void current_log(sylar::Logger::ptr logger, int i) {
+    SYLAR_LOG_DYNAMIC(logger, sylar::LogLevel::INFO) << "request done id=" << i << " cost=" << 1.5 << "ms path=/index.html";
+}
+
+static uint64_t now_ns() {
+    return sylar::GetMonotonicNS();
+}
+
+static void check_same_output() {
+    sylar::Logger::ptr logger(new sylar::Logger("check"));
+    sylar::LogFormatter::ptr fmt(new sylar::LogFormatter(kPattern));
+    sylar::LogEvent::ptr event(new sylar::LogEvent(logger, sylar::LogLevel::WARN, __FILE__, __LINE__, 7,
+                sylar::GetThreadID(), 3, time(0), sylar::Thread::GetName()));
+    event -> getSS() << "hello " << -42 << " " << std::hex << 255;
+    std::stringstream legacy;
+    fmt -> format(legacy, logger, sylar::LogLevel::WARN, event);
+    std::string current;
+    fmt -> format(current, logger, sylar::LogLevel::WARN, event);
+    SYLAR_ASSERT(legacy.str() == current);
+    SYLAR_ASSERT(fmt -> format(logger, sylar::LogLevel::WARN, event) == current);
+}
+
+int main(int argc, char** argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 200000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 4;
+    check_same_output();
+
+    const char* names[] = {"legacy ", "current"};
+    for(int mode = 0; mode < 2; ++ mode) {
+        for(int threads = 1; threads <= max_threads; threads *= 2) {
+            std::vector<sylar::Logger::ptr> loggers;
+            std::vector<uint64_t> used(threads, 0);
+            for(int t = 0; t < threads; ++ t) {
+                sylar::Logger::ptr logger(new sylar::Logger("bench_" + std::to_string(t)));
+                logger -> setLevel(sylar::LogLevel::INFO);
+                logger -> setFormatter(kPattern);
+                logger -> addAppender(NullAppender::ptr(new NullAppender(mode == 0)));
+                loggers.push_back(logger);
+            }
+            uint64_t allocs_begin = 0;
+            std::vector<sylar::Thread::ptr> thrs;
+            std::atomic<int> ready = {0};
+            std::atomic<bool> go = {false};
+            for(int t = 0; t < threads; ++ t) {
+                thrs.push_back(sylar::Thread::ptr(new sylar::Thread([&, t](){
+                    for(int i = 0; i < 1000; ++ i) {          // 预热，线程本地的缓存建好
+                        mode == 0 ? legacy_log(loggers[t], i) : current_log(loggers[t], i);
+                    }
+                    ++ready;
+                    while(!go) {
+                    }
+                    uint64_t begin = now_ns();
+                    for(int i = 0; i < lines; ++ i) {
+                        mode == 0 ? legacy_log(loggers[t], i) : current_log(loggers[t], i);
+                    }
+                    used[t] = now_ns() - begin;
+                }, "bench_" + std::to_string(t))));
+            }
+            while(ready < threads) {
+            }
+            allocs_begin = s_allocs;
+            go = true;
+            for(auto& i : thrs) {
+                i -> join();
+            }
+            uint64_t allocs = s_allocs - allocs_begin;
+            uint64_t sum = 0;
+            for(auto u : used) {
+                sum += u;
+            }
+            double per_thread = sum ? (double)lines * threads / (sum / 1e9) : 0;
+            SYLAR_LOG_INFO(g_logger) << names[mode] << " threads=" << threads
+                << " lines/s/thread=" << (uint64_t)per_thread
+                << " allocs/line=" << (double)allocs / ((uint64_t)lines * threads);
+        }
+    }
+    return 0;
+}
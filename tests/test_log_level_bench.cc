@@ -0,0 +1,128 @@
+#include "sylar/sylar.h"
+#include "sylar/log.h"
+#include "sylar/macro.h"
+#include <time.h>
+
+/*
+    关掉的日志语句本身的开销，logger等级调到ERROR，循环里打DEBUG
+    - runtime: 原来的宏，每次求logger表达式再比等级(SYLAR_LOG_DYNAMIC就是这个)
+    - cached:  SYLAR_LOG_DEBUG，调用点缓存的开关，比一下logger是不是记下的那个就知道开没开
+    - compiled out: SYLAR_LOG_MIN_LEVEL比DEBUG高，语句整条没了
+    logger分文件里的g_logger和SYLAR_LOG_ROOT()两种，后者求值要拿单例、拷shared_ptr
+    顺便确认关掉的时候<<后面的参数不求值，setLevel之后调用点跟着变，
+    同一个调用点传进来不同的logger(一个关着一个开着)不会拿前一个的OFF把后一个的日志吞掉
+    test_log_level_bench [循环次数]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_NAME("bench");
+
+static uint64_t s_evaluated = 0;
+
+static int expensive() {
+    ++s_evaluated;
+    return 0;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char* tag, uint64_t used, uint64_t base, int n) {
+    SYLAR_LOG_ERROR(g_logger) << tag << " " << (double)used / n << "ns/stmt"
+        << " over empty loop " << ((double)used - base) / n << "ns";
+}
+
+static void empty_loop(int n) {
+    for(int i = 0; i < n; ++ i) {
+    }
+}
+
+static void runtime_global(int n) {
+    for(int i = 0; i < n; ++ i) {
+        SYLAR_LOG_DYNAMIC(g_logger, sylar::LogLevel::DEBUG) << "i=" << i << expensive();
+    }
+}
+
+static void cached_global(int n) {
+    for(int i = 0; i < n; ++ i) {
+        SYLAR_LOG_DEBUG(g_logger) << "i=" << i << expensive();
+    }
+}
+
+static void runtime_root(int n) {
+    for(int i = 0; i < n; ++ i) {
+        SYLAR_LOG_DYNAMIC(SYLAR_LOG_ROOT(), sylar::LogLevel::DEBUG) << "i=" << i << expensive();
+    }
+}
+
+static void cached_root(int n) {
+    for(int i = 0; i < n; ++ i) {
+        SYLAR_LOG_DEBUG(SYLAR_LOG_ROOT()) << "i=" << i << expensive();
+    }
+}
+
+// 宏展开的时候才看SYLAR_LOG_MIN_LEVEL，这里改掉模拟cmake -DSYLAR_LOG_MIN_LEVEL=INFO
+#undef SYLAR_LOG_MIN_LEVEL
+#define SYLAR_LOG_MIN_LEVEL sylar::LogLevel::INFO
+
+static void compiled_out(int n) {
+    for(int i = 0; i < n; ++ i) {
+        SYLAR_LOG_DEBUG(g_logger) << "i=" << i << expensive();
+    }
+}
+
+static bool site_enabled() {
+    return SYLAR_LOG_ENABLED(g_logger, sylar::LogLevel::DEBUG);
+}
+
+static bool param_enabled(sylar::Logger::ptr logger) {
+    return SYLAR_LOG_ENABLED(logger, sylar::LogLevel::DEBUG);
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 10000000;
+    g_logger -> setLevel(sylar::LogLevel::ERROR);
+    SYLAR_LOG_ROOT() -> setLevel(sylar::LogLevel::ERROR);
+
+    struct Case {
+        const char* tag;
+        void (*fn)(int);
+    } cases[] = {
+        {"runtime g_logger         ", runtime_global},
+        {"cached  g_logger         ", cached_global},
+        {"runtime SYLAR_LOG_ROOT() ", runtime_root},
+        {"cached  SYLAR_LOG_ROOT() ", cached_root},
+        {"compiled out             ", compiled_out},
+    };
+    uint64_t begin = now_ns();
+    empty_loop(n);
+    uint64_t base = now_ns() - begin;
+    report("empty loop               ", base, base, n);
+    for(auto& c : cases) {
+        begin = now_ns();
+        c.fn(n);
+        report(c.tag, now_ns() - begin, base, n);
+    }
+    SYLAR_ASSERT(s_evaluated == 0);
+
+    // 等级变了调用点要跟着变
+    SYLAR_ASSERT(!site_enabled());
+    g_logger -> setLevel(sylar::LogLevel::DEBUG);
+    SYLAR_ASSERT(site_enabled());
+    g_logger -> setLevel(sylar::LogLevel::ERROR);
+    SYLAR_ASSERT(!site_enabled());
+
+    // 调用点先见到关着的logger缓存成OFF，再来一个开着的
+    sylar::Logger::ptr on(new sylar::Logger("bench_on"));
+    on -> setLevel(sylar::LogLevel::DEBUG);
+    g_logger -> setLevel(sylar::LogLevel::ERROR);
+    SYLAR_ASSERT(!param_enabled(g_logger));
+    SYLAR_ASSERT(!param_enabled(g_logger));
+    SYLAR_ASSERT(param_enabled(on));
+    SYLAR_ASSERT(!param_enabled(g_logger));
+    SYLAR_ASSERT(param_enabled(on));
+    SYLAR_LOG_ERROR(g_logger) << "log sites=" << sylar::LogSite::GetCount();
+    return 0;
+}
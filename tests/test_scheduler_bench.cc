@@ -0,0 +1,118 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include <atomic>
+
+/*
+    对比 全局队列(scheduler.work_stealing=false) 和 每线程队列+work stealing 的吞吐
+    1. flood: 外部线程一次性塞大量小任务
+    2. fanout: 任务在worker里再派生子任务，这种情况本地队列的好处最明显
+    3. batch: 和flood一样，但是每攒64个任务用TaskBatch提交一次
+    4. burst: 一阵一阵地塞任务，中间停一下让worker都去睡，看tickle真正写了几次、省掉了几次
+    用法: test_scheduler_bench [线程数] [任务数]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<uint64_t> s_done = {0};
+
+void spawn(int depth) {
+    ++s_done;
+    if(depth <= 0) {
+        return;
+    }
+    sylar::IOManager* iom = sylar::IOManager::GetThis();
+    iom -> schedule(std::bind(&spawn, depth - 1));
+    iom -> schedule(std::bind(&spawn, depth - 1));
+}
+
+double run_flood(int threads, int tasks) {
+    s_done = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "flood");
+        for(int i = 0; i < tasks; ++ i) {
+            iom.schedule([](){ ++s_done; });
+        }
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    return s_done * 1000000.0 / used;
+}
+
+double run_batch(int threads, int tasks) {
+    s_done = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "batch");
+        sylar::Scheduler::TaskBatch batch(&iom);
+        for(int i = 0; i < tasks; ++ i) {
+            batch.add([](){ ++s_done; });
+            if(batch.size() == 64) {
+                iom.schedule(batch);
+            }
+        }
+        iom.schedule(batch);
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    return s_done * 1000000.0 / used;
+}
+
+double run_fanout(int threads, int tasks) {
+    int depth = 1;
+    while((2 << depth) - 1 < tasks) {               // 一棵满二叉树一共 2^(depth+1)-1 个任务
+        ++ depth;
+    }
+    s_done = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "fanout");
+        iom.schedule(std::bind(&spawn, depth));
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    return s_done * 1000000.0 / used;
+}
+
+double run_burst(int threads, int tasks, uint64_t& sent, uint64_t& suppressed) {
+    s_done = 0;
+    uint64_t begin = sylar::GetCurrentUS();
+    {
+        sylar::IOManager iom(threads, false, "burst");
+        for(int i = 0; i < tasks; ++ i) {
+            iom.schedule([](){ ++s_done; });
+            if(i % 256 == 255) {
+                usleep(200);
+            }
+        }
+        while(s_done < (uint64_t)tasks) {
+            usleep(100);
+        }
+        sent = iom.getTickleCount();
+        suppressed = iom.getTickleSuppressed();
+    }
+    uint64_t used = sylar::GetCurrentUS() - begin;
+    return s_done * 1000000.0 / used;
+}
+
+int main(int argc, char** argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int tasks = argc > 2 ? atoi(argv[2]) : 200000;
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+
+    sylar::ConfigVar<bool>::ptr work_stealing = sylar::Config::Lookup<bool>("scheduler.work_stealing");
+    bool modes[] = {false, true};
+    for(bool ws : modes) {
+        work_stealing -> setValue(ws);
+        double flood = run_flood(threads, tasks);
+        double batch = run_batch(threads, tasks);
+        double fanout = run_fanout(threads, tasks);
+        uint64_t sent = 0, suppressed = 0;
+        double burst = run_burst(threads, tasks, sent, suppressed);
+        SYLAR_LOG_INFO(g_logger) << (ws ? "work_stealing" : "global_queue ")
+            << " threads=" << threads
+            << " flood=" << (uint64_t)flood << " tasks/s"
+            << " batch=" << (uint64_t)batch << " tasks/s"
+            << " fanout=" << (uint64_t)fanout << " tasks/s"
+            << " burst=" << (uint64_t)burst << " tasks/s"
+            << " tickle_sent=" << sent << " tickle_suppressed=" << suppressed;
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/stack_allocator.h"
+#include <atomic>
+#include <stdlib.h>
+
+/*
+    大量同时挂起的协程，每个挂起前在栈上递归几层、写一点数据，醒来之后检查数据还对不对
+    test_shared_stack [协程数]        共享栈模式(fiber.shared_stack=true)
+    test_shared_stack [协程数] -n     每个协程独立的栈，对比内存
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_done = {0};
+static std::atomic<int> s_bad = {0};
+
+static long rss_kb() {
+    long pages = 0, rss = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(fp) {
+        if(fscanf(fp, "%ld %ld", &pages, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(fp);
+    }
+    return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int deep(int id, int depth) {
+    char buf[512];
+    memset(buf, (char)(id + depth), sizeof(buf));
+    int rt = 0;
+    if(depth > 0) {
+        rt = deep(id, depth - 1);
+    } else {
+        usleep(200 * 1000);                 // hook的sleep，挂起的时候所有协程同时活着
+    }
+    for(size_t i = 0; i < sizeof(buf); ++ i) {
+        if(buf[i] != (char)(id + depth)) {
+            return rt + 1;
+        }
+    }
+    return rt;
+}
+
+static void run(int id) {
+    if(deep(id, id % 8)) {
+        ++s_bad;
+    }
+    ++s_done;
+}
+
+int main(int argc, char** argv) {
+    int n = 10000;
+    bool shared = true;
+    for(int i = 1; i < argc; ++ i) {
+        if(!strcmp(argv[i], "-n")) {
+            shared = false;
+        } else {
+            n = atoi(argv[i]);
+        }
+    }
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+    sylar::Config::Lookup<bool>("fiber.shared_stack") -> setValue(shared);
+
+    long rss_begin = rss_kb();
+    long rss_peak = 0;
+    uint64_t saved_peak = 0;
+    uint64_t begin = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(4, false);
+        for(int i = 0; i < n; ++ i) {
+            iom.schedule(std::bind(&run, i));
+        }
+        // 100ms的时候大家都睡在usleep里
+        iom.addTimer(100, [&rss_peak, &saved_peak](){
+            rss_peak = rss_kb();
+            saved_peak = sylar::Fiber::SharedStackSavedBytes();
+        });
+    }
+    SYLAR_LOG_INFO(g_logger) << (sylar::Fiber::SharedStackEnabled() ? "shared stack" : "own stack")
+        << " fibers=" << n << " done=" << s_done << " bad=" << s_bad
+        << " used=" << (sylar::GetCurrentMS() - begin) << "ms"
+        << " rss_growth=" << (rss_peak - rss_begin) / 1024 << "MB"
+        << " saved_bytes=" << saved_peak / 1024 << "KB"
+        << " stacks_mapped=" << sylar::StackAllocator::GetMisses();
+    return s_bad == 0 && s_done == n ? 0 : 1;
+}
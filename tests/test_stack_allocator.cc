@@ -0,0 +1,69 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/stack_allocator.h"
+#include "sylar/macro.h"
+#include <atomic>
+
+/*
+    test_stack_allocator          大量会阻塞的回调，每次cb_fiber都会被换掉，看协程栈池子的命中率，
+                                  线程退出之后各线程的计数加起来还是对的
+    test_stack_allocator -o       协程里无限递归，应该撞到guard page直接SIGSEGV，而不是写坏别的内存
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static std::atomic<int> s_done = {0};
+
+static int s_max_depth = 1 << 30;
+
+int recurse(int depth) {
+    volatile char buf[1024];
+    buf[0] = (char)depth;
+    if(depth >= s_max_depth) {
+        return buf[0];
+    }
+    return recurse(depth + 1) + buf[0];
+}
+
+void step(int left) {
+    usleep(100);                        // hook的sleep，阻塞之后cb_fiber会被换掉，下一个回调要新建协程
+    ++s_done;
+    if(left > 1) {
+        sylar::IOManager::GetThis() -> schedule(std::bind(&step, left - 1));
+    }
+}
+
+void print_stats(const char* tag) {
+    SYLAR_LOG_INFO(g_logger) << tag
+        << " hits=" << sylar::StackAllocator::GetHits()
+        << " misses=" << sylar::StackAllocator::GetMisses()
+        << " cached=" << sylar::StackAllocator::GetCached()
+        << " mapped=" << sylar::StackAllocator::GetMapped();
+}
+
+int main(int argc, char** argv) {
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+    if(argc > 1 && !strcmp(argv[1], "-o")) {
+        sylar::IOManager iom(1);
+        iom.schedule([](){
+            SYLAR_LOG_INFO(g_logger) << "recurse until guard page";
+            recurse(0);
+        });
+        return 0;
+    }
+
+    // 16条链，每一步都是一个会阻塞的回调(cb_fiber会被换掉)，做完再派生下一步，同时活着的协程不多，栈应该基本都能复用
+    uint64_t begin = sylar::GetCurrentMS();
+    {
+        sylar::IOManager iom(4, false);
+        for(int i = 0; i < 16; ++ i) {
+            iom.schedule(std::bind(&step, 1250));
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "done=" << s_done << " used=" << (sylar::GetCurrentMS() - begin) << "ms";
+    print_stats("stack pool");
+    // 工作线程都退了，它们的计数并到一起，还mmap着的只剩池子里缓存的
+    SYLAR_ASSERT(sylar::StackAllocator::GetHits() + sylar::StackAllocator::GetMisses() >= (uint64_t)s_done);
+    SYLAR_ASSERT(sylar::StackAllocator::GetMapped() == sylar::StackAllocator::GetCached());
+    return 0;
+}
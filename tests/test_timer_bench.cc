@@ -0,0 +1,124 @@
+#include "sylar/sylar.h"
+#include "sylar/iomanager.h"
+#include "sylar/macro.h"
+#include <atomic>
+#include <vector>
+
+/*
+    定时器压测，模拟大量带超时的读：
+    每个"连接"加一个条件定时器(和hook.cc里do_io一样用addConditionTimer)，
+    大部分(90%)在超时前"读到了数据"被cancel，剩下的10%真的超时触发
+    test_timer_bench [定时器数量]    两种实现(timer.wheel=true/false)各跑一遍，时间轮再开timer.slack_ms=10跑一遍
+    batches是回调在多少个不同的ms里跑的，大致就是为定时器唤醒了几次
+    顺便确认cancel的时候回调捕获的东西当场就放掉了
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+static const int kThreads = 4;
+
+struct Stats {
+    std::atomic<int> added = {0};
+    std::atomic<int> cancelled = {0};
+    std::atomic<int> fired = {0};
+    std::atomic<uint64_t> late_sum = {0};
+    std::atomic<uint64_t> late_max = {0};
+    std::atomic<uint64_t> last_ms = {0};
+    std::atomic<int> batches = {0};
+};
+
+static void wait_for(std::atomic<int>& v, int expect) {
+    while(v < expect) {
+        usleep(1000);
+    }
+}
+
+static void run(bool wheel, uint64_t slack, int n) {
+    sylar::Config::Lookup<bool>("timer.wheel") -> setValue(wheel);
+    sylar::Config::Lookup<uint64_t>("timer.slack_ms") -> setValue(slack);
+
+    Stats st;
+    std::vector<sylar::Timer::ptr> timers(n);
+    std::shared_ptr<int> cond(new int(0));
+    std::weak_ptr<int> weak_cond(cond);
+    int expire_n = n / 10;
+
+    sylar::IOManager iom(kThreads, false);
+
+    // 1. 每个线程加n/kThreads个，超时30s左右; 前10%的超时短一点(5~6s)，后面会真的触发
+    uint64_t begin = sylar::GetCurrentUS();
+    for(int t = 0; t < kThreads; ++ t) {
+        iom.schedule([&, t](){
+            for(int i = t; i < n; i += kThreads) {
+                uint64_t ms = i < expire_n ? 5000 + i % 1000 : 30000 + i % 1000;
+                uint64_t deadline = sylar::GetCurrentMS() + ms;
+                Stats* s = &st;
+                timers[i] = iom.addConditionTimer(ms, [s, deadline](){
+                    uint64_t now = sylar::GetCurrentMS();
+                    uint64_t late = now > deadline ? now - deadline : 0;
+                    s -> late_sum += late;
+                    uint64_t m = s -> late_max;
+                    while(late > m && !s -> late_max.compare_exchange_weak(m, late));
+                    if(s -> last_ms.exchange(now) != now) {
+                        ++s -> batches;
+                    }
+                    ++s -> fired;
+                }, weak_cond);
+                ++st.added;
+            }
+        });
+    }
+    wait_for(st.added, n);
+    uint64_t add_us = sylar::GetCurrentUS() - begin;
+
+    // 2. 后90%在超时之前读到了数据，取消
+    begin = sylar::GetCurrentUS();
+    for(int t = 0; t < kThreads; ++ t) {
+        iom.schedule([&, t](){
+            for(int i = expire_n + t; i < n; i += kThreads) {
+                timers[i] -> cancel();
+                timers[i].reset();
+                ++st.cancelled;
+            }
+        });
+    }
+    wait_for(st.cancelled, n - expire_n);
+    uint64_t cancel_us = sylar::GetCurrentUS() - begin;
+
+    // 取消的时候回调和它捕获的东西马上放掉，不等墓碑被清
+    std::shared_ptr<int> probe(new int(0));
+    std::atomic<int> probed = {0};
+    iom.schedule([&](){
+        sylar::Timer::ptr t = iom.addTimer(60000, [probe](){});
+        SYLAR_ASSERT(probe.use_count() == 2);
+        SYLAR_ASSERT(t -> cancel());
+        SYLAR_ASSERT(probe.use_count() == 1);
+        ++probed;
+    });
+    wait_for(probed, 1);
+
+    // 3. 剩下的10%超时
+    wait_for(st.fired, expire_n);
+    SYLAR_LOG_INFO(g_logger) << (wheel ? "wheel" : "set  ")
+        << " slack=" << slack << "ms"
+        << " timers=" << n
+        << " add=" << (uint64_t)(n * 1000000.0 / (add_us ? add_us : 1)) << "/s"
+        << " cancel=" << (uint64_t)((n - expire_n) * 1000000.0 / (cancel_us ? cancel_us : 1)) << "/s"
+        << " fired=" << st.fired
+        << " late_avg=" << (double)st.late_sum / (st.fired ? (int)st.fired : 1) << "ms"
+        << " late_max=" << st.late_max << "ms"
+        << " batches=" << st.batches;
+    timers.clear();
+}
+
+int main(int argc, char** argv) {
+    int n = 1000000;
+    if(argc > 1) {
+        n = atoi(argv[1]);
+    }
+    sylar::LoggerMgr::GetInstance() -> getLogger("system") -> setLevel(sylar::LogLevel::ERROR);
+    run(false, 0, n);
+    run(true, 0, n);
+    run(true, 10, n);
+    return 0;
+}
@@ -0,0 +1,59 @@
+#include "sylar/sylar.h"
+#include "sylar/topology.h"
+#include "sylar/macro.h"
+#include <sched.h>
+
+/*
+    打印机器的cpu/node拓扑，然后起一个scheduler.affinity配成auto(或者命令行给的cpu列表)的IOManager，
+    打出每个worker实际绑到的cpu/node，并且在每个worker上确认sched_getcpu()和绑的一致
+    test_topology [cpu列表，比如0-3]
+*/
+
+sylar::Logger::ptr g_logger = SYLAR_LOG_ROOT();
+
+int main(int argc, char** argv) {
+    const sylar::CpuTopology& topo = sylar::CpuTopology::Get();
+    SYLAR_LOG_INFO(g_logger) << "cpus=" << topo.getCpus().size() << " nodes=" << topo.getNodeCount();
+    for(auto& c : topo.getCpus()) {
+        SYLAR_LOG_INFO(g_logger) << "cpu=" << c.id << " node=" << c.node
+            << " package=" << c.package << " core=" << c.core;
+    }
+    std::stringstream ss;
+    for(auto i : topo.getAutoOrder()) {
+        ss << i << " ";
+    }
+    SYLAR_LOG_INFO(g_logger) << "auto order: " << ss.str();
+
+    std::vector<int> cpus;
+    SYLAR_ASSERT(sylar::CpuTopology::ParseCpuList("0-2, 5,7-7", cpus));
+    SYLAR_ASSERT(cpus.size() == 5 && cpus[0] == 0 && cpus[2] == 2 && cpus[3] == 5 && cpus[4] == 7);
+    SYLAR_ASSERT(!sylar::CpuTopology::ParseCpuList("3-1", cpus));
+    SYLAR_ASSERT(!sylar::CpuTopology::ParseCpuList("a", cpus));
+
+    std::map<std::string, std::string> affinity;
+    affinity["topo"] = argc > 1 ? argv[1] : "auto";
+    sylar::Config::Lookup<std::map<std::string, std::string> >("scheduler.affinity") -> setValue(affinity);
+
+    std::atomic<int> mismatch = {0};
+    {
+        sylar::IOManager iom(4, false, "topo");
+        auto placement = iom.getPlacement();
+        for(auto& p : placement) {
+            SYLAR_LOG_INFO(g_logger) << "worker=" << p.index << " thread=" << p.threadId
+                << " cpu=" << p.cpu << " node=" << p.node;
+            if(p.cpu < 0) {
+                continue;
+            }
+            for(int i = 0; i < 100; ++ i) {
+                iom.schedule([p, &mismatch](){
+                    if(sched_getcpu() != p.cpu) {
+                        ++mismatch;
+                    }
+                }, p.threadId);
+            }
+        }
+    }
+    SYLAR_LOG_INFO(g_logger) << "sched_getcpu mismatches=" << mismatch;
+    SYLAR_ASSERT(mismatch == 0);
+    return 0;
+}